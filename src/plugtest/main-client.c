@@ -34,6 +34,7 @@
 #include <smcp/assert-macros.h>
 
 #include <smcp/smcp.h>
+#include <smcp/smcp-block.h>
 
 bool gFinished;
 
@@ -51,6 +52,7 @@ typedef struct {
 	int inbound_packets;
 	int inbound_dupe_packets;
 	int outbound_attempts;
+	uint32_t outbound_content_len;
 
 	uint32_t block1_option;
 	uint32_t block2_option;
@@ -485,21 +487,274 @@ test_TD_COAP_BLOCK_01(smcp_t smcp, const char* url, test_data_s *test_data)
 	) && test_data->has_block2_option;
 }
 
+
+#if SMCP_CONF_TRANS_ENABLE_BLOCK2
+static uint8_t gBlockContent[2048];
+
+//!	The content of "large", which block-wise uploads also send.
+static uint8_t
+large_content_byte(uint32_t i) {
+	return ((i+1)%64) ? (uint8_t)('0'+(i%10)) : '\n';
+}
+
+static smcp_status_t
+block_test_build_request(void* context) {
+	test_data_s* test_data = context;
+	smcp_status_t status = 0;
+
+	status = smcp_outbound_begin(smcp_get_current_instance(),test_data->outbound_code, test_data->outbound_tt);
+	require_noerr(status,bail);
+
+	status = smcp_outbound_set_uri(test_data->url, 0);
+	require_noerr(status,bail);
+
+	test_data->outbound_attempts++;
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+block2_test_request(void* context) {
+	smcp_status_t status = block_test_build_request(context);
+
+	if(status == SMCP_STATUS_OK)
+		status = smcp_outbound_send();
+
+	return status;
+}
+
+static void
+block2_test_finished(void* context, int statuscode, uint32_t total_len) {
+	test_data_s* test_data = context;
+
+	test_data->finished = true;
+	test_data->inbound_content_len = total_len;
+	if(statuscode < 0)
+		test_data->error = statuscode;
+	else
+		test_data->inbound_code = statuscode;
+}
+
+static void
+block_test_init(test_data_s *test_data, const char* url, const char* rel, coap_code_t outbound_code,coap_transaction_type_t outbound_tt,coap_code_t expected_code)
+{
+	memset(test_data,0,sizeof(*test_data));
+	test_data->outbound_code = outbound_code;
+	test_data->outbound_tt = outbound_tt;
+	test_data->expected_code = expected_code;
+	test_data->failed = true;
+	if(strlen(url) && (url[strlen(url)-1] == '/'))
+		snprintf(test_data->url,sizeof(test_data->url), "%s%s",url,rel);
+	else
+		snprintf(test_data->url,sizeof(test_data->url), "%s/%s",url,rel);
+
+	gettimeofday(&test_data->start_time, NULL);
+}
+
+static bool
+block_test_wait(smcp_t smcp, test_data_s *test_data)
+{
+	while(!test_data->finished) {
+		smcp_wait(smcp,30*MSEC_PER_SEC);
+		smcp_process(smcp);
+	}
+
+	gettimeofday(&test_data->stop_time, NULL);
+
+	test_data->failed = (test_data->inbound_code != test_data->expected_code);
+
+	return !test_data->failed;
+}
+
+//!	Fetches `rel` a block at a time, with several blocks in flight.
+static bool
+block2_test_fetch(smcp_t smcp, test_data_s *test_data, const char* url, const char* rel, coap_transaction_type_t outbound_tt, uint32_t expected_len)
+{
+	struct smcp_block2_fetch_s fetch;
+	uint32_t i;
+
+	block_test_init(test_data, url, rel, COAP_METHOD_GET, outbound_tt, COAP_RESULT_205_CONTENT);
+	memset(gBlockContent,0,sizeof(gBlockContent));
+
+	smcp_block2_fetch_init(
+		&fetch,
+		&block2_test_request,
+		NULL,
+		&block2_test_finished,
+		(void*)test_data
+	);
+	smcp_block2_fetch_set_buffer(&fetch,gBlockContent,sizeof(gBlockContent));
+	smcp_block2_fetch_set_window(&fetch,4);
+	smcp_block2_fetch_set_szx(&fetch,2);	// 64 byte block size.
+
+	require_action(smcp_block2_fetch_begin(smcp,&fetch,30*MSEC_PER_SEC) == SMCP_STATUS_OK,bail,test_data->error = SMCP_STATUS_FAILURE);
+
+	require(block_test_wait(smcp,test_data),bail);
+
+	test_data->failed = true;
+	require(test_data->inbound_content_len == expected_len,bail);
+	for(i = 0; i < expected_len; i++)
+		require_string(gBlockContent[i] == large_content_byte(i),bail,"Reassembled content mismatch");
+
+	test_data->failed = false;
+
+bail:
+	smcp_block2_fetch_end(smcp,&fetch);
+	return !test_data->failed;
+}
+
 bool
-test_TD_COAP_BLOCK_03(smcp_t smcp, const char* url, test_data_s *test_data)
+test_BLOCK2_WINDOW(smcp_t smcp, const char* url, test_data_s *test_data)
 {
-	return test_simple(
-		smcp,
-		test_data,
-		url,
-		"large-update",
-		COAP_METHOD_PUT,
-		COAP_TRANS_TYPE_CONFIRMABLE,
-		COAP_RESULT_204_CHANGED,
-		EXT_BLOCK_01
+	return block2_test_fetch(smcp, test_data, url, "large", COAP_TRANS_TYPE_CONFIRMABLE, 2000);
+}
+
+// MARK: -
+// MARK: Block1
+
+static smcp_status_t
+block1_test_read(void* context, uint8_t* buffer, coap_size_t* len, uint32_t offset) {
+	test_data_s* test_data = context;
+	coap_size_t i;
+
+	if(offset >= test_data->outbound_content_len)
+		*len = 0;
+	else if(*len > test_data->outbound_content_len - offset)
+		*len = (coap_size_t)(test_data->outbound_content_len - offset);
+
+	for(i = 0; i < *len; i++)
+		buffer[i] = large_content_byte(offset + i);
+
+	return SMCP_STATUS_OK;
+}
+
+static void
+block1_test_finished(void* context, int statuscode) {
+	test_data_s* test_data = context;
+
+	test_data->finished = true;
+	if(statuscode < 0)
+		test_data->error = statuscode;
+	else
+		test_data->inbound_code = statuscode;
+}
+
+//!	Uploads `len` bytes of the "large" content to "large-update".
+static bool
+block1_test_upload(smcp_t smcp, test_data_s *test_data, const char* url, uint32_t len)
+{
+	struct smcp_block1_upload_s upload;
+
+	block_test_init(test_data, url, "large-update", COAP_METHOD_PUT, COAP_TRANS_TYPE_CONFIRMABLE, COAP_RESULT_204_CHANGED);
+	test_data->outbound_content_len = len;
+
+	smcp_block1_upload_init(
+		&upload,
+		&block_test_build_request,
+		&block1_test_read,
+		&block1_test_finished,
+		(void*)test_data
 	);
+	smcp_block1_upload_set_size(&upload,len);
+	smcp_block1_upload_set_szx(&upload,2);	// 64 byte block size.
+
+	// The server reassembles blocks in any order.
+	smcp_block1_upload_set_window(&upload,4);
+
+	require_action(smcp_block1_upload_begin(smcp,&upload,30*MSEC_PER_SEC) == SMCP_STATUS_OK,bail,test_data->error = SMCP_STATUS_FAILURE);
+
+	block_test_wait(smcp,test_data);
+
+bail:
+	smcp_block1_upload_end(smcp,&upload);
+	return !test_data->failed;
 }
 
+bool
+test_TD_COAP_BLOCK_03(smcp_t smcp, const char* url, test_data_s *test_data)
+{
+	return block1_test_upload(smcp, test_data, url, 2000)
+		&& block2_test_fetch(smcp, test_data, url, "large-update", COAP_TRANS_TYPE_CONFIRMABLE, 2000);
+}
+
+//!	Order in which test_BLOCK1_OUT_OF_ORDER() sends its blocks.
+static const uint8_t gBlock1Sequence[] = { 0, 2, 1, 1, 3 };
+
+#define BLOCK1_SEQUENCE_LEN		(3*64+40)
+
+static smcp_status_t
+block1_sequence_request(void* context) {
+	test_data_s* test_data = context;
+	smcp_status_t status = 0;
+	const uint32_t num = test_data->block1_option >> 4;
+	const uint32_t offset = num*64;
+	const uint32_t len = MIN(64,BLOCK1_SEQUENCE_LEN-offset);
+	coap_size_t max_len = 0;
+	uint8_t* content;
+	uint32_t i;
+
+	status = block_test_build_request(context);
+	require_noerr(status,bail);
+
+	status = smcp_outbound_add_option_uint(COAP_OPTION_BLOCK1, test_data->block1_option);
+	require_noerr(status,bail);
+
+	content = (uint8_t*)smcp_outbound_get_content_ptr(&max_len);
+	require_action(content!=NULL && max_len>=len,bail,status = SMCP_STATUS_FAILURE);
+
+	for(i = 0; i < len; i++)
+		content[i] = large_content_byte(offset + i);
+
+	status = smcp_outbound_set_content_len(len);
+	require_noerr(status,bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+bool
+test_BLOCK1_OUT_OF_ORDER(smcp_t smcp, const char* url, test_data_s *test_data)
+{
+	const int last = sizeof(gBlock1Sequence)-1;
+	int i;
+
+	// Block 2 arrives ahead of block 1, and block 1 is then sent again
+	// as a new request. The final block completes the body.
+	for(i = 0; i <= last; i++) {
+		struct smcp_transaction_s transaction;
+
+		block_test_init(
+			test_data,
+			url,
+			"large-update",
+			COAP_METHOD_PUT,
+			COAP_TRANS_TYPE_CONFIRMABLE,
+			(i == last)?COAP_RESULT_204_CHANGED:COAP_RESULT_231_CONTINUE
+		);
+		test_data->block1_option = (gBlock1Sequence[i]<<4) | ((i == last)?0:(1<<3)) | 2;
+
+		smcp_transaction_init(
+			&transaction,
+			SMCP_TRANSACTION_ALWAYS_INVALIDATE, // Flags
+			(void*)&block1_sequence_request,
+			(void*)&response_test_handler,
+			(void*)test_data
+		);
+
+		smcp_transaction_begin(smcp,&transaction,30*MSEC_PER_SEC);
+
+		if(!block_test_wait(smcp,test_data))
+			return false;
+	}
+
+	// The server drops the first request for block 1, so that the
+	// blocks after it arrive before it does.
+	return block2_test_fetch(smcp, test_data, url, "large-update", COAP_TRANS_TYPE_NONCONFIRMABLE, BLOCK1_SEQUENCE_LEN);
+}
+#endif // SMCP_CONF_TRANS_ENABLE_BLOCK2
 
 
 int
@@ -548,7 +803,11 @@ main(int argc, char * argv[]) {
 
 		do_test(TD_COAP_BLOCK_01);
 		do_test(TD_COAP_BLOCK_02);
-		//do_test(TD_COAP_BLOCK_03);
+#if SMCP_CONF_TRANS_ENABLE_BLOCK2
+		do_test(BLOCK2_WINDOW);
+		do_test(TD_COAP_BLOCK_03);
+		do_test(BLOCK1_OUT_OF_ORDER);
+#endif
 	}
 
 	return errorcount;
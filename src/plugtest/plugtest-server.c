@@ -353,20 +353,136 @@ bail:
 	return ret;
 }
 
-/*
-// Not yet implemented.
+#if SMCP_CONF_TRANS_ENABLE_BLOCK2
+static smcp_status_t
+plugtest_large_update_write(
+	struct plugtest_server_s *self,
+	const uint8_t* data,
+	coap_size_t len,
+	uint32_t offset
+) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+
+	require_action(offset+len <= sizeof(self->large_update_content), bail, ret = SMCP_STATUS_MESSAGE_TOO_BIG);
+
+	memcpy(self->large_update_content+offset, data, len);
+	self->large_update_len = offset+len;
+
+bail:
+	return ret;
+}
 
 smcp_status_t
 plugtest_large_update_handler(
-	smcp_node_t		node
+	struct plugtest_server_s *self
 ) {
 	smcp_status_t ret = SMCP_STATUS_NOT_ALLOWED;
+	char* content = NULL;
+	coap_size_t max_len = 0;
+	smcp_method_t method = smcp_inbound_get_code();
+	uint32_t block_option = 0x03;
+	uint32_t block_start = 0;
+	uint32_t block_stop = 0;
 
-	// TODO: Writeme!
+	if(method==COAP_METHOD_PUT) {
+		ret = smcp_block1_receive(
+			&self->large_update_receiver,
+			(smcp_block_data_func)&plugtest_large_update_write,
+			(void*)self
+		);
+
+		// Intermediate blocks and oversized bodies have been answered already.
+		if(ret == SMCP_STATUS_CONTINUE || ret == SMCP_STATUS_MESSAGE_TOO_BIG) {
+			ret = SMCP_STATUS_OK;
+			goto bail;
+		}
+		require_noerr(ret,bail);
+
+		// Lose the next request for the second block, so that the
+		// blocks after it are received before its retransmission.
+		self->large_update_drop = true;
+
+		ret = smcp_outbound_begin_response(COAP_RESULT_204_CHANGED);
+		require_noerr(ret,bail);
+
+		ret = smcp_outbound_send();
+		goto bail;
+	}
+
+	require(method==COAP_METHOD_GET,bail);
+
+	{
+		const uint8_t* value;
+		coap_size_t value_len;
+		coap_option_key_t key;
+		while((key=smcp_inbound_next_option(&value, &value_len))!=COAP_OPTION_INVALID) {
+			if(key == COAP_OPTION_BLOCK2) {
+				uint8_t i;
+				block_option = 0;
+				for(i = 0; i < value_len; i++)
+					block_option = (block_option << 8) + value[i];
+			}
+		}
+	}
+
+	{
+		struct coap_block_info_s block_info;
+		coap_decode_block(&block_info, block_option);
+		block_start = block_info.block_offset;
+		block_stop = block_info.block_offset + block_info.block_size;
+	}
+
+	if(self->large_update_drop
+		&& (block_option>>4) == 1
+		&& smcp_inbound_get_packet()->tt==COAP_TRANS_TYPE_NONCONFIRMABLE
+	) {
+		// Nothing gets sent back for a non-confirmable request.
+		self->large_update_drop = false;
+		ret = SMCP_STATUS_OK;
+		goto bail;
+	}
+
+	require_action(block_start<self->large_update_len || !block_start,bail,ret=SMCP_STATUS_INVALID_ARGUMENT);
+
+	if(block_stop>=self->large_update_len)
+		block_option &= ~(1<<3);
+	else
+		block_option |= (1<<3);
+
+	ret = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE, COAP_CONTENT_TYPE_TEXT_PLAIN);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_add_option_uint(COAP_OPTION_BLOCK2,block_option);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_add_option_uint(COAP_OPTION_SIZE,self->large_update_len);
+	require_noerr(ret,bail);
+
+	content = smcp_outbound_get_content_ptr(&max_len);
+
+	require_action(NULL!=content, bail, ret = SMCP_STATUS_FAILURE);
+	require_action(max_len>(block_stop-block_start), bail, ret = SMCP_STATUS_MESSAGE_TOO_BIG);
+
+	block_stop = MIN(block_stop,self->large_update_len);
+	block_stop = MAX(block_stop,block_start);
+
+	memcpy(content,self->large_update_content+block_start,block_stop-block_start);
+
+	ret = smcp_outbound_set_content_len(block_stop-block_start);
+	require_noerr(ret,bail);
+
+	ret = smcp_outbound_send();
 
 bail:
 	return ret;
 }
+#endif // SMCP_CONF_TRANS_ENABLE_BLOCK2
+
+/*
+// Not yet implemented.
 
 smcp_status_t
 plugtest_large_create_handler(
@@ -403,11 +519,15 @@ plugtest_server_init(struct plugtest_server_s *self,smcp_node_t root) {
 	smcp_node_init(&self->large,root,"large");
 	self->large.request_handler = (smcp_callback_func)&plugtest_large_handler;
 
+#if SMCP_CONF_TRANS_ENABLE_BLOCK2
+	smcp_node_init(&self->large_update,root,"large-update");
+	self->large_update.request_handler = (smcp_callback_func)&plugtest_large_update_handler;
+	self->large_update.context = (void*)self;
+	smcp_block1_receiver_init(&self->large_update_receiver,sizeof(self->large_update_content));
+#endif
+
 /*
 	// Not yet implemented.
-	smcp_node_init(&self->large_update,root,"large_update");
-	self->large_update.request_handler = &plugtest_large_update_handler;
-
 	smcp_node_init(&self->large_create,root,"large_create");
 	self->large_create.request_handler = &plugtest_large_create_handler;
 */
@@ -31,6 +31,9 @@
 #include <smcp/smcp-node-router.h>
 #include <smcp/smcp-timer.h>
 #include <smcp/smcp-observable.h>
+#include <smcp/smcp-block.h>
+
+#define PLUGTEST_LARGE_UPDATE_MAX_SIZE	(2048)
 
 struct plugtest_server_s {
 	struct smcp_node_s test;
@@ -41,6 +44,12 @@ struct plugtest_server_s {
 	struct smcp_node_s separate;
 	struct smcp_node_s large;
 	struct smcp_node_s large_update;
+#if SMCP_CONF_TRANS_ENABLE_BLOCK2
+	struct smcp_block1_receiver_s large_update_receiver;
+	uint8_t large_update_content[PLUGTEST_LARGE_UPDATE_MAX_SIZE];
+	uint32_t large_update_len;
+	bool large_update_drop;
+#endif
 	struct smcp_node_s large_create;
 	struct smcp_node_s obs;
 	struct smcp_timer_s obs_timer;
@@ -39,10 +39,11 @@
 **
 **	    cc btree.c -Wall -DBTREE_SELF_TEST=1 -o btree
 **
-**	## Todo ##
+**	## Balancing ##
 **
-**	 * Add some sort of automatic tree-balancing algorithm,
-**	   like <http://en.wikipedia.org/wiki/Scapegoat_tree>.
+**	When BTREE_USE_RED_BLACK is set (the default on hosted builds),
+**	insertions and removals keep the tree balanced as a red-black
+**	tree. See <http://en.wikipedia.org/wiki/Red-black_tree>.
 */
 
 #include "btree.h"
@@ -56,6 +57,151 @@
 #define assert(x)		do { } while (0)
 #endif
 
+#if BTREE_USE_RED_BLACK
+#define BT_BLACK		0
+#define BT_RED			1
+
+#define bt_is_red_(item)	((item) && ((item)->color == BT_RED))
+
+//!	Returns the pointer which points to the given item.
+static void**
+bt_slot_(void** bt, bt_item_t item) {
+	if(!item->parent)
+		return bt;
+	if(item->parent->lhs == item)
+		return (void**)&item->parent->lhs;
+	return (void**)&item->parent->rhs;
+}
+
+static void
+bt_insert_fixup_(void** bt, bt_item_t item) {
+	bt_item_t parent;
+
+	while((parent = item->parent) && bt_is_red_(parent)) {
+		bt_item_t const grandparent = parent->parent;
+		bt_item_t uncle;
+
+		// A red root means the colors were invalidated by one of
+		// the manual rotation functions. Just stop here.
+		if(!grandparent)
+			break;
+
+		if(parent == grandparent->lhs) {
+			uncle = grandparent->rhs;
+			if(bt_is_red_(uncle)) {
+				parent->color = BT_BLACK;
+				uncle->color = BT_BLACK;
+				grandparent->color = BT_RED;
+				item = grandparent;
+				continue;
+			}
+			if(item == parent->rhs) {
+				item = parent;
+				bt_rotate_left(bt_slot_(bt, item));
+				parent = item->parent;
+			}
+			parent->color = BT_BLACK;
+			grandparent->color = BT_RED;
+			bt_rotate_right(bt_slot_(bt, grandparent));
+		} else {
+			uncle = grandparent->lhs;
+			if(bt_is_red_(uncle)) {
+				parent->color = BT_BLACK;
+				uncle->color = BT_BLACK;
+				grandparent->color = BT_RED;
+				item = grandparent;
+				continue;
+			}
+			if(item == parent->lhs) {
+				item = parent;
+				bt_rotate_right(bt_slot_(bt, item));
+				parent = item->parent;
+			}
+			parent->color = BT_BLACK;
+			grandparent->color = BT_RED;
+			bt_rotate_left(bt_slot_(bt, grandparent));
+		}
+	}
+
+	((bt_item_t)*bt)->color = BT_BLACK;
+}
+
+static void
+bt_remove_fixup_(void** bt, bt_item_t item, bt_item_t parent) {
+	while(parent && !bt_is_red_(item)) {
+		bt_item_t sibling;
+
+		if(item == parent->lhs) {
+			sibling = parent->rhs;
+			if(bt_is_red_(sibling)) {
+				sibling->color = BT_BLACK;
+				parent->color = BT_RED;
+				bt_rotate_left(bt_slot_(bt, parent));
+				sibling = parent->rhs;
+			}
+			if(!sibling) {
+				// Only possible if the colors were invalidated.
+				item = parent;
+				parent = item->parent;
+				continue;
+			}
+			if(!bt_is_red_(sibling->lhs) && !bt_is_red_(sibling->rhs)) {
+				sibling->color = BT_RED;
+				item = parent;
+				parent = item->parent;
+				continue;
+			}
+			if(!bt_is_red_(sibling->rhs)) {
+				sibling->lhs->color = BT_BLACK;
+				sibling->color = BT_RED;
+				bt_rotate_right(bt_slot_(bt, sibling));
+				sibling = parent->rhs;
+			}
+			sibling->color = parent->color;
+			parent->color = BT_BLACK;
+			if(sibling->rhs)
+				sibling->rhs->color = BT_BLACK;
+			bt_rotate_left(bt_slot_(bt, parent));
+		} else {
+			sibling = parent->lhs;
+			if(bt_is_red_(sibling)) {
+				sibling->color = BT_BLACK;
+				parent->color = BT_RED;
+				bt_rotate_right(bt_slot_(bt, parent));
+				sibling = parent->lhs;
+			}
+			if(!sibling) {
+				item = parent;
+				parent = item->parent;
+				continue;
+			}
+			if(!bt_is_red_(sibling->lhs) && !bt_is_red_(sibling->rhs)) {
+				sibling->color = BT_RED;
+				item = parent;
+				parent = item->parent;
+				continue;
+			}
+			if(!bt_is_red_(sibling->lhs)) {
+				sibling->rhs->color = BT_BLACK;
+				sibling->color = BT_RED;
+				bt_rotate_left(bt_slot_(bt, sibling));
+				sibling = parent->lhs;
+			}
+			sibling->color = parent->color;
+			parent->color = BT_BLACK;
+			if(sibling->lhs)
+				sibling->lhs->color = BT_BLACK;
+			bt_rotate_right(bt_slot_(bt, parent));
+		}
+		item = *bt;
+		break;
+	}
+
+	if(item)
+		item->color = BT_BLACK;
+}
+#endif // BTREE_USE_RED_BLACK
+
 int
 bt_insert(
 	void** bt,
@@ -67,6 +213,11 @@ bt_insert(
 	int depth = 0;
 	bt_item_t const item_ = item;
 	bt_item_t location_;
+#if BTREE_USE_RED_BLACK
+	void** const root = bt;
+
+	item_->parent = NULL;
+#endif
 
 again:
 
@@ -98,12 +249,21 @@ again:
 			item_->rhs = location_->rhs;
 			if(location_->rhs)
 				location_->rhs->parent = item_;
+#if BTREE_USE_RED_BLACK
+			item_->color = location_->color;
+#endif
 			*bt = item_;
 			(*delete_func)(location_, context);
 		}
 	} else {
 		// Found ourselves a good spot. Put the item here.
 		*bt = item_;
+#if BTREE_USE_RED_BLACK
+		item_->lhs = NULL;
+		item_->rhs = NULL;
+		item_->color = BT_RED;
+		bt_insert_fixup_(root, item_);
+#endif
 	}
 
 	return depth;
@@ -141,6 +301,57 @@ bt_remove(
 ) {
 	bt_item_t const item_ = bt_find(bt, item, compare_func, context);
 
+#if BTREE_USE_RED_BLACK
+	if(item_) {
+		bt_item_t child;
+		bt_item_t child_parent;
+		uint8_t removed_color = item_->color;
+
+		if(item_->lhs && item_->rhs) {
+			// Replace the item with its in-order successor,
+			// which has no left child.
+			bt_item_t const next = bt_first(item_->rhs);
+
+			removed_color = next->color;
+			child = next->rhs;
+
+			if(next->parent == item_) {
+				child_parent = next;
+			} else {
+				child_parent = next->parent;
+				child_parent->lhs = child;
+				if(child)
+					child->parent = child_parent;
+				next->rhs = item_->rhs;
+				next->rhs->parent = next;
+			}
+
+			next->lhs = item_->lhs;
+			next->lhs->parent = next;
+			*bt_slot_(bt, item_) = next;
+			next->parent = item_->parent;
+			next->color = item_->color;
+		} else {
+			child = item_->lhs ? item_->lhs : item_->rhs;
+			child_parent = item_->parent;
+			*bt_slot_(bt, item_) = child;
+			if(child)
+				child->parent = child_parent;
+		}
+
+		if(removed_color == BT_BLACK)
+			bt_remove_fixup_(bt, child, child_parent);
+
+		item_->lhs = NULL;
+		item_->rhs = NULL;
+		item_->parent = NULL;
+
+		if(delete_func)
+			(*delete_func)(item_, context);
+
+		return true;
+	}
+#else
 	if(item_) {
 		if(item_->parent) {
 			bt = (void**)((item_->parent->lhs == item_)?&item_->parent->lhs:&item_->parent->rhs);
@@ -172,6 +383,7 @@ bt_remove(
 
 		return true;
 	}
+#endif
 
 	return false;
 }
@@ -364,8 +576,8 @@ bt_get_balance(void* node) {
 	return ret;
 }
 
-unsigned int
-bt_rebalance(void** bt) {
+static unsigned int
+bt_rebalance_(void** bt) {
 	unsigned int ret = 0;
 
 	bt_item_t iter = bt_first(*bt);
@@ -389,13 +601,52 @@ bt_rebalance(void** bt) {
 
 	// Rinse and repeat on both child branches.
 	iter = *bt;
-	ret += bt_rebalance((void**)&iter->lhs);
-	ret += bt_rebalance((void**)&iter->rhs);
+	ret += bt_rebalance_((void**)&iter->lhs);
+	ret += bt_rebalance_((void**)&iter->rhs);
 
 bail:
 	return ret;
 }
 
+#if BTREE_USE_RED_BLACK
+static int
+bt_min_height_(bt_item_t item) {
+	int lhs, rhs;
+
+	if(!item)
+		return 0;
+
+	lhs = bt_min_height_(item->lhs);
+	rhs = bt_min_height_(item->rhs);
+
+	return 1 + ((lhs < rhs) ? lhs : rhs);
+}
+
+static void
+bt_recolor_(bt_item_t item, int depth, int black_height) {
+	// After a full rebalance, every path from the root has either
+	// black_height or black_height+1 nodes. Color everything above
+	// black_height black and the rest red.
+	for(; item; item = item->rhs, depth++) {
+		item->color = (depth < black_height) ? BT_BLACK : BT_RED;
+		bt_recolor_(item->lhs, depth + 1, black_height);
+	}
+}
+#endif
+
+unsigned int
+bt_rebalance(void** bt) {
+	unsigned int ret = bt_rebalance_(bt);
+
+#if BTREE_USE_RED_BLACK
+	if(*bt)
+		((bt_item_t)*bt)->parent = NULL;
+	bt_recolor_(*bt, 0, bt_min_height_(*bt));
+#endif
+
+	return ret;
+}
+
 #endif // !__SDCC
 
 /* -------------------------------------------------------------------------- */
@@ -404,6 +655,7 @@ bail:
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 static int nodes_alive = 0;
 
@@ -507,6 +759,187 @@ reverse_traversal_test(self_test_node_t root) {
 	printf("OK\n");
 }
 
+int
+tree_height(bt_item_t item) {
+	int lhs, rhs;
+
+	if(!item)
+		return 0;
+
+	lhs = tree_height(item->lhs);
+	rhs = tree_height(item->rhs);
+
+	return 1 + ((lhs > rhs) ? lhs : rhs);
+}
+
+#if BTREE_USE_RED_BLACK
+//!	Returns the black height of the tree, or -1 if the tree is invalid.
+int
+red_black_check(bt_item_t item, bt_item_t parent) {
+	int lhs, rhs;
+
+	if(!item)
+		return 1;
+
+	if(item->parent != parent)
+		return -1;
+
+	if(item->color == BT_RED) {
+		if(!parent)
+			return -1;
+		if(bt_is_red_(item->lhs) || bt_is_red_(item->rhs))
+			return -1;
+	}
+
+	lhs = red_black_check(item->lhs, item);
+	rhs = red_black_check(item->rhs, item);
+
+	if(lhs < 0 || lhs != rhs)
+		return -1;
+
+	return lhs + (item->color == BT_BLACK);
+}
+#endif
+
+/* -------------------------------------------------------------------------- */
+
+// Worst-case insertion order benchmarks. Without balancing, the
+// ascending and descending orders degrade the tree into a linked list.
+
+#define BENCHMARK_NODE_COUNT		(20000)
+
+struct bench_node_s {
+	struct bt_item_s item;
+	int key;
+};
+
+typedef struct bench_node_s *bench_node_t;
+
+bt_compare_result_t
+bench_node_compare(bench_node_t lhs, bench_node_t rhs, void* context) {
+	(void)context;
+	return (lhs->key > rhs->key) - (lhs->key < rhs->key);
+}
+
+bt_compare_result_t
+bench_node_compare_int(bench_node_t lhs, const int* rhs, void* context) {
+	(void)context;
+	return (lhs->key > *rhs) - (lhs->key < *rhs);
+}
+
+int
+bench_key_ascending(int i) {
+	return i;
+}
+
+int
+bench_key_descending(int i) {
+	return BENCHMARK_NODE_COUNT - i;
+}
+
+int
+bench_key_zigzag(int i) {
+	// 0, N, 1, N-1, 2, N-2, ...
+	return (i & 1) ? (BENCHMARK_NODE_COUNT - i / 2) : (i / 2);
+}
+
+int
+benchmark(const char* name, int (*key_func)(int)) {
+	int ret = 0;
+	bench_node_t nodes = calloc(BENCHMARK_NODE_COUNT, sizeof(*nodes));
+	bench_node_t root = NULL;
+	clock_t start, insert_time, find_time, remove_time;
+	int i, height;
+
+	for(i = 0; i < BENCHMARK_NODE_COUNT; i++)
+		nodes[i].key = (*key_func)(i);
+
+	start = clock();
+	for(i = 0; i < BENCHMARK_NODE_COUNT; i++) {
+		bt_insert(
+			(void**)&root,
+			&nodes[i],
+			(bt_compare_func_t)&bench_node_compare,
+			NULL,
+			NULL
+		);
+	}
+	insert_time = clock() - start;
+
+	height = tree_height(&root->item);
+
+	start = clock();
+	for(i = 0; i < BENCHMARK_NODE_COUNT; i++) {
+		if(bt_find(
+			(void**)&root,
+			&nodes[i].key,
+			(bt_compare_func_t)&bench_node_compare_int,
+			NULL
+		) != &nodes[i]) {
+			printf("error: %s: Unable to find key %d\n", name, nodes[i].key);
+			ret++;
+			break;
+		}
+	}
+	find_time = clock() - start;
+
+#if BTREE_USE_RED_BLACK
+	if(red_black_check(&root->item, NULL) < 0) {
+		printf("error: %s: Red-black invariants violated\n", name);
+		ret++;
+	}
+
+	// 2*log2(n+1) is the upper bound on the height of a red-black tree.
+	for(i = 0; (1 << i) <= BENCHMARK_NODE_COUNT; i++) { }
+	if(height > 2 * i) {
+		printf("error: %s: Tree height %d exceeds %d\n", name, height, 2 * i);
+		ret++;
+	}
+#endif
+
+	start = clock();
+	for(i = 0; i < BENCHMARK_NODE_COUNT; i++) {
+		if(!bt_remove(
+			(void**)&root,
+			&nodes[i].key,
+			(bt_compare_func_t)&bench_node_compare_int,
+			NULL,
+			NULL
+		)) {
+			printf("error: %s: Unable to remove key %d\n", name, nodes[i].key);
+			ret++;
+			break;
+		}
+#if BTREE_USE_RED_BLACK
+		if(((i & 1023) == 0) && red_black_check(&root->item, NULL) < 0) {
+			printf("error: %s: Red-black invariants violated during removal\n", name);
+			ret++;
+			break;
+		}
+#endif
+	}
+	remove_time = clock() - start;
+
+	if(root) {
+		printf("error: %s: Tree not empty after removing all nodes\n", name);
+		ret++;
+	}
+
+	printf(
+		"Benchmark %-10s n=%d height=%d insert=%.2fms find=%.2fms remove=%.2fms\n",
+		name,
+		BENCHMARK_NODE_COUNT,
+		height,
+		insert_time * 1000.0 / CLOCKS_PER_SEC,
+		find_time * 1000.0 / CLOCKS_PER_SEC,
+		remove_time * 1000.0 / CLOCKS_PER_SEC
+	);
+
+	free(nodes);
+
+	return ret;
+}
+
 int
 main(void) {
 	int ret = 0;
@@ -549,6 +982,14 @@ again:
 	}
 
 	printf(" * balance = %d\n",bt_get_balance(root));
+	printf(" * height = %d\n",tree_height(&root->item));
+
+#if BTREE_USE_RED_BLACK
+	if(red_black_check(&root->item, NULL) < 0) {
+		printf("error: Red-black invariants violated after insertion.\n");
+		ret++;
+	}
+#endif
 
 	forward_traversal_test(root);
 	reverse_traversal_test(root);
@@ -577,6 +1018,13 @@ again:
 			ret++;
 			break;
 		}
+#if BTREE_USE_RED_BLACK
+		if(root && red_black_check(&root->item, NULL) < 0) {
+			printf("error: Red-black invariants violated after removal.\n");
+			ret++;
+			break;
+		}
+#endif
 		forward_traversal_test(root);
 		reverse_traversal_test(root);
 	}
@@ -668,6 +1116,13 @@ again:
 	i = bt_rebalance((void**)&root);
 	printf("Rebalance operation took %u rotations\n", i);
 
+#if BTREE_USE_RED_BLACK
+	if(red_black_check(&root->item, NULL) < 0) {
+		printf("error: Red-black invariants violated after rebalancing.\n");
+		ret++;
+	}
+#endif
+
 	if(bt_get_balance(root)) {
 		printf(
 			"error: Tree doesn't seem balanced even after rebalancing. "
@@ -800,6 +1255,11 @@ again:
 		ret++;
 	}
 
+	// Worst-case insertion orders.
+	ret += benchmark("ascending", &bench_key_ascending);
+	ret += benchmark("descending", &bench_key_descending);
+	ret += benchmark("zigzag", &bench_key_zigzag);
+
 	if(ret)
 		printf("Failed with %d errors.\n",ret);
 	else {
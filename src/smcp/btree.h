@@ -49,6 +49,25 @@
 #include <stdint.h>
 #include <stdio.h>      // For ssize_t
 
+/*!	@define BTREE_USE_RED_BLACK
+**
+**	If set to 1, then `bt_insert()` and `bt_remove()` will keep the
+**	tree balanced using the red-black tree algorithm, guaranteeing
+**	that the height of the tree never exceeds 2*log2(n+1). This
+**	costs one extra byte (plus padding) per item.
+**
+**	Note that `bt_rotate_left()`, `bt_rotate_right()`, `bt_splay()`
+**	and `bt_unbalance()` do not maintain the node colors. Call
+**	`bt_rebalance()` afterward to restore them.
+*/
+#ifndef BTREE_USE_RED_BLACK
+#if defined(__SDCC) || CONTIKI
+#define BTREE_USE_RED_BLACK		0
+#else
+#define BTREE_USE_RED_BLACK		1
+#endif
+#endif
+
 __BEGIN_DECLS
 
 /*!	@defgroup btree Binary Tree Functions
@@ -64,6 +83,9 @@ struct bt_item_s {
 	bt_item_t	lhs;
 	bt_item_t	rhs;
 	bt_item_t	parent;
+#if BTREE_USE_RED_BLACK
+	uint8_t		color;
+#endif
 };
 
 typedef signed char bt_compare_result_t;
@@ -123,6 +145,7 @@ extern void bt_rotate_left(void** pivot);
 extern void bt_rotate_right(void** pivot);
 
 //!	Completely rebalance of the tree.
+//! If BTREE_USE_RED_BLACK is set, this also recolors the nodes.
 extern unsigned int bt_rebalance(void** bt);
 
 //!	Completely unbalances the tree. Primarily useful for debugging.
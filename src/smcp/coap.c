@@ -289,9 +289,11 @@ coap_verify_packet(const char* packet,coap_size_t packet_size) {
 		return false;
 	}
 
-	if(packet_size>COAP_MAX_MESSAGE_SIZE) {
+	// Jumbo configurations allow packets beyond what an
+	// unfragmented IPv6 datagram could carry.
+	if(packet_size>MAX(COAP_MAX_MESSAGE_SIZE,SMCP_MAX_PACKET_LENGTH)) {
 		// Packet too large
-		DEBUG_PRINTF("PACKET CORRUPTED: Too Large: %d (%d max)", packet_size, COAP_MAX_MESSAGE_SIZE);
+		DEBUG_PRINTF("PACKET CORRUPTED: Too Large: %d (%d max)", packet_size, (int)MAX(COAP_MAX_MESSAGE_SIZE,SMCP_MAX_PACKET_LENGTH));
 		return false;
 	}
 
@@ -453,6 +455,8 @@ coap_option_key_to_cstr(
 
 		case COAP_OPTION_BLOCK1: ret = "Block1"; break;
 		case COAP_OPTION_BLOCK2: ret = "Block2"; break;
+		case COAP_OPTION_SIZE: ret = "Size2"; break;
+		case COAP_OPTION_SIZE1: ret = "Size1"; break;
 
 		default:
 #if SMCP_AVOID_PRINTF
@@ -593,6 +597,7 @@ http_code_to_cstr(int x) {
 	case HTTP_RESULT_CODE_CONTINUE: return "CONTINUE"; break;
 	case HTTP_RESULT_CODE_OK: return "OK"; break;
 	case HTTP_RESULT_CODE_CONTENT: return "CONTENT"; break;
+	case HTTP_RESULT_CODE_BLOCK_CONTINUE: return "CONTINUE"; break;
 	case HTTP_RESULT_CODE_VALID: return "VALID"; break;
 	case HTTP_RESULT_CODE_CREATED: return "CREATED"; break;
 	case HTTP_RESULT_CODE_CHANGED: return "CHANGED"; break;
@@ -615,6 +620,8 @@ http_code_to_cstr(int x) {
 		break;
 	case HTTP_RESULT_CODE_CONFLICT: return "CONFLICT"; break;
 	case HTTP_RESULT_CODE_GONE: return "GONE"; break;
+	case HTTP_RESULT_CODE_REQUEST_ENTITY_TOO_LARGE: return
+		    "REQUEST_ENTITY_TOO_LARGE"; break;
 	case HTTP_RESULT_CODE_UNSUPPORTED_MEDIA_TYPE: return
 		    "UNSUPPORTED_MEDIA_TYPE"; break;
 
@@ -754,6 +761,8 @@ coap_dump_header(
 		case COAP_OPTION_MAX_AGE:
 		case COAP_OPTION_URI_PORT:
 		case COAP_OPTION_OBSERVE:
+		case COAP_OPTION_SIZE:
+		case COAP_OPTION_SIZE1:
 		{
 			unsigned long v = 0;
 			uint8_t i;
@@ -126,6 +126,7 @@ enum {
 	COAP_RESULT_203_VALID = HTTP_TO_COAP_CODE(203),
 	COAP_RESULT_204_CHANGED = HTTP_TO_COAP_CODE(204),
 	COAP_RESULT_205_CONTENT = HTTP_TO_COAP_CODE(205),
+	COAP_RESULT_231_CONTINUE = HTTP_TO_COAP_CODE(231),	/* draft-ietf-core-block */
 
 	COAP_RESULT_400_BAD_REQUEST = HTTP_TO_COAP_CODE(400),
 	COAP_RESULT_401_UNAUTHORIZED = HTTP_TO_COAP_CODE(401),
@@ -156,6 +157,7 @@ enum {
 	HTTP_RESULT_CODE_VALID = 203,
 	HTTP_RESULT_CODE_CHANGED = 204,
 	HTTP_RESULT_CODE_CONTENT = 205,
+	HTTP_RESULT_CODE_BLOCK_CONTINUE = 231,
 
 	HTTP_RESULT_CODE_NOT_MODIFIED = 304,
 
@@ -213,6 +215,7 @@ typedef enum {
 	COAP_OPTION_BLOCK1				= 27,	/* draft-ietf-core-block-10 */
 	COAP_OPTION_SIZE				= 28,	/* draft-ietf-core-block-10 */
 	COAP_OPTION_PROXY_URI			= 35,
+	COAP_OPTION_SIZE1				= 60,	/* draft-ietf-core-block-14 */
 
 	//////////////////////////////////////////////////////////////////////
 	// Experimental after this point. Experimentals start at 65000.
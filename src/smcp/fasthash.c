@@ -5,6 +5,12 @@
 //  Created by Robert Quattlebaum on 12/23/12.
 //  Copyright (c) 2012 deepdarc. All rights reserved.
 //
+//  This file includes its own unit test and benchmark. To compile it,
+//  simply compile this file with the macro FASTHASH_SELF_TEST set to 1.
+//  For example:
+//
+//      cc fasthash.c -Wall -O2 -DFASTHASH_SELF_TEST=1 -o fasthashtest
+//
 
 #include "fasthash.h"
 #include <stdio.h>
@@ -42,8 +48,46 @@ fasthash_feed_byte(struct fasthash_state_s* state, uint8_t data) {
 	}
 }
 
+static uint32_t
+fasthash_load_block(const uint8_t* data) {
+	// Blocks are always little-endian, regardless of the host.
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	uint32_t blk;
+	memcpy(&blk, data, sizeof(blk));
+	return blk;
+#else
+	return (uint32_t)data[0]
+		| ((uint32_t)data[1] << 8)
+		| ((uint32_t)data[2] << 16)
+		| ((uint32_t)data[3] << 24);
+#endif
+}
+
 void
-fasthash_feed(struct fasthash_state_s* state, const uint8_t* data, uint8_t len) {
+fasthash_feed(struct fasthash_state_s* state, const uint8_t* data, size_t len) {
+	// Finish off any partial block byte-by-byte.
+	while (len && (state->bytes & 3)) {
+		fasthash_feed_byte(state, *data++);
+		len--;
+	}
+
+	// Then consume whole blocks.
+	while (len >= 8) {
+		state->bytes += 4;
+		fasthash_feed_block(state, fasthash_load_block(data));
+		state->bytes += 4;
+		fasthash_feed_block(state, fasthash_load_block(data + 4));
+		data += 8;
+		len -= 8;
+	}
+
+	if (len >= 4) {
+		state->bytes += 4;
+		fasthash_feed_block(state, fasthash_load_block(data));
+		data += 4;
+		len -= 4;
+	}
+
 	while (len--) {
 		fasthash_feed_byte(state, *data++);
 	}
@@ -72,3 +116,123 @@ uint8_t
 fasthash_finish_uint8(struct fasthash_state_s* state) {
 	return fasthash_finish_uint32(state)>>24;
 }
+
+fasthash_hash_t
+fasthash_buffer(const void* data, size_t len, fasthash_hash_t salt) {
+	struct fasthash_state_s state;
+
+	fasthash_start(&state, salt);
+	fasthash_feed(&state, (const uint8_t*)data, len);
+	return fasthash_finish(&state);
+}
+
+/* -------------------------------------------------------------------------- */
+
+#if FASTHASH_SELF_TEST
+
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCHMARK_BUFFER_SIZE		(4096)
+#define BENCHMARK_BYTES				(64*1024*1024)
+
+// The original byte-at-a-time implementation, used as a reference.
+static fasthash_hash_t
+bytewise_hash(const uint8_t* data, size_t len, fasthash_hash_t salt) {
+	struct fasthash_state_s state;
+
+	fasthash_start(&state, salt);
+	while (len--) {
+		fasthash_feed_byte(&state, *data++);
+	}
+	return fasthash_finish(&state);
+}
+
+static double
+benchmark(const char* name, fasthash_hash_t (*hash_func)(const uint8_t*, size_t, fasthash_hash_t), const uint8_t* data, size_t len) {
+	volatile fasthash_hash_t sink = 0;
+	clock_t start = clock();
+	double seconds;
+	size_t total;
+
+	for (total = 0; total < BENCHMARK_BYTES; total += len) {
+		sink ^= (*hash_func)(data, len, 0);
+	}
+
+	seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	(void)sink;
+
+	printf("Benchmark %-9s len=%-5d %8.1f MB/s\n", name, (int)len, total / (seconds * 1024 * 1024));
+
+	return seconds;
+}
+
+static fasthash_hash_t
+bulk_hash(const uint8_t* data, size_t len, fasthash_hash_t salt) {
+	return fasthash_buffer(data, len, salt);
+}
+
+int
+main(void) {
+	int ret = 0;
+	uint8_t* buffer = malloc(BENCHMARK_BUFFER_SIZE + 8);
+	size_t len, offset, split;
+	const size_t lengths[] = { 30, 256, BENCHMARK_BUFFER_SIZE };
+	int i;
+
+	for (len = 0; len < BENCHMARK_BUFFER_SIZE + 8; len++) {
+		buffer[len] = (uint8_t)(len * 97 + 101);
+	}
+
+	// Make sure the bulk path produces the same hashes as the
+	// byte-at-a-time path, for every alignment and split point.
+	printf("Consistency test...");
+	fflush(stdout);
+	for (offset = 0; offset < 8; offset++) {
+		for (len = 0; len < 64; len++) {
+			const fasthash_hash_t expected = bytewise_hash(buffer + offset, len, 1234);
+
+			if (fasthash_buffer(buffer + offset, len, 1234) != expected) {
+				printf("\nerror: fasthash_buffer() mismatch, offset=%d len=%d\n", (int)offset, (int)len);
+				ret++;
+			}
+
+			for (split = 0; split <= len; split++) {
+				struct fasthash_state_s state;
+
+				fasthash_start(&state, 1234);
+				fasthash_feed(&state, buffer + offset, split);
+				fasthash_feed(&state, buffer + offset + split, len - split);
+
+				if (fasthash_finish(&state) != expected) {
+					printf("\nerror: fasthash_feed() mismatch, offset=%d len=%d split=%d\n", (int)offset, (int)len, (int)split);
+					ret++;
+				}
+			}
+		}
+	}
+
+	if (fasthash_buffer(buffer, BENCHMARK_BUFFER_SIZE, 0) != bytewise_hash(buffer, BENCHMARK_BUFFER_SIZE, 0)) {
+		printf("\nerror: fasthash_buffer() mismatch on large buffer\n");
+		ret++;
+	}
+
+	if (!ret)
+		printf("OK\n");
+
+	for (i = 0; i < (int)(sizeof(lengths) / sizeof(*lengths)); i++) {
+		const double bytewise = benchmark("bytewise", &bytewise_hash, buffer + 1, lengths[i]);
+		const double bulk = benchmark("bulk", &bulk_hash, buffer + 1, lengths[i]);
+
+		printf(" * speedup = %.2fx\n", bytewise / bulk);
+	}
+
+	free(buffer);
+
+	if (ret)
+		printf("Failed with %d errors.\n", ret);
+
+	return ret;
+}
+
+#endif // FASTHASH_SELF_TEST
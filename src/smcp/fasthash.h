@@ -30,6 +30,7 @@
 #define SMCP_fasthash_h
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef uint32_t fasthash_hash_t;
 
@@ -41,11 +42,16 @@ struct fasthash_state_s {
 
 extern void fasthash_start(struct fasthash_state_s* state, fasthash_hash_t salt);
 extern void fasthash_feed_byte(struct fasthash_state_s* state, uint8_t data);
-extern void fasthash_feed(struct fasthash_state_s* state, const uint8_t* data, uint8_t len);
+extern void fasthash_feed(struct fasthash_state_s* state, const uint8_t* data, size_t len);
 extern fasthash_hash_t fasthash_finish(struct fasthash_state_s* state);
 extern uint32_t fasthash_finish_uint32(struct fasthash_state_s* state);
 extern uint16_t fasthash_finish_uint16(struct fasthash_state_s* state);
 extern uint8_t fasthash_finish_uint8(struct fasthash_state_s* state);
 
+//!	Hashes the given buffer in one shot.
+/*!	Equivalent to calling `fasthash_start()`, `fasthash_feed()`
+**	and `fasthash_finish()` in sequence. */
+extern fasthash_hash_t fasthash_buffer(const void* data, size_t len, fasthash_hash_t salt);
+
 
 #endif
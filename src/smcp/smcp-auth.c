@@ -163,11 +163,11 @@ smcp_auth_user_set(smcp_auth_user_t auth_user,const char* username,const char* p
 	strncpy(auth_user->username,username,sizeof(auth_user->username)-1);
 	struct fasthash_state_s fasthash;
 	fasthash_start(&fasthash, 0);
-	fasthash_feed(&fasthash, (const uint8_t*)auth_user->username, (uint8_t)strlen(auth_user->username));
+	fasthash_feed(&fasthash, (const uint8_t*)auth_user->username, strlen(auth_user->username));
 	fasthash_feed_byte(&fasthash, ':');
-	fasthash_feed(&fasthash, (const uint8_t*)realm, (uint8_t)strlen(realm));
+	fasthash_feed(&fasthash, (const uint8_t*)realm, strlen(realm));
 	fasthash_feed_byte(&fasthash, ':');
-	fasthash_feed(&fasthash, (const uint8_t*)password, (uint8_t)strlen(password));
+	fasthash_feed(&fasthash, (const uint8_t*)password, strlen(password));
 	auth_user->ha1 = fasthash_finish(&fasthash);
 
 	// Get the compiler to shut up while this code is in development.
@@ -196,7 +196,6 @@ smcp_auth_inbound_init() {
 
 	if (COAP_CODE_IS_REQUEST(smcp_inbound_get_code())) {
 		// REQUEST!
-		coap_option_key_t key;
 		const uint8_t* authvalue;
 		coap_size_t authvalue_len;
 
@@ -205,18 +204,15 @@ smcp_auth_inbound_init() {
 			ret = SMCP_STATUS_UNAUTHORIZED;
 		}
 
-		smcp_inbound_reset_next_option();
-
-		while((key = smcp_inbound_next_option(&authvalue,&authvalue_len))!=COAP_OPTION_INVALID) {
-			if(key==COAP_OPTION_PROXY_URI) {
-				// For testing purposes only!
-				ret = SMCP_STATUS_OK;
-			}
-			if(key==COAP_OPTION_AUTHENTICATE) {
-				// For testing purposes only!
-				ret = SMCP_STATUS_OK;
-				// writeme!
-			}
+		if(smcp_inbound_get_nth_option(COAP_OPTION_PROXY_URI, 0, NULL, NULL)) {
+			// For testing purposes only!
+			ret = SMCP_STATUS_OK;
+		}
+
+		if(smcp_inbound_get_nth_option(COAP_OPTION_AUTHENTICATE, 0, &authvalue, &authvalue_len)) {
+			// For testing purposes only!
+			ret = SMCP_STATUS_OK;
+			// writeme!
 		}
 
 		if(smcp_inbound_origin_is_local()) {
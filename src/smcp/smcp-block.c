@@ -0,0 +1,1127 @@
+/*!	@file smcp-block.c
+**	@author Robert Quattlebaum <darco@deepdarc.com>
+**
+**	Copyright (C) 2014 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef VERBOSE_DEBUG
+#define VERBOSE_DEBUG 0
+#endif
+
+#ifndef DEBUG
+#define DEBUG VERBOSE_DEBUG
+#endif
+
+#include "assert-macros.h"
+
+#include "smcp.h"
+#include "smcp-block.h"
+
+#if SMCP_CONF_TRANS_ENABLE_BLOCK2
+
+#include "smcp-internal.h"
+#include "smcp-logging.h"
+
+#include <string.h>
+
+#if SMCP_USE_BSD_SOCKETS
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+// Room left in a packet for the header, token and options of a block.
+#define SMCP_BLOCK_OVERHEAD	(64)
+
+#define BLOCK_SZX_TO_SIZE(szx)	((uint32_t)16<<(szx))
+
+enum {
+	SLOT_IDLE = 0,
+	SLOT_WAITING,
+	SLOT_RECEIVED,
+};
+
+static void block2_fetch_schedule_pump(smcp_block2_fetch_t fetch);
+
+//!	Returns the largest block size exponent that fits in a packet.
+static uint8_t
+block_max_szx(void)
+{
+	uint8_t szx = 6;
+
+	while(szx && (BLOCK_SZX_TO_SIZE(szx) + SMCP_BLOCK_OVERHEAD > SMCP_MAX_PACKET_LENGTH))
+		szx--;
+
+	return szx;
+}
+
+//!	Looks up an option of the inbound packet without moving the option scanner.
+static bool
+block_inbound_get_option_uint(coap_option_key_t key, uint32_t* value)
+{
+	const uint8_t* option_value;
+	coap_size_t option_len;
+
+	if(!smcp_inbound_get_nth_option(key, 0, &option_value, &option_len))
+		return false;
+
+	*value = coap_decode_uint32(option_value, (uint8_t)option_len);
+	return true;
+}
+
+// MARK: -
+// MARK: Block2 Slots
+
+static smcp_status_t
+block2_slot_request(struct smcp_block2_slot_s* slot)
+{
+	// The Block2 option is added from transaction->next_block2.
+	return (*slot->fetch->request_func)(slot->fetch->context);
+}
+
+static void
+block2_fetch_fail(smcp_block2_fetch_t fetch, int statuscode)
+{
+	if(!fetch->failed) {
+		fetch->failed = true;
+		fetch->failed_status = statuscode;
+	}
+	block2_fetch_schedule_pump(fetch);
+}
+
+//!	Hands any blocks which are now contiguous to the data callback.
+static void
+block2_fetch_deliver(smcp_block2_fetch_t fetch)
+{
+	int i;
+
+	for(i = 0; i < fetch->window; i++) {
+		struct smcp_block2_slot_s* const slot = &fetch->slots[i];
+
+		if(slot->state != SLOT_RECEIVED || slot->offset > fetch->delivered)
+			continue;
+
+		slot->state = SLOT_IDLE;
+
+		// Blocks can overlap if the server changed the block size.
+		if(slot->offset + slot->len > fetch->delivered) {
+			const uint32_t skip = fetch->delivered - slot->offset;
+			const coap_size_t len = (coap_size_t)(slot->len - skip);
+
+			if(fetch->data_func) {
+				smcp_status_t status = (*fetch->data_func)(fetch->context, slot->data + skip, len, fetch->delivered);
+
+				if(status) {
+					block2_fetch_fail(fetch, status);
+					break;
+				}
+			}
+
+			fetch->delivered += len;
+		}
+
+		// Start over, since an earlier slot may hold the next block.
+		i = -1;
+	}
+}
+
+static smcp_status_t
+block2_slot_response(int statuscode, struct smcp_block2_slot_s* slot)
+{
+	smcp_block2_fetch_t const fetch = slot->fetch;
+	const uint8_t* content = (const uint8_t*)smcp_inbound_get_content_ptr();
+	coap_size_t content_len = smcp_inbound_get_content_len();
+	bool has_block2 = false;
+	uint32_t block2 = 0;
+	uint32_t block_size;
+	uint32_t offset;
+
+	if(slot->state != SLOT_WAITING)
+		goto bail;
+
+	slot->state = SLOT_IDLE;
+
+	if(fetch->failed)
+		goto bail;
+
+	if((statuscode < COAP_RESULT_200) || (statuscode >= COAP_RESULT_300)) {
+		if(fetch->end_known && (slot->offset >= fetch->end)) {
+			// We asked for more than there was. No harm done.
+		} else if(COAP_CODE_IS_RESULT(statuscode) && (statuscode >= COAP_RESULT_400) && slot->offset) {
+			// Probably past the end. We'll know once the blocks
+			// before this one arrive.
+			if(slot->offset < fetch->limit) {
+				fetch->limit = slot->offset;
+				fetch->limit_status = statuscode;
+			}
+		} else {
+			block2_fetch_fail(fetch, statuscode);
+		}
+		goto bail;
+	}
+
+	has_block2 = block_inbound_get_option_uint(COAP_OPTION_BLOCK2, &block2);
+
+	{
+		uint32_t size;
+
+		// Size2 tells us where the end is up front.
+		if(block_inbound_get_option_uint(COAP_OPTION_SIZE, &size)
+			&& (!fetch->end_known || (size < fetch->end))
+		) {
+			fetch->end = size;
+			fetch->end_known = true;
+		}
+	}
+
+	fetch->statuscode = statuscode;
+
+	if(has_block2) {
+		block_size = BLOCK_SZX_TO_SIZE(block2 & 0x7);
+		offset = (block2 >> 4) * block_size;
+	} else {
+		// The server sent the whole thing at once.
+		block_size = content_len;
+		offset = 0;
+	}
+
+	require_action(offset == slot->offset, bail, block2_fetch_fail(fetch, SMCP_STATUS_FAILURE));
+	require_action(content_len <= block_size, bail, block2_fetch_fail(fetch, SMCP_STATUS_FAILURE));
+	// A whole response can be bigger than any block, but it is only
+	// kept in the slot when it is going to a callback.
+	require_action(!fetch->data_func || (content_len <= sizeof(slot->data)), bail, block2_fetch_fail(fetch, SMCP_STATUS_MESSAGE_TOO_BIG));
+
+	if(!has_block2 || !(block2 & (1<<3))) {
+		if(!fetch->end_known || (offset + content_len < fetch->end)) {
+			fetch->end = offset + content_len;
+			fetch->end_known = true;
+		}
+	} else {
+		require_action(content_len == block_size, bail, block2_fetch_fail(fetch, SMCP_STATUS_FAILURE));
+
+		if(!fetch->started || (block_size < BLOCK_SZX_TO_SIZE(fetch->szx))) {
+			// Follow the server's lead on the block size. Anything
+			// which was asked for at a larger size and comes back
+			// short leaves a gap, which the pump will notice.
+			fetch->szx = block2 & 0x7;
+		}
+	}
+
+	fetch->started = true;
+
+	if(fetch->buffer) {
+		require_action(
+			offset + content_len <= fetch->buffer_size,
+			bail,
+			block2_fetch_fail(fetch, SMCP_STATUS_MESSAGE_TOO_BIG)
+		);
+		memcpy(fetch->buffer + offset, content, content_len);
+	}
+
+	if(fetch->data_func)
+		memcpy(slot->data, content, content_len);
+
+	slot->len = content_len;
+	slot->state = SLOT_RECEIVED;
+
+	block2_fetch_deliver(fetch);
+
+bail:
+	block2_fetch_schedule_pump(fetch);
+	return SMCP_STATUS_OK;
+}
+
+// MARK: -
+// MARK: Block2 Pump
+
+//!	Returns the lowest offset that is neither delivered, received nor requested.
+static uint32_t
+block2_fetch_next_offset(smcp_block2_fetch_t fetch)
+{
+	uint32_t offset = fetch->delivered;
+	bool moved;
+	int i;
+
+	do {
+		moved = false;
+		for(i = 0; i < fetch->window; i++) {
+			const struct smcp_block2_slot_s* const slot = &fetch->slots[i];
+
+			if(slot->state == SLOT_IDLE)
+				continue;
+
+			if((slot->offset <= offset) && (offset < slot->offset + slot->len)) {
+				offset = slot->offset + slot->len;
+				moved = true;
+			}
+		}
+	} while(moved);
+
+	return offset;
+}
+
+static void
+block2_fetch_finish(smcp_block2_fetch_t fetch, int statuscode)
+{
+	smcp_block2_finished_func const finished_func = fetch->finished_func;
+
+	smcp_block2_fetch_end(fetch->interface, fetch);
+
+	if(finished_func)
+		(*finished_func)(fetch->context, statuscode, fetch->delivered);
+}
+
+//!	Finishes the fetch, or keeps the window full. Runs from a timer.
+static void
+block2_fetch_pump(smcp_t self, smcp_block2_fetch_t fetch)
+{
+	int i;
+
+	if(!fetch->active)
+		return;
+
+	if(fetch->failed) {
+		block2_fetch_finish(fetch, fetch->failed_status);
+		return;
+	}
+
+	if(fetch->end_known && (fetch->delivered >= fetch->end)) {
+		block2_fetch_finish(fetch, fetch->statuscode);
+		return;
+	}
+
+	if(fetch->delivered >= fetch->limit) {
+		block2_fetch_finish(fetch, fetch->limit_status);
+		return;
+	}
+
+	if(fetch->buffer && (fetch->delivered >= fetch->buffer_size)) {
+		block2_fetch_finish(fetch, SMCP_STATUS_MESSAGE_TOO_BIG);
+		return;
+	}
+
+	for(i = 0; i < fetch->window; i++) {
+		struct smcp_block2_slot_s* const slot = &fetch->slots[i];
+		const uint32_t block_size = BLOCK_SZX_TO_SIZE(fetch->szx);
+		uint32_t offset;
+		smcp_status_t status;
+
+		if(slot->state != SLOT_IDLE)
+			continue;
+
+		// Until the first block comes back we don't know the block
+		// size, so we don't get ahead of ourselves.
+		if(!fetch->started && (block2_fetch_next_offset(fetch) != 0))
+			break;
+
+		offset = block2_fetch_next_offset(fetch);
+
+		if(fetch->end_known && (offset >= fetch->end))
+			break;
+		if(offset >= fetch->limit)
+			break;
+		if(fetch->buffer && (offset >= fetch->buffer_size))
+			break;
+
+		smcp_transaction_init(
+			&slot->transaction,
+			0, // Flags
+			(void*)&block2_slot_request,
+			(void*)&block2_slot_response,
+			(void*)slot
+		);
+
+		slot->offset = offset;
+		slot->len = block_size;
+		slot->state = SLOT_WAITING;
+
+		status = smcp_transaction_begin(self, &slot->transaction, fetch->expiration);
+
+		if(status) {
+			slot->state = SLOT_IDLE;
+			block2_fetch_finish(fetch, status);
+			return;
+		}
+
+		// smcp_transaction_begin() clears this, so it goes last.
+		slot->transaction.next_block2 = ((offset / block_size) << 4) | fetch->szx;
+
+		DEBUG_PRINTF("Block2: Requesting %u bytes at %u", (unsigned)block_size, (unsigned)offset);
+	}
+}
+
+static void
+block2_fetch_schedule_pump(smcp_block2_fetch_t fetch)
+{
+	if(fetch->active && !smcp_timer_is_scheduled(fetch->interface, &fetch->timer))
+		smcp_schedule_timer(fetch->interface, &fetch->timer, 0);
+}
+
+// MARK: -
+// MARK: Block2 Public API
+
+smcp_block2_fetch_t
+smcp_block2_fetch_init(
+	smcp_block2_fetch_t fetch,
+	smcp_inbound_resend_func request_func,
+	smcp_block_data_func data_func,
+	smcp_block2_finished_func finished_func,
+	void* context
+) {
+	int i;
+
+	require(fetch != NULL, bail);
+
+	memset(fetch, 0, sizeof(*fetch));
+
+	fetch->request_func = request_func;
+	fetch->data_func = data_func;
+	fetch->finished_func = finished_func;
+	fetch->context = context;
+	fetch->window = SMCP_BLOCK2_DEFAULT_WINDOW;
+
+	if(fetch->window > SMCP_BLOCK2_MAX_WINDOW)
+		fetch->window = SMCP_BLOCK2_MAX_WINDOW;
+
+	// Start with the biggest block that we can receive.
+	fetch->szx = block_max_szx();
+
+	for(i = 0; i < SMCP_BLOCK2_MAX_WINDOW; i++)
+		fetch->slots[i].fetch = fetch;
+
+bail:
+	return fetch;
+}
+
+void
+smcp_block2_fetch_set_buffer(
+	smcp_block2_fetch_t fetch,
+	uint8_t* buffer,
+	uint32_t size
+) {
+	fetch->buffer = buffer;
+	fetch->buffer_size = size;
+}
+
+void
+smcp_block2_fetch_set_window(
+	smcp_block2_fetch_t fetch,
+	uint8_t window
+) {
+	if(window < 1)
+		window = 1;
+	if(window > SMCP_BLOCK2_MAX_WINDOW)
+		window = SMCP_BLOCK2_MAX_WINDOW;
+	fetch->window = window;
+}
+
+void
+smcp_block2_fetch_set_szx(
+	smcp_block2_fetch_t fetch,
+	uint8_t szx
+) {
+	if(szx < fetch->szx)
+		fetch->szx = szx;
+}
+
+smcp_status_t
+smcp_block2_fetch_begin(
+	smcp_t self,
+	smcp_block2_fetch_t fetch,
+	cms_t expiration
+) {
+	smcp_status_t ret = SMCP_STATUS_INVALID_ARGUMENT;
+
+	SMCP_EMBEDDED_SELF_HOOK;
+
+	require(fetch != NULL, bail);
+	require(fetch->request_func != NULL, bail);
+	require(fetch->data_func || fetch->buffer, bail);
+
+	smcp_block2_fetch_end(self, fetch);
+
+	fetch->interface = self;
+	fetch->expiration = expiration;
+	fetch->delivered = 0;
+	fetch->end = 0;
+	fetch->limit = UINT32_MAX;
+	fetch->statuscode = 0;
+	fetch->started = false;
+	fetch->end_known = false;
+	fetch->failed = false;
+	fetch->active = true;
+
+	smcp_timer_init(
+		&fetch->timer,
+		(smcp_timer_callback_t)&block2_fetch_pump,
+		NULL,
+		fetch
+	);
+
+	block2_fetch_pump(self, fetch);
+
+	ret = fetch->active ? SMCP_STATUS_OK : SMCP_STATUS_FAILURE;
+
+bail:
+	return ret;
+}
+
+smcp_status_t
+smcp_block2_fetch_end(
+	smcp_t self,
+	smcp_block2_fetch_t fetch
+) {
+	int i;
+
+	SMCP_EMBEDDED_SELF_HOOK;
+
+	if(!fetch->active)
+		goto bail;
+
+	fetch->active = false;
+
+	smcp_invalidate_timer(self, &fetch->timer);
+
+	for(i = 0; i < SMCP_BLOCK2_MAX_WINDOW; i++) {
+		struct smcp_block2_slot_s* const slot = &fetch->slots[i];
+
+		if(slot->state == SLOT_WAITING) {
+			slot->state = SLOT_IDLE;
+			smcp_transaction_end(self, &slot->transaction);
+		}
+		slot->state = SLOT_IDLE;
+	}
+
+bail:
+	return SMCP_STATUS_OK;
+}
+
+// MARK: -
+// MARK: Block1 Slots
+
+static void block1_upload_schedule_pump(smcp_block1_upload_t upload);
+
+static void
+block1_upload_finish(smcp_block1_upload_t upload, int statuscode)
+{
+	smcp_block1_finished_func const finished_func = upload->finished_func;
+
+	smcp_block1_upload_end(upload->interface, upload);
+
+	if(finished_func)
+		(*finished_func)(upload->context, statuscode);
+}
+
+static smcp_status_t
+block1_slot_request(struct smcp_block1_slot_s* slot)
+{
+	smcp_block1_upload_t const upload = slot->upload;
+	smcp_status_t status;
+
+	// The Block1 option is added from transaction->next_block1.
+	status = (*upload->request_func)(upload->context);
+	require_noerr(status, bail);
+
+	if(upload->size_known && slot->block1 && (slot->offset == 0)) {
+		status = smcp_outbound_add_option_uint(COAP_OPTION_SIZE1, upload->size);
+		require_noerr(status, bail);
+	}
+
+	status = smcp_outbound_append_content((const char*)slot->data, slot->len);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+static smcp_status_t
+block1_slot_response(int statuscode, struct smcp_block1_slot_s* slot)
+{
+	smcp_block1_upload_t const upload = slot->upload;
+	bool has_block1 = false;
+	uint32_t block1 = 0;
+
+	if(slot->state != SLOT_WAITING)
+		goto bail;
+
+	slot->state = SLOT_IDLE;
+
+	if(!upload->active || upload->failed)
+		goto bail;
+
+	if(COAP_CODE_IS_RESULT(statuscode))
+		has_block1 = block_inbound_get_option_uint(COAP_OPTION_BLOCK1, &block1);
+
+	if((slot->block1 & (1<<3))
+		&& ((statuscode == COAP_RESULT_231_CONTINUE)
+			|| (has_block1 && (statuscode >= COAP_RESULT_200) && (statuscode < COAP_RESULT_300)))
+	) {
+		// Servers which act on each block as it arrives may
+		// acknowledge with a 2.04 (Changed) instead.
+		upload->started = true;
+
+		if(has_block1 && ((block1 & 0x7) < upload->szx)) {
+			// Smaller blocks from here on. The block that was just
+			// acknowledged still counts in full.
+			upload->szx = block1 & 0x7;
+		}
+
+		block1_upload_schedule_pump(upload);
+		goto bail;
+	}
+
+	if((statuscode == COAP_RESULT_413_REQUEST_ENTITY_TOO_LARGE)
+		&& !upload->started
+		&& (slot->offset == 0)
+		&& has_block1
+		&& ((block1 & 0x7) < upload->szx)
+	) {
+		// Start over with the block size the server asked for.
+		// Nothing else is in flight until the first block is
+		// acknowledged, so the carry buffer holds everything after
+		// this block.
+		memmove(upload->carry + slot->len, upload->carry, upload->carry_len);
+		memcpy(upload->carry, slot->data, slot->len);
+		upload->carry_len += slot->len;
+		upload->offset = 0;
+		upload->final_sent = false;
+		upload->szx = block1 & 0x7;
+
+		DEBUG_PRINTF("Block1: Restarting with %u byte blocks", (unsigned)BLOCK_SZX_TO_SIZE(upload->szx));
+
+		block1_upload_schedule_pump(upload);
+		goto bail;
+	}
+
+	// Anything else is the end of the upload, one way or another.
+	// This is done from here so that the response is still around.
+	block1_upload_finish(upload, statuscode);
+
+bail:
+	return SMCP_STATUS_OK;
+}
+
+// MARK: -
+// MARK: Block1 Pump
+
+static bool
+block1_upload_in_flight(smcp_block1_upload_t upload)
+{
+	int i;
+
+	for(i = 0; i < SMCP_BLOCK1_MAX_WINDOW; i++)
+		if(upload->slots[i].state == SLOT_WAITING)
+			return true;
+
+	return false;
+}
+
+//!	Returns the offset of the oldest block that hasn't been acknowledged.
+static uint32_t
+block1_upload_oldest(smcp_block1_upload_t upload)
+{
+	uint32_t offset = upload->offset;
+	int i;
+
+	for(i = 0; i < SMCP_BLOCK1_MAX_WINDOW; i++) {
+		const struct smcp_block1_slot_s* const slot = &upload->slots[i];
+
+		if((slot->state == SLOT_WAITING) && (slot->offset < offset))
+			offset = slot->offset;
+	}
+
+	return offset;
+}
+
+//!	Reads until the carry buffer has `want` bytes or the body ends.
+static smcp_status_t
+block1_upload_read(smcp_block1_upload_t upload, coap_size_t want)
+{
+	smcp_status_t status = SMCP_STATUS_OK;
+
+	while(!upload->eof && (upload->carry_len < want)) {
+		uint8_t* const buffer = upload->carry + upload->carry_len;
+		coap_size_t len = (coap_size_t)(sizeof(upload->carry) - upload->carry_len);
+
+		if(upload->read_func) {
+			status = (*upload->read_func)(
+				upload->context,
+				buffer,
+				&len,
+				upload->offset + upload->carry_len
+			);
+			require_noerr(status, bail);
+#if SMCP_USE_BSD_SOCKETS
+		} else if(upload->fd >= 0) {
+			ssize_t bytes = read(upload->fd, buffer, len);
+
+			if((bytes < 0) && (errno == EINTR))
+				continue;
+
+			require_action(bytes >= 0, bail, status = SMCP_STATUS_ERRNO);
+
+			len = (coap_size_t)bytes;
+#endif
+		} else {
+			len = 0;
+		}
+
+		if(!len)
+			upload->eof = true;
+
+		upload->carry_len += len;
+	}
+
+bail:
+	return status;
+}
+
+//!	Finishes the upload, or keeps the window full. Runs from a timer.
+static void
+block1_upload_pump(smcp_t self, smcp_block1_upload_t upload)
+{
+	int i;
+
+	if(!upload->active)
+		return;
+
+	if(upload->failed) {
+		block1_upload_finish(upload, upload->failed_status);
+		return;
+	}
+
+	for(i = 0; i < upload->window; i++) {
+		struct smcp_block1_slot_s* const slot = &upload->slots[i];
+		const uint32_t block_size = BLOCK_SZX_TO_SIZE(upload->szx);
+		smcp_status_t status;
+		bool more;
+
+		if(slot->state != SLOT_IDLE)
+			continue;
+
+		if(upload->final_sent)
+			break;
+
+		// Until the first block is acknowledged we don't know the
+		// block size, so we don't get ahead of ourselves.
+		if(!upload->started && block1_upload_in_flight(upload))
+			break;
+
+		// The server has to hold on to anything that arrives after a
+		// lost block, so don't get more than a window ahead of it.
+		if(upload->offset >= block1_upload_oldest(upload) + upload->window * block_size)
+			break;
+
+		// One byte past the block tells us if there is more.
+		status = block1_upload_read(upload, (coap_size_t)block_size + 1);
+
+		if(status) {
+			block1_upload_finish(upload, status);
+			return;
+		}
+
+		more = (upload->carry_len > block_size);
+
+		// The response to the final block is the response to the
+		// whole upload, so it waits for the others.
+		if(!more && block1_upload_in_flight(upload))
+			break;
+
+		slot->offset = upload->offset;
+		slot->len = more ? (coap_size_t)block_size : upload->carry_len;
+		memcpy(slot->data, upload->carry, slot->len);
+		upload->carry_len -= slot->len;
+		memmove(upload->carry, upload->carry + slot->len, upload->carry_len);
+		upload->offset += slot->len;
+
+		if(!more && (slot->offset == 0)) {
+			// It all fits in one request.
+			slot->block1 = 0;
+		} else {
+			slot->block1 = ((slot->offset / block_size) << 4) | (more << 3) | upload->szx;
+		}
+
+		if(!more)
+			upload->final_sent = true;
+
+		smcp_transaction_init(
+			&slot->transaction,
+			0, // Flags
+			(void*)&block1_slot_request,
+			(void*)&block1_slot_response,
+			(void*)slot
+		);
+
+		slot->state = SLOT_WAITING;
+
+		status = smcp_transaction_begin(self, &slot->transaction, upload->expiration);
+
+		if(status) {
+			slot->state = SLOT_IDLE;
+			block1_upload_finish(upload, status);
+			return;
+		}
+
+		// smcp_transaction_begin() clears this, so it goes last.
+		slot->transaction.next_block1 = slot->block1;
+
+		DEBUG_PRINTF("Block1: Sending %u bytes at %u", (unsigned)slot->len, (unsigned)slot->offset);
+	}
+}
+
+static void
+block1_upload_schedule_pump(smcp_block1_upload_t upload)
+{
+	if(upload->active && !smcp_timer_is_scheduled(upload->interface, &upload->timer))
+		smcp_schedule_timer(upload->interface, &upload->timer, 0);
+}
+
+// MARK: -
+// MARK: Block1 Public API
+
+smcp_block1_upload_t
+smcp_block1_upload_init(
+	smcp_block1_upload_t upload,
+	smcp_block1_request_func request_func,
+	smcp_block1_read_func read_func,
+	smcp_block1_finished_func finished_func,
+	void* context
+) {
+	int i;
+
+	require(upload != NULL, bail);
+
+	memset(upload, 0, sizeof(*upload));
+
+	upload->request_func = request_func;
+	upload->read_func = read_func;
+	upload->finished_func = finished_func;
+	upload->context = context;
+	upload->fd = -1;
+	upload->window = 1;
+	upload->szx = block_max_szx();
+
+	for(i = 0; i < SMCP_BLOCK1_MAX_WINDOW; i++)
+		upload->slots[i].upload = upload;
+
+bail:
+	return upload;
+}
+
+#if SMCP_USE_BSD_SOCKETS
+void
+smcp_block1_upload_set_fd(
+	smcp_block1_upload_t upload,
+	int fd
+) {
+	upload->fd = fd;
+}
+#endif
+
+void
+smcp_block1_upload_set_size(
+	smcp_block1_upload_t upload,
+	uint32_t size
+) {
+	upload->size = size;
+	upload->size_known = true;
+}
+
+void
+smcp_block1_upload_set_window(
+	smcp_block1_upload_t upload,
+	uint8_t window
+) {
+	if(window < 1)
+		window = 1;
+	if(window > SMCP_BLOCK1_MAX_WINDOW)
+		window = SMCP_BLOCK1_MAX_WINDOW;
+	upload->window = window;
+}
+
+void
+smcp_block1_upload_set_szx(
+	smcp_block1_upload_t upload,
+	uint8_t szx
+) {
+	if(szx < upload->szx)
+		upload->szx = szx;
+}
+
+smcp_status_t
+smcp_block1_upload_begin(
+	smcp_t self,
+	smcp_block1_upload_t upload,
+	cms_t expiration
+) {
+	smcp_status_t ret = SMCP_STATUS_INVALID_ARGUMENT;
+
+	SMCP_EMBEDDED_SELF_HOOK;
+
+	require(upload != NULL, bail);
+	require(upload->request_func != NULL, bail);
+
+	smcp_block1_upload_end(self, upload);
+
+	upload->interface = self;
+	upload->expiration = expiration;
+	upload->offset = 0;
+	upload->carry_len = 0;
+	upload->started = false;
+	upload->eof = false;
+	upload->final_sent = false;
+	upload->failed = false;
+	upload->active = true;
+
+	smcp_timer_init(
+		&upload->timer,
+		(smcp_timer_callback_t)&block1_upload_pump,
+		NULL,
+		upload
+	);
+
+	block1_upload_pump(self, upload);
+
+	ret = upload->active ? SMCP_STATUS_OK : SMCP_STATUS_FAILURE;
+
+bail:
+	return ret;
+}
+
+smcp_status_t
+smcp_block1_upload_end(
+	smcp_t self,
+	smcp_block1_upload_t upload
+) {
+	int i;
+
+	SMCP_EMBEDDED_SELF_HOOK;
+
+	if(!upload->active)
+		goto bail;
+
+	upload->active = false;
+
+	smcp_invalidate_timer(self, &upload->timer);
+
+	for(i = 0; i < SMCP_BLOCK1_MAX_WINDOW; i++) {
+		struct smcp_block1_slot_s* const slot = &upload->slots[i];
+
+		if(slot->state == SLOT_WAITING) {
+			slot->state = SLOT_IDLE;
+			smcp_transaction_end(self, &slot->transaction);
+		}
+		slot->state = SLOT_IDLE;
+	}
+
+bail:
+	return SMCP_STATUS_OK;
+}
+
+// MARK: -
+// MARK: Block1 Receiver
+
+void
+smcp_block1_receiver_init(
+	struct smcp_block1_receiver_s* receiver,
+	uint32_t max_size
+) {
+	memset(receiver, 0, sizeof(*receiver));
+	receiver->max_size = max_size;
+	receiver->szx = block_max_szx();
+}
+
+//!	Passes on whatever part of a block hasn't been delivered yet.
+static smcp_status_t
+block1_receiver_deliver(
+	struct smcp_block1_receiver_s* receiver,
+	smcp_block_data_func data_func,
+	void* context,
+	const uint8_t* data,
+	coap_size_t len,
+	uint32_t offset
+) {
+	smcp_status_t status = SMCP_STATUS_OK;
+
+	if(offset + len > receiver->next_offset) {
+		const uint32_t skip = receiver->next_offset - offset;
+
+		len = (coap_size_t)(len - skip);
+
+		status = (*data_func)(context, data + skip, len, receiver->next_offset);
+
+		// The rest of the body is of no use without this part.
+		require_action(status == SMCP_STATUS_OK, bail, receiver->active = false);
+
+		receiver->next_offset += len;
+	}
+
+bail:
+	return status;
+}
+
+smcp_status_t
+smcp_block1_receive(
+	struct smcp_block1_receiver_s* receiver,
+	smcp_block_data_func data_func,
+	void* context
+) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	const uint8_t* content = (const uint8_t*)smcp_inbound_get_content_ptr();
+	coap_size_t content_len = smcp_inbound_get_content_len();
+	bool has_block1;
+	uint32_t block1 = 0;
+	uint32_t size1 = 0;
+	uint32_t block_size;
+	uint32_t offset;
+	bool more;
+	int i;
+
+	require_action(receiver != NULL && data_func != NULL, bail, ret = SMCP_STATUS_INVALID_ARGUMENT);
+
+	has_block1 = block_inbound_get_option_uint(COAP_OPTION_BLOCK1, &block1);
+
+	block_size = BLOCK_SZX_TO_SIZE(block1 & 0x7);
+	offset = (block1 >> 4) * block_size;
+	more = !!(block1 & (1<<3));
+
+	if(has_block1) {
+		require_action((block1 & 0x7) != 7, bail, ret = SMCP_STATUS_BAD_OPTION);
+		require_action(content_len <= block_size, bail, ret = SMCP_STATUS_BAD_OPTION);
+		require_action(!more || (content_len == block_size), bail, ret = SMCP_STATUS_BAD_OPTION);
+	}
+
+	if(receiver->max_size
+		&& ((offset + content_len > receiver->max_size)
+			|| (block_inbound_get_option_uint(COAP_OPTION_SIZE1, &size1) && (size1 > receiver->max_size)))
+	) {
+		receiver->active = false;
+
+		ret = smcp_outbound_begin_response(COAP_RESULT_413_REQUEST_ENTITY_TOO_LARGE);
+		require_noerr(ret, bail);
+
+		ret = smcp_outbound_add_option_uint(COAP_OPTION_SIZE1, receiver->max_size);
+		require_noerr(ret, bail);
+
+		ret = smcp_outbound_send();
+		require_noerr(ret, bail);
+
+		ret = SMCP_STATUS_MESSAGE_TOO_BIG;
+		goto bail;
+	}
+
+	if(offset == 0) {
+		// The start of a new body, whether or not it comes in blocks.
+		receiver->next_offset = 0;
+		receiver->active = more;
+		receiver->remote_saddr = *smcp_inbound_get_srcaddr();
+
+		for(i = 0; i < SMCP_BLOCK1_MAX_WINDOW; i++)
+			receiver->held[i].len = 0;
+
+	} else if(!receiver->active
+		|| (0 != memcmp(&receiver->remote_saddr, smcp_inbound_get_srcaddr(), sizeof(receiver->remote_saddr)))
+	) {
+		// A continuation of something we weren't following.
+		ret = SMCP_STATUS_INCOMPLETE;
+		goto bail;
+	}
+
+	if(offset > receiver->next_offset) {
+		struct smcp_block1_held_s* held = NULL;
+
+		// This block got ahead of the ones before it. The final block
+		// can't be acknowledged until the rest have arrived, though.
+		require_action(more, bail, ret = SMCP_STATUS_INCOMPLETE);
+
+		for(i = 0; i < SMCP_BLOCK1_MAX_WINDOW; i++) {
+			if(receiver->held[i].len && (receiver->held[i].offset == offset)) {
+				held = &receiver->held[i];
+				break;
+			}
+			if(!held && !receiver->held[i].len)
+				held = &receiver->held[i];
+		}
+
+		require_action(held != NULL, bail, ret = SMCP_STATUS_INCOMPLETE);
+
+		held->offset = offset;
+		held->len = content_len;
+		memcpy(held->data, content, content_len);
+
+	} else {
+		ret = block1_receiver_deliver(receiver, data_func, context, content, content_len, offset);
+		require_noerr(ret, bail);
+
+		// Anything that was held and is now contiguous goes next.
+		for(i = 0; i < SMCP_BLOCK1_MAX_WINDOW; i++) {
+			struct smcp_block1_held_s* const held = &receiver->held[i];
+
+			if(!held->len || (held->offset > receiver->next_offset))
+				continue;
+
+			ret = block1_receiver_deliver(receiver, data_func, context, held->data, held->len, held->offset);
+			held->len = 0;
+			require_noerr(ret, bail);
+
+			i = -1;
+		}
+	}
+
+	if(!more) {
+		// That was the last of it.
+		receiver->active = false;
+		goto bail;
+	}
+
+	{
+		// Acknowledge the block, asking for smaller ones if need be.
+		const uint8_t szx = ((block1 & 0x7) < receiver->szx) ? (block1 & 0x7) : receiver->szx;
+
+		ret = smcp_outbound_begin_response(COAP_RESULT_231_CONTINUE);
+		require_noerr(ret, bail);
+
+		ret = smcp_outbound_add_option_uint(
+			COAP_OPTION_BLOCK1,
+			((offset >> (szx + 4)) << 4) | (1<<3) | szx
+		);
+		require_noerr(ret, bail);
+
+		ret = smcp_outbound_send();
+		require_noerr(ret, bail);
+
+		ret = SMCP_STATUS_CONTINUE;
+	}
+
+bail:
+	return ret;
+}
+
+#endif // SMCP_CONF_TRANS_ENABLE_BLOCK2
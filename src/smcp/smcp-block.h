@@ -0,0 +1,392 @@
+/*!	@file smcp-block.h
+**	@author Robert Quattlebaum <darco@deepdarc.com>
+**
+**	Copyright (C) 2014 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __SMCP_BLOCK_H__
+#define __SMCP_BLOCK_H__ 1
+
+#include "smcp.h"
+#include "smcp-transaction.h"
+
+#if SMCP_CONF_TRANS_ENABLE_BLOCK2
+
+#if SMCP_EMBEDDED
+#define smcp_block2_fetch_begin(self,...)		smcp_block2_fetch_begin(__VA_ARGS__)
+#define smcp_block2_fetch_end(self,...)		smcp_block2_fetch_end(__VA_ARGS__)
+#define smcp_block1_upload_begin(self,...)		smcp_block1_upload_begin(__VA_ARGS__)
+#define smcp_block1_upload_end(self,...)		smcp_block1_upload_end(__VA_ARGS__)
+#endif
+
+//!	The largest block that a block-wise transfer will use.
+/*!	CoAP blocks top out at 1KB, so this stays put even when
+**	SMCP_MAX_CONTENT_LENGTH is raised for jumbo packets. */
+#define SMCP_BLOCK_MAX_SIZE \
+	((SMCP_MAX_CONTENT_LENGTH < 1024) ? SMCP_MAX_CONTENT_LENGTH : 1024)
+
+__BEGIN_DECLS
+
+/*!	@addtogroup smcp
+**	@{
+*/
+
+/*!	@defgroup smcp-block2 Block2 Transfers
+**	@{
+**	@brief Fetching large resources a block at a time.
+**
+**	A plain transaction with SMCP_TRANSACTION_ALWAYS_INVALIDATE follows
+**	Block2 responses by asking for the next block once the previous
+**	one has arrived, which costs a full round trip per block. A Block2
+**	fetch instead keeps a window of block requests in flight, each in a
+**	transaction of its own, and puts the blocks back in order as they
+**	come in.
+**
+**	The first block is requested with the largest block size that fits
+**	in SMCP_MAX_CONTENT_LENGTH (or the size given to
+**	smcp_block2_fetch_set_szx()), so a server which would otherwise
+**	default to small blocks may use bigger ones. Whatever size the
+**	server answers with is used from then on. If the server shrinks the
+**	block size part way through, the gaps are requested again at the
+**	smaller size.
+**
+**	The reassembled content is either written into a caller-supplied
+**	buffer or handed to a callback in order as it becomes contiguous.
+**
+**	The request callback works just like the resend callback of a
+**	transaction: it must build and send the request (method, URI,
+**	Accept and so on), and should not add a Block2 option itself, as
+**	the right one is added automatically. It is called once for every
+**	block, and must build the same request every time.
+*/
+
+struct smcp_block2_fetch_s;
+typedef struct smcp_block2_fetch_s* smcp_block2_fetch_t;
+
+//!	Called with contiguous content, in order. Return non-zero to abort.
+typedef smcp_status_t (*smcp_block_data_func)(
+	void* context,
+	const uint8_t* data,
+	coap_size_t len,
+	uint32_t offset
+);
+
+//!	Called once the fetch is over.
+/*!	`statuscode` is the result code of the response (e.g. 2.05) if the
+**	whole resource was fetched, or an error otherwise. `total_len` is the
+**	amount of contiguous content that was delivered. */
+typedef void (*smcp_block2_finished_func)(
+	void* context,
+	int statuscode,
+	uint32_t total_len
+);
+
+struct smcp_block2_slot_s {
+	struct smcp_transaction_s	transaction;
+	smcp_block2_fetch_t			fetch;
+	uint32_t					offset;
+	uint32_t					len;	//!< Requested size while waiting, received size after.
+	uint8_t						state;
+	uint8_t						data[SMCP_BLOCK_MAX_SIZE];
+};
+
+struct smcp_block2_fetch_s {
+	/**** All of this is private. Don't touch. ****/
+
+	smcp_t						interface;
+	smcp_inbound_resend_func	request_func;
+	smcp_block_data_func		data_func;
+	smcp_block2_finished_func	finished_func;
+	void*						context;
+
+	uint8_t*					buffer;
+	uint32_t					buffer_size;
+
+	cms_t						expiration;
+	struct smcp_timer_s			timer;
+
+	uint32_t					delivered;	//!< Content before this offset has been delivered.
+	uint32_t					end;		//!< Size of the resource, once known.
+	uint32_t					limit;		//!< Lowest offset the server refused.
+	int							limit_status;
+	int							statuscode;
+	int							failed_status;
+
+	uint8_t						window;
+	uint8_t						szx;
+	uint8_t						active:1,
+								started:1,	//!< The first response has come back.
+								end_known:1,
+								failed:1;
+
+	struct smcp_block2_slot_s	slots[SMCP_BLOCK2_MAX_WINDOW];
+};
+
+//!	Initializes a Block2 fetch. See smcp_transaction_init().
+SMCP_API_EXTERN smcp_block2_fetch_t smcp_block2_fetch_init(
+	smcp_block2_fetch_t fetch,
+	smcp_inbound_resend_func request_func,
+	smcp_block_data_func data_func,
+	smcp_block2_finished_func finished_func,
+	void* context
+);
+
+//!	Reassemble into `buffer` instead of (or as well as) calling the data callback.
+/*!	The fetch fails with SMCP_STATUS_MESSAGE_TOO_BIG if the resource
+**	doesn't fit. */
+SMCP_API_EXTERN void smcp_block2_fetch_set_buffer(
+	smcp_block2_fetch_t fetch,
+	uint8_t* buffer,
+	uint32_t size
+);
+
+//!	Sets the number of blocks to keep in flight, up to SMCP_BLOCK2_MAX_WINDOW.
+SMCP_API_EXTERN void smcp_block2_fetch_set_window(
+	smcp_block2_fetch_t fetch,
+	uint8_t window
+);
+
+//!	Sets the block size exponent to ask for first, as in the Block2 option.
+SMCP_API_EXTERN void smcp_block2_fetch_set_szx(
+	smcp_block2_fetch_t fetch,
+	uint8_t szx
+);
+
+//!	Starts fetching. `expiration` applies to each block request.
+SMCP_API_EXTERN smcp_status_t smcp_block2_fetch_begin(
+	smcp_t self,
+	smcp_block2_fetch_t fetch,
+	cms_t expiration
+);
+
+//!	Stops fetching without calling the finished callback.
+SMCP_API_EXTERN smcp_status_t smcp_block2_fetch_end(
+	smcp_t self,
+	smcp_block2_fetch_t fetch
+);
+
+/*!	@} */
+
+/*!	@defgroup smcp-block1 Block1 Transfers
+**	@{
+**	@brief Sending and receiving large request bodies a block at a time.
+**
+**	A Block1 upload sends a request body which is too big for one
+**	packet as a series of requests, each carrying one block. The body is
+**	pulled from a read callback (or a file descriptor) as it is needed,
+**	so it never has to be in memory all at once. By default one block is
+**	sent at a time, as each 2.31 (Continue) response may change the
+**	block size; servers which are known to reassemble blocks in any
+**	order can be sent several at once with smcp_block1_upload_set_window().
+**	The final block is only sent once all of the others have been
+**	acknowledged, and its response is the response to the whole upload.
+**
+**	If the server answers the first block with 4.13 (Request Entity Too
+**	Large) and a smaller block size, the upload starts over at that size.
+**
+**	On the receiving end, a request handler passes every request to
+**	smcp_block1_receive(), which hands the body to a callback in order
+**	and answers intermediate blocks with 2.31 (Continue) itself:
+**
+**		status = smcp_block1_receive(&node->receiver, &write_body, node);
+**		if(status == SMCP_STATUS_CONTINUE)
+**			return SMCP_STATUS_OK;	// Already responded.
+**		require_noerr(status, bail);
+**		// The whole body has arrived. Respond as usual.
+*/
+
+struct smcp_block1_upload_s;
+typedef struct smcp_block1_upload_s* smcp_block1_upload_t;
+
+//!	Builds a block request, without content. Must not send it.
+/*!	Typically calls smcp_outbound_begin(), smcp_outbound_set_uri() and
+**	adds a Content-Format option. It is called once for every block, and
+**	must build the same request every time. */
+typedef smcp_status_t (*smcp_block1_request_func)(void* context);
+
+//!	Reads up to `*len` bytes of the request body into `buffer`.
+/*!	On return, `*len` must be the number of bytes read, or zero at the
+**	end of the body. The body is read in order; `offset` is for
+**	convenience only. */
+typedef smcp_status_t (*smcp_block1_read_func)(
+	void* context,
+	uint8_t* buffer,
+	coap_size_t* len,
+	uint32_t offset
+);
+
+//!	Called once the upload is over.
+/*!	If `statuscode` is a result code, the response to the final block
+**	is the current inbound packet for the duration of the call. */
+typedef void (*smcp_block1_finished_func)(
+	void* context,
+	int statuscode
+);
+
+struct smcp_block1_slot_s {
+	struct smcp_transaction_s	transaction;
+	smcp_block1_upload_t		upload;
+	uint32_t					offset;
+	uint32_t					block1;	//!< Value of the Block1 option, zero for none.
+	coap_size_t					len;
+	uint8_t						state;
+	uint8_t						data[SMCP_BLOCK_MAX_SIZE];
+};
+
+struct smcp_block1_upload_s {
+	/**** All of this is private. Don't touch. ****/
+
+	smcp_t						interface;
+	smcp_block1_request_func	request_func;
+	smcp_block1_read_func		read_func;
+	smcp_block1_finished_func	finished_func;
+	void*						context;
+	int							fd;
+
+	cms_t						expiration;
+	struct smcp_timer_s			timer;
+
+	uint32_t					size;		//!< Total size, if known. Sent as Size1.
+	uint32_t					offset;		//!< Where the next block starts.
+	int							failed_status;
+
+	uint8_t						window;
+	uint8_t						szx;
+	uint8_t						active:1,
+								started:1,	//!< A block has been acknowledged.
+								size_known:1,
+								eof:1,
+								final_sent:1,
+								failed:1;
+
+	//!	Body that has been read but not yet put in a block.
+	coap_size_t					carry_len;
+	uint8_t						carry[2*SMCP_BLOCK_MAX_SIZE+1];
+
+	struct smcp_block1_slot_s	slots[SMCP_BLOCK1_MAX_WINDOW];
+};
+
+//!	Initializes a Block1 upload. `read_func` may be NULL if a file descriptor is set.
+SMCP_API_EXTERN smcp_block1_upload_t smcp_block1_upload_init(
+	smcp_block1_upload_t upload,
+	smcp_block1_request_func request_func,
+	smcp_block1_read_func read_func,
+	smcp_block1_finished_func finished_func,
+	void* context
+);
+
+#if SMCP_USE_BSD_SOCKETS
+//!	Reads the body from `fd` (which is not closed) instead of a callback.
+SMCP_API_EXTERN void smcp_block1_upload_set_fd(
+	smcp_block1_upload_t upload,
+	int fd
+);
+#endif
+
+//!	Sets the total size of the body, which is sent to the server as Size1.
+SMCP_API_EXTERN void smcp_block1_upload_set_size(
+	smcp_block1_upload_t upload,
+	uint32_t size
+);
+
+//!	Sets the number of blocks to keep in flight, up to SMCP_BLOCK1_MAX_WINDOW.
+SMCP_API_EXTERN void smcp_block1_upload_set_window(
+	smcp_block1_upload_t upload,
+	uint8_t window
+);
+
+//!	Sets the block size exponent to start with, as in the Block1 option.
+SMCP_API_EXTERN void smcp_block1_upload_set_szx(
+	smcp_block1_upload_t upload,
+	uint8_t szx
+);
+
+//!	Starts uploading. `expiration` applies to each block request.
+SMCP_API_EXTERN smcp_status_t smcp_block1_upload_begin(
+	smcp_t self,
+	smcp_block1_upload_t upload,
+	cms_t expiration
+);
+
+//!	Stops uploading without calling the finished callback.
+SMCP_API_EXTERN smcp_status_t smcp_block1_upload_end(
+	smcp_t self,
+	smcp_block1_upload_t upload
+);
+
+struct smcp_block1_held_s {
+	uint32_t					offset;
+	coap_size_t					len;	//!< Zero if unused.
+	uint8_t						data[SMCP_BLOCK_MAX_SIZE];
+};
+
+//!	Reassembly state for receiving Block1 request bodies.
+/*!	One of these is needed for every resource that accepts large
+**	bodies. It follows one transfer at a time; a new transfer (one
+**	starting at block zero) replaces any that was in progress. */
+struct smcp_block1_receiver_s {
+	/**** All of this is private. Don't touch. ****/
+
+	smcp_sockaddr_t				remote_saddr;
+	uint32_t					next_offset;	//!< Everything before this has been delivered.
+	uint32_t					max_size;
+	uint8_t						szx;
+	uint8_t						active:1;
+
+	struct smcp_block1_held_s	held[SMCP_BLOCK1_MAX_WINDOW];
+};
+
+//!	Initializes a receiver. `max_size` limits the size of a body, or zero for no limit.
+SMCP_API_EXTERN void smcp_block1_receiver_init(
+	struct smcp_block1_receiver_s* receiver,
+	uint32_t max_size
+);
+
+//!	Feeds the current inbound request to a Block1 receiver.
+/*!	The body is passed to `data_func` in order, a block at a time.
+**	Requests without a Block1 option are passed on whole.
+**
+**	@return SMCP_STATUS_OK once the whole body has been delivered, in
+**	which case the handler should respond as usual.
+**	SMCP_STATUS_CONTINUE if more blocks are expected; a 2.31 (Continue)
+**	response has already been sent. SMCP_STATUS_INCOMPLETE (which makes
+**	a 4.08 response) if a block arrived out of sequence, and
+**	SMCP_STATUS_MESSAGE_TOO_BIG if the body is over `max_size`, in which
+**	case a 4.13 response has already been sent. Any other error is from
+**	`data_func`. */
+SMCP_API_EXTERN smcp_status_t smcp_block1_receive(
+	struct smcp_block1_receiver_s* receiver,
+	smcp_block_data_func data_func,
+	void* context
+);
+
+/*!	@} */
+/*!	@} */
+
+__END_DECLS
+
+#endif // SMCP_CONF_TRANS_ENABLE_BLOCK2
+
+#endif // __SMCP_BLOCK_H__
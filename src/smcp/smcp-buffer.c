@@ -0,0 +1,158 @@
+/*!	@file smcp-buffer.c
+**	@author Robert Quattlebaum <darco@deepdarc.com>
+**	@brief Refcounted packet buffers
+**
+**
+**	Copyright (C) 2015 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "assert-macros.h"
+#include "smcp-internal.h"
+#include "smcp-buffer.h"
+
+#if SMCP_USE_BUFFER_POOL
+
+// Precedes the bytes of every buffer. Padded so that they are 8-byte aligned.
+struct smcp_buffer_s {
+	smcp_buffer_pool_t pool;
+	smcp_buffer_t next_free;
+	uint32_t refcount;
+	uint32_t align;
+};
+
+struct smcp_buffer_pool_s {
+	smcp_buffer_t free_list;
+	uint32_t free_count;
+	uint32_t live_count;
+	bool released;
+};
+
+static void
+smcp_buffer_pool_destroy(smcp_buffer_pool_t pool) {
+	while(pool->free_list) {
+		smcp_buffer_t const buffer = pool->free_list;
+		pool->free_list = buffer->next_free;
+		free(buffer);
+	}
+	free(pool);
+}
+
+smcp_buffer_t
+smcp_buffer_alloc(smcp_buffer_pool_t* pool_ptr) {
+	smcp_buffer_t buffer = NULL;
+	smcp_buffer_pool_t pool = pool_ptr ? *pool_ptr : NULL;
+
+	if(pool_ptr && !pool) {
+		pool = calloc(1, sizeof(*pool));
+		*pool_ptr = pool;
+	}
+
+	if(pool && pool->free_list) {
+		buffer = pool->free_list;
+		pool->free_list = buffer->next_free;
+		pool->free_count--;
+	} else {
+		buffer = malloc(sizeof(*buffer) + SMCP_BUFFER_SIZE);
+		require(buffer, bail);
+	}
+
+	buffer->pool = pool;
+	buffer->next_free = NULL;
+	buffer->refcount = 1;
+
+	if(pool)
+		pool->live_count++;
+
+bail:
+	return buffer;
+}
+
+smcp_buffer_t
+smcp_buffer_retain(smcp_buffer_t buffer) {
+	if(buffer)
+		buffer->refcount++;
+	return buffer;
+}
+
+void
+smcp_buffer_release(smcp_buffer_t buffer) {
+	smcp_buffer_pool_t pool;
+
+	if(!buffer)
+		return;
+
+	check(buffer->refcount != 0);
+
+	if(--buffer->refcount)
+		return;
+
+	pool = buffer->pool;
+
+	if(!pool) {
+		free(buffer);
+		return;
+	}
+
+	pool->live_count--;
+
+	if(pool->released) {
+		free(buffer);
+		if(!pool->live_count)
+			smcp_buffer_pool_destroy(pool);
+	} else if(pool->free_count < SMCP_BUFFER_POOL_MAX_FREE) {
+		buffer->next_free = pool->free_list;
+		pool->free_list = buffer;
+		pool->free_count++;
+	} else {
+		free(buffer);
+	}
+}
+
+uint8_t*
+smcp_buffer_get_bytes(smcp_buffer_t buffer) {
+	return (uint8_t*)(buffer + 1);
+}
+
+bool
+smcp_buffer_is_shared(smcp_buffer_t buffer) {
+	return buffer->refcount > 1;
+}
+
+void
+smcp_buffer_pool_release(smcp_buffer_pool_t pool) {
+	if(!pool)
+		return;
+
+	pool->released = true;
+
+	if(!pool->live_count)
+		smcp_buffer_pool_destroy(pool);
+}
+
+#endif // SMCP_USE_BUFFER_POOL
@@ -0,0 +1,83 @@
+/*!	@file smcp-buffer.h
+**	@author Robert Quattlebaum <darco@deepdarc.com>
+**	@brief Refcounted packet buffers
+**
+**
+**	Copyright (C) 2015 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef SMCP_smcp_buffer_h
+#define SMCP_smcp_buffer_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*	A packet buffer holds one packet of up to SMCP_MAX_PACKET_LENGTH
+**	bytes, plus room for a terminating NUL. Buffers are reference
+**	counted: whoever needs a packet to outlive the callback it arrived
+**	in retains its buffer, and the buffer goes back to the pool it came
+**	from once the last reference is released.
+**
+**	A pool keeps a few released buffers around so that receiving a
+**	packet normally doesn't need to touch malloc(). Like a slab, a pool
+**	is not thread-safe: its buffers must be retained and released by the
+**	thread that owns it, which is normally the thread driving its smcp
+**	instance.
+*/
+
+struct smcp_buffer_s;
+typedef struct smcp_buffer_s* smcp_buffer_t;
+
+struct smcp_buffer_pool_s;
+typedef struct smcp_buffer_pool_s* smcp_buffer_pool_t;
+
+//!	The number of bytes that every buffer can hold.
+#define SMCP_BUFFER_SIZE		((size_t)SMCP_MAX_PACKET_LENGTH + 1)
+
+//!	Allocates a buffer from `*pool`, with a reference count of one.
+/*!	The pool is created on first use. If `pool` is NULL, the buffer
+**	is allocated with malloc() instead. The contents of the buffer
+**	are not cleared. */
+smcp_buffer_t smcp_buffer_alloc(smcp_buffer_pool_t* pool);
+
+//!	Adds a reference to `buffer`, returning it.
+smcp_buffer_t smcp_buffer_retain(smcp_buffer_t buffer);
+
+//!	Drops a reference to `buffer`, returning it to its pool if it was the last.
+void smcp_buffer_release(smcp_buffer_t buffer);
+
+//!	Returns the SMCP_BUFFER_SIZE bytes held by `buffer`.
+uint8_t* smcp_buffer_get_bytes(smcp_buffer_t buffer);
+
+//!	Returns true if anyone other than the caller holds a reference to `buffer`.
+bool smcp_buffer_is_shared(smcp_buffer_t buffer);
+
+//!	Releases the pool.
+/*!	The memory behind the pool is freed once all of its
+**	outstanding buffers have been released. */
+void smcp_buffer_pool_release(smcp_buffer_pool_t pool);
+
+#endif
@@ -44,71 +44,342 @@
 #include "smcp-missing.h"
 #include "coap.h"
 #include "smcp-curl_proxy.h"
+#include "smcp-block.h"
+#include "fasthash.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <strings.h>
+#include <time.h>
+
+//!	How much of an HTTP body is held while waiting for the client to ask for it.
+/*!	Once this fills up, the transfer is paused until the client asks
+**	for the next block. It must hold at least two of the largest blocks. */
+#ifndef SMCP_CURL_PROXY_BUFFER_SIZE
+#define SMCP_CURL_PROXY_BUFFER_SIZE			(4*SMCP_BLOCK_MAX_SIZE)
+#endif
+
+//!	Block size exponent used when the client doesn't ask for one (512 bytes).
+#ifndef SMCP_CURL_PROXY_DEFAULT_SZX
+#define SMCP_CURL_PROXY_DEFAULT_SZX			(5)
+#endif
+
+//!	How long a response is kept around for the client to ask for the next block.
+#ifndef SMCP_CURL_PROXY_STREAM_TIMEOUT
+#define SMCP_CURL_PROXY_STREAM_TIMEOUT		(30*MSEC_PER_SEC)
+#endif
+
+//!	The largest HTTP body that will be kept in the response cache.
+#ifndef SMCP_CURL_PROXY_CACHE_MAX_ENTRY_SIZE
+#define SMCP_CURL_PROXY_CACHE_MAX_ENTRY_SIZE	(16*1024)
+#endif
+
+//!	How many responses the cache holds before it starts evicting them.
+#ifndef SMCP_CURL_PROXY_CACHE_MAX_ENTRIES
+#define SMCP_CURL_PROXY_CACHE_MAX_ENTRIES		(32)
+#endif
+
+#define SMCP_CURL_PROXY_MAX_ETAG_LEN			(8)
+
+typedef struct smcp_curl_cache_entry_s {
+	struct smcp_curl_cache_entry_s* next;
+	char* key;
+	fasthash_hash_t hash;
+
+	//! The transfer that is filling in this entry, NULL once it is over.
+	struct smcp_curl_request_s* leader;
+
+	char* content;
+	size_t content_len;
+	coap_code_t code;
+	coap_content_type_t content_type;
+	smcp_timestamp_t expires;
+	uint8_t etag[SMCP_CURL_PROXY_MAX_ETAG_LEN];
+	uint8_t etag_len;
+	uint8_t is_fresh:1,
+			is_overflowed:1;	//!< The body didn't fit, so it can't be shared.
+} *smcp_curl_cache_entry_t;
 
 typedef struct smcp_curl_request_s {
+	struct smcp_curl_request_s* next;
 	CURL* curl;
 	struct smcp_async_response_s async_response;
 	struct smcp_transaction_s async_transaction;
+	struct smcp_timer_s expiration_timer;
 	smcp_curl_proxy_node_t proxy_node;
+	smcp_t interface;
+
+	// What the block requests that follow the first one must match.
+	smcp_sockaddr_t remote_saddr;
+	coap_code_t method;
+	char* uri;
+
+	// A window onto the HTTP body, starting at `content_offset`.
 	char* content;
 	size_t content_len;
+	size_t content_size;
+	uint32_t content_offset;
+
+	//! Block2 option value of the response that is to be sent next.
+	uint32_t block2;
+
 	char* output_content;
 	size_t output_content_len;
+
+	CURLcode result;
+
+	//! Cache entry that this transfer is filling in, or is waiting on.
+	smcp_curl_cache_entry_t cache_entry;
+
+	// What the response says about how long it can be reused. Once
+	// `curl` is NULL, the response came out of the cache and the code
+	// and content type are here as well.
+	coap_code_t code;
+	coap_content_type_t content_type;
+	smcp_timestamp_t expires;
+	uint8_t etag[SMCP_CURL_PROXY_MAX_ETAG_LEN];
+	uint8_t etag_len;
+
+	//! Freshness headers of the response being received.
+	struct {
+		int32_t max_age;
+		int32_t s_maxage;
+		int32_t age;
+		time_t date;
+		time_t expires;
+		uint8_t no_store:1,
+				has_date:1,
+				has_expires:1;
+	} headers;
+
+	uint8_t is_async:1,		//!< Waiting for data to send an async response.
+			is_sending:1,	//!< The async response is in flight.
+			is_paused:1,	//!< The transfer is waiting for room in `content`.
+			is_running:1,	//!< Added to the multi handle.
+			is_done:1,		//!< The transfer is over.
+			is_fresh:1;		//!< `expires` says how long the response is good for.
 } *smcp_curl_request_t;
 
+static void smcp_curl_proxy_node_cache_abandon(smcp_curl_proxy_node_t self, smcp_curl_cache_entry_t entry);
+
 void
 smcp_curl_request_release(smcp_curl_request_t x) {
-	if(x->curl)
+	smcp_curl_request_t* iter;
+
+	if(x->proxy_node) {
+		for(iter = &x->proxy_node->requests; *iter; iter = &(*iter)->next) {
+			if(*iter == x) {
+				*iter = x->next;
+				break;
+			}
+		}
+	}
+
+	// Whoever was waiting on this transfer will have to fetch it themselves.
+	if(x->cache_entry && x->cache_entry->leader == x)
+		smcp_curl_proxy_node_cache_abandon(x->proxy_node, x->cache_entry);
+
+	if(x->interface) {
+		smcp_transaction_end(x->interface, &x->async_transaction);
+		smcp_invalidate_timer(x->interface, &x->expiration_timer);
+	}
+
+	smcp_finish_async_response(&x->async_response);
+
+	if(x->curl) {
+		// Removing the handle before cleaning it up leaves the
+		// connection in the multi handle's cache for reuse.
+		if(x->is_running)
+			curl_multi_remove_handle(x->proxy_node->curl_multi_handle, x->curl);
 		curl_easy_cleanup(x->curl);
+	}
+
+	free(x->uri);
+	free(x->content);
+	free(x->output_content);
 	free(x);
 }
 
+static void
+smcp_curl_request_expired(smcp_t smcp, void* context) {
+	smcp_curl_request_release((smcp_curl_request_t)context);
+}
+
 smcp_curl_request_t
 smcp_curl_request_create(void) {
 	smcp_curl_request_t ret = calloc(1,sizeof(*ret));
+	require(ret!=NULL, bail);
+	ret->headers.max_age = -1;
+	ret->headers.s_maxage = -1;
 	ret->curl = curl_easy_init();
 	if(!ret->curl) {
 		smcp_curl_request_release(ret);
 		ret = NULL;
 	}
+bail:
 	return ret;
 }
 
-static smcp_status_t
-resend_async_response(void* context) {
-	smcp_status_t ret = 0;
-	smcp_curl_request_t request = (smcp_curl_request_t)context;
-	struct smcp_async_response_s* async_response = &request->async_response;
+static bool
+smcp_curl_request_has_block(smcp_curl_request_t request) {
+	struct coap_block_info_s block;
+
+	coap_decode_block(&block, request->block2);
+
+	return request->is_done
+		|| (request->content_offset + request->content_len >= block.block_offset + block.block_size);
+}
+
+static bool
+smcp_curl_request_is_last_block(smcp_curl_request_t request) {
+	struct coap_block_info_s block;
+
+	coap_decode_block(&block, request->block2);
 
-	coap_size_t len = (coap_size_t)request->content_len;
-	if(len>512) {
-		len = 512;
+	return request->is_done
+		&& (request->content_offset + request->content_len <= block.block_offset + block.block_size);
+}
+
+//!	Moves on to the block in `block2`, dropping the content before it.
+static void
+smcp_curl_request_set_block2(smcp_curl_request_t request, uint32_t block2) {
+	struct coap_block_info_s block;
+	size_t drop;
+
+	coap_decode_block(&block, block2);
+
+	request->block2 = block2;
+
+	if(block.block_offset > request->content_offset) {
+		drop = MIN(request->content_len, block.block_offset - request->content_offset);
+		request->content_len -= drop;
+		request->content_offset += (uint32_t)drop;
+		memmove(request->content, request->content + drop, request->content_len);
 	}
 
-	{
-		uint16_t code;
-		curl_easy_getinfo(request->curl, CURLINFO_RESPONSE_CODE,&code);
-		code = http_to_coap_code(code);
+	// There might be room now. This may call WriteMemoryCallback().
+	if(request->is_paused) {
+		request->is_paused = false;
+		curl_easy_pause(request->curl, CURLPAUSE_CONT);
+	}
+}
+
+static coap_code_t
+smcp_curl_request_get_code(smcp_curl_request_t request) {
+	long code = 0;
+
+	if(!request->curl)
+		return request->code;
+
+	if(request->is_done && request->result != CURLE_OK)
+		return COAP_RESULT_502_BAD_GATEWAY;
+
+	curl_easy_getinfo(request->curl, CURLINFO_RESPONSE_CODE, &code);
+
+	return http_to_coap_code((uint16_t)code);
+}
+
+static coap_content_type_t
+smcp_curl_request_get_content_type(smcp_curl_request_t request) {
+	const char* content_type_string = NULL;
+
+	if(!request->curl)
+		return request->content_type;
+
+	curl_easy_getinfo(request->curl, CURLINFO_CONTENT_TYPE, &content_type_string);
+
+	if(!content_type_string)
+		return COAP_CONTENT_TYPE_UNKNOWN;
+
+	return coap_content_type_from_cstr(content_type_string);
+}
+
+//!	Returns how many more seconds the response can be reused for.
+static uint32_t
+smcp_curl_request_get_max_age(smcp_curl_request_t request) {
+	smcp_timestamp_t now = smcp_get_current_time(request->interface);
+
+	if(!request->is_fresh || request->expires <= now)
+		return 0;
+
+	return (uint32_t)((request->expires - now) / MSEC_PER_SEC);
+}
+
+//!	Adds the Max-Age and ETag options that go with every response.
+static smcp_status_t
+smcp_curl_request_append_freshness(smcp_curl_request_t request) {
+	smcp_status_t ret;
+
+	ret = smcp_outbound_add_option_uint(COAP_OPTION_MAX_AGE, smcp_curl_request_get_max_age(request));
+	require_noerr(ret,bail);
 
-		ret = smcp_outbound_begin_async_response(code,async_response);
+	if(request->etag_len) {
+		ret = smcp_outbound_add_option(COAP_OPTION_ETAG, (const char*)request->etag, request->etag_len);
 		require_noerr(ret,bail);
 	}
 
+bail:
+	return ret;
+}
+
+//!	Adds the options and content of the current block to the outbound packet.
+static smcp_status_t
+smcp_curl_request_append_block(smcp_curl_request_t request) {
+	smcp_status_t ret = 0;
+	struct coap_block_info_s block;
+	coap_size_t len = 0;
+
+	if(request->is_done && request->result != CURLE_OK)
+		goto bail;
+
+	coap_decode_block(&block, request->block2);
+
+	if(block.block_offset < request->content_offset + request->content_len)
+		len = (coap_size_t)MIN(block.block_size, request->content_offset + request->content_len - block.block_offset);
+
 	{
-		const char* content_type_string;
-		curl_easy_getinfo(request->curl, CURLINFO_CONTENT_TYPE,&content_type_string);
-		coap_content_type_t content_type = coap_content_type_from_cstr(content_type_string);
+		coap_content_type_t content_type = smcp_curl_request_get_content_type(request);
 		if(content_type!=COAP_CONTENT_TYPE_UNKNOWN) {
 			ret = smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE, content_type);
 			check_noerr(ret);
 		} else {
-			DEBUG_PRINTF("Unrecognised content-type: %s",content_type_string);
+			DEBUG_PRINTF("Unrecognised content-type");
 		}
 	}
 
-	ret = smcp_outbound_append_content(request->content, len);
+	ret = smcp_curl_request_append_freshness(request);
+	require_noerr(ret,bail);
+
+	if(!smcp_curl_request_is_last_block(request)) {
+		request->block2 |= (1<<3);
+	} else {
+		request->block2 &= ~(1<<3);
+	}
+
+	if(request->block2 > 0x7) {
+		ret = smcp_outbound_add_option_uint(COAP_OPTION_BLOCK2, request->block2);
+		require_noerr(ret,bail);
+	}
+
+	if(len) {
+		ret = smcp_outbound_append_content(request->content + (block.block_offset - request->content_offset), len);
+		require_noerr(ret,bail);
+	}
+
+bail:
+	return ret;
+}
+
+static smcp_status_t
+resend_async_response(void* context) {
+	smcp_status_t ret = 0;
+	smcp_curl_request_t request = (smcp_curl_request_t)context;
+	struct smcp_async_response_s* async_response = &request->async_response;
+
+	ret = smcp_outbound_begin_async_response(smcp_curl_request_get_code(request),async_response);
+	require_noerr(ret,bail);
+
+	ret = smcp_curl_request_append_block(request);
 	require_noerr(ret,bail);
 
 	ret = smcp_outbound_send();
@@ -132,11 +403,50 @@ async_response_ack_handler(int statuscode, void* context) {
 	smcp_curl_request_t request = (smcp_curl_request_t)context;
 	struct smcp_async_response_s* async_response = &request->async_response;
 
+	if(statuscode == SMCP_STATUS_TRANSACTION_INVALIDATED)
+		return SMCP_STATUS_OK;
+
+	request->is_async = false;
+	request->is_sending = false;
+
 	smcp_finish_async_response(async_response);
-	smcp_curl_request_release(request);
+
+	// The transaction lives in the request, so it has to go first.
+	smcp_transaction_end(request->interface, &request->async_transaction);
+
+	if(statuscode < 0 || smcp_curl_request_is_last_block(request)) {
+		smcp_curl_request_release(request);
+	} else {
+		smcp_invalidate_timer(request->interface, &request->expiration_timer);
+		smcp_schedule_timer(request->interface, &request->expiration_timer, SMCP_CURL_PROXY_STREAM_TIMEOUT);
+	}
+
 	return SMCP_STATUS_OK;
 }
 
+//!	Sends the async response if there is now enough content for it.
+static void
+smcp_curl_request_update(smcp_curl_request_t request) {
+	if(!request->is_async || request->is_sending || !smcp_curl_request_has_block(request))
+		return;
+
+	request->is_sending = true;
+
+	smcp_transaction_init(
+		&request->async_transaction,
+		0, // Flags
+		(void*)&resend_async_response,
+		(void*)&async_response_ack_handler,
+		(void*)request
+	);
+
+	smcp_transaction_begin(
+		request->interface,
+		&request->async_transaction,
+		10*1000	// Retry for thirty seconds.
+	);
+}
+
 static size_t
 ReadMemoryCallback(void *ptr, size_t size, size_t nmemb, void *userp)
 {
@@ -146,43 +456,546 @@ ReadMemoryCallback(void *ptr, size_t size, size_t nmemb, void *userp)
 	return len;
 }
 
+//!	Keeps a copy of the body for the cache, if this transfer is filling an entry.
+static void
+smcp_curl_request_cache_content(smcp_curl_request_t request, const void* contents, size_t len) {
+	smcp_curl_cache_entry_t entry = request->cache_entry;
+	char* content;
+
+	if(!entry || entry->leader != request || entry->is_overflowed)
+		return;
+
+	if(entry->content_len + len > SMCP_CURL_PROXY_CACHE_MAX_ENTRY_SIZE)
+		goto overflowed;
+
+	content = realloc(entry->content, MAX(1, entry->content_len + len));
+	require(content!=NULL, overflowed);
+	entry->content = content;
+
+	memcpy(entry->content + entry->content_len, contents, len);
+	entry->content_len += len;
+	return;
+
+overflowed:
+	// The waiters are sent off on their own from smcp_curl_proxy_node_check_done().
+	entry->is_overflowed = true;
+	free(entry->content);
+	entry->content = NULL;
+	entry->content_len = 0;
+}
+
 static size_t
 WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
 {
 	size_t realsize = size * nmemb;
+	size_t skip = 0;
 	smcp_curl_request_t request = (smcp_curl_request_t)userp;
+	struct coap_block_info_s block;
+	bool is_caching = request->cache_entry
+		&& request->cache_entry->leader == request
+		&& !request->cache_entry->is_overflowed;
 
-	require_action(realsize>=0,bail,realsize=0);
+	coap_decode_block(&block, request->block2);
 
-	// At the moment limit to one call.
-	require_action(request->content==NULL,bail,realsize=0);
+	// Nothing before the block that the client is after is needed.
+	if(!request->content_len && request->content_offset < block.block_offset)
+		skip = MIN(realsize, block.block_offset - request->content_offset);
 
-	request->content = realloc(request->content, request->content_len + realsize + 1);
+	if(request->content_len + realsize - skip > request->content_size) {
+		size_t content_size = MAX(SMCP_CURL_PROXY_BUFFER_SIZE, request->content_len + realsize - skip);
+		char* content;
 
-	require_action(request->content!=NULL,bail,realsize=0);
+		// Hold off until the client makes some room, unless there's no
+		// way to wait (curl_easy_perform()) or the chunk is just too big.
+		// A body that is going into the cache is bounded by the cache,
+		// and others may be waiting on it, so it isn't held up.
+		if(request->is_running && request->content_len && request->content_size && !is_caching) {
+			request->is_paused = true;
+			return CURL_WRITEFUNC_PAUSE;
+		}
 
-	memcpy(&(request->content[request->content_len]), contents, realsize);
-	request->content_len += realsize;
-	request->content[request->content_len] = 0;
+		content = realloc(request->content, content_size);
+		require_action(content!=NULL,bail,realsize=0);
+		request->content = content;
+		request->content_size = content_size;
+	}
 
-	smcp_transaction_init(
-		&request->async_transaction,
-		0, // Flags
-		(void*)&resend_async_response,
-		(void*)&async_response_ack_handler,
-		(void*)request
-	);
+	smcp_curl_request_cache_content(request, contents, realsize);
 
-	smcp_transaction_begin(
-		request->proxy_node->interface,
-		&request->async_transaction,
-		10*1000	// Retry for thirty seconds.
-	);
+	request->content_offset += (uint32_t)skip;
+	memcpy(request->content + request->content_len, (const char*)contents + skip, realsize - skip);
+	request->content_len += realsize - skip;
+
+	smcp_curl_request_update(request);
 
 bail:
 	return realsize;
 }
 
+//!	Works out how long the response can be reused, now that its headers are in.
+static void
+smcp_curl_request_headers_done(smcp_curl_request_t request) {
+	int64_t lifetime = -1;
+
+	if(request->headers.no_store) {
+		lifetime = -1;
+	} else if(request->headers.s_maxage >= 0) {
+		lifetime = request->headers.s_maxage;
+	} else if(request->headers.max_age >= 0) {
+		lifetime = request->headers.max_age;
+	} else if(request->headers.has_expires) {
+		lifetime = (int64_t)request->headers.expires
+			- (int64_t)(request->headers.has_date ? request->headers.date : time(NULL));
+	}
+
+	lifetime -= request->headers.age;
+
+	request->is_fresh = (lifetime > 0);
+
+	if(request->is_fresh) {
+		lifetime = MIN(lifetime, INT32_MAX);
+		request->expires = smcp_get_current_time(request->interface) + lifetime * MSEC_PER_SEC;
+	}
+}
+
+//!	Turns an HTTP entity tag into a CoAP one, hashing it if it is too long.
+static void
+smcp_curl_request_set_etag(smcp_curl_request_t request, const char* value) {
+	size_t len;
+
+	if(0==strncmp(value, "W/", 2))
+		value += 2;
+
+	if(*value == '"')
+		value++;
+
+	len = strcspn(value, "\"");
+
+	if(len > SMCP_CURL_PROXY_MAX_ETAG_LEN) {
+		fasthash_hash_t hash = fasthash_buffer(value, len, 0);
+		request->etag[0] = (uint8_t)(hash >> 24);
+		request->etag[1] = (uint8_t)(hash >> 16);
+		request->etag[2] = (uint8_t)(hash >> 8);
+		request->etag[3] = (uint8_t)(hash);
+		len = 4;
+	} else {
+		memcpy(request->etag, value, len);
+	}
+
+	request->etag_len = (uint8_t)len;
+}
+
+static size_t
+HeaderCallback(char *buffer, size_t size, size_t nitems, void *userp)
+{
+	size_t realsize = size * nitems;
+	smcp_curl_request_t request = (smcp_curl_request_t)userp;
+	char line[256];
+	size_t len = MIN(realsize, sizeof(line) - 1);
+	char* value;
+	char* token;
+	char* saveptr = NULL;
+
+	memcpy(line, buffer, len);
+
+	while(len && isspace((unsigned char)line[len-1]))
+		len--;
+
+	line[len] = 0;
+
+	if(0==strncmp(line, "HTTP/", 5)) {
+		// Each response (there may be redirects) starts over.
+		memset(&request->headers, 0, sizeof(request->headers));
+		request->headers.max_age = -1;
+		request->headers.s_maxage = -1;
+		request->etag_len = 0;
+		request->is_fresh = false;
+		goto bail;
+	}
+
+	if(!len) {
+		smcp_curl_request_headers_done(request);
+		goto bail;
+	}
+
+	value = strchr(line, ':');
+	require_quiet(value!=NULL, bail);
+	*value++ = 0;
+
+	while(isspace((unsigned char)*value))
+		value++;
+
+	if(0==strcasecmp(line, "Cache-Control")) {
+		for(token = strtok_r(value, ", ", &saveptr); token; token = strtok_r(NULL, ", ", &saveptr)) {
+			if(0==strcasecmp(token, "no-store")
+				|| 0==strcasecmp(token, "no-cache")
+				|| 0==strcasecmp(token, "private")
+			) {
+				request->headers.no_store = true;
+			} else if(0==strncasecmp(token, "max-age=", 8)) {
+				request->headers.max_age = (int32_t)strtol(token + 8, NULL, 10);
+			} else if(0==strncasecmp(token, "s-maxage=", 9)) {
+				request->headers.s_maxage = (int32_t)strtol(token + 9, NULL, 10);
+			}
+		}
+	} else if(0==strcasecmp(line, "Expires")) {
+		// A date that can't be parsed means it has already expired.
+		request->headers.expires = curl_getdate(value, NULL);
+		if(request->headers.expires == -1)
+			request->headers.expires = 0;
+		request->headers.has_expires = true;
+	} else if(0==strcasecmp(line, "Date")) {
+		request->headers.date = curl_getdate(value, NULL);
+		request->headers.has_date = (request->headers.date != -1);
+	} else if(0==strcasecmp(line, "Age")) {
+		request->headers.age = (int32_t)MAX(0, strtol(value, NULL, 10));
+	} else if(0==strcasecmp(line, "ETag")) {
+		smcp_curl_request_set_etag(request, value);
+	}
+
+bail:
+	return realsize;
+}
+
+// MARK: -
+// MARK: Response Cache
+
+//!	Builds the key that the response to a GET for `uri` is cached under.
+/*!	The scheme and host are lowercased, and the default port, an empty
+**	path and any fragment are dropped, so that equivalent URLs share
+**	an entry. Returns NULL if the response shouldn't be cached. */
+static char*
+smcp_curl_proxy_cache_key(const char* uri, int32_t accept) {
+	char* ret = NULL;
+	char* iter;
+	const char* authority;
+	const char* rest;
+	size_t scheme_len;
+	size_t authority_len;
+	size_t rest_len;
+	size_t i;
+
+	authority = strstr(uri, "://");
+	require_quiet(authority!=NULL, bail);
+
+	scheme_len = authority - uri;
+	authority += 3;
+	authority_len = strcspn(authority, "/?#");
+	rest = authority + authority_len;
+	rest_len = strcspn(rest, "#");
+
+	// Responses to requests with credentials aren't shared.
+	require_quiet(authority_len && !memchr(authority, '@', authority_len), bail);
+
+	if(scheme_len == 4 && 0==strncasecmp(uri, "http", 4)
+		&& authority_len > 3 && 0==memcmp(authority + authority_len - 3, ":80", 3)
+	) {
+		authority_len -= 3;
+	} else if(scheme_len == 5 && 0==strncasecmp(uri, "https", 5)
+		&& authority_len > 4 && 0==memcmp(authority + authority_len - 4, ":443", 4)
+	) {
+		authority_len -= 4;
+	}
+
+	ret = malloc(scheme_len + authority_len + rest_len + 20);
+	require(ret!=NULL, bail);
+
+	iter = ret;
+
+	for(i = 0; i < scheme_len; i++)
+		*iter++ = (char)tolower((unsigned char)uri[i]);
+
+	memcpy(iter, "://", 3);
+	iter += 3;
+
+	for(i = 0; i < authority_len; i++)
+		*iter++ = (char)tolower((unsigned char)authority[i]);
+
+	if(!rest_len || rest[0] != '/')
+		*iter++ = '/';
+
+	memcpy(iter, rest, rest_len);
+	iter += rest_len;
+
+	sprintf(iter, " %ld", (long)accept);
+
+bail:
+	return ret;
+}
+
+static void
+smcp_curl_cache_entry_release(smcp_curl_proxy_node_t self, smcp_curl_cache_entry_t entry) {
+	smcp_curl_cache_entry_t* iter;
+
+	for(iter = &self->cache; *iter; iter = &(*iter)->next) {
+		if(*iter == entry) {
+			*iter = entry->next;
+			self->cache_stats.entries--;
+			break;
+		}
+	}
+
+	if(entry->leader)
+		entry->leader->cache_entry = NULL;
+
+	free(entry->key);
+	free(entry->content);
+	free(entry);
+}
+
+//!	Finds the entry for `key`, if it is still fresh or still being fetched.
+static smcp_curl_cache_entry_t
+smcp_curl_proxy_node_cache_find(smcp_curl_proxy_node_t self, const char* key, fasthash_hash_t hash) {
+	smcp_curl_cache_entry_t* iter;
+	smcp_curl_cache_entry_t entry = NULL;
+
+	for(iter = &self->cache; *iter; iter = &(*iter)->next) {
+		entry = *iter;
+
+		if(entry->hash != hash || 0!=strcmp(entry->key, key))
+			continue;
+
+		if(!entry->leader && entry->expires <= smcp_get_current_time(self->interface)) {
+			smcp_curl_cache_entry_release(self, entry);
+			return NULL;
+		}
+
+		// Keep the most recently used entries at the front.
+		*iter = entry->next;
+		entry->next = self->cache;
+		self->cache = entry;
+
+		return entry;
+	}
+
+	return NULL;
+}
+
+//!	Adds an entry for `key` to be filled in by `leader`.
+/*!	Takes ownership of `key` on success. Returns NULL if there is no
+**	room, which only happens when every entry is still being fetched. */
+static smcp_curl_cache_entry_t
+smcp_curl_proxy_node_cache_add(
+	smcp_curl_proxy_node_t self,
+	char* key,
+	fasthash_hash_t hash,
+	smcp_curl_request_t leader
+) {
+	smcp_curl_cache_entry_t ret = NULL;
+	smcp_curl_cache_entry_t iter;
+	smcp_curl_cache_entry_t victim = NULL;
+
+	if(self->cache_stats.entries >= SMCP_CURL_PROXY_CACHE_MAX_ENTRIES) {
+		// Evict the least recently used entry that isn't being fetched.
+		for(iter = self->cache; iter; iter = iter->next) {
+			if(!iter->leader)
+				victim = iter;
+		}
+		require_quiet(victim!=NULL, bail);
+		smcp_curl_cache_entry_release(self, victim);
+	}
+
+	ret = calloc(1, sizeof(*ret));
+	require(ret!=NULL, bail);
+
+	ret->key = key;
+	ret->hash = hash;
+	ret->leader = leader;
+	leader->cache_entry = ret;
+
+	ret->next = self->cache;
+	self->cache = ret;
+	self->cache_stats.entries++;
+
+bail:
+	return ret;
+}
+
+//!	Serves `request` out of `entry` rather than from its own transfer.
+static void
+smcp_curl_request_fill_from_entry(smcp_curl_request_t request, smcp_curl_cache_entry_t entry) {
+	struct coap_block_info_s block;
+	size_t offset;
+
+	coap_decode_block(&block, request->block2);
+
+	offset = MIN(block.block_offset, entry->content_len);
+
+	free(request->content);
+	request->content_len = 0;
+	request->content_size = 0;
+	request->content_offset = (uint32_t)offset;
+	request->content = malloc(MAX(1, entry->content_len - offset));
+
+	if(request->content) {
+		request->content_len = entry->content_len - offset;
+		request->content_size = request->content_len;
+		memcpy(request->content, entry->content + offset, request->content_len);
+	}
+
+	if(request->curl) {
+		curl_easy_cleanup(request->curl);
+		request->curl = NULL;
+	}
+
+	request->cache_entry = NULL;
+	request->result = request->content ? CURLE_OK : CURLE_OUT_OF_MEMORY;
+	request->code = request->content ? entry->code : COAP_RESULT_500_INTERNAL_SERVER_ERROR;
+	request->content_type = entry->content_type;
+	request->expires = entry->expires;
+	request->is_fresh = entry->is_fresh;
+	request->etag_len = entry->etag_len;
+	memcpy(request->etag, entry->etag, entry->etag_len);
+	request->is_done = true;
+}
+
+//!	Starts the transfer for `request`, or runs it if there is no multi handle.
+static void
+smcp_curl_request_start(smcp_curl_request_t request) {
+	smcp_curl_proxy_node_t node = request->proxy_node;
+
+	if(node->curl_multi_handle) {
+		request->is_running = true;
+		curl_multi_add_handle(node->curl_multi_handle, request->curl);
+	} else {
+		request->result = curl_easy_perform(request->curl);
+		request->is_done = true;
+	}
+}
+
+//!	Gives up on sharing `entry`: everyone waiting on it fetches it themselves.
+static void
+smcp_curl_proxy_node_cache_abandon(smcp_curl_proxy_node_t self, smcp_curl_cache_entry_t entry) {
+	smcp_curl_request_t request;
+
+	smcp_curl_cache_entry_release(self, entry);
+
+	for(request = self->requests; request; request = request->next) {
+		if(request->cache_entry != entry)
+			continue;
+
+		request->cache_entry = NULL;
+		smcp_curl_request_start(request);
+		smcp_curl_request_update(request);
+	}
+}
+
+//!	Called when the transfer filling in `entry` is over.
+/*!	Everyone who asked for the same thing in the meantime gets the same
+**	answer. The entry is then kept only if the response can be reused. */
+static void
+smcp_curl_proxy_node_cache_finish(smcp_curl_proxy_node_t self, smcp_curl_cache_entry_t entry) {
+	smcp_curl_request_t leader = entry->leader;
+	smcp_curl_request_t request;
+
+	if(entry->is_overflowed) {
+		smcp_curl_proxy_node_cache_abandon(self, entry);
+		return;
+	}
+
+	entry->code = smcp_curl_request_get_code(leader);
+	entry->content_type = smcp_curl_request_get_content_type(leader);
+	entry->expires = leader->expires;
+	entry->is_fresh = leader->is_fresh;
+	entry->etag_len = leader->etag_len;
+	memcpy(entry->etag, leader->etag, leader->etag_len);
+
+	entry->leader = NULL;
+	leader->cache_entry = NULL;
+
+	for(request = self->requests; request; request = request->next) {
+		if(request->cache_entry != entry)
+			continue;
+
+		smcp_curl_request_fill_from_entry(request, entry);
+		smcp_curl_request_update(request);
+	}
+
+	// HTTP's 200 comes through as 2.00.
+	if(!entry->is_fresh || (entry->code != COAP_RESULT_200 && entry->code != COAP_RESULT_205_CONTENT))
+		smcp_curl_cache_entry_release(self, entry);
+}
+
+// MARK: -
+
+//!	Finds the response that a request for a later block refers to.
+static smcp_curl_request_t
+smcp_curl_proxy_node_find_request(smcp_curl_proxy_node_t node, const char* uri) {
+	smcp_curl_request_t request;
+
+	for(request = node->requests; request; request = request->next) {
+		if(request->method != smcp_inbound_get_code())
+			continue;
+		if(0!=memcmp(&request->remote_saddr,smcp_inbound_get_srcaddr(),sizeof(request->remote_saddr)))
+			continue;
+		if(0!=strcmp(request->uri,uri))
+			continue;
+		break;
+	}
+
+	return request;
+}
+
+//!	Finishes off every transfer that is over, and sends what they got.
+static void
+smcp_curl_proxy_node_check_done(smcp_curl_proxy_node_t self) {
+	CURLMsg* msg;
+	int msgs_left;
+	smcp_curl_cache_entry_t entry;
+	smcp_curl_cache_entry_t next;
+
+	// Entries whose bodies turned out to be too big. This can't be
+	// done from WriteMemoryCallback(), since curl isn't reentrant.
+	for(entry = self->cache; entry; entry = next) {
+		next = entry->next;
+		if(entry->leader && entry->is_overflowed)
+			smcp_curl_proxy_node_cache_abandon(self, entry);
+	}
+
+	while((msg = curl_multi_info_read(self->curl_multi_handle, &msgs_left))) {
+		smcp_curl_request_t request = NULL;
+
+		if(msg->msg != CURLMSG_DONE)
+			continue;
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&request);
+
+		// Lets the connection be reused by the next transfer.
+		curl_multi_remove_handle(self->curl_multi_handle, msg->easy_handle);
+
+		if(!request)
+			continue;
+
+		request->is_running = false;
+		request->is_paused = false;
+		request->is_done = true;
+		request->result = msg->data.result;
+
+		if(request->cache_entry && request->cache_entry->leader == request)
+			smcp_curl_proxy_node_cache_finish(self, request->cache_entry);
+
+		smcp_curl_request_update(request);
+	}
+}
+
+//!	Returns true if any of the inbound ETag options names the request's representation.
+static bool
+smcp_curl_request_etag_matches(smcp_curl_request_t request) {
+	const uint8_t* value;
+	coap_size_t value_len;
+	int i;
+
+	if(!request->etag_len)
+		return false;
+
+	for(i = 0; smcp_inbound_get_nth_option(COAP_OPTION_ETAG, i, &value, &value_len); i++) {
+		if(value_len == request->etag_len && 0 == memcmp(value, request->etag, value_len))
+			return true;
+	}
+
+	return false;
+}
+
 smcp_status_t
 smcp_curl_proxy_request_handler(
 	smcp_curl_proxy_node_t		node
@@ -191,6 +1004,11 @@ smcp_curl_proxy_request_handler(
 	smcp_curl_request_t request = NULL;
 	struct curl_slist *headerlist=NULL;
 	smcp_method_t method = smcp_inbound_get_code();
+	uint32_t block2 = SMCP_CURL_PROXY_DEFAULT_SZX;
+	char* uri = NULL;
+	char* cache_key = NULL;
+	bool is_cacheable = (method == COAP_METHOD_GET) && !smcp_inbound_get_content_len();
+	int32_t accept = -1;
 
 	//require_action(method<=COAP_METHOD_DELETE,bail,ret = SMCP_STATUS_NOT_ALLOWED);
 
@@ -201,7 +1019,6 @@ smcp_curl_proxy_request_handler(
 	smcp_inbound_reset_next_option();
 
 	request = smcp_curl_request_create();
-	request->proxy_node = node;
 
 	require_action(request!=NULL,bail,ret = SMCP_STATUS_MALLOC_FAILURE);
 
@@ -221,17 +1038,24 @@ smcp_curl_proxy_request_handler(
 		coap_size_t value_len;
 		while((key=smcp_inbound_next_option(&value, &value_len))!=COAP_OPTION_INVALID) {
 			if(key==COAP_OPTION_PROXY_URI) {
-				char uri[value_len+1];
+				free(uri);
+				uri = calloc(1,value_len+1);
+				require_action(uri!=NULL,bail,ret = SMCP_STATUS_MALLOC_FAILURE);
 				memcpy(uri,value,value_len);
-				uri[value_len] = 0;
 				curl_easy_setopt(request->curl, CURLOPT_URL, uri);
 				assert_printf("CuRL URL: \"%s\"",uri);
 				ret = 0;
+			} else if(key==COAP_OPTION_BLOCK2) {
+				block2 = coap_decode_uint32(value,(uint8_t)value_len);
+			} else if(key==COAP_OPTION_ETAG) {
+				// Each one is checked against the cache further down.
 			} else if(key==COAP_OPTION_URI_HOST) {
 			} else if(key==COAP_OPTION_URI_PORT) {
 			} else if(key==COAP_OPTION_URI_PATH) {
 			} else if(key==COAP_OPTION_URI_QUERY) {
 			} else if(key==COAP_OPTION_CONTENT_TYPE || key==COAP_OPTION_ACCEPT) {
+				if(key==COAP_OPTION_ACCEPT)
+					accept = (int32_t)coap_decode_uint32(value,(uint8_t)value_len);
 				const char* option_name = coap_option_key_to_cstr(key, false);
 				const char* value_string = coap_content_type_to_cstr(value[1]);
 				char header[strlen(option_name)+strlen(value_string)+3];
@@ -242,6 +1066,8 @@ smcp_curl_proxy_request_handler(
 				assert_printf("CuRL HEADER: \"%s\"",header);
 			} else {
 				if(coap_option_value_is_string(key)) {
+					// The response could depend on this header.
+					is_cacheable = false;
 					const char* option_name = coap_option_key_to_cstr(key, false);
 					char header[strlen(option_name)+value_len+3];
 					strcpy(header,option_name);
@@ -256,6 +1082,67 @@ smcp_curl_proxy_request_handler(
 
 	require_noerr(ret,bail);
 
+	// Don't hand out blocks bigger than we can send.
+	block2 &= ~(1<<3);
+	while((1<<((block2&0x7)+4)) > SMCP_BLOCK_MAX_SIZE)
+		block2 = (block2&~0x7) | ((block2&0x7)-1);
+
+	{
+		smcp_curl_request_t stream = smcp_curl_proxy_node_find_request(node, uri);
+		struct coap_block_info_s block;
+
+		coap_decode_block(&block, block2);
+
+		if(smcp_inbound_is_dupe() && (!stream || stream->is_async)) {
+			// Either we've already answered this, or we're still
+			// working on it. Either way, there's nothing new to say.
+			smcp_curl_request_release(request);
+			request = NULL;
+			if(stream) {
+				ret = smcp_outbound_begin_response(COAP_CODE_EMPTY);
+				require_noerr(ret,bail);
+				ret = smcp_outbound_send();
+			} else {
+				smcp_outbound_drop();
+				ret = SMCP_STATUS_DUPE;
+			}
+			goto bail;
+		}
+
+		// Asking for the first block again starts over, unless it's a retransmission.
+		if(stream && (block.block_offset || smcp_inbound_is_dupe()) && (block.block_offset >= stream->content_offset)) {
+			smcp_curl_request_release(request);
+			request = stream;
+
+			if(request->is_sending) {
+				smcp_transaction_end(request->interface, &request->async_transaction);
+				request->is_sending = false;
+			}
+
+			if(request->is_async) {
+				request->is_async = false;
+				smcp_finish_async_response(&request->async_response);
+			}
+
+			smcp_curl_request_set_block2(request, block2);
+
+			goto respond;
+		} else if(stream) {
+			smcp_curl_request_release(stream);
+		}
+	}
+
+	request->proxy_node = node;
+	request->interface = node->interface;
+	request->method = method;
+	request->uri = uri, uri = NULL;
+	request->block2 = block2;
+	memcpy(&request->remote_saddr,smcp_inbound_get_srcaddr(),sizeof(request->remote_saddr));
+	smcp_timer_init(&request->expiration_timer, &smcp_curl_request_expired, NULL, (void*)request);
+
+	request->next = node->requests;
+	node->requests = request;
+
 	if(smcp_inbound_get_content_len()) {
 		coap_size_t len = smcp_inbound_get_content_len();
 		request->output_content = calloc(1,len+1);
@@ -269,16 +1156,96 @@ smcp_curl_proxy_request_handler(
 	curl_easy_setopt(request->curl, CURLOPT_HTTPHEADER, headerlist),headerlist=NULL;
 	curl_easy_setopt(request->curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
 	curl_easy_setopt(request->curl, CURLOPT_WRITEDATA, (void *)request);
+	curl_easy_setopt(request->curl, CURLOPT_PRIVATE, (void *)request);
 
-	ret = smcp_start_async_response(&request->async_response,0);
-	require_noerr(ret,bail);
+	// Keeps the chunks handed to WriteMemoryCallback() down to a size that fits.
+	curl_easy_setopt(request->curl, CURLOPT_BUFFERSIZE, (long)(SMCP_CURL_PROXY_BUFFER_SIZE/2));
 
-	if(node->curl_multi_handle)
-		curl_multi_add_handle(node->curl_multi_handle, request->curl);
-	else
-		curl_easy_perform(request->curl);
+	curl_easy_setopt(request->curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+	curl_easy_setopt(request->curl, CURLOPT_HEADERDATA, (void *)request);
+
+	if(is_cacheable)
+		cache_key = smcp_curl_proxy_cache_key(request->uri, accept);
+
+	if(cache_key) {
+		fasthash_hash_t hash = fasthash_buffer(cache_key, strlen(cache_key), 0);
+		smcp_curl_cache_entry_t entry = smcp_curl_proxy_node_cache_find(node, cache_key, hash);
+		struct coap_block_info_s block;
+
+		coap_decode_block(&block, block2);
+
+		if(entry && !entry->leader) {
+			node->cache_stats.hits++;
+
+			smcp_curl_request_fill_from_entry(request, entry);
+
+			if(smcp_curl_request_etag_matches(request)) {
+				// The client already has this representation.
+				ret = smcp_outbound_begin_response(COAP_RESULT_203_VALID);
+				require_noerr(ret,bail);
+
+				ret = smcp_curl_request_append_freshness(request);
+				require_noerr(ret,bail);
+
+				ret = smcp_outbound_send();
+				require_noerr(ret,bail);
+
+				smcp_curl_request_release(request);
+				request = NULL;
+				goto bail;
+			}
+
+			goto respond;
+		} else if(entry) {
+			// Someone is already fetching this, so wait for them.
+			node->cache_stats.coalesced++;
+			request->cache_entry = entry;
+			goto respond;
+		}
+
+		node->cache_stats.misses++;
+
+		// Only a transfer that starts at the beginning sees the whole body.
+		if(!block.block_offset && smcp_curl_proxy_node_cache_add(node, cache_key, hash, request))
+			cache_key = NULL;
+	}
+
+	smcp_curl_request_start(request);
+
+	if(request->is_done && request->cache_entry)
+		smcp_curl_proxy_node_cache_finish(node, request->cache_entry);
+
+respond:
+	smcp_invalidate_timer(request->interface, &request->expiration_timer);
+
+	if(smcp_curl_request_has_block(request)) {
+		ret = smcp_outbound_begin_response(smcp_curl_request_get_code(request));
+		require_noerr(ret,bail);
+
+		ret = smcp_curl_request_append_block(request);
+		require_noerr(ret,bail);
+
+		ret = smcp_outbound_send();
+		require_noerr(ret,bail);
+
+		if(smcp_curl_request_is_last_block(request)) {
+			smcp_curl_request_release(request);
+			request = NULL;
+			goto bail;
+		}
+	} else {
+		ret = smcp_start_async_response(&request->async_response,0);
+		require_noerr(ret,bail);
+
+		request->is_async = true;
+	}
+
+	smcp_schedule_timer(request->interface, &request->expiration_timer, SMCP_CURL_PROXY_STREAM_TIMEOUT);
 
 bail:
+	free(uri);
+	free(cache_key);
+
 	if(headerlist)
 		curl_slist_free_all(headerlist);
 
@@ -290,6 +1257,17 @@ bail:
 
 void
 smcp_curl_proxy_node_dealloc(smcp_curl_proxy_node_t x) {
+	smcp_curl_request_t request;
+
+	// Nobody is waiting on anything after this.
+	for(request = x->requests; request; request = request->next)
+		request->cache_entry = NULL;
+
+	while(x->cache)
+		smcp_curl_cache_entry_release(x, x->cache);
+
+	while(x->requests)
+		smcp_curl_request_release(x->requests);
 	free(x);
 }
 
@@ -342,6 +1320,9 @@ smcp_curl_proxy_node_update_fdset(
 	int fd = *max_fd;
 	long cms_timeout = *timeout;
 
+	if(self->event_loop)
+		return SMCP_STATUS_OK;
+
 	curl_multi_fdset(
 		self->curl_multi_handle,
 		read_fd_set,
@@ -364,11 +1345,105 @@ smcp_curl_proxy_node_update_fdset(
 	return SMCP_STATUS_OK;
 }
 
+const struct smcp_curl_proxy_cache_stats_s*
+smcp_curl_proxy_node_get_cache_stats(smcp_curl_proxy_node_t self) {
+	return &self->cache_stats;
+}
+
 smcp_status_t
 smcp_curl_proxy_node_process(smcp_curl_proxy_node_t self) {
 	int running_curl_handles;
-	curl_multi_perform(self->curl_multi_handle, &running_curl_handles);
+	if(!self->event_loop) {
+		curl_multi_perform(self->curl_multi_handle, &running_curl_handles);
+		smcp_curl_proxy_node_check_done(self);
+	}
 	return SMCP_STATUS_OK;
 }
 
+// MARK: -
+// MARK: Event Loop Support
+
+static void
+smcp_curl_proxy_node_socket_ready(smcp_event_loop_t loop, int fd, int events, void* context) {
+	smcp_curl_proxy_node_t self = (smcp_curl_proxy_node_t)context;
+	int running_curl_handles;
+
+	curl_multi_socket_action(
+		self->curl_multi_handle,
+		fd,
+		((events & SMCP_EVENT_READ) ? CURL_CSELECT_IN : 0)
+		| ((events & SMCP_EVENT_WRITE) ? CURL_CSELECT_OUT : 0)
+		| ((events & SMCP_EVENT_ERROR) ? CURL_CSELECT_ERR : 0),
+		&running_curl_handles
+	);
+
+	smcp_curl_proxy_node_check_done(self);
+}
+
+static int
+smcp_curl_proxy_node_socket_func(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp) {
+	smcp_curl_proxy_node_t self = (smcp_curl_proxy_node_t)userp;
+
+	if(what == CURL_POLL_REMOVE) {
+		smcp_event_loop_remove_fd(self->event_loop, s);
+	} else {
+		smcp_event_loop_add_fd(
+			self->event_loop,
+			s,
+			((what & CURL_POLL_IN) ? SMCP_EVENT_READ : 0)
+			| ((what & CURL_POLL_OUT) ? SMCP_EVENT_WRITE : 0),
+			&smcp_curl_proxy_node_socket_ready,
+			(void*)self
+		);
+	}
+
+	return 0;
+}
+
+static void
+smcp_curl_proxy_node_timer_fired(smcp_t smcp, void* context) {
+	smcp_curl_proxy_node_t self = (smcp_curl_proxy_node_t)context;
+	int running_curl_handles;
+
+	curl_multi_socket_action(self->curl_multi_handle, CURL_SOCKET_TIMEOUT, 0, &running_curl_handles);
+
+	smcp_curl_proxy_node_check_done(self);
+}
+
+static int
+smcp_curl_proxy_node_timer_func(CURLM* multi, long timeout_ms, void* userp) {
+	smcp_curl_proxy_node_t self = (smcp_curl_proxy_node_t)userp;
+	smcp_t const instance = smcp_event_loop_get_instance(self->event_loop);
+
+	smcp_invalidate_timer(instance, &self->timer);
+
+	if(timeout_ms >= 0)
+		smcp_schedule_timer(instance, &self->timer, (cms_t)timeout_ms);
+
+	return 0;
+}
+
+smcp_status_t
+smcp_curl_proxy_node_set_event_loop(smcp_curl_proxy_node_t self, smcp_event_loop_t loop) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+
+	require_action(loop != NULL && smcp_event_loop_get_instance(loop) != NULL, bail, ret = SMCP_STATUS_INVALID_ARGUMENT);
+	require_action(self->event_loop == NULL, bail, ret = SMCP_STATUS_INVALID_ARGUMENT);
+
+	self->event_loop = loop;
+
+	if(!self->interface)
+		self->interface = smcp_event_loop_get_instance(loop);
+
+	smcp_timer_init(&self->timer, &smcp_curl_proxy_node_timer_fired, NULL, (void*)self);
+
+	curl_multi_setopt(self->curl_multi_handle, CURLMOPT_SOCKETFUNCTION, &smcp_curl_proxy_node_socket_func);
+	curl_multi_setopt(self->curl_multi_handle, CURLMOPT_SOCKETDATA, (void*)self);
+	curl_multi_setopt(self->curl_multi_handle, CURLMOPT_TIMERFUNCTION, &smcp_curl_proxy_node_timer_func);
+	curl_multi_setopt(self->curl_multi_handle, CURLMOPT_TIMERDATA, (void*)self);
+
+bail:
+	return ret;
+}
+
 #endif // SMCP_CONF_NODE_ROUTER
@@ -32,6 +32,7 @@
 
 #include "smcp.h"
 #include "smcp-node-router.h"
+#include "smcp-event-loop.h"
 #include <curl/curl.h>
 
 /*!	@addtogroup smcp-extras
@@ -42,13 +43,38 @@
 **	@{
 **	@brief Curl-based CoAP-HTTP Proxy Request Handler (Experimental)
 **
+**	HTTP bodies are streamed through a bounded buffer and handed out
+**	as Block2 responses, each block request from the client making
+**	room for more of the body. The transfer is paused while the buffer
+**	is full. All transfers share the node's multi handle, so repeated
+**	requests to the same origin reuse its connections.
+**
+**	Responses to GET requests are cached for as long as their
+**	Cache-Control or Expires headers allow, keyed on the normalized
+**	URL and the Accept option. Hits are answered from memory with
+**	the remaining lifetime as Max-Age, along with the ETag. Requests
+**	that come in while the same response is already being fetched
+**	wait for that transfer instead of starting their own.
 */
 
+//!	How well the proxy's response cache is doing.
+struct smcp_curl_proxy_cache_stats_s {
+	uint32_t hits;			//!< Requests answered from the cache.
+	uint32_t misses;		//!< Cacheable requests that went to the origin.
+	uint32_t coalesced;		//!< Requests that waited on a transfer already under way.
+	uint32_t entries;		//!< Responses in the cache, or being fetched for it.
+};
+
 
 typedef struct smcp_curl_proxy_node_s {
 	struct smcp_node_s	node;
 	CURLM *curl_multi_handle;
 	smcp_t interface;
+	smcp_event_loop_t event_loop;
+	struct smcp_timer_s timer;
+	struct smcp_curl_request_s* requests;	//!< Responses that are still being handed out.
+	struct smcp_curl_cache_entry_s* cache;	//!< Most recently used first.
+	struct smcp_curl_proxy_cache_stats_s cache_stats;
 } *smcp_curl_proxy_node_t;
 
 SMCP_API_EXTERN smcp_curl_proxy_node_t smcp_smcp_curl_proxy_node_alloc();
@@ -70,6 +96,20 @@ SMCP_API_EXTERN smcp_status_t smcp_curl_proxy_node_update_fdset(
 
 SMCP_API_EXTERN smcp_status_t smcp_curl_proxy_node_process(smcp_curl_proxy_node_t node);
 
+//!	Has `loop` drive the proxy's transfers from now on.
+/*!	Each of curl's sockets is added to the loop as curl asks for it,
+**	and curl's timeouts are scheduled on the loop's first instance.
+**	After this is called, smcp_curl_proxy_node_update_fdset() and
+**	smcp_curl_proxy_node_process() do nothing. */
+SMCP_API_EXTERN smcp_status_t smcp_curl_proxy_node_set_event_loop(
+	smcp_curl_proxy_node_t node,
+	smcp_event_loop_t loop
+);
+
+SMCP_API_EXTERN const struct smcp_curl_proxy_cache_stats_s* smcp_curl_proxy_node_get_cache_stats(
+	smcp_curl_proxy_node_t node
+);
+
 SMCP_API_EXTERN smcp_status_t smcp_curl_proxy_request_handler(smcp_curl_proxy_node_t node);
 
 /*!	@} */
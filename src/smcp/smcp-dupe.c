@@ -28,25 +28,272 @@
 */
 
 #include <stdio.h>
+#include "assert-macros.h"
+#include "smcp-logging.h"
 #include "smcp-internal.h"
 #include "smcp-dupe.h"
 #include "fasthash.h"
 
-// TODO: This code could use some optimization.
+static uint32_t
+smcp_dupe_hash(const smcp_sockaddr_t* saddr, coap_msg_id_t msg_id) {
+	struct fasthash_state_s fasthash;
+
+	// Calculate the message-id hash (address+port+message_id)
+	fasthash_start(&fasthash, 0);
+	fasthash_feed(&fasthash, (const uint8_t*)saddr, sizeof(*saddr));
+	fasthash_feed(&fasthash, (const uint8_t*)&msg_id, sizeof(msg_id));
+	return fasthash_finish_uint32(&fasthash);
+}
+
+#if SMCP_DUPE_USE_HASH
+
+/*	Received messages are remembered in a chained hash table keyed by
+**	remote address and message id. Every entry lives for exactly
+**	COAP_EXCHANGE_LIFETIME, so they are also kept on a singly-linked
+**	list in the order that they were added, which is also the order
+**	in which they expire. The oldest entries are forgotten early if
+**	the cache would otherwise grow beyond SMCP_CONF_DUPE_CACHE_MAX_BYTES.
+*/
+
+#define SMCP_DUPE_MIN_BUCKET_COUNT		(64)
+
+static size_t
+smcp_dupe_entry_size(const struct smcp_dupe_entry_s* entry) {
+	return sizeof(*entry) + entry->response_header_len + entry->response_content_len;
+}
+
+static void
+smcp_dupe_remove_oldest(struct smcp_dupe_info_s* info) {
+	struct smcp_dupe_entry_s* const entry = info->oldest;
+	struct smcp_dupe_entry_s** link = &info->buckets[entry->hash & (info->bucket_count - 1)];
+
+	while(*link != entry)
+		link = &(*link)->next_in_bucket;
+
+	*link = entry->next_in_bucket;
+
+	info->oldest = entry->next_to_expire;
+	if(!info->oldest)
+		info->newest = NULL;
+
+	if(info->current == entry)
+		info->current = NULL;
+
+	info->bytes_used -= smcp_dupe_entry_size(entry);
+	info->count--;
+
+	free(entry->response);
+	free(entry);
+}
+
+static bool
+smcp_dupe_grow(struct smcp_dupe_info_s* info) {
+	const uint32_t bucket_count = info->bucket_count ? info->bucket_count * 2 : SMCP_DUPE_MIN_BUCKET_COUNT;
+	const size_t added_bytes = (bucket_count - info->bucket_count) * sizeof(*info->buckets);
+	struct smcp_dupe_entry_s** buckets;
+	uint32_t i;
+
+	if(info->bytes_used + added_bytes > SMCP_CONF_DUPE_CACHE_MAX_BYTES)
+		return false;
+
+	buckets = calloc(bucket_count, sizeof(*buckets));
+
+	if(!buckets)
+		return false;
+
+	for(i = 0; i < info->bucket_count; i++) {
+		while(info->buckets[i]) {
+			struct smcp_dupe_entry_s* const entry = info->buckets[i];
+			struct smcp_dupe_entry_s** const bucket = &buckets[entry->hash & (bucket_count - 1)];
+
+			info->buckets[i] = entry->next_in_bucket;
+			entry->next_in_bucket = *bucket;
+			*bucket = entry;
+		}
+	}
+
+	free(info->buckets);
+	info->buckets = buckets;
+	info->bucket_count = bucket_count;
+	info->bytes_used += added_bytes;
+
+	return true;
+}
+
+bool
+smcp_inbound_dupe_check(void)
+{
+	smcp_t const self = smcp_get_current_instance();
+	struct smcp_dupe_info_s* const info = &self->dupe_info;
+	const smcp_timestamp_t now = smcp_get_current_time(self);
+	const coap_msg_id_t msg_id = self->inbound.packet->msg_id;
+	const uint32_t hash = smcp_dupe_hash(&self->inbound.saddr, msg_id);
+	struct smcp_dupe_entry_s* entry;
+
+	info->current = NULL;
+
+	// Forget anything that has expired.
+	while(info->oldest && (info->oldest->expiration <= now)) {
+		smcp_dupe_remove_oldest(info);
+	}
+
+	// Check to see if this packet is a duplicate.
+	if(info->bucket_count) {
+		for(entry = info->buckets[hash & (info->bucket_count - 1)]; entry; entry = entry->next_in_bucket) {
+			if((entry->hash == hash)
+				&& (entry->msg_id == msg_id)
+				&& (0 == memcmp(&entry->from, &self->inbound.saddr, sizeof(self->inbound.saddr)))
+			) {
+				info->current = entry;
+				return true;
+			}
+		}
+	}
+
+	// This is not a dupe, add it to the cache.
+	while(info->oldest && (info->bytes_used + sizeof(*entry) > SMCP_CONF_DUPE_CACHE_MAX_BYTES)) {
+		smcp_dupe_remove_oldest(info);
+	}
+
+	if(info->count >= info->bucket_count) {
+		// If we can't grow, we just end up with longer chains.
+		smcp_dupe_grow(info);
+		require(info->bucket_count, bail);
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	require(entry, bail);
+
+	entry->hash = hash;
+	entry->msg_id = msg_id;
+	memcpy(&entry->from, &self->inbound.saddr, sizeof(self->inbound.saddr));
+	entry->expiration = now + (smcp_timestamp_t)(COAP_EXCHANGE_LIFETIME*MSEC_PER_SEC);
+
+	entry->next_in_bucket = info->buckets[hash & (info->bucket_count - 1)];
+	info->buckets[hash & (info->bucket_count - 1)] = entry;
+
+	if(info->newest)
+		info->newest->next_to_expire = entry;
+	else
+		info->oldest = entry;
+	info->newest = entry;
+
+	info->bytes_used += sizeof(*entry);
+	info->count++;
+	info->current = entry;
+
+bail:
+	return false;
+}
+
+void
+smcp_outbound_dupe_store(void)
+{
+	smcp_t const self = smcp_get_current_instance();
+	struct smcp_dupe_info_s* const info = &self->dupe_info;
+	struct smcp_dupe_entry_s* const entry = info->current;
+	const size_t old_len = entry ? (entry->response_header_len + entry->response_content_len) : 0;
+	coap_size_t header_len, content_len;
+	uint8_t* response;
+
+	// Only the piggy-backed response (or reset) to a
+	// confirmable message is worth remembering.
+	if(!entry
+		|| !self->is_processing_message
+		|| self->inbound.is_dupe
+		|| self->inbound.packet->tt != COAP_TRANS_TYPE_CONFIRMABLE
+		|| self->outbound.packet->tt < COAP_TRANS_TYPE_ACK
+		|| self->outbound.packet->msg_id != self->inbound.packet->msg_id
+	) {
+		return;
+	}
+
+	header_len = (coap_size_t)(self->outbound.content_ptr - (char*)self->outbound.packet);
+	content_len = self->outbound.content_len;
+
+	while(info->oldest
+		&& (info->oldest != entry)
+		&& (info->bytes_used - old_len + header_len + content_len > SMCP_CONF_DUPE_CACHE_MAX_BYTES)
+	) {
+		smcp_dupe_remove_oldest(info);
+	}
+
+	require(info->bytes_used - old_len + header_len + content_len <= SMCP_CONF_DUPE_CACHE_MAX_BYTES, bail);
+
+	response = realloc(entry->response, header_len + content_len);
+	require(response, bail);
+
+	memcpy(response, self->outbound.packet, header_len + content_len);
+
+	info->bytes_used += header_len + content_len;
+	info->bytes_used -= old_len;
+	entry->response = response;
+	entry->response_header_len = header_len;
+	entry->response_content_len = content_len;
+
+bail:
+	return;
+}
+
+smcp_status_t
+smcp_inbound_dupe_replay(void)
+{
+	smcp_t const self = smcp_get_current_instance();
+	struct smcp_dupe_entry_s* const entry = self->dupe_info.current;
+	smcp_status_t ret = SMCP_STATUS_NOT_FOUND;
+
+	require(self->inbound.is_dupe && entry && entry->response, bail);
+
+	DEBUG_PRINTF("Inbound: Duplicate, replaying cached response");
+
+	ret = smcp_outbound_begin_response(COAP_CODE_EMPTY);
+	require_noerr(ret, bail);
+
+	require_action(
+		entry->response_header_len + entry->response_content_len <= self->outbound.max_packet_len,
+		bail,
+		ret = SMCP_STATUS_MESSAGE_TOO_BIG
+	);
+
+	memcpy(
+		self->outbound.packet,
+		entry->response,
+		entry->response_header_len + entry->response_content_len
+	);
+	self->outbound.content_ptr = (char*)self->outbound.packet + entry->response_header_len;
+	self->outbound.content_len = entry->response_content_len;
+	self->outbound.options_encoded = true;
+	self->outbound.auto_options_added = true;
+
+	ret = smcp_outbound_send();
+
+bail:
+	return ret;
+}
+
+void
+smcp_release_dupe_info(smcp_t self)
+{
+	SMCP_EMBEDDED_SELF_HOOK;
+
+	while(self->dupe_info.oldest) {
+		smcp_dupe_remove_oldest(&self->dupe_info);
+	}
+
+	free(self->dupe_info.buckets);
+	memset(&self->dupe_info, 0, sizeof(self->dupe_info));
+}
+
+#else // SMCP_DUPE_USE_HASH
 
 bool
 smcp_inbound_dupe_check(void)
 {
 	smcp_t const self = smcp_get_current_instance();
 	bool is_dupe = false;
-	struct fasthash_state_s fasthash;
 	uint32_t hash;
 
-	// Calculate the message-id hash (address+port+message_id)
-	fasthash_start(&fasthash, 0);
-	fasthash_feed(&fasthash, (void*)&self->inbound.saddr,sizeof(self->inbound.saddr));
-	fasthash_feed(&fasthash, (const uint8_t*)&self->inbound.packet->msg_id,sizeof(self->inbound.packet->msg_id));
-	hash = fasthash_finish_uint32(&fasthash);
+	hash = smcp_dupe_hash(&self->inbound.saddr, self->inbound.packet->msg_id);
 
 	// Check to see if this packet is a duplicate.
 	unsigned int i = SMCP_CONF_DUPE_BUFFER_SIZE;
@@ -72,3 +319,23 @@ smcp_inbound_dupe_check(void)
 
 	return is_dupe;
 }
+
+void
+smcp_outbound_dupe_store(void)
+{
+	// Responses are not cached in the ring buffer.
+}
+
+smcp_status_t
+smcp_inbound_dupe_replay(void)
+{
+	return SMCP_STATUS_NOT_FOUND;
+}
+
+void
+smcp_release_dupe_info(smcp_t self)
+{
+	// Nothing to free.
+}
+
+#endif // !SMCP_DUPE_USE_HASH
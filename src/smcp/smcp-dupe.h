@@ -32,6 +32,37 @@
 
 #include "smcp.h"
 
+#if SMCP_DUPE_USE_HASH
+struct smcp_dupe_entry_s {
+	struct smcp_dupe_entry_s* next_in_bucket;
+	struct smcp_dupe_entry_s* next_to_expire;
+	uint32_t hash;
+	smcp_sockaddr_t from;
+	coap_msg_id_t msg_id;
+	smcp_timestamp_t expiration;
+
+	// Cached response, if any. The first `response_header_len`
+	// bytes include the start-of-content marker.
+	uint8_t* response;
+	coap_size_t response_header_len;
+	coap_size_t response_content_len;
+};
+
+struct smcp_dupe_info_s {
+	struct smcp_dupe_entry_s** buckets;
+	uint32_t bucket_count;
+	uint32_t count;
+	size_t bytes_used;
+
+	// Entries all live for the same amount of time, so
+	// they expire in the order they were added.
+	struct smcp_dupe_entry_s* oldest;
+	struct smcp_dupe_entry_s* newest;
+
+	// Entry for the message currently being processed.
+	struct smcp_dupe_entry_s* current;
+};
+#else
 struct smcp_dupe_info_s {
 	struct {
 		uint32_t hash;
@@ -45,7 +76,22 @@ struct smcp_dupe_info_s {
 	uint16_t dupe_index;
 #endif
 };
+#endif // !SMCP_DUPE_USE_HASH
+
+#if SMCP_EMBEDDED
+#define smcp_release_dupe_info(self)		smcp_release_dupe_info()
+#endif
 
 bool smcp_inbound_dupe_check(void);
 
+//!	Resends the cached response to the current inbound duplicate.
+/*!	Returns SMCP_STATUS_NOT_FOUND if there is no cached response. */
+smcp_status_t smcp_inbound_dupe_replay(void);
+
+//!	Caches the outbound packet as the response to the current inbound message.
+void smcp_outbound_dupe_store(void);
+
+//!	Forgets all recently received messages, freeing any storage.
+void smcp_release_dupe_info(smcp_t self);
+
 #endif
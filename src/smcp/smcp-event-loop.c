@@ -0,0 +1,574 @@
+/*!	@file smcp-event-loop.c
+**	@author Robert Quattlebaum <darco@deepdarc.com>
+**
+**	Copyright (C) 2014 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef VERBOSE_DEBUG
+#define VERBOSE_DEBUG 0
+#endif
+
+#ifndef DEBUG
+#define DEBUG VERBOSE_DEBUG
+#endif
+
+#include "assert-macros.h"
+
+#include "smcp.h"
+#include "smcp-event-loop.h"
+
+#if SMCP_USE_BSD_SOCKETS
+
+#include "smcp-internal.h"
+#include "smcp-logging.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+//!	If set, event loops use epoll unless asked not to.
+#ifndef SMCP_EVENT_LOOP_USE_EPOLL
+#define SMCP_EVENT_LOOP_USE_EPOLL			(HAVE_SYS_EPOLL_H && HAVE_EPOLL_CREATE1)
+#endif
+
+#if SMCP_EVENT_LOOP_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+//!	The most ready descriptors that are handled per wakeup.
+#ifndef SMCP_EVENT_LOOP_MAX_EVENTS
+#define SMCP_EVENT_LOOP_MAX_EVENTS			(64)
+#endif
+
+struct smcp_event_fd_s {
+	smcp_event_callback_t	callback;		//!< NULL if not added.
+	void*					context;
+	uint32_t				generation;		//!< Tells stale events from fresh ones.
+	uint32_t				poll_slot;		//!< Index into `pollfds` plus one, zero if not watched.
+	uint8_t					events;
+	bool					watched;		//!< In the kernel's interest list (epoll).
+};
+
+struct smcp_event_ready_s {
+	int						fd;
+	uint32_t				generation;
+	int						events;
+};
+
+struct smcp_event_instance_s {
+	smcp_t					instance;
+	int						dns_fd;
+	int						observers_fd;
+	bool					ready;
+};
+
+struct smcp_event_loop_s {
+	int						epoll_fd;		//!< -1 when using poll().
+
+	//!	Indexed by file descriptor.
+	struct smcp_event_fd_s*	fds;
+	int						fd_capacity;
+	int						fd_count;
+	uint32_t				next_generation;
+
+	struct pollfd*			pollfds;
+	int						pollfd_count;
+	int						pollfd_capacity;
+	int						poll_start;		//!< Where the next scan starts, for fairness.
+
+	struct smcp_event_instance_s* instances;
+	int						instance_count;
+};
+
+// MARK: -
+// MARK: Backends
+
+#if SMCP_EVENT_LOOP_USE_EPOLL
+static uint32_t
+smcp_event_to_epoll(int events) {
+	return ((events & SMCP_EVENT_READ) ? EPOLLIN : 0)
+		| ((events & SMCP_EVENT_WRITE) ? EPOLLOUT : 0);
+}
+
+static int
+smcp_event_from_epoll(uint32_t events) {
+	return ((events & EPOLLIN) ? SMCP_EVENT_READ : 0)
+		| ((events & EPOLLOUT) ? SMCP_EVENT_WRITE : 0)
+		| ((events & (EPOLLERR | EPOLLHUP)) ? SMCP_EVENT_ERROR : 0);
+}
+#endif
+
+static short
+smcp_event_to_poll(int events) {
+	return ((events & SMCP_EVENT_READ) ? POLLIN : 0)
+		| ((events & SMCP_EVENT_WRITE) ? POLLOUT : 0);
+}
+
+static int
+smcp_event_from_poll(short events) {
+	return ((events & POLLIN) ? SMCP_EVENT_READ : 0)
+		| ((events & POLLOUT) ? SMCP_EVENT_WRITE : 0)
+		| ((events & (POLLERR | POLLHUP | POLLNVAL)) ? SMCP_EVENT_ERROR : 0);
+}
+
+//!	Brings the backend up to date with the events wanted for `fd`.
+static smcp_status_t
+smcp_event_loop_watch(smcp_event_loop_t loop, int fd) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	struct smcp_event_fd_s* const entry = &loop->fds[fd];
+	const bool want = (entry->callback != NULL) && (entry->events != 0);
+
+#if SMCP_EVENT_LOOP_USE_EPOLL
+	if(loop->epoll_fd >= 0) {
+		struct epoll_event ev = {};
+		int op;
+
+		if(want) {
+			op = entry->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+		} else if(entry->watched) {
+			op = EPOLL_CTL_DEL;
+		} else {
+			goto bail;
+		}
+
+		ev.events = smcp_event_to_epoll(entry->events);
+		ev.data.u64 = (uint32_t)fd | ((uint64_t)entry->generation << 32);
+
+		if(epoll_ctl(loop->epoll_fd, op, fd, &ev) < 0) {
+			// Removing a descriptor that was already closed is harmless.
+			require_action_string(op == EPOLL_CTL_DEL, bail, ret = SMCP_STATUS_ERRNO, strerror(errno));
+		}
+
+		entry->watched = want;
+		goto bail;
+	}
+#endif
+
+	if(want && !entry->poll_slot) {
+		if(loop->pollfd_count == loop->pollfd_capacity) {
+			const int capacity = loop->pollfd_capacity ? loop->pollfd_capacity * 2 : 16;
+			struct pollfd* const pollfds = realloc(loop->pollfds, capacity * sizeof(*pollfds));
+
+			require_action(pollfds != NULL, bail, ret = SMCP_STATUS_MALLOC_FAILURE);
+
+			loop->pollfds = pollfds;
+			loop->pollfd_capacity = capacity;
+		}
+		entry->poll_slot = ++loop->pollfd_count;
+		loop->pollfds[entry->poll_slot - 1].fd = fd;
+	}
+
+	if(want) {
+		loop->pollfds[entry->poll_slot - 1].events = smcp_event_to_poll(entry->events);
+		loop->pollfds[entry->poll_slot - 1].revents = 0;
+	} else if(entry->poll_slot) {
+		// Move the last one into the hole.
+		struct pollfd* const last = &loop->pollfds[--loop->pollfd_count];
+
+		loop->pollfds[entry->poll_slot - 1] = *last;
+		loop->fds[last->fd].poll_slot = entry->poll_slot;
+		entry->poll_slot = 0;
+	}
+
+bail:
+	return ret;
+}
+
+//!	Waits for descriptors, filling in `ready`. Returns the count, or -1.
+static int
+smcp_event_loop_wait(smcp_event_loop_t loop, struct smcp_event_ready_s* ready, cms_t cms) {
+	int count = 0;
+	int i;
+
+#if SMCP_EVENT_LOOP_USE_EPOLL
+	if(loop->epoll_fd >= 0) {
+		struct epoll_event evs[SMCP_EVENT_LOOP_MAX_EVENTS];
+
+		count = epoll_wait(loop->epoll_fd, evs, SMCP_EVENT_LOOP_MAX_EVENTS, cms);
+
+		for(i = 0; i < count; i++) {
+			ready[i].fd = (int)(uint32_t)evs[i].data.u64;
+			ready[i].generation = (uint32_t)(evs[i].data.u64 >> 32);
+			ready[i].events = smcp_event_from_epoll(evs[i].events);
+		}
+
+		return count;
+	}
+#endif
+
+	if(poll(loop->pollfds, loop->pollfd_count, cms) < 0)
+		return -1;
+
+	// Everything is level-triggered, so anything beyond what fits
+	// is picked up next time. Start somewhere new each time so that
+	// the descriptors at the end get their turn.
+	for(i = 0; (i < loop->pollfd_count) && (count < SMCP_EVENT_LOOP_MAX_EVENTS); i++) {
+		const struct pollfd* const pollee = &loop->pollfds[(loop->poll_start + i) % loop->pollfd_count];
+
+		if(!pollee->revents)
+			continue;
+
+		ready[count].fd = pollee->fd;
+		ready[count].generation = loop->fds[pollee->fd].generation;
+		ready[count].events = smcp_event_from_poll(pollee->revents);
+		count++;
+	}
+
+	if(loop->pollfd_count)
+		loop->poll_start = (loop->poll_start + 1) % loop->pollfd_count;
+
+	return count;
+}
+
+// MARK: -
+// MARK: Descriptors
+
+smcp_event_loop_t
+smcp_event_loop_create(int flags) {
+	smcp_event_loop_t loop = calloc(1, sizeof(*loop));
+
+	require(loop != NULL, bail);
+
+	loop->epoll_fd = -1;
+
+#if SMCP_EVENT_LOOP_USE_EPOLL
+	if(!(flags & SMCP_EVENT_LOOP_FLAG_USE_POLL)) {
+		loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+		// Fall back to poll() if the kernel won't give us an epoll.
+		check_string(loop->epoll_fd >= 0, strerror(errno));
+	}
+#endif
+
+bail:
+	return loop;
+}
+
+void
+smcp_event_loop_release(smcp_event_loop_t loop) {
+	if(!loop)
+		return;
+
+	if(loop->epoll_fd >= 0)
+		close(loop->epoll_fd);
+
+	free(loop->fds);
+	free(loop->pollfds);
+	free(loop->instances);
+	free(loop);
+}
+
+const char*
+smcp_event_loop_get_backend(smcp_event_loop_t loop) {
+	return (loop->epoll_fd >= 0) ? "epoll" : "poll";
+}
+
+smcp_status_t
+smcp_event_loop_add_fd(
+	smcp_event_loop_t loop,
+	int fd,
+	int events,
+	smcp_event_callback_t callback,
+	void* context
+) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	struct smcp_event_fd_s* entry;
+
+	require_action(fd >= 0 && callback != NULL, bail, ret = SMCP_STATUS_INVALID_ARGUMENT);
+
+	if(fd >= loop->fd_capacity) {
+		int capacity = loop->fd_capacity ? loop->fd_capacity : 64;
+		struct smcp_event_fd_s* fds;
+
+		while(capacity <= fd)
+			capacity *= 2;
+
+		fds = realloc(loop->fds, capacity * sizeof(*fds));
+		require_action(fds != NULL, bail, ret = SMCP_STATUS_MALLOC_FAILURE);
+
+		memset(fds + loop->fd_capacity, 0, (capacity - loop->fd_capacity) * sizeof(*fds));
+		loop->fds = fds;
+		loop->fd_capacity = capacity;
+	}
+
+	entry = &loop->fds[fd];
+
+	if(!entry->callback) {
+		entry->generation = ++loop->next_generation;
+		loop->fd_count++;
+	}
+
+	entry->callback = callback;
+	entry->context = context;
+	entry->events = (uint8_t)(events & (SMCP_EVENT_READ | SMCP_EVENT_WRITE));
+
+	ret = smcp_event_loop_watch(loop, fd);
+
+	if(ret) {
+		entry->callback = NULL;
+		loop->fd_count--;
+	}
+
+bail:
+	return ret;
+}
+
+smcp_status_t
+smcp_event_loop_set_fd_events(smcp_event_loop_t loop, int fd, int events) {
+	smcp_status_t ret = SMCP_STATUS_NOT_FOUND;
+
+	require(fd >= 0 && fd < loop->fd_capacity && loop->fds[fd].callback, bail);
+
+	events &= (SMCP_EVENT_READ | SMCP_EVENT_WRITE);
+
+	if(loop->fds[fd].events == events) {
+		ret = SMCP_STATUS_OK;
+		goto bail;
+	}
+
+	loop->fds[fd].events = (uint8_t)events;
+
+	ret = smcp_event_loop_watch(loop, fd);
+
+bail:
+	return ret;
+}
+
+smcp_status_t
+smcp_event_loop_remove_fd(smcp_event_loop_t loop, int fd) {
+	smcp_status_t ret = SMCP_STATUS_NOT_FOUND;
+
+	require(fd >= 0 && fd < loop->fd_capacity && loop->fds[fd].callback, bail);
+
+	loop->fds[fd].callback = NULL;
+	loop->fds[fd].context = NULL;
+	loop->fd_count--;
+
+	// Any event for this descriptor that is waiting to be
+	// dispatched is now stale.
+	loop->fds[fd].generation = ++loop->next_generation;
+
+	ret = smcp_event_loop_watch(loop, fd);
+
+bail:
+	return ret;
+}
+
+int
+smcp_event_loop_get_fd_count(smcp_event_loop_t loop) {
+	return loop->fd_count;
+}
+
+// MARK: -
+// MARK: Instances
+
+static void
+smcp_event_loop_instance_ready(smcp_event_loop_t loop, int fd, int events, void* context) {
+	int i;
+
+	for(i = 0; i < loop->instance_count; i++) {
+		if(loop->instances[i].instance == (smcp_t)context) {
+			loop->instances[i].ready = true;
+			break;
+		}
+	}
+}
+
+//!	Moves the watch in `*watched_fd` over to `fd`.
+static void
+smcp_event_loop_watch_instance_fd(smcp_event_loop_t loop, struct smcp_event_instance_s* item, int* watched_fd, int fd) {
+	if(fd == *watched_fd)
+		return;
+
+	if(*watched_fd >= 0)
+		smcp_event_loop_remove_fd(loop, *watched_fd);
+
+	*watched_fd = fd;
+
+	if(fd >= 0)
+		smcp_event_loop_add_fd(loop, fd, SMCP_EVENT_READ, &smcp_event_loop_instance_ready, item->instance);
+}
+
+//!	Watches the hostname lookup and observer descriptors, which show up once they are first needed.
+static void
+smcp_event_loop_update_fds(smcp_event_loop_t loop, struct smcp_event_instance_s* item) {
+	smcp_event_loop_watch_instance_fd(loop, item, &item->dns_fd, smcp_get_dns_fd(item->instance));
+#if SMCP_OBSERVABLE_USE_REGISTRY
+	smcp_event_loop_watch_instance_fd(loop, item, &item->observers_fd, smcp_get_observers_fd(item->instance));
+#endif
+}
+
+smcp_status_t
+smcp_event_loop_add_instance(smcp_event_loop_t loop, smcp_t instance) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	struct smcp_event_instance_s* instances;
+	struct smcp_event_instance_s* item;
+
+	int i;
+
+	require_action(instance != NULL, bail, ret = SMCP_STATUS_INVALID_ARGUMENT);
+
+	for(i = 0; i < loop->instance_count; i++) {
+		if(loop->instances[i].instance == instance)
+			goto bail;
+	}
+
+	instances = realloc(loop->instances, (loop->instance_count + 1) * sizeof(*instances));
+	require_action(instances != NULL, bail, ret = SMCP_STATUS_MALLOC_FAILURE);
+	loop->instances = instances;
+
+	ret = smcp_event_loop_add_fd(loop, smcp_get_fd(instance), SMCP_EVENT_READ, &smcp_event_loop_instance_ready, instance);
+	require_noerr(ret, bail);
+
+	item = &loop->instances[loop->instance_count++];
+	item->instance = instance;
+	item->dns_fd = -1;
+	item->observers_fd = -1;
+
+	// Whatever came in before now still needs handling.
+	item->ready = true;
+
+	smcp_event_loop_update_fds(loop, item);
+
+bail:
+	return ret;
+}
+
+smcp_status_t
+smcp_event_loop_remove_instance(smcp_event_loop_t loop, smcp_t instance) {
+	smcp_status_t ret = SMCP_STATUS_NOT_FOUND;
+	int i;
+
+	for(i = 0; i < loop->instance_count; i++) {
+		struct smcp_event_instance_s* const item = &loop->instances[i];
+
+		if(item->instance != instance)
+			continue;
+
+		smcp_event_loop_remove_fd(loop, smcp_get_fd(instance));
+
+		if(item->dns_fd >= 0)
+			smcp_event_loop_remove_fd(loop, item->dns_fd);
+
+		if(item->observers_fd >= 0)
+			smcp_event_loop_remove_fd(loop, item->observers_fd);
+
+		memmove(item, item + 1, (loop->instance_count - i - 1) * sizeof(*item));
+		loop->instance_count--;
+		ret = SMCP_STATUS_OK;
+		break;
+	}
+
+	return ret;
+}
+
+smcp_t
+smcp_event_loop_get_instance(smcp_event_loop_t loop) {
+	return loop->instance_count ? loop->instances[0].instance : NULL;
+}
+
+// MARK: -
+// MARK: Running
+
+smcp_status_t
+smcp_event_loop_run_once(smcp_event_loop_t loop, cms_t cms) {
+	smcp_status_t ret = SMCP_STATUS_TIMEOUT;
+	struct smcp_event_ready_s ready[SMCP_EVENT_LOOP_MAX_EVENTS];
+	int count;
+	int i;
+
+	for(i = 0; i < loop->instance_count; i++) {
+		smcp_t const instance = loop->instances[i].instance;
+		cms_t timeout;
+
+		// Don't sleep while packets are still waiting to go out.
+		smcp_flush(instance);
+
+		timeout = loop->instances[i].ready ? 0 : smcp_get_timeout(instance);
+
+		if((cms < 0) || (timeout < cms))
+			cms = timeout;
+	}
+
+	errno = 0;
+
+	count = smcp_event_loop_wait(loop, ready, cms);
+
+	if(count < 0) {
+		require_action_string(errno == EINTR, bail, ret = SMCP_STATUS_ERRNO, strerror(errno));
+		ret = SMCP_STATUS_OK;
+		count = 0;
+	}
+
+	// Callbacks get the same current instance that timer callbacks do.
+	smcp_set_current_instance(smcp_event_loop_get_instance(loop));
+
+	for(i = 0; i < count; i++) {
+		struct smcp_event_fd_s* entry;
+		int events;
+
+		if(ready[i].fd >= loop->fd_capacity)
+			continue;
+
+		entry = &loop->fds[ready[i].fd];
+
+		// Skip anything that an earlier callback removed.
+		if(!entry->callback || (entry->generation != ready[i].generation))
+			continue;
+
+		events = ready[i].events & (entry->events | SMCP_EVENT_ERROR);
+
+		if(events) {
+			ret = SMCP_STATUS_OK;
+			(*entry->callback)(loop, ready[i].fd, events, entry->context);
+		}
+	}
+
+	smcp_set_current_instance(NULL);
+
+	for(i = 0; i < loop->instance_count; i++) {
+		struct smcp_event_instance_s* const item = &loop->instances[i];
+
+		if(item->ready || (smcp_get_timeout(item->instance) == 0)) {
+			item->ready = false;
+			ret = SMCP_STATUS_OK;
+			smcp_process(item->instance);
+			smcp_event_loop_update_fds(loop, item);
+		} else {
+			// Send anything that the callbacks queued up.
+			smcp_flush(item->instance);
+		}
+	}
+
+bail:
+	return ret;
+}
+
+#endif // SMCP_USE_BSD_SOCKETS
@@ -0,0 +1,141 @@
+/*!	@file smcp-event-loop.h
+**	@author Robert Quattlebaum <darco@deepdarc.com>
+**
+**	Copyright (C) 2014 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __SMCP_EVENT_LOOP_H__
+#define __SMCP_EVENT_LOOP_H__ 1
+
+#include "smcp.h"
+
+#if SMCP_USE_BSD_SOCKETS
+
+__BEGIN_DECLS
+
+/*!	@addtogroup smcp
+**	@{
+*/
+
+/*!	@defgroup smcp-event-loop Event Loop
+**	@{
+**	@brief Waiting on many file descriptors and instances at once.
+**
+**	An event loop watches any number of file descriptors, each with its
+**	own callback, along with the sockets and timers of the SMCP instances
+**	added to it. It uses epoll where that is available and poll()
+**	otherwise. With epoll, the work done per wakeup is proportional to
+**	the number of descriptors that are ready rather than the number
+**	being watched, and there is no FD_SETSIZE limit either way.
+**
+**	Anything that needs a timeout should schedule an ordinary SMCP
+**	timer on one of the loop's instances, such as the one returned by
+**	smcp_event_loop_get_instance(). The loop never sleeps past the
+**	next timer of any of its instances.
+**
+**	An event loop is not thread-safe. It, and the instances added to
+**	it, must only be used from the thread that runs it.
+*/
+
+struct smcp_event_loop_s;
+typedef struct smcp_event_loop_s *smcp_event_loop_t;
+
+enum {
+	SMCP_EVENT_READ = (1<<0),	//!< Ready to read, or at end of file.
+	SMCP_EVENT_WRITE = (1<<1),	//!< Ready to write.
+	SMCP_EVENT_ERROR = (1<<2),	//!< Error or hangup. Never needs to be asked for.
+};
+
+enum {
+	//!	Use poll() even if epoll is available.
+	SMCP_EVENT_LOOP_FLAG_USE_POLL = (1<<0),
+};
+
+//!	Called when a file descriptor is ready.
+/*!	`events` says which of the events that were asked for have
+**	happened, plus SMCP_EVENT_ERROR. The callback may add, change or
+**	remove any descriptor, including its own. */
+typedef void (*smcp_event_callback_t)(smcp_event_loop_t loop, int fd, int events, void* context);
+
+//!	Creates an event loop.
+SMCP_API_EXTERN smcp_event_loop_t smcp_event_loop_create(int flags);
+
+//!	Releases an event loop.
+/*!	The descriptors and instances that were added are left alone. */
+SMCP_API_EXTERN void smcp_event_loop_release(smcp_event_loop_t loop);
+
+//!	Returns "epoll" or "poll".
+SMCP_API_EXTERN const char* smcp_event_loop_get_backend(smcp_event_loop_t loop);
+
+//!	Starts watching `fd`, or changes what is done for it if already watched.
+/*!	A descriptor with no `events` stays added, but isn't watched for
+**	anything until smcp_event_loop_set_fd_events() says otherwise. */
+SMCP_API_EXTERN smcp_status_t smcp_event_loop_add_fd(
+	smcp_event_loop_t loop,
+	int fd,
+	int events,
+	smcp_event_callback_t callback,
+	void* context
+);
+
+//!	Changes the events that are watched for on `fd`.
+SMCP_API_EXTERN smcp_status_t smcp_event_loop_set_fd_events(
+	smcp_event_loop_t loop,
+	int fd,
+	int events
+);
+
+//!	Stops watching `fd`.
+/*!	This must be called *before* `fd` is closed. */
+SMCP_API_EXTERN smcp_status_t smcp_event_loop_remove_fd(smcp_event_loop_t loop, int fd);
+
+//!	Returns the number of descriptors that have been added.
+SMCP_API_EXTERN int smcp_event_loop_get_fd_count(smcp_event_loop_t loop);
+
+//!	Has the loop receive packets for `instance` and fire its timers.
+SMCP_API_EXTERN smcp_status_t smcp_event_loop_add_instance(smcp_event_loop_t loop, smcp_t instance);
+
+//!	Stops driving `instance`, so that something else may.
+SMCP_API_EXTERN smcp_status_t smcp_event_loop_remove_instance(smcp_event_loop_t loop, smcp_t instance);
+
+//!	Returns the first instance added to the loop, or NULL if there are none.
+SMCP_API_EXTERN smcp_t smcp_event_loop_get_instance(smcp_event_loop_t loop);
+
+//!	Waits up to `cms` milliseconds and handles whatever is ready.
+/*!	A negative `cms` waits until something happens. Instances have
+**	their packets sent and received, their timers fired and their
+**	queued packets flushed before this returns. Returns
+**	SMCP_STATUS_TIMEOUT if nothing happened, and SMCP_STATUS_OK if
+**	the wait was interrupted by a signal. */
+SMCP_API_EXTERN smcp_status_t smcp_event_loop_run_once(smcp_event_loop_t loop, cms_t cms);
+
+/*!	@} */
+/*!	@} */
+
+__END_DECLS
+
+#endif // SMCP_USE_BSD_SOCKETS
+
+#endif // __SMCP_EVENT_LOOP_H__
@@ -88,6 +88,33 @@ coap_size_t smcp_inbound_get_packet_length() {
 	return smcp_get_current_instance()->inbound.packet_len;
 }
 
+#if SMCP_USE_BUFFER_POOL
+smcp_buffer_t
+smcp_inbound_retain_packet() {
+	smcp_t const self = smcp_get_current_instance();
+	smcp_buffer_t buffer = NULL;
+
+	require(self->inbound.packet != NULL, bail);
+
+	if(self->inbound.buffer) {
+		buffer = smcp_buffer_retain(self->inbound.buffer);
+		goto bail;
+	}
+
+	// The packet lives in memory we don't own, so it has to be copied.
+	require(self->inbound.packet_len < SMCP_BUFFER_SIZE, bail);
+
+	buffer = smcp_buffer_alloc(&self->buffer_pool);
+	require(buffer != NULL, bail);
+
+	memcpy(smcp_buffer_get_bytes(buffer), self->inbound.packet, self->inbound.packet_len);
+	smcp_buffer_get_bytes(buffer)[self->inbound.packet_len] = 0;
+
+bail:
+	return buffer;
+}
+#endif
+
 const char*
 smcp_inbound_get_content_ptr() {
 	return smcp_get_current_instance()->inbound.content_ptr;
@@ -185,6 +212,161 @@ smcp_inbound_option_strequal(coap_option_key_t key,const char* cstr) {
 	return cstr[i]==0;
 }
 
+// MARK: -
+// MARK: Option Index
+
+//!	Looks up the option at position `index`.
+/*!	Options which made it into the index are answered directly. Anything
+**	past the end of an overflowed index is found by decoding the packet,
+**	starting just after the last indexed option.
+**
+**	`option_ptr` and `prev_key` describe where the option scanner would
+**	need to be for smcp_inbound_next_option() to return this option. If
+**	there is no such option, they describe the end of the options. */
+static coap_option_key_t
+smcp_inbound_option_at(
+	int index,
+	const uint8_t** option_ptr,
+	coap_option_key_t* prev_key,
+	const uint8_t** value,
+	coap_size_t* len
+) {
+	smcp_t const self = smcp_get_current_instance();
+	const uint8_t* const packet = (const uint8_t*)self->inbound.packet;
+	const uint8_t* const end = packet + self->inbound.packet_len;
+	const uint8_t* iter;
+	coap_option_key_t key = 0;
+	int i = self->inbound.option_count;
+
+	if(index < i) {
+		const struct smcp_inbound_option_s* const entry = &self->inbound.options[index];
+		if(option_ptr)
+			*option_ptr = packet + entry->offset;
+		if(prev_key)
+			*prev_key = index ? entry[-1].key : 0;
+		if(value)
+			*value = packet + entry->value_offset;
+		if(len)
+			*len = entry->value_len;
+		return entry->key;
+	}
+
+	if(i) {
+		const struct smcp_inbound_option_s* const entry = &self->inbound.options[i - 1];
+		iter = packet + entry->value_offset + entry->value_len;
+		key = entry->key;
+	} else {
+		iter = self->inbound.packet->token + self->inbound.packet->token_len;
+	}
+
+	if(self->inbound.options_overflowed) {
+		for(;(iter < end) && (iter[0] != 0xFF);i++) {
+			coap_option_key_t next_key = key;
+			const uint8_t* next_value;
+			coap_size_t next_len;
+			const uint8_t* next = coap_decode_option(iter, &next_key, &next_value, &next_len);
+
+			if(i == index) {
+				if(option_ptr)
+					*option_ptr = iter;
+				if(prev_key)
+					*prev_key = key;
+				if(value)
+					*value = next_value;
+				if(len)
+					*len = next_len;
+				return next_key;
+			}
+
+			iter = next;
+			key = next_key;
+		}
+	}
+
+	if(option_ptr)
+		*option_ptr = iter;
+	if(prev_key)
+		*prev_key = key;
+	return COAP_OPTION_INVALID;
+}
+
+//!	Finds the position of the `n`th option with the given key.
+/*!	If there is no such option, returns the position where it would be
+**	and sets `found` to false. */
+static int
+smcp_inbound_find_option(coap_option_key_t key, int n, bool* found)
+{
+	coap_option_key_t iter_key;
+	int i;
+
+	for(i = 0; (iter_key = smcp_inbound_option_at(i, NULL, NULL, NULL, NULL)) != COAP_OPTION_INVALID; i++) {
+		if(iter_key > key)
+			break;
+		if((iter_key == key) && (n-- == 0)) {
+			*found = true;
+			return i;
+		}
+	}
+
+	*found = false;
+	return i;
+}
+
+coap_option_key_t
+smcp_inbound_get_option_at(int index, const uint8_t** value, coap_size_t* len)
+{
+	if(index < 0)
+		return COAP_OPTION_INVALID;
+	return smcp_inbound_option_at(index, NULL, NULL, value, len);
+}
+
+int
+smcp_inbound_get_option_count(coap_option_key_t key)
+{
+	coap_option_key_t iter_key;
+	int ret = 0;
+	int i;
+
+	for(i = 0; (iter_key = smcp_inbound_option_at(i, NULL, NULL, NULL, NULL)) != COAP_OPTION_INVALID; i++) {
+		if(iter_key > key)
+			break;
+		if(iter_key == key)
+			ret++;
+	}
+
+	return ret;
+}
+
+bool
+smcp_inbound_get_nth_option(coap_option_key_t key, int n, const uint8_t** value, coap_size_t* len)
+{
+	bool found;
+	int index = smcp_inbound_find_option(key, n, &found);
+
+	if(found)
+		smcp_inbound_option_at(index, NULL, NULL, value, len);
+
+	return found;
+}
+
+bool
+smcp_inbound_seek_option(coap_option_key_t key, int n)
+{
+	smcp_t const self = smcp_get_current_instance();
+	bool found;
+	int index = smcp_inbound_find_option(key, n, &found);
+
+	smcp_inbound_option_at(
+		index,
+		&self->inbound.this_option,
+		&self->inbound.last_option_key,
+		NULL,
+		NULL
+	);
+
+	return found;
+}
+
 // MARK: -
 // MARK: Nontrivial inbound getters
 
@@ -208,13 +390,11 @@ smcp_inbound_get_path(char* where, uint8_t flags)
 {
 	smcp_t const self = smcp_get_current_instance();
 
-	coap_option_key_t		last_option_key = self->inbound.last_option_key;
-	const uint8_t*			this_option = self->inbound.this_option;
-
 	char* filename;
 	coap_size_t filename_len;
-	coap_option_key_t key;
 	char* iter;
+	bool found;
+	int i;
 
 	if(!where)
 		where = calloc(1,SMCP_MAX_URI_LENGTH+1);
@@ -224,17 +404,16 @@ smcp_inbound_get_path(char* where, uint8_t flags)
 
 	iter = where;
 
-	if(!(flags&SMCP_GET_PATH_REMAINING))
-		smcp_inbound_reset_next_option();
+	i = smcp_inbound_find_option(COAP_OPTION_URI_PATH, 0, &found);
 
-	while((key = smcp_inbound_peek_option(NULL,NULL))!=COAP_OPTION_URI_PATH
-		&& key!=COAP_OPTION_INVALID
-	) {
-		smcp_inbound_next_option(NULL,NULL);
-	}
+	while(smcp_inbound_option_at(i++, NULL, NULL, (const uint8_t**)&filename, &filename_len)==COAP_OPTION_URI_PATH) {
+		char old_end;
 
-	while(smcp_inbound_next_option((const uint8_t**)&filename, &filename_len)==COAP_OPTION_URI_PATH) {
-		char old_end = filename[filename_len];
+		// Skip the segments that the option scanner has already passed.
+		if((flags&SMCP_GET_PATH_REMAINING) && ((const uint8_t*)filename < self->inbound.this_option))
+			continue;
+
+		old_end = filename[filename_len];
 		if(iter!=where || (flags&SMCP_GET_PATH_LEADING_SLASH))
 			*iter++='/';
 		filename[filename_len] = 0;
@@ -243,15 +422,10 @@ smcp_inbound_get_path(char* where, uint8_t flags)
 	}
 
 	if(flags&SMCP_GET_PATH_INCLUDE_QUERY) {
-		smcp_inbound_reset_next_option();
-		while((key = smcp_inbound_peek_option((const uint8_t**)&filename, &filename_len))!=COAP_OPTION_URI_QUERY
-			&& key!=COAP_OPTION_INVALID
-		) {
-			smcp_inbound_next_option(NULL,NULL);
-		}
-		if(key==COAP_OPTION_URI_QUERY) {
+		i = smcp_inbound_find_option(COAP_OPTION_URI_QUERY, 0, &found);
+		if(found) {
 			*iter++='?';
-			while(smcp_inbound_next_option((const uint8_t**)&filename, &filename_len)==COAP_OPTION_URI_QUERY) {
+			while(smcp_inbound_option_at(i++, NULL, NULL, (const uint8_t**)&filename, &filename_len)==COAP_OPTION_URI_QUERY) {
 				char old_end = filename[filename_len];
 				char* equal_sign;
 
@@ -278,8 +452,6 @@ smcp_inbound_get_path(char* where, uint8_t flags)
 
 	*iter = 0;
 
-	self->inbound.last_option_key = last_option_key;
-	self->inbound.this_option = this_option;
 	return where;
 }
 
@@ -402,15 +574,44 @@ smcp_inbound_finish_packet() {
 		self->inbound.is_dupe = smcp_inbound_dupe_check();
 	}
 
+	if (self->inbound.is_dupe
+		&& COAP_CODE_IS_REQUEST(packet->code)
+		&& (packet->tt == COAP_TRANS_TYPE_CONFIRMABLE)
+	) {
+		// If we still remember what we said the first time,
+		// say it again without bothering the request handler.
+		if (smcp_inbound_dupe_replay() == SMCP_STATUS_OK) {
+			ret = SMCP_STATUS_OK;
+			goto bail;
+		}
+	}
+
 	{	// Initial scan thru all of the options.
 		const uint8_t* value;
 		coap_size_t value_len;
 		coap_option_key_t key;
 
+		const uint8_t* option_ptr;
+
 		// Reset option scanner for initial option scan.
 		smcp_inbound_reset_next_option();
 
+		option_ptr = self->inbound.this_option;
+
 		while((key = smcp_inbound_next_option(&value,&value_len)) != COAP_OPTION_INVALID) {
+			// Remember where each option is, so nobody needs to scan
+			// the packet again to find one.
+			if(self->inbound.option_count < SMCP_CONF_MAX_INBOUND_OPTIONS) {
+				struct smcp_inbound_option_s* const entry = &self->inbound.options[self->inbound.option_count++];
+				entry->key = key;
+				entry->offset = (coap_size_t)(option_ptr - (const uint8_t*)packet);
+				entry->value_offset = (coap_size_t)(value - (const uint8_t*)packet);
+				entry->value_len = value_len;
+			} else {
+				self->inbound.options_overflowed = true;
+			}
+			option_ptr = self->inbound.this_option;
+
 			switch(key) {
 			case COAP_OPTION_CONTENT_TYPE:
 				self->inbound.content_type = (coap_content_type_t)coap_decode_uint32(value,(uint8_t)value_len);
@@ -83,6 +83,21 @@ SMCP_INTERNAL_EXTERN void smcp_set_current_instance(smcp_t x);
 #endif
 
 #include "smcp-dupe.h"
+#include "smcp-slab.h"
+
+#if SMCP_TRANSACTIONS_USE_HASH
+//!	Open-addressing hash table of transactions.
+struct smcp_transaction_index_s {
+	struct smcp_transaction_index_slot_s {
+		uint32_t				hash;
+		smcp_transaction_t		transaction;
+	}*						slots;
+	uint32_t				capacity;	//!< Always zero or a power of two.
+	uint32_t				used;		//!< Live entries plus tombstones.
+	uint32_t				count;		//!< Live entries.
+	bool					overflowed;	//!< Set if an allocation failed.
+};
+#endif
 
 #if SMCP_CONF_ENABLE_VHOSTS
 struct smcp_vhost_s {
@@ -100,21 +115,62 @@ struct smcp_s {
 #if SMCP_USE_BSD_SOCKETS
 	int						fd;
 	int						mcfd;	// For multicast
+	uint16_t				port;	// Host byte order, looked up once at bind time.
+	struct smcp_plat_bsd_recv_s	recv;
+	struct smcp_plat_bsd_send_s	send;
+	struct smcp_plat_stats_s	plat_stats;
+	struct smcp_plat_bsd_dns_s	dns;
 #elif SMCP_USE_UIP
 	struct uip_udp_conn*	udp_conn;
 #endif
 
+#if SMCP_TIMERS_USE_HEAP
+	smcp_timer_t*			timer_heap;
+	uint32_t				timer_count;
+	uint32_t				timer_capacity;
+#else
 	smcp_timer_t			timers;
+#endif
 
 	smcp_transaction_t		transactions;
 	smcp_transaction_t		current_transaction;
 
+#if SMCP_TRANSACTIONS_USE_HASH
+	struct smcp_transaction_index_s	transactions_by_msg_id;
+	struct smcp_transaction_index_s	transactions_by_token;
+#endif
+
+#if SMCP_USE_SLAB_ALLOCATOR
+	smcp_slab_t				transaction_slab;
+	smcp_slab_t				node_slab;
+#endif
+
+#if SMCP_USE_BUFFER_POOL
+	smcp_buffer_pool_t		buffer_pool;
+#endif
+
+#if SMCP_OBSERVABLE_USE_REGISTRY
+	struct smcp_observer_registry_s* observer_registry;
+#endif
+
+#if SMCP_CONF_NODE_ROUTER && SMCP_CONF_NODE_ROUTE_CACHE_SIZE
+	struct smcp_node_route_cache_s {
+		struct smcp_node_s*		node;		//!< NULL if unused.
+		uint32_t				hash;		//!< Hash of the root and the path.
+		uint32_t				generation;	//!< Node tree generation when cached.
+		uint8_t					depth;		//!< Path segments consumed by the route.
+	} route_cache[SMCP_CONF_NODE_ROUTE_CACHE_SIZE];
+#endif
+
 	// Operational Flags
 	uint8_t					is_responding:1,
 							did_respond:1,
 							is_processing_message:1,
 							has_cascade_count:1,
-							force_current_outbound_code:1;
+							force_current_outbound_code:1,
+							has_current_time:1;
+
+	smcp_timestamp_t		current_time;
 
 	coap_msg_id_t			last_msg_id;
 
@@ -122,6 +178,9 @@ struct smcp_s {
 	struct {
 		const struct coap_header_s*	packet;
 		coap_size_t					packet_len;
+#if SMCP_USE_BUFFER_POOL
+		smcp_buffer_t				buffer;		//!< Holds `packet`, if it came from the pool.
+#endif
 
 		coap_option_key_t		last_option_key;
 		const uint8_t*			this_option;
@@ -141,6 +200,15 @@ struct smcp_s {
 		uint32_t				observe_value;
 		uint32_t				block2_value;
 
+		//! Index of the options, built by the initial scan.
+		struct smcp_inbound_option_s {
+			coap_option_key_t	key;
+			coap_size_t			offset;			//!< Of the option header.
+			coap_size_t			value_offset;
+			coap_size_t			value_len;
+		}						options[SMCP_CONF_MAX_INBOUND_OPTIONS];
+		uint8_t					option_count;
+		bool					options_overflowed;
 
 		smcp_sockaddr_t			saddr;
 
@@ -170,6 +238,20 @@ struct smcp_s {
 
 		coap_option_key_t		last_option_key;
 
+		//! Options waiting to be sorted and encoded into the packet.
+		/*! The values are kept at the very end of the packet buffer,
+		**	out of the way until smcp_outbound_get_content_ptr() or
+		**	smcp_outbound_send() encodes them all in one pass. */
+		struct smcp_outbound_option_s {
+			coap_option_key_t	key;
+			coap_size_t			value_offset;
+			coap_size_t			value_len;
+		}						options[SMCP_CONF_MAX_OUTBOUND_OPTIONS];
+		uint8_t					option_count;
+		coap_size_t				option_bytes;
+		uint8_t					options_encoded:1,
+								auto_options_added:1;
+
 #if SMCP_DTLS
 		bool					use_dtls;
 #endif
@@ -202,8 +284,44 @@ struct smcp_s {
 
 SMCP_INTERNAL_EXTERN smcp_status_t smcp_handle_request();
 
+//!	Cancels and invalidates every pending timer, freeing any timer storage.
+SMCP_INTERNAL_EXTERN void smcp_release_timers(smcp_t self);
+
+//!	Ends every pending transaction, freeing any transaction index storage.
+SMCP_INTERNAL_EXTERN void smcp_release_transactions(smcp_t self);
+
+#if SMCP_OBSERVABLE_USE_REGISTRY
+//!	Drops every observer, freeing the observer registry.
+SMCP_INTERNAL_EXTERN void smcp_release_observers(smcp_t self);
+
+//!	Returns the descriptor that becomes readable when another thread
+//!	triggers one of our observables, or -1 if there isn't one (yet).
+SMCP_INTERNAL_EXTERN int smcp_get_observers_fd(smcp_t self);
+
+//!	Sends the notifications that other threads have triggered for us.
+SMCP_INTERNAL_EXTERN void smcp_process_observers(smcp_t self);
+#endif
+
+//!	Finds the transaction with the given token that was sent to `saddr`.
+/*!	Multicast transactions match responses from any address. */
+SMCP_INTERNAL_EXTERN smcp_transaction_t smcp_transaction_find_via_token_and_saddr(
+	smcp_t self,
+	coap_msg_id_t token,
+	const smcp_sockaddr_t* saddr
+);
+
+//!	Updates the remote address of a transaction, keeping any index current.
+SMCP_INTERNAL_EXTERN void smcp_transaction_set_saddr(
+	smcp_t self,
+	smcp_transaction_t handler,
+	const smcp_sockaddr_t* saddr
+);
+
 SMCP_INTERNAL_EXTERN smcp_status_t smcp_handle_response();
 
+//!	Retries every transaction that is waiting on a hostname lookup.
+SMCP_INTERNAL_EXTERN void smcp_transaction_wake_dns_waiters(smcp_t self);
+
 SMCP_INTERNAL_EXTERN smcp_status_t smcp_outbound_set_var_content_int(int v);
 SMCP_INTERNAL_EXTERN smcp_status_t smcp_outbound_set_var_content_unsigned_int(unsigned int v);
 SMCP_INTERNAL_EXTERN smcp_status_t smcp_outbound_set_var_content_unsigned_long_int(unsigned long int v);
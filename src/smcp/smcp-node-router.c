@@ -81,37 +81,78 @@ smcp_node_router_handler(void* context) {
 	return (*handler)(context);
 }
 
+//!	Bumped whenever any node tree changes, which invalidates cached routes.
+static uint32_t smcp_node_generation;
+
+#if SMCP_CONF_NODE_ROUTE_CACHE_SIZE
+//!	Checks that a cached route really is the route for this path.
+/*!	Guards against hash collisions: the names of the nodes on the way
+**	down must match the path, and the next path segment (if any) must
+**	not match a child. */
+static bool
+smcp_node_route_verify(
+	smcp_node_t root,
+	smcp_node_t node,
+	uint8_t depth,
+	uint8_t segment_count,
+	const uint8_t* const segment_value[],
+	const coap_size_t segment_len[]
+) {
+	smcp_node_t iter = node;
+	int i;
+
+	for(i = depth; i-- > 0;) {
+		if(!iter
+			|| !iter->name
+			|| (iter->name_len != segment_len[i])
+			|| (0 != memcmp(iter->name, segment_value[i], segment_len[i]))
+		) {
+			return false;
+		}
+		iter = iter->parent;
+	}
+
+	if(iter != root)
+		return false;
+
+	if((depth < segment_count)
+		&& smcp_node_find(node, (const char*)segment_value[depth], (int)segment_len[depth])
+	) {
+		return false;
+	}
+
+	return true;
+}
+#endif
+
 smcp_status_t
 smcp_node_route(smcp_node_t node, smcp_request_handler_func* func, void** context) {
 	smcp_status_t ret = 0;
-	smcp_t const self = smcp_get_current_instance();
-
-	smcp_inbound_reset_next_option();
+	smcp_node_t const root = node;
+	const uint8_t* segment_value[SMCP_CONF_NODE_ROUTE_MAX_DEPTH];
+	coap_size_t segment_len[SMCP_CONF_NODE_ROUTE_MAX_DEPTH];
+	uint8_t segment_count = 0;
+	int depth = 0;
+	bool too_deep = false;
 
 	{
-		// TODO: Rewrite this to be more efficient.
-		const uint8_t* prev_option_ptr = self->inbound.this_option;
-		coap_option_key_t prev_key = 0;
+		// Check everything up to the end of the path using the
+		// option index, rather than rescanning the packet.
 		coap_option_key_t key;
 		const uint8_t* value;
 		coap_size_t value_len;
-		while((key=smcp_inbound_next_option(&value, &value_len))!=COAP_OPTION_INVALID) {
+		int i;
+
+		for(i = 0; (key=smcp_inbound_get_option_at(i, &value, &value_len))!=COAP_OPTION_INVALID; i++) {
 			if(key>COAP_OPTION_URI_PATH) {
-				self->inbound.this_option = prev_option_ptr;
-				self->inbound.last_option_key = prev_key;
 				break;
 			} else if(key==COAP_OPTION_URI_PATH) {
-				smcp_node_t next = smcp_node_find(
-					node,
-					(const char*)value,
-					(int)value_len
-				);
-				if(next) {
-					node = next;
+				if(segment_count < SMCP_CONF_NODE_ROUTE_MAX_DEPTH) {
+					segment_value[segment_count] = value;
+					segment_len[segment_count] = value_len;
+					segment_count++;
 				} else {
-					self->inbound.this_option = prev_option_ptr;
-					self->inbound.last_option_key = prev_key;
-					break;
+					too_deep = true;
 				}
 			} else if(key==COAP_OPTION_URI_HOST) {
 				// Skip host at the moment,
@@ -123,6 +164,8 @@ smcp_node_route(smcp_node_t node, smcp_request_handler_func* func, void** contex
 				// Skip the proxy URI for now.
 			} else if(key==COAP_OPTION_CONTENT_TYPE) {
 				// Skip.
+			} else if(key==COAP_OPTION_IF_MATCH || key==COAP_OPTION_IF_NONE_MATCH) {
+				// Left for the node to check.
 			} else {
 				if(COAP_OPTION_IS_CRITICAL(key)) {
 					ret=SMCP_STATUS_BAD_OPTION;
@@ -133,11 +176,73 @@ smcp_node_route(smcp_node_t node, smcp_request_handler_func* func, void** contex
 					goto bail;
 				}
 			}
-			prev_option_ptr = self->inbound.this_option;
-			prev_key = self->inbound.last_option_key;
 		}
 	}
 
+	if(too_deep) {
+		// Too deep to cache, so just descend one segment at a time.
+		const uint8_t* value;
+		coap_size_t value_len;
+
+		while(smcp_inbound_get_path_segment(depth, &value, &value_len)) {
+			smcp_node_t next = smcp_node_find(node, (const char*)value, (int)value_len);
+			if(!next)
+				break;
+			node = next;
+			depth++;
+		}
+	} else {
+#if SMCP_CONF_NODE_ROUTE_CACHE_SIZE
+		smcp_t const self = smcp_get_current_instance();
+		struct smcp_node_route_cache_s* entry;
+		struct fasthash_state_s hash_state;
+		uint32_t hash;
+		int i;
+
+		fasthash_start(&hash_state, (fasthash_hash_t)(uintptr_t)root);
+		for(i = 0; i < segment_count; i++) {
+			fasthash_feed_byte(&hash_state, (uint8_t)segment_len[i]);
+			fasthash_feed_byte(&hash_state, (uint8_t)(segment_len[i] >> 8));
+			fasthash_feed(&hash_state, segment_value[i], segment_len[i]);
+		}
+		hash = fasthash_finish_uint32(&hash_state);
+
+		entry = &self->route_cache[hash & (SMCP_CONF_NODE_ROUTE_CACHE_SIZE - 1)];
+
+		if(entry->node
+			&& (entry->hash == hash)
+			&& (entry->generation == smcp_node_generation)
+			&& smcp_node_route_verify(root, entry->node, entry->depth, segment_count, segment_value, segment_len)
+		) {
+			node = entry->node;
+			depth = entry->depth;
+		} else
+#endif
+		{
+			while(depth < segment_count) {
+				smcp_node_t next = smcp_node_find(
+					node,
+					(const char*)segment_value[depth],
+					(int)segment_len[depth]
+				);
+				if(!next)
+					break;
+				node = next;
+				depth++;
+			}
+
+#if SMCP_CONF_NODE_ROUTE_CACHE_SIZE
+			entry->node = node;
+			entry->hash = hash;
+			entry->generation = smcp_node_generation;
+			entry->depth = (uint8_t)depth;
+#endif
+		}
+	}
+
+	// Leave the scanner on the first path segment we didn't consume.
+	smcp_inbound_seek_option(COAP_OPTION_URI_PATH, depth);
+
 	*func = (void*)node->request_handler;
 	if(node->context)
 		*context = node->context;
@@ -155,6 +260,8 @@ void
 smcp_node_dealloc(smcp_node_t x) {
 #if SMCP_AVOID_MALLOC
 	x->finalize = NULL;
+#elif SMCP_USE_SLAB_ALLOCATOR
+	smcp_slab_free(x);
 #else
 	free(x);
 #endif
@@ -173,6 +280,12 @@ smcp_node_alloc() {
 		}
 		break;
 	}
+#elif SMCP_USE_SLAB_ALLOCATOR
+	smcp_t const self = smcp_get_current_instance();
+	ret = (smcp_node_t)smcp_slab_alloc(
+		self ? &self->node_slab : NULL,
+		sizeof(struct smcp_node_s)
+	);
 #else
 	ret = (smcp_node_t)calloc(sizeof(struct smcp_node_s), 1);
 #endif
@@ -215,7 +328,7 @@ smcp_node_ncompare_cstr(
 	ret = (bt_compare_result_t)strncmp(lhs->name, rhs, len);
 
 	if(ret == 0) {
-		int lhs_len = (int)strlen(lhs->name);
+		const intptr_t lhs_len = lhs->name_len;
 		if(lhs_len > len)
 			ret = 1;
 		else if(lhs_len < len)
@@ -240,6 +353,8 @@ smcp_node_init(
 	if(node) {
 		require(name, bail);
 		ret->name = name;
+		ret->name_len = (uint16_t)strlen(name);
+		smcp_node_generation++;
 #if SMCP_NODE_ROUTER_USE_BTREE
 		bt_insert(
 			(void**)&((smcp_node_t)node)->children,
@@ -269,6 +384,8 @@ smcp_node_delete(smcp_node_t node) {
 
 	DEBUG_PRINTF("%s: %p",__func__,node);
 
+	smcp_node_generation++;
+
 	if(node->parent)
 		owner = (void**)&((smcp_node_t)node->parent)->children;
 
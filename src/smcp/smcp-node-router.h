@@ -113,6 +113,7 @@ struct smcp_node_s {
 	struct ll_item_s			ll_item;
 #endif
 	const char*					name;
+	uint16_t					name_len;
 	smcp_node_t					parent;
 	smcp_node_t					children;
 
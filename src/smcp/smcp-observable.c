@@ -26,16 +26,621 @@
 **	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include "assert-macros.h"
 #include "smcp-logging.h"
 #include "smcp-observable.h"
 #include "smcp-internal.h"
 #include "smcp-transaction.h"
 
-#define INVALID_OBSERVER_INDEX		(SMCP_MAX_OBSERVERS)
-
 #define SHOULD_CONFIRM_EVENT_FOR_OBSERVER(obs)		(!((obs)->seq&0x7))
 
+#define SMCP_OBSERVABLE_USE_THREADS	(SMCP_OBSERVABLE_USE_REGISTRY && SMCP_USE_BSD_SOCKETS && SMCP_MULTITHREAD && HAVE_PTHREAD)
+
+#if SMCP_OBSERVABLE_USE_THREADS
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if SMCP_OBSERVABLE_USE_REGISTRY
+
+// MARK: -
+// MARK: Observer Registry
+
+/*	Each smcp instance keeps its observers in a registry of its own.
+**
+**	Observers are hashed by observable, key, remote address and token,
+**	so that a (re)registration can be matched in constant time. They are
+**	also grouped by observable and key, and the groups are hashed by
+**	observable alone, so that triggering a key only visits the observers
+**	of that key (plus those of the broadcast key), and triggering the
+**	broadcast key only visits the groups of that observable.
+**
+**	Finally, observers are kept in the order that they last registered,
+**	which is used to evict the stalest observer when the registry is full.
+**
+**	A dropped observer can't be freed right away, because we may be in
+**	the middle of a callback from its transaction. Instead, it is moved
+**	onto a list of dropped observers which is swept the next time the
+**	registry is used from outside of such a callback.
+**
+**	When SMCP_OBSERVABLE_CACHE_NOTIFICATIONS is set, each group also
+**	remembers the encoded options and content of the last notification
+**	it sent. Since a trigger means that the representation of the key
+**	has changed, the cache is invalidated by bumping the generation of
+**	the group, and the next observer to be notified renders it again.
+**	Everyone else gets a copy, so the handler runs once per trigger
+**	instead of once per observer. This assumes that the observable key
+**	identifies a single representation: observers whose requests differ
+**	(in an Accept option, for example) are still rendered individually.
+**
+**	An observable may have observers in the registries of several
+**	instances (the instances of a worker pool, for example), so every
+**	registry is also kept on a process-wide list, and a trigger visits
+**	each registry that has a group for the observable. A registry may
+**	only be used by the thread that drives its instance, so triggers
+**	for registries owned by other threads are queued on the registry,
+**	and its wake descriptor is written to. The owning thread picks them
+**	up in smcp_process(). Groups are only added, removed or counted
+**	with the list lock held, so that other threads may look at them.
+*/
+
+#define SMCP_OBSERVER_REGISTRY_MIN_BUCKETS		(64)
+#define SMCP_OBSERVER_GROUP_MIN_BUCKETS			(16)
+
+//!	Registries beyond this many per thread get their triggers queued.
+#define SMCP_OBSERVER_LOCAL_TRIGGER_MAX			(8)
+
+struct smcp_observer_group_s {
+	struct smcp_observer_group_s* next_in_bucket;
+	smcp_observable_t observable;
+	struct smcp_observer_s* first_observer;
+	uint32_t hash;
+	uint32_t count;
+	uint8_t key;
+
+#if SMCP_OBSERVABLE_CACHE_NOTIFICATIONS
+	uint32_t generation;
+	uint32_t cache_generation;
+	uint32_t cache_request_hash;
+	coap_code_t cache_code;
+	coap_option_key_t cache_observe_prev_key;
+	coap_option_key_t cache_last_option_key;
+	coap_size_t cache_prefix_len;	// Options before Observe
+	coap_size_t cache_suffix_len;	// Options after Observe
+	coap_size_t cache_content_len;
+	uint8_t* cache;
+#endif
+};
+
+struct smcp_observer_s {
+	/**** All of this is private. Don't touch. ****/
+
+	struct smcp_observer_registry_s* registry;
+	struct smcp_observer_group_s* group;	// NULL once dropped
+	struct smcp_observer_s* next_in_bucket;	// Also used for dropped list
+	struct smcp_observer_s* prev_in_group;
+	struct smcp_observer_s* next_in_group;
+	struct smcp_observer_s* older;
+	struct smcp_observer_s* newer;
+	uint32_t hash;
+	uint32_t seq;
+	struct smcp_async_response_s async_response;
+	struct smcp_transaction_s transaction;
+};
+
+struct smcp_observer_trigger_s {
+	smcp_observable_t observable;
+	uint8_t key;
+};
+
+struct smcp_observer_registry_s {
+	smcp_t interface;
+	struct smcp_observer_registry_s* next;	// On observer_registries
+
+#if SMCP_OBSERVABLE_USE_THREADS
+	pthread_t owner;
+	int wake_fd[2];	// Read end, write end. -1 if we couldn't get a pipe.
+	struct smcp_observer_trigger_s* pending;
+	uint32_t pending_count;
+	uint32_t pending_size;
+#endif
+
+	struct smcp_observer_s** buckets;
+	uint32_t bucket_count;
+	uint32_t count;
+
+	struct smcp_observer_group_s** group_buckets;
+	uint32_t group_bucket_count;
+	uint32_t group_count;
+
+	struct smcp_observer_s* oldest;
+	struct smcp_observer_s* newest;
+	struct smcp_observer_s* dropped;
+
+	size_t bytes_used;
+	smcp_slab_t slab;
+};
+
+static struct smcp_observer_registry_s* observer_registries;
+
+#if SMCP_OBSERVABLE_USE_THREADS
+static pthread_mutex_t observer_registries_lock = PTHREAD_MUTEX_INITIALIZER;
+#define observer_registries_lock_acquire()	pthread_mutex_lock(&observer_registries_lock)
+#define observer_registries_lock_release()	pthread_mutex_unlock(&observer_registries_lock)
+#else
+#define observer_registries_lock_acquire()	do { } while(0)
+#define observer_registries_lock_release()	do { } while(0)
+#endif
+
+static uint32_t
+observer_hash_observable(smcp_observable_t observable) {
+	struct fasthash_state_s state;
+	fasthash_start(&state, 0);
+	fasthash_feed(&state, (const uint8_t*)&observable, sizeof(observable));
+	return fasthash_finish_uint32(&state);
+}
+
+static uint32_t
+observer_hash(
+	smcp_observable_t observable,
+	uint8_t key,
+	const smcp_sockaddr_t* saddr,
+	const uint8_t* token,
+	uint8_t token_len
+) {
+	struct fasthash_state_s state;
+	fasthash_start(&state, key);
+	fasthash_feed(&state, (const uint8_t*)&observable, sizeof(observable));
+	fasthash_feed(&state, (const uint8_t*)&saddr->smcp_addr, sizeof(saddr->smcp_addr));
+	fasthash_feed(&state, (const uint8_t*)&saddr->smcp_port, sizeof(saddr->smcp_port));
+	fasthash_feed(&state, token, token_len);
+	return fasthash_finish_uint32(&state);
+}
+
+static struct smcp_observer_registry_s*
+observer_registry_get(smcp_t interface, bool create) {
+	struct smcp_observer_registry_s* registry = interface->observer_registry;
+
+	if(!registry && create) {
+		registry = calloc(1, sizeof(*registry));
+		if(registry) {
+			registry->interface = interface;
+#if SMCP_OBSERVABLE_USE_THREADS
+			registry->owner = pthread_self();
+			if(0 == pipe(registry->wake_fd)) {
+				fcntl(registry->wake_fd[0], F_SETFL, fcntl(registry->wake_fd[0], F_GETFL) | O_NONBLOCK);
+				fcntl(registry->wake_fd[1], F_SETFL, fcntl(registry->wake_fd[1], F_GETFL) | O_NONBLOCK);
+				fcntl(registry->wake_fd[0], F_SETFD, FD_CLOEXEC);
+				fcntl(registry->wake_fd[1], F_SETFD, FD_CLOEXEC);
+			} else {
+				registry->wake_fd[0] = registry->wake_fd[1] = -1;
+			}
+#endif
+			interface->observer_registry = registry;
+
+			observer_registries_lock_acquire();
+			registry->next = observer_registries;
+			observer_registries = registry;
+			observer_registries_lock_release();
+		}
+	}
+
+	return registry;
+}
+
+//!	Doubles the size of a bucket array. `next_offset` locates the chain link.
+static bool
+observer_registry_grow(
+	void*** buckets_ptr,
+	uint32_t* bucket_count_ptr,
+	uint32_t min_bucket_count,
+	size_t next_offset,
+	size_t hash_offset
+) {
+	void** const old_buckets = *buckets_ptr;
+	const uint32_t old_count = *bucket_count_ptr;
+	const uint32_t bucket_count = old_count ? old_count * 2 : min_bucket_count;
+	void** buckets = calloc(bucket_count, sizeof(*buckets));
+	uint32_t i;
+
+	if(!buckets)
+		return false;
+
+	for(i = 0; i < old_count; i++) {
+		while(old_buckets[i]) {
+			uint8_t* const item = old_buckets[i];
+			void** const next = (void**)(item + next_offset);
+			const uint32_t hash = *(const uint32_t*)(item + hash_offset);
+
+			old_buckets[i] = *next;
+			*next = buckets[hash & (bucket_count - 1)];
+			buckets[hash & (bucket_count - 1)] = item;
+		}
+	}
+
+	free(old_buckets);
+	*buckets_ptr = buckets;
+	*bucket_count_ptr = bucket_count;
+
+	return true;
+}
+
+static struct smcp_observer_group_s*
+observer_group_find(
+	struct smcp_observer_registry_s* registry,
+	smcp_observable_t observable,
+	uint8_t key,
+	bool create
+) {
+	const uint32_t hash = observer_hash_observable(observable);
+	struct smcp_observer_group_s* group = NULL;
+
+	if(registry->group_bucket_count) {
+		group = registry->group_buckets[hash & (registry->group_bucket_count - 1)];
+
+		for(; group; group = group->next_in_bucket) {
+			if(group->observable == observable && group->key == key)
+				break;
+		}
+	}
+
+	if(!group && create) {
+		if(registry->group_count >= registry->group_bucket_count) {
+			observer_registry_grow(
+				(void***)&registry->group_buckets,
+				&registry->group_bucket_count,
+				SMCP_OBSERVER_GROUP_MIN_BUCKETS,
+				offsetof(struct smcp_observer_group_s, next_in_bucket),
+				offsetof(struct smcp_observer_group_s, hash)
+			);
+			require(registry->group_bucket_count, bail);
+		}
+
+		group = calloc(1, sizeof(*group));
+		require(group, bail);
+
+		group->observable = observable;
+		group->key = key;
+		group->hash = hash;
+		group->next_in_bucket = registry->group_buckets[hash & (registry->group_bucket_count - 1)];
+		registry->group_buckets[hash & (registry->group_bucket_count - 1)] = group;
+		registry->group_count++;
+	}
+
+bail:
+	return group;
+}
+
+static void
+observer_group_remove(
+	struct smcp_observer_registry_s* registry,
+	struct smcp_observer_group_s* group
+) {
+	struct smcp_observer_group_s** link = &registry->group_buckets[group->hash & (registry->group_bucket_count - 1)];
+
+	while(*link != group)
+		link = &(*link)->next_in_bucket;
+
+	*link = group->next_in_bucket;
+	registry->group_count--;
+#if SMCP_OBSERVABLE_CACHE_NOTIFICATIONS
+	if(group->cache) {
+		registry->bytes_used -= group->cache_prefix_len + group->cache_suffix_len + group->cache_content_len;
+		free(group->cache);
+	}
+#endif
+	free(group);
+}
+
+static struct smcp_observer_s*
+observer_find(
+	struct smcp_observer_registry_s* registry,
+	uint32_t hash,
+	smcp_observable_t observable,
+	uint8_t key,
+	const smcp_sockaddr_t* saddr,
+	const uint8_t* token,
+	uint8_t token_len
+) {
+	struct smcp_observer_s* observer = NULL;
+
+	if(registry->bucket_count) {
+		observer = registry->buckets[hash & (registry->bucket_count - 1)];
+
+		for(; observer; observer = observer->next_in_bucket) {
+			const struct coap_header_s* const request = smcp_async_response_get_request(&observer->async_response);
+
+			if((observer->hash == hash)
+				&& (request != NULL)
+				&& (observer->group->observable == observable)
+				&& (observer->group->key == key)
+				&& (0 == memcmp(&observer->async_response.remote_saddr.smcp_addr, &saddr->smcp_addr, sizeof(saddr->smcp_addr)))
+				&& (observer->async_response.remote_saddr.smcp_port == saddr->smcp_port)
+				&& (request->token_len == token_len)
+				&& (0 == memcmp(request->token, token, token_len))
+			) {
+				break;
+			}
+		}
+	}
+
+	return observer;
+}
+
+static void
+observer_touch(struct smcp_observer_registry_s* registry, struct smcp_observer_s* observer) {
+	if(registry->newest == observer)
+		return;
+
+	// Unlink...
+	if(observer->older)
+		observer->older->newer = observer->newer;
+	else
+		registry->oldest = observer->newer;
+	observer->newer->older = observer->older;
+
+	// ...and move to the end.
+	observer->older = registry->newest;
+	observer->newer = NULL;
+	registry->newest->newer = observer;
+	registry->newest = observer;
+}
+
+//!	Frees dropped observers. Must not be called from an observer callback.
+static void
+observer_registry_sweep(struct smcp_observer_registry_s* registry) {
+	struct smcp_observer_s** link = &registry->dropped;
+
+	while(*link) {
+		struct smcp_observer_s* const observer = *link;
+
+		if(observer->transaction.active) {
+			link = &observer->next_in_bucket;
+			continue;
+		}
+
+		*link = observer->next_in_bucket;
+		registry->bytes_used -= sizeof(*observer);
+		smcp_slab_free(observer);
+	}
+}
+
+static void
+free_observer(struct smcp_observer_s *observer) {
+	struct smcp_observer_registry_s* const registry = observer->registry;
+	struct smcp_observer_group_s* const group = observer->group;
+	struct smcp_observer_s** link;
+
+	if(!group)
+		goto bail;
+
+	observer_registries_lock_acquire();
+
+	observer->group = NULL;
+
+	// Remove from the hash table.
+	link = &registry->buckets[observer->hash & (registry->bucket_count - 1)];
+	while(*link != observer)
+		link = &(*link)->next_in_bucket;
+	*link = observer->next_in_bucket;
+	registry->count--;
+
+	// Remove from the group.
+	if(observer->prev_in_group)
+		observer->prev_in_group->next_in_group = observer->next_in_group;
+	else
+		group->first_observer = observer->next_in_group;
+	if(observer->next_in_group)
+		observer->next_in_group->prev_in_group = observer->prev_in_group;
+
+	if(0 == --group->count)
+		observer_group_remove(registry, group);
+
+	// Remove from the registration order.
+	if(observer->older)
+		observer->older->newer = observer->newer;
+	else
+		registry->oldest = observer->newer;
+	if(observer->newer)
+		observer->newer->older = observer->older;
+	else
+		registry->newest = observer->older;
+
+	// Hang on to it until it is safe to free.
+	observer->next_in_bucket = registry->dropped;
+	registry->dropped = observer;
+
+	observer_registries_lock_release();
+
+	smcp_transaction_end(registry->interface, &observer->transaction);
+
+bail:
+	smcp_finish_async_response(&observer->async_response);
+	return;
+}
+
+static struct smcp_observer_s*
+observer_add(
+	struct smcp_observer_registry_s* registry,
+	uint32_t hash,
+	smcp_observable_t observable,
+	uint8_t key
+) {
+	struct smcp_observer_s* observer = NULL;
+	struct smcp_observer_group_s* group;
+
+	// Make sure we have room.
+	while(registry->bytes_used + sizeof(*observer) > SMCP_CONF_OBSERVER_REGISTRY_MAX_BYTES) {
+#if SMCP_CONF_OBSERVER_EVICT_OLDEST
+		if(registry->oldest) {
+			DEBUG_PRINTF("Observer registry full, evicting %p", registry->oldest);
+			free_observer(registry->oldest);
+			observer_registry_sweep(registry);
+			continue;
+		}
+#endif
+		DEBUG_PRINTF("Observer registry full, refusing new observer");
+		goto bail;
+	}
+
+	if(registry->count >= registry->bucket_count) {
+		observer_registry_grow(
+			(void***)&registry->buckets,
+			&registry->bucket_count,
+			SMCP_OBSERVER_REGISTRY_MIN_BUCKETS,
+			offsetof(struct smcp_observer_s, next_in_bucket),
+			offsetof(struct smcp_observer_s, hash)
+		);
+		require(registry->bucket_count, bail);
+	}
+
+	// Other threads may be counting our groups.
+	observer_registries_lock_acquire();
+
+	group = observer_group_find(registry, observable, key, true);
+	require_action(group, bail, observer_registries_lock_release());
+
+	observer = smcp_slab_alloc(&registry->slab, sizeof(*observer));
+
+	if(!observer) {
+		if(!group->count)
+			observer_group_remove(registry, group);
+		observer_registries_lock_release();
+		goto bail;
+	}
+
+	registry->bytes_used += sizeof(*observer);
+
+	observer->registry = registry;
+	observer->group = group;
+	observer->hash = hash;
+
+	observer->next_in_bucket = registry->buckets[hash & (registry->bucket_count - 1)];
+	registry->buckets[hash & (registry->bucket_count - 1)] = observer;
+	registry->count++;
+
+	observer->next_in_group = group->first_observer;
+	if(group->first_observer)
+		group->first_observer->prev_in_group = observer;
+	group->first_observer = observer;
+	group->count++;
+
+	observer->older = registry->newest;
+	if(registry->newest)
+		registry->newest->newer = observer;
+	else
+		registry->oldest = observer;
+	registry->newest = observer;
+
+	observer_registries_lock_release();
+
+bail:
+	return observer;
+}
+
+void
+smcp_release_observers(smcp_t self) {
+	struct smcp_observer_registry_s* const registry = self->observer_registry;
+
+	struct smcp_observer_registry_s** link;
+
+	if(!registry)
+		return;
+
+	observer_registries_lock_acquire();
+	for(link = &observer_registries; *link != registry; link = &(*link)->next) { }
+	*link = registry->next;
+	observer_registries_lock_release();
+
+	while(registry->oldest) {
+		free_observer(registry->oldest);
+	}
+
+	observer_registry_sweep(registry);
+
+#if SMCP_OBSERVABLE_USE_THREADS
+	if(registry->wake_fd[0] >= 0) {
+		close(registry->wake_fd[0]);
+		close(registry->wake_fd[1]);
+	}
+	free(registry->pending);
+#endif
+
+	free(registry->buckets);
+	free(registry->group_buckets);
+	smcp_slab_release(registry->slab);
+	free(registry);
+
+	self->observer_registry = NULL;
+}
+
+smcp_status_t
+smcp_observable_update(smcp_observable_t context, uint8_t key) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	smcp_t const interface = smcp_get_current_instance();
+	struct smcp_observer_registry_s* registry;
+	struct smcp_observer_s* observer;
+	uint32_t hash;
+
+	if(interface->inbound.packet == NULL || interface->inbound.is_fake || interface->inbound.is_dupe) {
+		goto bail;
+	}
+
+	registry = observer_registry_get(interface, interface->inbound.has_observe_option);
+
+	if(!registry)
+		goto bail;
+
+	observer_registry_sweep(registry);
+
+	hash = observer_hash(
+		context,
+		key,
+		&interface->inbound.saddr,
+		interface->inbound.packet->token,
+		interface->inbound.packet->token_len
+	);
+
+	observer = observer_find(
+		registry,
+		hash,
+		context,
+		key,
+		&interface->inbound.saddr,
+		interface->inbound.packet->token,
+		interface->inbound.packet->token_len
+	);
+
+	if(interface->inbound.has_observe_option) {
+		if(observer) {
+			observer_touch(registry, observer);
+		} else {
+			observer = observer_add(registry, hash, context, key);
+			if(!observer)
+				goto bail;
+		}
+
+		ret = smcp_start_async_response(&observer->async_response,SMCP_ASYNC_RESPONSE_FLAG_DONT_ACK);
+		require_action(ret == SMCP_STATUS_OK, bail, free_observer(observer));
+
+		ret = smcp_outbound_add_option_uint(COAP_OPTION_OBSERVE,observer->seq);
+	} else if(observer) {
+		free_observer(observer);
+	}
+
+bail:
+	return ret;
+}
+
+#else // SMCP_OBSERVABLE_USE_REGISTRY
+
+#define INVALID_OBSERVER_INDEX		(SMCP_MAX_OBSERVERS)
+
 struct smcp_observer_s {
 	/**** All of this is private. Don't touch. ****/
 
@@ -135,7 +740,8 @@ smcp_observable_update(smcp_observable_t context, uint8_t key) {
 			observer_table[i].observable = context;
 		}
 
-		smcp_start_async_response(&observer_table[i].async_response,SMCP_ASYNC_RESPONSE_FLAG_DONT_ACK);
+		ret = smcp_start_async_response(&observer_table[i].async_response,SMCP_ASYNC_RESPONSE_FLAG_DONT_ACK);
+		require_action(ret == SMCP_STATUS_OK, bail, free_observer(&observer_table[i]));
 
 		ret = smcp_outbound_add_option_uint(COAP_OPTION_OBSERVE,observer_table[i].seq);
 	} else if(i != -1) {
@@ -146,6 +752,8 @@ bail:
 	return ret;
 }
 
+#endif // !SMCP_OBSERVABLE_USE_REGISTRY
+
 static smcp_status_t
 event_response_handler(int statuscode, struct smcp_observer_s* observer)
 {
@@ -171,15 +779,174 @@ event_response_handler(int statuscode, struct smcp_observer_s* observer)
 	return SMCP_STATUS_OK;
 }
 
+#if SMCP_OBSERVABLE_CACHE_NOTIFICATIONS
+
+static uint32_t
+observer_request_hash(const struct smcp_observer_s* observer) {
+	const struct smcp_async_response_s* const x = &observer->async_response;
+	const struct coap_header_s* const request = smcp_async_response_get_request(x);
+	coap_size_t header_len;
+
+	if(!request)
+		return 0;
+
+	header_len = sizeof(struct coap_header_s) + request->token_len;
+
+	// Everything after the token, so that the token itself doesn't matter.
+	if(x->request_len <= header_len)
+		return 0;
+
+	return fasthash_buffer((const uint8_t*)request + header_len, x->request_len - header_len, 0);
+}
+
+//!	Saves the notification that was just sent so that it can be reused.
+static void
+observer_group_cache_capture(
+	struct smcp_observer_group_s* group,
+	uint32_t request_hash
+) {
+	smcp_t const self = smcp_get_current_instance();
+	struct smcp_observer_registry_s* const registry = self->observer_registry;
+	const struct coap_header_s* const packet = self->outbound.packet;
+	const uint8_t* const options = packet->token + packet->token_len;
+	const uint8_t* const options_end = (const uint8_t*)self->outbound.content_ptr - 1;
+	const uint8_t* iter = options;
+	const uint8_t* observe = NULL;
+	coap_option_key_t key = 0;
+	coap_option_key_t prev_key = 0;
+	coap_size_t prefix_len, suffix_len, content_len;
+	uint8_t* cache;
+
+	require_quiet(packet->code >= COAP_RESULT_200 && packet->code < COAP_RESULT_300, bail);
+
+	while(iter < options_end) {
+		const uint8_t* const option = iter;
+
+		prev_key = key;
+		iter = coap_decode_option(iter, &key, NULL, NULL);
+		require(iter && iter <= options_end, bail);
+
+		if(key == COAP_OPTION_OBSERVE) {
+			observe = option;
+			break;
+		}
+	}
+
+	// The handler may have stripped the Observe option, in which
+	// case the observer is about to go away anyway.
+	require_quiet(observe, bail);
+
+	prefix_len = (coap_size_t)(observe - options);
+	suffix_len = (coap_size_t)(options_end - iter);
+	content_len = self->outbound.content_len;
+
+	cache = malloc(prefix_len + suffix_len + content_len);
+	require(cache, bail);
+
+	memcpy(cache, options, prefix_len);
+	memcpy(cache + prefix_len, iter, suffix_len);
+	memcpy(cache + prefix_len + suffix_len, self->outbound.content_ptr, content_len);
+
+	if(group->cache) {
+		registry->bytes_used -= group->cache_prefix_len + group->cache_suffix_len + group->cache_content_len;
+		free(group->cache);
+	}
+
+	group->cache = cache;
+	group->cache_generation = group->generation;
+	group->cache_request_hash = request_hash;
+	group->cache_code = packet->code;
+	group->cache_observe_prev_key = prev_key;
+	group->cache_last_option_key = self->outbound.last_option_key;
+	group->cache_prefix_len = prefix_len;
+	group->cache_suffix_len = suffix_len;
+	group->cache_content_len = content_len;
+	registry->bytes_used += prefix_len + suffix_len + content_len;
+
+bail:
+	return;
+}
+
+//!	Sends the cached notification of the observer's group.
+static smcp_status_t
+observer_send_cached_event(struct smcp_observer_s* observer)
+{
+	smcp_status_t status = SMCP_STATUS_MESSAGE_TOO_BIG;
+	smcp_t const self = smcp_get_current_instance();
+	const struct smcp_observer_group_s* const group = observer->group;
+	struct coap_header_s* const packet = self->outbound.packet;
+	uint8_t* ptr = packet->token + packet->token_len;
+	const uint32_t seq = htonl(observer->seq);
+	const uint8_t* seq_ptr = (const uint8_t*)&seq;
+	coap_size_t seq_len = sizeof(seq);
+
+	while(seq_len && !*seq_ptr) {
+		seq_ptr++;
+		seq_len--;
+	}
+
+	// Worst case for the Observe option is five bytes.
+	require(
+		(ptr - (uint8_t*)packet) + group->cache_prefix_len + 5 + seq_len
+			+ group->cache_suffix_len + 1 + group->cache_content_len
+			<= self->outbound.max_packet_len,
+		bail
+	);
+
+	packet->code = group->cache_code;
+	packet->tt = SHOULD_CONFIRM_EVENT_FOR_OBSERVER(observer)?COAP_TRANS_TYPE_CONFIRMABLE:COAP_TRANS_TYPE_NONCONFIRMABLE;
+
+	memcpy(ptr, group->cache, group->cache_prefix_len);
+	ptr += group->cache_prefix_len;
+
+	ptr = coap_encode_option(ptr, group->cache_observe_prev_key, COAP_OPTION_OBSERVE, seq_ptr, seq_len);
+
+	memcpy(ptr, group->cache + group->cache_prefix_len, group->cache_suffix_len);
+	ptr += group->cache_suffix_len;
+
+	*ptr++ = 0xFF;
+
+	memcpy(ptr, group->cache + group->cache_prefix_len + group->cache_suffix_len, group->cache_content_len);
+
+	self->outbound.last_option_key = group->cache_last_option_key;
+	self->outbound.content_ptr = (char*)ptr;
+	self->outbound.content_len = group->cache_content_len;
+	self->outbound.options_encoded = true;
+	self->outbound.auto_options_added = true;
+	self->is_responding = true;
+
+	status = smcp_outbound_send();
+
+bail:
+	return status;
+}
+
+#endif // SMCP_OBSERVABLE_CACHE_NOTIFICATIONS
+
 static smcp_status_t
 retry_sending_event(struct smcp_observer_s* observer)
 {
 	smcp_status_t status;
 	smcp_t const self = smcp_get_current_instance();
+#if SMCP_OBSERVABLE_CACHE_NOTIFICATIONS
+	const uint32_t request_hash = observer_request_hash(observer);
+	struct smcp_observer_group_s* const group = observer->group;
+#endif
 
 	status = smcp_outbound_begin_async_response(COAP_RESULT_205_CONTENT,&observer->async_response);
 	require_noerr(status,bail);
 
+#if SMCP_OBSERVABLE_CACHE_NOTIFICATIONS
+	if(group
+		&& group->cache
+		&& (group->cache_generation == group->generation)
+		&& (group->cache_request_hash == request_hash)
+	) {
+		status = observer_send_cached_event(observer);
+		goto bail;
+	}
+#endif
+
 	status = smcp_outbound_add_option_uint(COAP_OPTION_OBSERVE,observer->seq);
 	require_noerr(status,bail);
 
@@ -207,6 +974,11 @@ retry_sending_event(struct smcp_observer_s* observer)
 		smcp_outbound_set_content_len(0);
 		smcp_outbound_send();
 	}
+#if SMCP_OBSERVABLE_CACHE_NOTIFICATIONS
+	else if(self->did_respond && (group == observer->group)) {
+		observer_group_cache_capture(group, request_hash);
+	}
+#endif
 
 bail:
 	self->is_processing_message = false;
@@ -214,12 +986,290 @@ bail:
 	return status;
 }
 
+static smcp_status_t
+trigger_observer(smcp_t interface, struct smcp_observer_s* observer)
+{
+	smcp_status_t ret = SMCP_STATUS_OK;
+
+	observer->seq++;
+
+	if(observer->transaction.active) {
+		smcp_transaction_new_msg_id(interface, &observer->transaction, smcp_get_next_msg_id(interface));
+		smcp_transaction_tickle(interface, &observer->transaction);
+	} else {
+		smcp_transaction_init(
+			&observer->transaction,
+			0, // Flags
+			(void*)&retry_sending_event,
+			(void*)&event_response_handler,
+			(void*)observer
+		);
+
+		ret = smcp_transaction_begin(
+			interface,
+			&observer->transaction,
+			SHOULD_CONFIRM_EVENT_FOR_OBSERVER(observer)?SMCP_OBSERVER_CON_EVENT_EXPIRATION:SMCP_OBSERVER_NON_EVENT_EXPIRATION
+		);
+	}
+
+	return ret;
+}
+
+#if SMCP_OBSERVABLE_USE_REGISTRY
+
+static smcp_status_t
+trigger_group(smcp_t interface, struct smcp_observer_group_s* group)
+{
+	smcp_status_t ret = SMCP_STATUS_OK;
+	struct smcp_observer_s* observer;
+
+	if(!group)
+		goto bail;
+
+#if SMCP_OBSERVABLE_CACHE_NOTIFICATIONS
+	group->generation++;
+#endif
+
+	for(observer = group->first_observer; observer; observer = observer->next_in_group) {
+		ret = trigger_observer(interface, observer);
+	}
+
+bail:
+	return ret;
+}
+
+//!	Triggers the observers of `context` in a registry owned by this thread.
+static smcp_status_t
+observer_registry_trigger(
+	struct smcp_observer_registry_s* registry,
+	smcp_observable_t context,
+	uint8_t key
+) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	smcp_t const interface = registry->interface;
+
+	if(!registry->group_count)
+		goto bail;
+
+	observer_registry_sweep(registry);
+
+	if(key == SMCP_OBSERVABLE_BROADCAST_KEY) {
+		// Every group for this observable is in the same bucket.
+		struct smcp_observer_group_s* group = registry->group_buckets[observer_hash_observable(context) & (registry->group_bucket_count - 1)];
+
+		for(; group; group = group->next_in_bucket) {
+			if(group->observable == context)
+				ret = trigger_group(interface, group);
+		}
+	} else {
+		ret = trigger_group(interface, observer_group_find(registry, context, key, false));
+		ret = trigger_group(interface, observer_group_find(registry, context, SMCP_OBSERVABLE_BROADCAST_KEY, false));
+	}
+
+bail:
+	return ret;
+}
+
+//!	Returns true if `registry` has any observers of `context`. Needs the list lock.
+static bool
+observer_registry_has_observable(
+	struct smcp_observer_registry_s* registry,
+	smcp_observable_t context
+) {
+	struct smcp_observer_group_s* group = NULL;
+
+	if(registry->group_count) {
+		group = registry->group_buckets[observer_hash_observable(context) & (registry->group_bucket_count - 1)];
+
+		while(group && (group->observable != context))
+			group = group->next_in_bucket;
+	}
+
+	return group != NULL;
+}
+
+#if SMCP_OBSERVABLE_USE_THREADS
+
+//!	Hands a trigger to the thread that owns `registry`. Needs the list lock.
+static void
+observer_registry_post(
+	struct smcp_observer_registry_s* registry,
+	smcp_observable_t context,
+	uint8_t key
+) {
+	const uint8_t wake = 0;
+	uint32_t i;
+
+	for(i = 0; i < registry->pending_count; i++) {
+		if((registry->pending[i].observable == context)
+			&& ((registry->pending[i].key == key) || (registry->pending[i].key == SMCP_OBSERVABLE_BROADCAST_KEY))
+		) {
+			// Already on its way.
+			goto bail;
+		}
+	}
+
+	if(registry->pending_count >= registry->pending_size) {
+		const uint32_t size = registry->pending_size ? registry->pending_size * 2 : 4;
+		struct smcp_observer_trigger_s* const pending = realloc(registry->pending, size * sizeof(*pending));
+
+		require(pending, bail);
+
+		registry->pending = pending;
+		registry->pending_size = size;
+	}
+
+	registry->pending[registry->pending_count].observable = context;
+	registry->pending[registry->pending_count].key = key;
+
+	// The owner empties the queue all at once, so one byte is enough.
+	if((0 == registry->pending_count++) && (registry->wake_fd[1] >= 0)) {
+		const ssize_t written = write(registry->wake_fd[1], &wake, sizeof(wake));
+		check(written == sizeof(wake));
+		(void)written;
+	}
+
+bail:
+	return;
+}
+
+#endif // SMCP_OBSERVABLE_USE_THREADS
+
+smcp_status_t
+smcp_observable_trigger(smcp_observable_t context, uint8_t key, uint8_t flags)
+{
+	smcp_status_t ret = SMCP_STATUS_OK;
+	struct smcp_observer_registry_s* registry;
+#if SMCP_OBSERVABLE_USE_THREADS
+	struct smcp_observer_registry_s* local[SMCP_OBSERVER_LOCAL_TRIGGER_MAX];
+	int local_count = 0;
+	int i;
+
+	observer_registries_lock_acquire();
+
+	for(registry = observer_registries; registry; registry = registry->next) {
+		if(!observer_registry_has_observable(registry, context))
+			continue;
+
+		// Only the owner of a registry may release it, so ours will
+		// still be around once we let go of the lock.
+		if(pthread_equal(registry->owner, pthread_self())
+			&& (local_count < SMCP_OBSERVER_LOCAL_TRIGGER_MAX)
+		) {
+			local[local_count++] = registry;
+		} else {
+			observer_registry_post(registry, context, key);
+		}
+	}
+
+	observer_registries_lock_release();
+
+	for(i = 0; i < local_count; i++) {
+		ret = observer_registry_trigger(local[i], context, key);
+	}
+#else
+	for(registry = observer_registries; registry; registry = registry->next) {
+		if(observer_registry_has_observable(registry, context))
+			ret = observer_registry_trigger(registry, context, key);
+	}
+#endif
+
+	return ret;
+}
+
+int
+smcp_observable_observer_count(smcp_observable_t context, uint8_t key)
+{
+	int count = 0;
+	struct smcp_observer_registry_s* registry;
+	struct smcp_observer_group_s* group;
+
+	observer_registries_lock_acquire();
+
+	for(registry = observer_registries; registry; registry = registry->next) {
+		if(!registry->group_count)
+			continue;
+
+		if(key == SMCP_OBSERVABLE_BROADCAST_KEY) {
+			group = registry->group_buckets[observer_hash_observable(context) & (registry->group_bucket_count - 1)];
+
+			for(; group; group = group->next_in_bucket) {
+				if(group->observable == context)
+					count += group->count;
+			}
+		} else {
+			group = observer_group_find(registry, context, key, false);
+			if(group)
+				count += group->count;
+			group = observer_group_find(registry, context, SMCP_OBSERVABLE_BROADCAST_KEY, false);
+			if(group)
+				count += group->count;
+		}
+	}
+
+	observer_registries_lock_release();
+
+	return count;
+}
+
+int
+smcp_get_observers_fd(smcp_t self)
+{
+#if SMCP_OBSERVABLE_USE_THREADS
+	if(self->observer_registry)
+		return self->observer_registry->wake_fd[0];
+#endif
+	return -1;
+}
+
+void
+smcp_process_observers(smcp_t self)
+{
+#if SMCP_OBSERVABLE_USE_THREADS
+	struct smcp_observer_registry_s* const registry = self->observer_registry;
+	struct smcp_observer_trigger_s* pending;
+	uint32_t pending_count;
+	uint32_t i;
+	uint8_t wake[16];
+
+	if(!registry)
+		return;
+
+	if(registry->wake_fd[0] >= 0) {
+		while(read(registry->wake_fd[0], wake, sizeof(wake)) > 0) { }
+	}
+
+	observer_registries_lock_acquire();
+
+	// Whoever drives the instance owns its registry.
+	registry->owner = pthread_self();
+
+	pending = registry->pending;
+	pending_count = registry->pending_count;
+	registry->pending = NULL;
+	registry->pending_count = 0;
+	registry->pending_size = 0;
+
+	observer_registries_lock_release();
+
+	for(i = 0; i < pending_count; i++) {
+		observer_registry_trigger(registry, pending[i].observable, pending[i].key);
+	}
+
+	free(pending);
+#endif
+}
+
+#else // SMCP_OBSERVABLE_USE_REGISTRY
+
 smcp_status_t
 smcp_observable_trigger(smcp_observable_t context, uint8_t key, uint8_t flags)
 {
 	smcp_status_t ret = SMCP_STATUS_OK;
 	int8_t i;
-#if !SMCP_EMBEDDED
+#if SMCP_EMBEDDED
+	smcp_t const interface = smcp_get_current_instance();
+#else
 	smcp_t const interface = context->interface;
 
 	if(!interface)
@@ -237,26 +1287,7 @@ smcp_observable_trigger(smcp_observable_t context, uint8_t key, uint8_t flags)
 			continue;
 		}
 
-		observer_table[i].seq++;
-
-		if(observer_table[i].transaction.active) {
-			smcp_transaction_new_msg_id(interface, &observer_table[i].transaction, smcp_get_next_msg_id(interface));
-			smcp_transaction_tickle(interface, &observer_table[i].transaction);
-		} else {
-			smcp_transaction_init(
-				&observer_table[i].transaction,
-				0, // Flags
-				(void*)&retry_sending_event,
-				(void*)&event_response_handler,
-				(void*)&observer_table[i]
-			);
-
-			ret = smcp_transaction_begin(
-				interface,
-				&observer_table[i].transaction,
-				SHOULD_CONFIRM_EVENT_FOR_OBSERVER(&observer_table[i])?SMCP_OBSERVER_CON_EVENT_EXPIRATION:SMCP_OBSERVER_NON_EVENT_EXPIRATION
-			);
-		}
+		ret = trigger_observer(interface, &observer_table[i]);
 	}
 
 bail:
@@ -285,3 +1316,5 @@ smcp_observable_observer_count(smcp_observable_t context, uint8_t key)
 bail:
 	return count;
 }
+
+#endif // !SMCP_OBSERVABLE_USE_REGISTRY
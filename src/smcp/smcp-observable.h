@@ -56,10 +56,12 @@ struct smcp_observable_s {
 	smcp_t interface;
 #endif
 
+#if !SMCP_OBSERVABLE_USE_REGISTRY
 	// Consider all members below this line as private!
 
 	int8_t first_observer; //!^ always +1, zero is end of list
 	int8_t last_observer; //!^ always +1, zero is end of list
+#endif
 };
 
 //! Key to trigger all observers using the given observable context.
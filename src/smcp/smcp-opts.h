@@ -81,9 +81,22 @@
 #endif
 #endif
 
+//!	@define SMCP_CONF_JUMBO_PACKETS
+/*!	If set, SMCP_MAX_CONTENT_LENGTH defaults to 8KB instead of 1KB,
+**	which suits links with jumbo frames. Inbound packets are received
+**	into pool buffers (see SMCP_USE_BUFFER_POOL) and block-wise
+**	transfers still use blocks of at most 1KB, so the only things that
+**	grow are the buffers inside the smcp instance itself.
+*/
+#ifndef SMCP_CONF_JUMBO_PACKETS
+#define SMCP_CONF_JUMBO_PACKETS		0
+#endif
+
 #if !defined(SMCP_MAX_PACKET_LENGTH) && !defined(SMCP_MAX_CONTENT_LENGTH)
 #if SMCP_USE_UIP
 #define SMCP_MAX_PACKET_LENGTH ((UIP_BUFSIZE - UIP_LLH_LEN - UIP_IPUDPH_LEN))
+#elif SMCP_CONF_JUMBO_PACKETS
+#define SMCP_MAX_CONTENT_LENGTH     (8192)
 #else
 #define SMCP_MAX_CONTENT_LENGTH     (1024)
 #endif
@@ -137,10 +150,143 @@
 #define SMCP_CONF_MAX_TIMEOUT					30
 #endif
 
+//!	@define SMCP_CONF_MAX_INBOUND_OPTIONS
+/*!	Number of options remembered in the index built when an inbound
+**	packet is first scanned. Packets with more options than this still
+**	work, but the random-access option getters fall back to rescanning
+**	the packet.
+*/
+#ifndef SMCP_CONF_MAX_INBOUND_OPTIONS
+#if SMCP_EMBEDDED
+#define SMCP_CONF_MAX_INBOUND_OPTIONS			8
+#else
+#define SMCP_CONF_MAX_INBOUND_OPTIONS			32
+#endif
+#endif
+
+//!	@define SMCP_CONF_MAX_OUTBOUND_OPTIONS
+/*!	Number of outbound options which can be collected before they are
+**	sorted and encoded into the packet all at once. Options added after
+**	that are inserted into the packet one at a time.
+*/
+#ifndef SMCP_CONF_MAX_OUTBOUND_OPTIONS
+#if SMCP_EMBEDDED
+#define SMCP_CONF_MAX_OUTBOUND_OPTIONS			8
+#else
+#define SMCP_CONF_MAX_OUTBOUND_OPTIONS			24
+#endif
+#endif
+
+//!	Only relevant when SMCP_DUPE_USE_HASH is not set.
 #ifndef SMCP_CONF_DUPE_BUFFER_SIZE
 #define SMCP_CONF_DUPE_BUFFER_SIZE				(16)
 #endif
 
+//!	@define SMCP_DUPE_USE_HASH
+/*!	If set, recently received messages are remembered in a hash table
+**	for COAP_EXCHANGE_LIFETIME seconds instead of in a fixed ring of
+**	SMCP_CONF_DUPE_BUFFER_SIZE entries. The response to each confirmable
+**	request is also remembered, so that a retransmitted request can be
+**	answered again without calling the request handler.
+*/
+#ifndef SMCP_DUPE_USE_HASH
+#define SMCP_DUPE_USE_HASH						!SMCP_AVOID_MALLOC
+#endif
+
+//!	@define SMCP_CONF_DUPE_CACHE_MAX_BYTES
+/*!	Upper bound on the memory used by the duplicate detection cache,
+**	including cached responses. When the budget is exhausted, the oldest
+**	entries are forgotten early. Only relevant when SMCP_DUPE_USE_HASH
+**	is set.
+*/
+#ifndef SMCP_CONF_DUPE_CACHE_MAX_BYTES
+#define SMCP_CONF_DUPE_CACHE_MAX_BYTES			(256*1024)
+#endif
+
+//!	@define SMCP_CONF_RECV_BATCH_SIZE
+/*!	Maximum number of datagrams that smcp_process() will drain from
+**	the socket in a single call. When greater than one and recvmmsg()
+**	is available, the whole batch is received with one system call.
+**	Each slot costs a full packet buffer in the smcp instance.
+*/
+#ifndef SMCP_CONF_RECV_BATCH_SIZE
+#if SMCP_EMBEDDED
+#define SMCP_CONF_RECV_BATCH_SIZE				(1)
+#else
+#define SMCP_CONF_RECV_BATCH_SIZE				(16)
+#endif
+#endif
+
+//!	@define SMCP_CONF_SEND_BATCH_SIZE
+/*!	Number of finished outbound packets that can be queued before they
+**	are handed to the socket. The queue is flushed with a single
+**	sendmmsg() (where available) at the end of smcp_process(), before
+**	smcp_wait() blocks, when smcp_flush() is called, or when it fills up.
+**	A value of one sends each packet immediately.
+*/
+#ifndef SMCP_CONF_SEND_BATCH_SIZE
+#if SMCP_EMBEDDED
+#define SMCP_CONF_SEND_BATCH_SIZE				(1)
+#else
+#define SMCP_CONF_SEND_BATCH_SIZE				(16)
+#endif
+#endif
+
+//!	@define SMCP_CONF_DNS_CACHE_SIZE
+/*!	Number of hostnames whose lookup results (including failures) are
+**	remembered by each instance on BSD sockets. Each entry costs about
+**	SMCP_CONF_DNS_MAX_HOSTNAME_LEN bytes. Zero disables the cache.
+*/
+#ifndef SMCP_CONF_DNS_CACHE_SIZE
+#define SMCP_CONF_DNS_CACHE_SIZE				(8)
+#endif
+
+//!	@define SMCP_CONF_DNS_MAX_HOSTNAME_LEN
+/*!	Longest hostname that can be cached or looked up asynchronously.
+**	Longer names are looked up synchronously every time.
+*/
+#ifndef SMCP_CONF_DNS_MAX_HOSTNAME_LEN
+#define SMCP_CONF_DNS_MAX_HOSTNAME_LEN			(255)
+#endif
+
+//!	@define SMCP_CONF_DNS_CACHE_TTL
+/*!	How long, in milliseconds, a successful lookup is used for.
+**	getaddrinfo() doesn't tell us the real TTL, so this is an upper
+**	bound on how stale an address can get.
+*/
+#ifndef SMCP_CONF_DNS_CACHE_TTL
+#define SMCP_CONF_DNS_CACHE_TTL					(60*MSEC_PER_SEC)
+#endif
+
+//!	@define SMCP_CONF_DNS_NEGATIVE_TTL
+/*!	How long, in milliseconds, a failed lookup is remembered before
+**	the name is looked up again.
+*/
+#ifndef SMCP_CONF_DNS_NEGATIVE_TTL
+#define SMCP_CONF_DNS_NEGATIVE_TTL				(5*MSEC_PER_SEC)
+#endif
+
+//!	@define SMCP_CONF_DNS_ASYNC
+/*!	If set, hostnames are looked up on short-lived helper threads so
+**	that a slow DNS server doesn't hold up the event loop. Until the
+**	answer arrives, smcp_outbound_set_uri() returns
+**	SMCP_STATUS_WAIT_FOR_DNS and the transaction tries again later.
+**	Requires pthreads and SMCP_CONF_DNS_CACHE_SIZE.
+*/
+#ifndef SMCP_CONF_DNS_ASYNC
+#define SMCP_CONF_DNS_ASYNC						SMCP_MULTITHREAD
+#endif
+
+//!	@define SMCP_CONF_ENABLE_WORKER_POOL
+/*!	If set, smcp-worker-pool.h provides a pool of instances sharing one
+**	port, each on its own thread. Requires BSD sockets and pthreads;
+**	code built outside of this package must define HAVE_PTHREAD (or
+**	this) to see it.
+*/
+#ifndef SMCP_CONF_ENABLE_WORKER_POOL
+#define SMCP_CONF_ENABLE_WORKER_POOL			(SMCP_USE_BSD_SOCKETS && SMCP_MULTITHREAD && HAVE_PTHREAD)
+#endif
+
 #ifndef SMCP_CONF_ENABLE_VHOSTS
 #define SMCP_CONF_ENABLE_VHOSTS					!SMCP_EMBEDDED
 #endif
@@ -153,14 +299,88 @@
 #define SMCP_CONF_TRANS_ENABLE_BLOCK2			!SMCP_EMBEDDED
 #endif
 
+//!	@define SMCP_BLOCK2_MAX_WINDOW
+/*!	The most Block2 requests that a single smcp_block2_fetch_t will keep
+**	in flight at once. Each one reserves SMCP_BLOCK_MAX_SIZE bytes in
+**	the fetch object for reassembling blocks that arrive out of order.
+*/
+#ifndef SMCP_BLOCK2_MAX_WINDOW
+#define SMCP_BLOCK2_MAX_WINDOW					8
+#endif
+
+//!	@define SMCP_BLOCK2_DEFAULT_WINDOW
+/*!	The window used by a Block2 fetch unless smcp_block2_fetch_set_window()
+**	says otherwise.
+*/
+#ifndef SMCP_BLOCK2_DEFAULT_WINDOW
+#define SMCP_BLOCK2_DEFAULT_WINDOW				4
+#endif
+
+//!	@define SMCP_BLOCK1_MAX_WINDOW
+/*!	The most Block1 requests that a single smcp_block1_upload_t will keep
+**	in flight at once, and the most blocks that a Block1 receiver will
+**	hold on to when they arrive ahead of the ones before them. Each one
+**	reserves SMCP_BLOCK_MAX_SIZE bytes.
+*/
+#ifndef SMCP_BLOCK1_MAX_WINDOW
+#define SMCP_BLOCK1_MAX_WINDOW					8
+#endif
+
 #ifndef SMCP_CONF_TRANS_ENABLE_OBSERVING
 #define SMCP_CONF_TRANS_ENABLE_OBSERVING		!SMCP_EMBEDDED
 #endif
 
+//!	@define SMCP_TIMERS_USE_HEAP
+/*!	If set, pending timers are kept in a 4-ary min-heap instead of a
+**	sorted linked list, making scheduling and invalidating a timer
+**	O(log n) rather than O(n). The heap is a malloc'd array.
+*/
+#ifndef SMCP_TIMERS_USE_HEAP
+#define SMCP_TIMERS_USE_HEAP					!SMCP_AVOID_MALLOC
+#endif
+
 #ifndef SMCP_TRANSACTIONS_USE_BTREE
 #define SMCP_TRANSACTIONS_USE_BTREE				!SMCP_EMBEDDED
 #endif
 
+//!	@define SMCP_TRANSACTIONS_USE_HASH
+/*!	If set, pending transactions are also indexed by two open-addressing
+**	hash tables, one keyed by message id and one keyed by token and remote
+**	address, so that matching an inbound response is O(1). The tables are
+**	malloc'd arrays.
+*/
+#ifndef SMCP_TRANSACTIONS_USE_HASH
+#define SMCP_TRANSACTIONS_USE_HASH				!SMCP_AVOID_MALLOC
+#endif
+
+//!	@define SMCP_USE_SLAB_ALLOCATOR
+/*!	If set, transactions and nodes allocated while an smcp instance is
+**	current are carved out of per-instance slabs with free lists, rather
+**	than being individually malloc'd and freed.
+*/
+#ifndef SMCP_USE_SLAB_ALLOCATOR
+#define SMCP_USE_SLAB_ALLOCATOR					!SMCP_AVOID_MALLOC
+#endif
+
+//!	@define SMCP_USE_BUFFER_POOL
+/*!	If set, inbound packets are received into refcounted buffers from
+**	a per-instance pool. A request handler can keep the packet past its
+**	callback with smcp_inbound_retain_packet(), and asynchronous
+**	responses (and so observers) hold a reference to the request
+**	rather than a copy of it.
+*/
+#ifndef SMCP_USE_BUFFER_POOL
+#define SMCP_USE_BUFFER_POOL					!SMCP_AVOID_MALLOC
+#endif
+
+//!	@define SMCP_BUFFER_POOL_MAX_FREE
+/*!	The most unused buffers that a buffer pool holds on to for reuse.
+**	Buffers released beyond this are freed.
+*/
+#ifndef SMCP_BUFFER_POOL_MAX_FREE
+#define SMCP_BUFFER_POOL_MAX_FREE				32
+#endif
+
 /*****************************************************************************/
 // MARK: - Debugging
 
@@ -175,6 +395,45 @@
 /*****************************************************************************/
 // MARK: - Observation Options
 
+//!	@define SMCP_OBSERVABLE_USE_REGISTRY
+/*!	If set, each smcp instance keeps its observers in its own dynamically
+**	sized registry, hashed by observable, key, remote address and token,
+**	instead of in the process-wide table of SMCP_MAX_OBSERVERS entries.
+*/
+#ifndef SMCP_OBSERVABLE_USE_REGISTRY
+#define SMCP_OBSERVABLE_USE_REGISTRY	(!SMCP_AVOID_MALLOC && !SMCP_EMBEDDED)
+#endif
+
+//!	@define SMCP_CONF_OBSERVER_REGISTRY_MAX_BYTES
+/*!	Upper bound on the memory used by the observers of a single smcp
+**	instance. Only relevant when SMCP_OBSERVABLE_USE_REGISTRY is set.
+*/
+#ifndef SMCP_CONF_OBSERVER_REGISTRY_MAX_BYTES
+#define SMCP_CONF_OBSERVER_REGISTRY_MAX_BYTES	(4*1024*1024)
+#endif
+
+//!	@define SMCP_CONF_OBSERVER_EVICT_OLDEST
+/*!	Determines what happens when a new observer would exceed
+**	SMCP_CONF_OBSERVER_REGISTRY_MAX_BYTES. If set, the observer which
+**	least recently (re)registered is dropped to make room. Otherwise,
+**	the new observer is refused and gets a plain response.
+*/
+#ifndef SMCP_CONF_OBSERVER_EVICT_OLDEST
+#define SMCP_CONF_OBSERVER_EVICT_OLDEST			1
+#endif
+
+//!	@define SMCP_OBSERVABLE_CACHE_NOTIFICATIONS
+/*!	If set, a triggered observable is only rendered once per key: the
+**	options and content of the first notification are cached and reused
+**	for every other observer of the same key that made the same request,
+**	with only the token, message id, type and Observe sequence changed.
+**	Requires SMCP_OBSERVABLE_USE_REGISTRY.
+*/
+#ifndef SMCP_OBSERVABLE_CACHE_NOTIFICATIONS
+#define SMCP_OBSERVABLE_CACHE_NOTIFICATIONS	SMCP_OBSERVABLE_USE_REGISTRY
+#endif
+
+//!	Only relevant when SMCP_OBSERVABLE_USE_REGISTRY is not set.
 #ifdef SMCP_CONF_MAX_OBSERVERS
 #define SMCP_MAX_OBSERVERS			(SMCP_CONF_MAX_OBSERVERS)
 #else
@@ -212,6 +471,27 @@
 #define SMCP_NODE_ROUTER_USE_BTREE				!SMCP_EMBEDDED
 #endif
 
+//!	@define SMCP_CONF_NODE_ROUTE_CACHE_SIZE
+/*!	Number of routes remembered by each instance, keyed on a hash of
+**	the request path, so that smcp_node_route() can skip descending the
+**	node tree for paths it has seen before. Must be zero or a power of
+**	two. Any change to a node tree invalidates every cached route.
+*/
+#ifndef SMCP_CONF_NODE_ROUTE_CACHE_SIZE
+#if SMCP_EMBEDDED
+#define SMCP_CONF_NODE_ROUTE_CACHE_SIZE			(0)
+#else
+#define SMCP_CONF_NODE_ROUTE_CACHE_SIZE			(32)
+#endif
+#endif
+
+//!	@define SMCP_CONF_NODE_ROUTE_MAX_DEPTH
+/*!	Paths with more segments than this are always routed the slow way.
+*/
+#ifndef SMCP_CONF_NODE_ROUTE_MAX_DEPTH
+#define SMCP_CONF_NODE_ROUTE_MAX_DEPTH			(8)
+#endif
+
 //!	@define SMCP_ADD_NEWLINES_TO_LIST_OUTPUT
 /*!	If set, newlines are added to list output when using the node router.
 **
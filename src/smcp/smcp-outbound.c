@@ -170,6 +170,10 @@ smcp_outbound_begin(
 	}
 
 	self->outbound.last_option_key = 0;
+	self->outbound.option_count = 0;
+	self->outbound.option_bytes = 0;
+	self->outbound.options_encoded = false;
+	self->outbound.auto_options_added = false;
 
 	self->outbound.content_ptr = (char*)self->outbound.packet->token + self->outbound.packet->token_len;
 	*self->outbound.content_ptr++ = 0xFF;  // start-of-content marker
@@ -258,15 +262,15 @@ bail:
 	return ret;
 }
 
+//!	Inserts an option directly into the packet, keeping the options sorted.
+/*!	This has to shift everything after the insertion point, so it is only
+**	used once the staged options have already been encoded. */
 static smcp_status_t
-smcp_outbound_add_option_(
+smcp_outbound_insert_option_(
 	coap_option_key_t key, const char* value, coap_size_t len
 ) {
 	smcp_t const self = smcp_get_current_instance();
 
-	if(len == SMCP_CSTR_LEN)
-		len = (coap_size_t)strlen(value);
-
 	if(	smcp_outbound_get_space_remaining() < len + 8 ) {
 		// We ran out of room!
 		return SMCP_STATUS_MESSAGE_TOO_BIG;
@@ -304,21 +308,175 @@ smcp_outbound_add_option_(
 	return SMCP_STATUS_OK;
 }
 
+//!	Sorts the staged options by key.
+/*!	Options with the same key must stay in the order they were added, so
+**	this is a (stable) insertion sort. There are only ever a handful of
+**	options, and they are usually added in order anyway. */
+static void
+smcp_outbound_sort_staged_options_(void)
+{
+	smcp_t const self = smcp_get_current_instance();
+	struct smcp_outbound_option_s* const options = self->outbound.options;
+	uint8_t i, j;
+
+	for(i = 1; i < self->outbound.option_count; i++) {
+		struct smcp_outbound_option_s option = options[i];
+
+		for(j = i; j && (options[j-1].key > option.key); j--)
+			options[j] = options[j-1];
+
+		options[j] = option;
+	}
+}
+
+//!	Returns an upper bound on the bytes the staged options will take up once encoded.
+/*!	Each option header is at most five bytes (one byte, plus up to two
+**	each for the extended delta and length), so this doesn't need to
+**	sort the options first. It is called for every option that gets
+**	staged, and must stay cheap. */
+static coap_size_t
+smcp_outbound_get_staged_options_len_(void)
+{
+	smcp_t const self = smcp_get_current_instance();
+
+	return self->outbound.option_bytes + 5 * self->outbound.option_count;
+}
+
+//!	Encodes all of the staged options into the packet in a single pass.
+static void
+smcp_outbound_encode_staged_options_(void)
+{
+	smcp_t const self = smcp_get_current_instance();
+	uint8_t* ptr = (uint8_t*)self->outbound.packet->token + self->outbound.packet->token_len;
+	uint8_t i;
+
+	if(self->outbound.options_encoded)
+		return;
+
+	self->outbound.options_encoded = true;
+
+	if(!self->outbound.option_count)
+		return;
+
+	smcp_outbound_sort_staged_options_();
+
+	// The values are at the end of the buffer, and we made sure there
+	// was room for the encoded options before staging them, so we
+	// can't write over a value we haven't encoded yet.
+	for(i = 0; i < self->outbound.option_count; i++) {
+		const struct smcp_outbound_option_s* const option = &self->outbound.options[i];
+
+		ptr = coap_encode_option(
+			ptr,
+			self->outbound.last_option_key,
+			option->key,
+			(const uint8_t*)self->outbound.packet + option->value_offset,
+			option->value_len
+		);
+		self->outbound.last_option_key = option->key;
+	}
+
+	*ptr++ = 0xFF;  // Add end-of-options marker
+
+	self->outbound.content_ptr = (char*)ptr;
+	self->outbound.option_count = 0;
+	self->outbound.option_bytes = 0;
+
+#if OPTION_DEBUG
+	coap_dump_header(
+		SMCP_DEBUG_OUT_FILE,
+		"Option-Debug >>> ",
+		self->outbound.packet,
+		self->outbound.content_ptr-(char*)self->outbound.packet
+	);
+#endif
+}
+
+//!	Adds an option to the packet, staging it if possible.
 static smcp_status_t
-smcp_outbound_add_options_up_to_key_(
-	coap_option_key_t key
+smcp_outbound_add_option_(
+	coap_option_key_t key, const char* value, coap_size_t len
 ) {
+	smcp_t const self = smcp_get_current_instance();
+
+	if(len == SMCP_CSTR_LEN)
+		len = (coap_size_t)strlen(value);
+
+	if(!self->outbound.options_encoded) {
+		// Staging an option needs room for its value at the end of the
+		// buffer, plus room for the encoded option (at most five bytes of
+		// header) at the front.
+		if(	(self->outbound.option_count < SMCP_CONF_MAX_OUTBOUND_OPTIONS)
+			&& (smcp_outbound_get_space_remaining() >= self->outbound.option_bytes + 2 * len + 5)
+		) {
+			struct smcp_outbound_option_s* const option = &self->outbound.options[self->outbound.option_count++];
+
+			self->outbound.option_bytes += len;
+			option->key = key;
+			option->value_len = len;
+			option->value_offset = self->outbound.max_packet_len - self->outbound.option_bytes;
+			if(len)
+				memcpy((uint8_t*)self->outbound.packet + option->value_offset, value, len);
+
+			return SMCP_STATUS_OK;
+		}
+
+		// No more room for staging, so encode what we have
+		// and fall back to inserting options one at a time.
+		smcp_outbound_encode_staged_options_();
+	}
+
+	return smcp_outbound_insert_option_(key, value, len);
+}
+
+#if SMCP_CONF_TRANS_ENABLE_OBSERVING || SMCP_USE_CASCADE_COUNT
+//!	Returns true if an option with the given key is waiting to be encoded.
+static bool
+smcp_outbound_has_staged_option_(coap_option_key_t key)
+{
+	smcp_t const self = smcp_get_current_instance();
+	uint8_t i;
+
+	for(i = 0; i < self->outbound.option_count; i++) {
+		if(self->outbound.options[i].key == key)
+			return true;
+	}
+
+	return false;
+}
+#endif
+
+//!	Adds the options that the current transaction (or the stack) wants on every packet.
+static smcp_status_t
+smcp_outbound_add_automatic_options_(void)
+{
 	smcp_status_t ret;
 	smcp_t const self = smcp_get_current_instance();
 
 	(void)self;
 	ret = SMCP_STATUS_OK;
 
+	if(self->outbound.auto_options_added)
+		goto bail;
+
+	self->outbound.auto_options_added = true;
+
 #if SMCP_CONF_TRANS_ENABLE_BLOCK2
-	if(	(self->current_transaction
-		&& self->current_transaction->next_block2)
-		&& self->outbound.last_option_key<COAP_OPTION_BLOCK2
-		&& key>COAP_OPTION_BLOCK2
+	if(	self->current_transaction
+		&& self->current_transaction->next_block1
+	) {
+		uint32_t block1 = htonl(self->current_transaction->next_block1);
+		uint8_t size = smcp_calc_uint32_option_size(block1);
+		ret = smcp_outbound_add_option_(
+			COAP_OPTION_BLOCK1,
+			(char*)&block1+4-size,
+			size
+		);
+		require_noerr(ret, bail);
+	}
+
+	if(	self->current_transaction
+		&& self->current_transaction->next_block2
 	) {
 		uint32_t block2 = htonl(self->current_transaction->next_block2);
 		uint8_t size = smcp_calc_uint32_option_size(block2);
@@ -327,29 +485,28 @@ smcp_outbound_add_options_up_to_key_(
 			(char*)&block2+4-size,
 			size
 		);
+		require_noerr(ret, bail);
 	}
 #endif
 
 #if SMCP_CONF_TRANS_ENABLE_OBSERVING
 	if(	(self->current_transaction && self->current_transaction->flags&SMCP_TRANSACTION_OBSERVE)
-		&& self->outbound.last_option_key<COAP_OPTION_OBSERVE
-		&& key>COAP_OPTION_OBSERVE
+		&& self->outbound.packet->code && self->outbound.packet->code<COAP_RESULT_100
+		&& !smcp_outbound_has_staged_option_(COAP_OPTION_OBSERVE)
 	) {
-		if(self->outbound.packet->code && self->outbound.packet->code<COAP_RESULT_100) {
-			// For sending a request.
-			ret = smcp_outbound_add_option_(
-				COAP_OPTION_OBSERVE,
-				(void*)NULL,
-				0
-			);
-		}
+		// For sending a request.
+		ret = smcp_outbound_add_option_(
+			COAP_OPTION_OBSERVE,
+			(void*)NULL,
+			0
+		);
+		require_noerr(ret, bail);
 	}
 #endif
 
 #if SMCP_USE_CASCADE_COUNT
-	if(	self->outbound.last_option_key<COAP_OPTION_CASCADE_COUNT
-		&& key>COAP_OPTION_CASCADE_COUNT
-		&& self->cascade_count
+	if(	self->cascade_count
+		&& !smcp_outbound_has_staged_option_(COAP_OPTION_CASCADE_COUNT)
 	) {
 		uint8_t cc = self->cascade_count-1;
 		ret = smcp_outbound_add_option_(
@@ -357,22 +514,41 @@ smcp_outbound_add_options_up_to_key_(
 			(char*)&cc,
 			1
 		);
+		require_noerr(ret, bail);
 	}
 #endif
 
+bail:
 	return ret;
 }
 
+//!	Finishes off the options, so that the content can be written.
+static void
+smcp_outbound_finish_options_(void)
+{
+	smcp_t const self = smcp_get_current_instance();
+
+	// Finish up any remaining automatically-added headers.
+	if(self->outbound.packet->code)
+		smcp_outbound_add_automatic_options_();
+
+	smcp_outbound_encode_staged_options_();
+}
+
 smcp_status_t
 smcp_outbound_add_option(
 	coap_option_key_t key, const char* value, coap_size_t len
 ) {
-	smcp_status_t ret;
-
-	ret = smcp_outbound_add_options_up_to_key_(key);
-	require_noerr(ret, bail);
+	smcp_status_t ret = SMCP_STATUS_OK;
 
 #if SMCP_CONF_TRANS_ENABLE_BLOCK2
+	if(key==COAP_OPTION_BLOCK1
+		&& smcp_get_current_instance()->current_transaction
+		&& smcp_get_current_instance()->current_transaction->next_block1
+	) {
+		goto bail;
+	}
+
 	if(key==COAP_OPTION_BLOCK2
 		&& smcp_get_current_instance()->current_transaction
 		&& smcp_get_current_instance()->current_transaction->next_block2
@@ -408,12 +584,7 @@ smcp_outbound_set_destaddr(const smcp_sockaddr_t* sockaddr) {
 	);
 
 	if(self->current_transaction) {
-		memcpy(
-			&self->current_transaction->saddr,
-			sockaddr,
-			sizeof(self->current_transaction->saddr)
-		);
-		self->current_transaction->multicast = SMCP_IS_ADDR_MULTICAST(&sockaddr->smcp_addr);
+		smcp_transaction_set_saddr(self, self->current_transaction, sockaddr);
 	}
 	return SMCP_STATUS_OK;
 }
@@ -475,8 +646,10 @@ smcp_outbound_set_uri(
 		// use malloc. Let's use what room we have left
 		// in the packet buffer, since this is temporary anyway...
 		// It helps a bunch that we know the user hasn't written
-		// any content yet (because that would be an API violation)
-		if (smcp_outbound_get_space_remaining() > strlen(uri) + 8) {
+		// any content yet (because that would be an API violation).
+		// The options we add are staged at the very end of the
+		// buffer, so leave room for a second copy of the URI.
+		if (smcp_outbound_get_space_remaining() > 2 * strlen(uri) + 8) {
 			uri_copy = self->outbound.content_ptr + self->outbound.content_len;
 
 			// The options section may be expanding as we parse this, so
@@ -618,7 +791,8 @@ smcp_outbound_get_space_remaining(void)
 {
 	smcp_t const self = smcp_get_current_instance();
 	coap_size_t len = (coap_size_t)(self->outbound.content_ptr-(char*)self->outbound.packet)
-		+ self->outbound.content_len;
+		+ self->outbound.content_len
+		+ smcp_outbound_get_staged_options_len_();
 	if (self->outbound.max_packet_len > len)
 		return self->outbound.max_packet_len - len;
 	return 0;
@@ -629,18 +803,19 @@ smcp_outbound_append_content(const char* value, coap_size_t len)
 {
 	smcp_status_t ret = SMCP_STATUS_FAILURE;
 	smcp_t const self = smcp_get_current_instance();
-	coap_size_t max_len = smcp_outbound_get_space_remaining();
+	coap_size_t max_len;
 	char* dest;
 
 	if (SMCP_CSTR_LEN == len) {
 		len = (coap_size_t)strlen(value);
 	}
 
-	require_action(max_len>len, bail, ret = SMCP_STATUS_MESSAGE_TOO_BIG);
-
-	dest = smcp_outbound_get_content_ptr(&max_len);
+	dest = smcp_outbound_get_content_ptr(NULL);
 	require(dest,bail);
 
+	max_len = smcp_outbound_get_space_remaining();
+	require_action(max_len>len, bail, ret = SMCP_STATUS_MESSAGE_TOO_BIG);
+
 	dest += self->outbound.content_len;
 
 	memcpy(dest, value, len);
@@ -657,9 +832,7 @@ char*
 smcp_outbound_get_content_ptr(coap_size_t* max_len) {
 	smcp_t const self = smcp_get_current_instance();
 
-	// Finish up any remaining automatically-added headers.
-	if(self->outbound.packet->code)
-		smcp_outbound_add_options_up_to_key_(COAP_OPTION_INVALID);
+	smcp_outbound_finish_options_();
 
 	if(max_len)
 		*max_len = smcp_outbound_get_space_remaining()+self->outbound.content_len;
@@ -759,6 +932,8 @@ smcp_outbound_send() {
 		require_noerr(ret,bail);
 	}
 
+	smcp_outbound_finish_options_();
+
 #if DEBUG
 	{
 		coap_size_t header_len = (coap_size_t)(smcp_outbound_get_content_ptr(NULL)-(char*)self->outbound.packet);
@@ -776,6 +951,9 @@ smcp_outbound_send() {
 	if(self->current_transaction)
 		self->current_transaction->sent_code = self->outbound.packet->code;
 
+	if(self->is_processing_message)
+		smcp_outbound_dupe_store();
+
 #if defined(SMCP_DEBUG_OUTBOUND_DROP_PERCENT)
 	if(SMCP_DEBUG_OUTBOUND_DROP_PERCENT*SMCP_RANDOM_MAX>SMCP_FUNC_RANDOM_UINT32()) {
 		DEBUG_PRINTF("Dropping outbound packet for debugging!");
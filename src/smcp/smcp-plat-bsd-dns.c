@@ -0,0 +1,485 @@
+/*	@file smcp-plat-bsd-dns.c
+**	@author Robert Quattlebaum <darco@deepdarc.com>
+**
+**	Copyright (C) 2014 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef VERBOSE_DEBUG
+#define VERBOSE_DEBUG 0
+#endif
+
+#ifndef DEBUG
+#define DEBUG VERBOSE_DEBUG
+#endif
+
+#include "assert-macros.h"
+
+#include "smcp.h"
+
+#if SMCP_USE_BSD_SOCKETS
+
+#include "smcp-internal.h"
+#include "smcp-logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/errno.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#define SMCP_DNS_USE_THREADS	(SMCP_CONF_DNS_ASYNC && SMCP_CONF_DNS_CACHE_SIZE && HAVE_PTHREAD)
+
+#if SMCP_DNS_USE_THREADS
+#include <pthread.h>
+#endif
+
+#ifndef SOCKADDR_HAS_LENGTH_FIELD
+#if defined(__KAME__)
+#define SOCKADDR_HAS_LENGTH_FIELD 1
+#endif
+#endif
+
+//!	Looks up `hostname` with getaddrinfo(). Blocks unless `flags` has AI_NUMERICHOST.
+static smcp_status_t
+smcp_plat_bsd_getaddrinfo(const char* hostname, int flags, smcp_sockaddr_t* saddr)
+{
+	smcp_status_t ret;
+	struct addrinfo hint = {
+		.ai_flags		= flags,
+		.ai_family		= AF_UNSPEC,
+	};
+
+	struct addrinfo *results = NULL;
+	struct addrinfo *iter = NULL;
+
+	memset(saddr, 0, sizeof(*saddr));
+	saddr->___smcp_family = SMCP_BSD_SOCKETS_NET_FAMILY;
+
+#if SOCKADDR_HAS_LENGTH_FIELD
+	saddr->___smcp_len = sizeof(*saddr);
+#endif
+
+	int error = getaddrinfo(hostname, NULL, &hint, &results);
+
+#if SMCP_BSD_SOCKETS_NET_FAMILY==AF_INET6
+	if(error && (inet_addr(hostname) != INADDR_NONE)) {
+		char addr_v4mapped_str[8 + strlen(hostname)];
+		hint.ai_family = AF_INET6;
+		hint.ai_flags = AI_ALL | AI_V4MAPPED | (flags & AI_NUMERICHOST),
+		strcpy(addr_v4mapped_str,"::ffff:");
+		strcat(addr_v4mapped_str,hostname);
+		error = getaddrinfo(addr_v4mapped_str,
+			NULL,
+			&hint,
+			&results
+		);
+	}
+#endif
+
+	if (EAI_AGAIN == error) {
+		ret = SMCP_STATUS_WAIT_FOR_DNS;
+		goto bail;
+	}
+
+#ifdef TM_EWOULDBLOCK
+	if (TM_EWOULDBLOCK == error) {
+		ret = SMCP_STATUS_WAIT_FOR_DNS;
+		goto bail;
+	}
+#endif
+
+	if(error) {
+		// Not being a numeric address isn't worth complaining about.
+		if(!(flags & AI_NUMERICHOST))
+			DEBUG_PRINTF("getaddrinfo(\"%s\"): %s", hostname, gai_strerror(error));
+		ret = SMCP_STATUS_HOST_LOOKUP_FAILURE;
+		goto bail;
+	}
+
+	// Move to the first recognized result
+	for(iter = results;iter && (iter->ai_family!=AF_INET6 && iter->ai_family!=AF_INET);iter=iter->ai_next);
+
+	require_action(
+		iter,
+		bail,
+		ret = SMCP_STATUS_HOST_LOOKUP_FAILURE
+	);
+
+#if SMCP_BSD_SOCKETS_NET_FAMILY==AF_INET6
+	if(iter->ai_family == AF_INET) {
+		struct sockaddr_in *v4addr = (void*)iter->ai_addr;
+		saddr->sin6_addr.s6_addr[10] = 0xFF;
+		saddr->sin6_addr.s6_addr[11] = 0xFF;
+		memcpy(&saddr->sin6_addr.s6_addr[12], &v4addr->sin_addr.s_addr, 4);
+	} else
+#endif
+	if(iter->ai_family == SMCP_BSD_SOCKETS_NET_FAMILY) {
+		memcpy(saddr, iter->ai_addr, iter->ai_addrlen);
+	}
+
+	ret = SMCP_STATUS_OK;
+
+bail:
+	if(results)
+		freeaddrinfo(results);
+	return ret;
+}
+
+// MARK: -
+// MARK: Lookup Threads
+
+#if SMCP_DNS_USE_THREADS
+
+/*	Each lookup gets its own detached thread, which hands the finished
+**	job back to the instance through a pipe. The pipe and its lock are
+**	reference counted, since a thread stuck in getaddrinfo() may well
+**	outlive the instance that started it.
+*/
+
+struct smcp_plat_bsd_dns_shared_s {
+	pthread_mutex_t			lock;
+	int						refs;
+	int						fd[2];	//!< Read end, write end. -1 once closed.
+};
+
+struct smcp_plat_bsd_dns_job_s {
+	struct smcp_plat_bsd_dns_shared_s*	shared;
+	smcp_status_t			status;
+	smcp_sockaddr_t			saddr;
+	char					hostname[SMCP_CONF_DNS_MAX_HOSTNAME_LEN+1];
+};
+
+//!	Drops a reference. Must be called with the lock held; releases it.
+static void
+smcp_plat_bsd_dns_shared_unref_locked(struct smcp_plat_bsd_dns_shared_s* shared)
+{
+	const bool is_last = (--shared->refs == 0);
+
+	pthread_mutex_unlock(&shared->lock);
+
+	if(is_last) {
+		if(shared->fd[0] >= 0)
+			close(shared->fd[0]);
+		if(shared->fd[1] >= 0)
+			close(shared->fd[1]);
+		pthread_mutex_destroy(&shared->lock);
+		free(shared);
+	}
+}
+
+static void*
+smcp_plat_bsd_dns_thread_main(void* context)
+{
+	struct smcp_plat_bsd_dns_job_s* job = context;
+	struct smcp_plat_bsd_dns_shared_s* const shared = job->shared;
+
+	job->status = smcp_plat_bsd_getaddrinfo(job->hostname, AI_ADDRCONFIG, &job->saddr);
+
+	pthread_mutex_lock(&shared->lock);
+
+	// A pointer is well under PIPE_BUF, so this write is atomic.
+	if((shared->fd[1] < 0)
+		|| (write(shared->fd[1], &job, sizeof(job)) != sizeof(job))
+	) {
+		free(job);
+	}
+
+	smcp_plat_bsd_dns_shared_unref_locked(shared);
+
+	return NULL;
+}
+
+static struct smcp_plat_bsd_dns_shared_s*
+smcp_plat_bsd_dns_shared_create(void)
+{
+	struct smcp_plat_bsd_dns_shared_s* ret = calloc(1, sizeof(*ret));
+
+	require(ret != NULL, bail);
+
+	require_action(0 == pipe(ret->fd), bail, (free(ret), ret = NULL));
+
+	fcntl(ret->fd[0], F_SETFL, fcntl(ret->fd[0], F_GETFL) | O_NONBLOCK);
+	fcntl(ret->fd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(ret->fd[1], F_SETFD, FD_CLOEXEC);
+
+	pthread_mutex_init(&ret->lock, NULL);
+	ret->refs = 1;
+
+bail:
+	return ret;
+}
+
+//!	Starts looking up `hostname` in the background.
+static smcp_status_t
+smcp_plat_bsd_dns_start(smcp_t self, const char* hostname)
+{
+	smcp_status_t ret = SMCP_STATUS_MALLOC_FAILURE;
+	struct smcp_plat_bsd_dns_job_s* job = NULL;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if(!self->dns.shared) {
+		self->dns.shared = smcp_plat_bsd_dns_shared_create();
+		require(self->dns.shared != NULL, bail);
+	}
+
+	job = calloc(1, sizeof(*job));
+	require(job != NULL, bail);
+
+	job->shared = self->dns.shared;
+	strcpy(job->hostname, hostname);
+
+	pthread_mutex_lock(&job->shared->lock);
+	job->shared->refs++;
+	pthread_mutex_unlock(&job->shared->lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if(0 != pthread_create(&thread, &attr, &smcp_plat_bsd_dns_thread_main, job)) {
+		pthread_mutex_lock(&job->shared->lock);
+		smcp_plat_bsd_dns_shared_unref_locked(job->shared);
+		ret = SMCP_STATUS_FAILURE;
+	} else {
+		job = NULL;
+		ret = SMCP_STATUS_OK;
+	}
+
+	pthread_attr_destroy(&attr);
+
+bail:
+	free(job);
+	return ret;
+}
+
+#endif // SMCP_DNS_USE_THREADS
+
+// MARK: -
+// MARK: Cache
+
+#if SMCP_CONF_DNS_CACHE_SIZE
+
+static struct smcp_plat_bsd_dns_entry_s*
+smcp_plat_bsd_dns_find(smcp_t self, const char* hostname)
+{
+	int i;
+
+	for(i = 0; i < SMCP_CONF_DNS_CACHE_SIZE; i++) {
+		struct smcp_plat_bsd_dns_entry_s* const entry = &self->dns.cache[i];
+
+		if(entry->hostname[0] && (0 == strcasecmp(entry->hostname, hostname)))
+			return entry;
+	}
+
+	return NULL;
+}
+
+//!	Picks an entry to reuse: an empty one, or the least recently used.
+static struct smcp_plat_bsd_dns_entry_s*
+smcp_plat_bsd_dns_evict(smcp_t self)
+{
+	struct smcp_plat_bsd_dns_entry_s* ret = NULL;
+	int i;
+
+	for(i = 0; i < SMCP_CONF_DNS_CACHE_SIZE; i++) {
+		struct smcp_plat_bsd_dns_entry_s* const entry = &self->dns.cache[i];
+
+		if(!entry->hostname[0])
+			return entry;
+
+		// Lookups in progress have nowhere else to land.
+		if(entry->pending)
+			continue;
+
+		if(!ret || (entry->last_used < ret->last_used))
+			ret = entry;
+	}
+
+	return ret;
+}
+
+static void
+smcp_plat_bsd_dns_store(
+	smcp_t self,
+	struct smcp_plat_bsd_dns_entry_s* entry,
+	smcp_status_t status,
+	const smcp_sockaddr_t* saddr
+) {
+	entry->pending = false;
+	entry->status = status;
+	entry->saddr = *saddr;
+	entry->expires = smcp_get_current_time(self) + (
+		(status == SMCP_STATUS_OK) ? SMCP_CONF_DNS_CACHE_TTL : SMCP_CONF_DNS_NEGATIVE_TTL
+	);
+}
+
+#endif // SMCP_CONF_DNS_CACHE_SIZE
+
+// MARK: -
+
+smcp_status_t
+smcp_internal_lookup_hostname(const char* hostname, smcp_sockaddr_t* saddr)
+{
+	smcp_status_t ret;
+#if SMCP_CONF_DNS_CACHE_SIZE
+	smcp_t const self = smcp_get_current_instance();
+	struct smcp_plat_bsd_dns_entry_s* entry = NULL;
+	smcp_timestamp_t now;
+#endif
+
+	// Numeric addresses never need to wait.
+	ret = smcp_plat_bsd_getaddrinfo(hostname, AI_NUMERICHOST, saddr);
+
+	if(ret == SMCP_STATUS_OK)
+		goto bail;
+
+#if SMCP_CONF_DNS_CACHE_SIZE
+	if(strlen(hostname) > SMCP_CONF_DNS_MAX_HOSTNAME_LEN)
+		goto lookup_now;
+
+	now = smcp_get_current_time(self);
+	entry = smcp_plat_bsd_dns_find(self, hostname);
+
+	if(entry) {
+		if(entry->pending) {
+			ret = SMCP_STATUS_WAIT_FOR_DNS;
+			goto bail;
+		}
+
+		if(now < entry->expires) {
+			entry->last_used = now;
+			ret = entry->status;
+			*saddr = entry->saddr;
+			goto bail;
+		}
+	} else {
+		entry = smcp_plat_bsd_dns_evict(self);
+
+		// Everything is busy being looked up.
+		if(!entry)
+			goto lookup_now;
+
+		strcpy(entry->hostname, hostname);
+	}
+
+	entry->last_used = now;
+
+#if SMCP_DNS_USE_THREADS
+	if(SMCP_STATUS_OK == smcp_plat_bsd_dns_start(self, hostname)) {
+		DEBUG_PRINTF("DNS: Looking up \"%s\" in the background", hostname);
+		entry->pending = true;
+		ret = SMCP_STATUS_WAIT_FOR_DNS;
+		goto bail;
+	}
+#endif
+
+lookup_now:
+#endif // SMCP_CONF_DNS_CACHE_SIZE
+
+	ret = smcp_plat_bsd_getaddrinfo(hostname, AI_ADDRCONFIG, saddr);
+
+#if SMCP_CONF_DNS_CACHE_SIZE
+	if(entry)
+		smcp_plat_bsd_dns_store(self, entry, ret, saddr);
+#endif
+
+bail:
+	return ret;
+}
+
+void
+smcp_plat_bsd_dns_process(smcp_t self)
+{
+#if SMCP_DNS_USE_THREADS
+	struct smcp_plat_bsd_dns_job_s* job;
+	bool did_finish = false;
+
+	if(!self->dns.shared)
+		return;
+
+	while(read(self->dns.shared->fd[0], &job, sizeof(job)) == sizeof(job)) {
+		struct smcp_plat_bsd_dns_entry_s* const entry = smcp_plat_bsd_dns_find(self, job->hostname);
+
+		DEBUG_PRINTF("DNS: \"%s\" finished with %d", job->hostname, job->status);
+
+		if(entry && entry->pending)
+			smcp_plat_bsd_dns_store(self, entry, job->status, &job->saddr);
+
+		free(job);
+		did_finish = true;
+	}
+
+	if(did_finish)
+		smcp_transaction_wake_dns_waiters(self);
+#endif
+}
+
+void
+smcp_plat_bsd_dns_release(smcp_t self)
+{
+#if SMCP_DNS_USE_THREADS
+	struct smcp_plat_bsd_dns_shared_s* const shared = self->dns.shared;
+	struct smcp_plat_bsd_dns_job_s* job;
+
+	if(shared) {
+		pthread_mutex_lock(&shared->lock);
+
+		// Threads which finish from now on clean up after themselves.
+		close(shared->fd[1]);
+		shared->fd[1] = -1;
+
+		while(read(shared->fd[0], &job, sizeof(job)) == sizeof(job))
+			free(job);
+
+		smcp_plat_bsd_dns_shared_unref_locked(shared);
+		self->dns.shared = NULL;
+	}
+#endif
+
+#if SMCP_CONF_DNS_CACHE_SIZE
+	memset(self->dns.cache, 0, sizeof(self->dns.cache));
+#endif
+}
+
+int
+smcp_get_dns_fd(smcp_t self)
+{
+	SMCP_EMBEDDED_SELF_HOOK;
+#if SMCP_DNS_USE_THREADS
+	if(self->dns.shared)
+		return self->dns.shared->fd[0];
+#endif
+	return -1;
+}
+
+#endif // #if SMCP_USE_BSD_SOCKETS
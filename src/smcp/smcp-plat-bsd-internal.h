@@ -62,6 +62,7 @@
 #define SMCP_PKTINFO IPV6_PKTINFO
 #endif
 #define SMCP_IPPROTO IPPROTO_IPV6
+typedef struct in6_pktinfo smcp_pktinfo_t;
 
 #elif SMCP_BSD_SOCKETS_NET_FAMILY == AF_INET
 #define ___smcp_len		sin_len
@@ -73,6 +74,7 @@
 #define SMCP_PKTINFO IP_PKTINFO
 #endif
 #define SMCP_IPPROTO IPPROTO_IPV4
+typedef struct in_pktinfo smcp_pktinfo_t;
 
 #define SMCP_IS_ADDR_MULTICAST(addrptr) ((*(const uint8_t*)(addrptr)&0xF0)==224)
 #define SMCP_IS_ADDR_UNSPECIFIED(addrptr) (*(const uint32_t*)(addrptr)==0)
@@ -83,6 +85,64 @@
 #error Unsupported value for SMCP_BSD_SOCKETS_NET_FAMILY
 #endif // SMCP_BSD_SOCKETS_NET_FAMILY
 
+#ifndef SMCP_PLAT_BSD_CMSG_SPACE
+#define SMCP_PLAT_BSD_CMSG_SPACE		(0x100)
+#endif
+
+//!	Preallocated buffers used by smcp_process() for batched receives.
+struct smcp_plat_bsd_recv_s {
+#if SMCP_USE_BUFFER_POOL
+	//!	Pool buffers to receive into. NULL slots are refilled before each receive.
+	smcp_buffer_t			buffers[SMCP_CONF_RECV_BATCH_SIZE];
+#else
+	char					packet_bytes[SMCP_CONF_RECV_BATCH_SIZE][SMCP_MAX_PACKET_LENGTH+1];
+#endif
+	smcp_sockaddr_t			saddr[SMCP_CONF_RECV_BATCH_SIZE];
+	uint8_t					cmbuf[SMCP_CONF_RECV_BATCH_SIZE][SMCP_PLAT_BSD_CMSG_SPACE];
+	uint16_t				batch_size;
+};
+
+//!	Outbound packets waiting to be flushed to the socket.
+struct smcp_plat_bsd_send_s {
+#if SMCP_CONF_SEND_BATCH_SIZE > 1
+	struct {
+		char				packet_bytes[SMCP_MAX_PACKET_LENGTH];
+		coap_size_t			packet_len;
+		bool				has_pktinfo;
+		smcp_sockaddr_t		saddr;
+		smcp_pktinfo_t		pktinfo;
+	} queue[SMCP_CONF_SEND_BATCH_SIZE];
+#endif
+	uint16_t				count;
+};
+
+#if SMCP_CONF_DNS_CACHE_SIZE
+//!	A remembered hostname lookup.
+struct smcp_plat_bsd_dns_entry_s {
+	smcp_timestamp_t		expires;
+	smcp_timestamp_t		last_used;
+	smcp_sockaddr_t			saddr;
+	smcp_status_t			status;		//!< Result of the lookup.
+	bool					pending;	//!< Lookup still in progress.
+	char					hostname[SMCP_CONF_DNS_MAX_HOSTNAME_LEN+1];	//!< Empty if unused.
+};
+#endif
+
+//!	Hostname cache and asynchronous lookup state.
+struct smcp_plat_bsd_dns_s {
+#if SMCP_CONF_DNS_CACHE_SIZE
+	struct smcp_plat_bsd_dns_entry_s	cache[SMCP_CONF_DNS_CACHE_SIZE];
+#endif
+	//!	Shared with the lookup threads, which may outlive the instance.
+	struct smcp_plat_bsd_dns_shared_s*	shared;
+};
+
 SMCP_INTERNAL_EXTERN smcp_status_t smcp_internal_lookup_hostname(const char* hostname, smcp_sockaddr_t* sockaddr);
 
+//!	Takes in the results of finished asynchronous lookups. Called from smcp_process().
+SMCP_INTERNAL_EXTERN void smcp_plat_bsd_dns_process(smcp_t self);
+
+//!	Forgets all cached lookups and abandons any in progress.
+SMCP_INTERNAL_EXTERN void smcp_plat_bsd_dns_release(smcp_t self);
+
 #endif
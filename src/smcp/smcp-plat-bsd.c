@@ -49,6 +49,7 @@
 #include "smcp-auth.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <poll.h>
 #include <netdb.h>
 #include <sys/socket.h>
@@ -64,14 +65,13 @@
 #endif
 #endif
 
-smcp_t
-smcp_init(
-	smcp_t self, uint16_t port
+//!	Shared implementation of smcp_init() and smcp_create_reuseport().
+/*!	When `reuseport` is set, the socket is bound with SO_REUSEPORT and
+**	we don't go looking for another port if the requested one is taken. */
+static smcp_t
+smcp_plat_init(
+	smcp_t self, uint16_t port, bool reuseport
 ) {
-#if SMCP_EMBEDDED
-	smcp_t self = smcp_get_current_instance();
-#endif
-
 	require(self != NULL, bail);
 
 	if(port == 0)
@@ -93,6 +93,7 @@ smcp_init(
 
 	self->mcfd = -1;
 	self->fd = -1;
+	self->recv.batch_size = SMCP_CONF_RECV_BATCH_SIZE;
 	errno = 0;
 
 	self->fd = socket(SMCP_BSD_SOCKETS_NET_FAMILY, SOCK_DGRAM, IPPROTO_UDP);
@@ -117,10 +118,30 @@ smcp_init(
 	}
 #endif
 
+	if(reuseport) {
+#ifdef SO_REUSEPORT
+		int value = 1;
+		require_action_string(
+			0 == setsockopt(self->fd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)),
+			bail,
+			{ smcp_release(self); self = NULL; },
+			strerror(errno)
+		);
+#else
+		require_action_string(
+			false,
+			bail,
+			{ smcp_release(self); self = NULL; },
+			"SO_REUSEPORT is not supported on this platform"
+		);
+#endif
+	}
+
 	// Keep attempting to bind until we find a port that works.
 	while(bind(self->fd, (struct sockaddr*)&saddr, sizeof(saddr)) != 0) {
-		// We should only continue trying if errno == EADDRINUSE.
-		require_action_string(errno == EADDRINUSE, bail,
+		// We should only continue trying if errno == EADDRINUSE,
+		// and only if we aren't trying to share a specific port.
+		require_action_string(errno == EADDRINUSE && !reuseport, bail,
 			{ DEBUG_PRINTF(CSTR("errno=%d"), errno); smcp_release(
 				    self); self = NULL; }, "Failed to bind socket");
 		port++;
@@ -133,6 +154,12 @@ smcp_init(
 		saddr.smcp_port = htons(port);
 	}
 
+	{	// Remember which port we got, so nobody has to ask the kernel again.
+		socklen_t socklen = sizeof(saddr);
+		getsockname(self->fd, (struct sockaddr*)&saddr, &socklen);
+		self->port = ntohs(saddr.smcp_port);
+	}
+
 
 	{	// Handle sockopts.
 		int value;
@@ -186,14 +213,55 @@ bail:
 	return self;
 }
 
+smcp_t
+smcp_init(
+	smcp_t self, uint16_t port
+) {
+#if SMCP_EMBEDDED
+	smcp_t self = smcp_get_current_instance();
+#endif
+
+	return smcp_plat_init(self, port, false);
+}
+
+#if !SMCP_EMBEDDED
+smcp_t
+smcp_create_reuseport(uint16_t port) {
+	smcp_t ret = NULL;
+
+	ret = (smcp_t)calloc(1, sizeof(struct smcp_s));
+
+	require(ret != NULL, bail);
+
+	ret = smcp_plat_init(ret, port, true);
+
+bail:
+	return ret;
+}
+#endif
+
 void
 smcp_release_plat(smcp_t self) {
 	SMCP_EMBEDDED_SELF_HOOK;
 
-	if(self->fd>=0)
+	if(self->fd>=0) {
+		smcp_flush(self);
 		close(self->fd);
+	}
 	if(self->mcfd>=0)
 		close(self->mcfd);
+
+#if SMCP_USE_BUFFER_POOL
+	{
+		int i;
+		for(i = 0; i < SMCP_CONF_RECV_BATCH_SIZE; i++) {
+			smcp_buffer_release(self->recv.buffers[i]);
+			self->recv.buffers[i] = NULL;
+		}
+	}
+#endif
+
+	smcp_plat_bsd_dns_release(self);
 }
 
 int
@@ -205,12 +273,136 @@ smcp_get_fd(smcp_t self) {
 uint16_t
 smcp_get_port(smcp_t self) {
 	SMCP_EMBEDDED_SELF_HOOK;
-	smcp_sockaddr_t saddr;
-	socklen_t socklen = sizeof(saddr);
-	getsockname(self->fd, (struct sockaddr*)&saddr, &socklen);
-	return ntohs(saddr.smcp_port);
+	return self->port;
+}
+
+
+//!	Prepares `msg` for sending the given packet, attaching
+//!	`pktinfo` as ancillary data if it is not NULL.
+static void
+smcp_plat_init_send_msghdr(
+	struct msghdr* msg,
+	struct iovec* iov,
+	uint8_t* cmbuf,
+	char* packet,
+	coap_size_t packet_len,
+	smcp_sockaddr_t* saddr,
+	const smcp_pktinfo_t* pktinfo
+) {
+	iov->iov_base = packet;
+	iov->iov_len = packet_len;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_name = saddr;
+	msg->msg_namelen = sizeof(*saddr);
+	msg->msg_iov = iov;
+	msg->msg_iovlen = 1;
+
+	if (pktinfo != NULL) {
+		struct cmsghdr *scmsgp;
+
+		msg->msg_control = cmbuf;
+		msg->msg_controllen = CMSG_SPACE(sizeof(smcp_pktinfo_t));
+		memset(cmbuf, 0, msg->msg_controllen);
+
+		scmsgp = CMSG_FIRSTHDR(msg);
+		scmsgp->cmsg_level = SMCP_IPPROTO;
+		scmsgp->cmsg_type = SMCP_PKTINFO;
+		scmsgp->cmsg_len = CMSG_LEN(sizeof(smcp_pktinfo_t));
+		memcpy(CMSG_DATA(scmsgp), pktinfo, sizeof(smcp_pktinfo_t));
+	}
+}
+
+#if SMCP_CONF_SEND_BATCH_SIZE > 1
+
+#if HAVE_SENDMMSG
+typedef struct mmsghdr smcp_send_mmsghdr_t;
+#else
+typedef struct {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+} smcp_send_mmsghdr_t;
+#endif
+
+smcp_status_t
+smcp_flush(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	smcp_status_t ret = SMCP_STATUS_OK;
+	struct smcp_plat_bsd_send_s* const send = &self->send;
+	smcp_send_mmsghdr_t msgs[SMCP_CONF_SEND_BATCH_SIZE];
+	struct iovec iov[SMCP_CONF_SEND_BATCH_SIZE];
+	uint8_t cmbuf[SMCP_CONF_SEND_BATCH_SIZE][CMSG_SPACE(sizeof(smcp_pktinfo_t))];
+	int i = 0;
+	int sent;
+
+	for (i = 0; i < send->count; i++) {
+		smcp_plat_init_send_msghdr(
+			&msgs[i].msg_hdr,
+			&iov[i],
+			cmbuf[i],
+			send->queue[i].packet_bytes,
+			send->queue[i].packet_len,
+			&send->queue[i].saddr,
+			send->queue[i].has_pktinfo ? &send->queue[i].pktinfo : NULL
+		);
+		msgs[i].msg_len = 0;
+	}
+
+	for (i = 0; i < send->count; i += (sent > 0) ? sent : 1) {
+		self->plat_stats.send_calls++;
+
+#if HAVE_SENDMMSG
+		sent = sendmmsg(self->fd, &msgs[i], send->count - i, 0);
+#else
+		sent = (sendmsg(self->fd, &msgs[i].msg_hdr, 0) < 0) ? -1 : 1;
+#endif
+
+		if (sent < 0) {
+			// Skip the packet that failed, but keep going
+			// so that one bad destination doesn't hold up the rest.
+			check_string(sent >= 0, strerror(errno));
+			ret = SMCP_STATUS_ERRNO;
+		} else {
+			self->plat_stats.send_packets += sent;
+		}
+	}
+
+	send->count = 0;
+
+	return ret;
 }
 
+//!	Copies the current outbound packet onto the send queue.
+static smcp_status_t
+smcp_plat_enqueue_packet(smcp_t self, coap_size_t packet_len) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	struct smcp_plat_bsd_send_s* const send = &self->send;
+
+	if (send->count >= SMCP_CONF_SEND_BATCH_SIZE) {
+		ret = smcp_flush(self);
+	}
+
+	memcpy(send->queue[send->count].packet_bytes, self->outbound.packet_bytes, packet_len);
+	send->queue[send->count].packet_len = packet_len;
+	send->queue[send->count].saddr = self->outbound.saddr;
+	send->queue[send->count].has_pktinfo = self->is_processing_message;
+	if (self->is_processing_message) {
+		send->queue[send->count].pktinfo = self->inbound.pktinfo;
+	}
+	send->count++;
+
+	return ret;
+}
+
+#else // SMCP_CONF_SEND_BATCH_SIZE > 1
+
+smcp_status_t
+smcp_flush(smcp_t self) {
+	// Packets are always sent immediately.
+	return SMCP_STATUS_OK;
+}
+
+#endif // SMCP_CONF_SEND_BATCH_SIZE > 1
 
 smcp_status_t
 smcp_outbound_send_hook() {
@@ -251,66 +443,45 @@ smcp_outbound_send_hook() {
 	}
 #endif
 
-	ssize_t sent_bytes;
-
-	if(self->is_processing_message)
+#if SMCP_CONF_SEND_BATCH_SIZE > 1
+	ret = smcp_plat_enqueue_packet(self, header_len + self->outbound.content_len);
+#else
 	{
-		struct iovec iov = {
+		ssize_t sent_bytes;
+		struct iovec iov;
+		uint8_t cmbuf[CMSG_SPACE(sizeof(smcp_pktinfo_t))];
+		struct msghdr msg;
+
+		smcp_plat_init_send_msghdr(
+			&msg,
+			&iov,
+			cmbuf,
 			self->outbound.packet_bytes,
-			header_len + self->outbound.content_len
-		};
-		uint8_t cmbuf[CMSG_SPACE(sizeof (struct in6_pktinfo))];
-		struct cmsghdr *scmsgp;
-		struct msghdr msg = {
-			.msg_name = &self->outbound.saddr,
-			.msg_namelen = sizeof(self->outbound.saddr),
-			.msg_iov = &iov,
-			.msg_iovlen = 1,
-			.msg_control = cmbuf,
-			.msg_controllen = sizeof(cmbuf),
-		};
-#if SMCP_BSD_SOCKETS_NET_FAMILY==AF_INET6
-		struct in6_pktinfo *pktinfo;
-		scmsgp = CMSG_FIRSTHDR(&msg);
-		scmsgp->cmsg_level = IPPROTO_IPV6;
-		scmsgp->cmsg_type = IPV6_PKTINFO;
-		scmsgp->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
-		pktinfo = (struct in6_pktinfo *)(CMSG_DATA(scmsgp));
-		*pktinfo = self->inbound.pktinfo;
-#elif SMCP_BSD_SOCKETS_NET_FAMILY==AF_INET
-		struct in_pktinfo *pktinfo;
-		scmsgp = CMSG_FIRSTHDR(&msg);
-		scmsgp->cmsg_level = IPPROTO_IPV4;
-		scmsgp->cmsg_type = IP_PKTINFO;
-		scmsgp->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
-		pktinfo = (struct in_pktinfo *)(CMSG_DATA(scmsgp));
-		*pktinfo = self->inbound.pktinfo;
-#endif
+			header_len + self->outbound.content_len,
+			&self->outbound.saddr,
+			self->is_processing_message ? &self->inbound.pktinfo : NULL
+		);
+
+		self->plat_stats.send_calls++;
+
 		sent_bytes = sendmsg(self->fd, &msg, 0);
-		memset(pktinfo,0,sizeof(*pktinfo));
-	} else {
-		sent_bytes = sendto(
-			self->fd,
-			self->outbound.packet_bytes,
-			header_len +
-			self->outbound.content_len,
-			0,
-			(struct sockaddr *)&self->outbound.saddr,
-			sizeof(self->outbound.saddr)
+
+		require_action_string(
+			(sent_bytes>=0),
+			bail, ret = SMCP_STATUS_ERRNO, strerror(errno)
 		);
-	}
 
-	require_action_string(
-		(sent_bytes>=0),
-		bail, ret = SMCP_STATUS_ERRNO, strerror(errno)
-	);
+		require_action_string(
+			sent_bytes,
+			bail, ret = SMCP_STATUS_FAILURE, "sendmsg() returned zero."
+		);
 
-	require_action_string(
-		sent_bytes,
-		bail, ret = SMCP_STATUS_FAILURE, "sendto() returned zero."
-	);
+		self->plat_stats.send_packets++;
+
+		ret = SMCP_STATUS_OK;
+	}
+#endif
 
-	ret = SMCP_STATUS_OK;
 bail:
 	return ret;
 }
@@ -334,7 +505,18 @@ smcp_wait(
 ) {
 	SMCP_EMBEDDED_SELF_HOOK;
 	smcp_status_t ret = 0;
-	struct pollfd pollee = { self->fd, POLLIN | POLLHUP, 0 };
+	struct pollfd pollee[3] = {
+		{ self->fd, POLLIN | POLLHUP, 0 },
+		{ smcp_get_dns_fd(self), POLLIN, 0 },
+#if SMCP_OBSERVABLE_USE_REGISTRY
+		{ smcp_get_observers_fd(self), POLLIN, 0 },
+#else
+		{ -1, 0, 0 },
+#endif
+	};
+
+	// Don't block while packets are still waiting to go out.
+	smcp_flush(self);
 
 	if(cms >= 0)
 		cms = MIN(cms, smcp_get_timeout(self));
@@ -343,7 +525,8 @@ smcp_wait(
 
 	errno = 0;
 
-	if (poll(&pollee, 1, cms) == 0) {
+	// Negative descriptors are ignored by poll().
+	if (poll(pollee, 3, cms) == 0) {
 		ret = SMCP_STATUS_TIMEOUT;
 	}
 
@@ -358,185 +541,223 @@ bail:
 	return ret;
 }
 
-smcp_status_t
-smcp_process(
-	smcp_t self
-) {
-	SMCP_EMBEDDED_SELF_HOOK;
-	smcp_status_t ret = 0;
-
-	int tmp;
-	struct pollfd pollee = { self->fd, POLLIN | POLLHUP, 0 };
-
-	errno = 0;
+#if HAVE_RECVMMSG
+typedef struct mmsghdr smcp_mmsghdr_t;
+#else
+typedef struct {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+} smcp_mmsghdr_t;
+#endif
 
-	tmp = poll(&pollee, 1, 0);
+//!	Receives up to `vlen` datagrams without blocking.
+/*!	@returns the number of datagrams received, or -1 on error. */
+static int
+smcp_plat_recv_batch(smcp_t self, smcp_mmsghdr_t* msgs, unsigned int vlen)
+{
+	int ret;
+#if HAVE_RECVMMSG
+	self->plat_stats.recv_calls++;
+	ret = recvmmsg(self->fd, msgs, vlen, MSG_DONTWAIT, NULL);
+#else
+	ssize_t len;
+
+	for (ret = 0; ret < (int)vlen; ret++) {
+		self->plat_stats.recv_calls++;
+		len = recvmsg(self->fd, &msgs[ret].msg_hdr, MSG_DONTWAIT);
+		if (len < 0) {
+			if (ret == 0) {
+				ret = -1;
+			}
+			break;
+		}
+		msgs[ret].msg_len = (unsigned int)len;
+	}
+#endif
+	return ret;
+}
 
-	// Ensure that poll did not fail with an error.
-	require_action_string(errno == 0,
-		bail,
-		ret = SMCP_STATUS_ERRNO,
-		strerror(errno)
-	);
+//!	Feeds a single received datagram through the inbound pipeline.
+static smcp_status_t
+smcp_plat_handle_datagram(smcp_t self, smcp_buffer_t buffer, struct msghdr* msg, coap_size_t packet_len)
+{
+	smcp_status_t ret = 0;
+	smcp_sockaddr_t* const packet_saddr = (smcp_sockaddr_t*)msg->msg_name;
+	struct cmsghdr *cmsg;
 
-	if(tmp > 0) {
-		char packet[SMCP_MAX_PACKET_LENGTH+1];
-		smcp_sockaddr_t packet_saddr;
-		ssize_t packet_len = 0;
-		char cmbuf[0x100];
-		struct iovec iov = { packet, SMCP_MAX_PACKET_LENGTH };
-		struct msghdr msg = {
-			.msg_name = &packet_saddr,
-			.msg_namelen = sizeof(packet_saddr),
-			.msg_iov = &iov,
-			.msg_iovlen = 1,
-			.msg_control = cmbuf,
-			.msg_controllen = sizeof(cmbuf),
-		};
-		struct cmsghdr *cmsg;
-
-		packet_len = recvmsg(self->fd, &msg, 0);
-
-		require_action(packet_len > 0, bail, ret = SMCP_STATUS_ERRNO);
-
-		packet[packet_len] = 0;
-
-		ret = smcp_inbound_start_packet(self, msg.msg_iov[0].iov_base, (coap_size_t)packet_len);
-		require(ret==SMCP_STATUS_OK,bail);
+	ret = smcp_inbound_start_packet(self, msg->msg_iov[0].iov_base, packet_len);
+	require(ret==SMCP_STATUS_OK,bail);
 
-		// Set the source address
-		ret = smcp_inbound_set_srcaddr((smcp_sockaddr_t*)msg.msg_name);
-		require(ret==SMCP_STATUS_OK,bail);
+#if SMCP_USE_BUFFER_POOL
+	self->inbound.buffer = buffer;
+#endif
 
-		for (
-			cmsg = CMSG_FIRSTHDR(&msg);
-			cmsg != NULL;
-			cmsg = CMSG_NXTHDR(&msg, cmsg)
+	// Set the source address
+	ret = smcp_inbound_set_srcaddr(packet_saddr);
+	require(ret==SMCP_STATUS_OK,bail);
+
+	for (
+		cmsg = CMSG_FIRSTHDR(msg);
+		cmsg != NULL;
+		cmsg = CMSG_NXTHDR(msg, cmsg)
+	) {
+		if (cmsg->cmsg_level != SMCP_IPPROTO
+			|| cmsg->cmsg_type != SMCP_PKTINFO
 		) {
-			if (cmsg->cmsg_level != SMCP_IPPROTO
-				|| cmsg->cmsg_type != SMCP_PKTINFO
-			) {
-				continue;
-			}
+			continue;
+		}
 
 #if SMCP_BSD_SOCKETS_NET_FAMILY==AF_INET6
-			struct in6_pktinfo *pi = (struct in6_pktinfo *)CMSG_DATA(cmsg);
-			packet_saddr.smcp_addr = pi->ipi6_addr;
+		struct in6_pktinfo *pi = (struct in6_pktinfo *)CMSG_DATA(cmsg);
+		packet_saddr->smcp_addr = pi->ipi6_addr;
 #elif SMCP_BSD_SOCKETS_NET_FAMILY==AF_INET
-			struct in_pktinfo *pi = (struct in_pktinfo *)CMSG_DATA(cmsg);
-			packet_saddr.smcp_addr = pi->ipi_addr;
+		struct in_pktinfo *pi = (struct in_pktinfo *)CMSG_DATA(cmsg);
+		packet_saddr->smcp_addr = pi->ipi_addr;
 #endif
-			packet_saddr.smcp_port = htons(smcp_get_port(self));
-			ret = smcp_inbound_set_destaddr(&packet_saddr);
-			require(ret==SMCP_STATUS_OK,bail);
-
-			self->inbound.pktinfo = *pi;
-		}
-
-		ret = smcp_inbound_finish_packet();
+		packet_saddr->smcp_port = htons(self->port);
+		ret = smcp_inbound_set_destaddr(packet_saddr);
 		require(ret==SMCP_STATUS_OK,bail);
+
+		self->inbound.pktinfo = *pi;
 	}
 
-	smcp_set_current_instance(self);
-	smcp_handle_timers(self);
+	ret = smcp_inbound_finish_packet();
 
 bail:
-	smcp_set_current_instance(NULL);
 	self->is_responding = false;
 	return ret;
 }
 
 smcp_status_t
-smcp_internal_lookup_hostname(const char* hostname, smcp_sockaddr_t* saddr)
-{
-	smcp_status_t ret;
-	struct addrinfo hint = {
-		.ai_flags		= AI_ADDRCONFIG,
-		.ai_family		= AF_UNSPEC,
-	};
-
-	struct addrinfo *results = NULL;
-	struct addrinfo *iter = NULL;
-
-	memset(saddr, 0, sizeof(*saddr));
-	saddr->___smcp_family = SMCP_BSD_SOCKETS_NET_FAMILY;
-
-#if SOCKADDR_HAS_LENGTH_FIELD
-	saddr->___smcp_len = sizeof(*saddr);
+smcp_process(
+	smcp_t self
+) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	smcp_status_t ret = 0;
+	struct smcp_plat_bsd_recv_s* const recv = &self->recv;
+	struct iovec iov[SMCP_CONF_RECV_BATCH_SIZE];
+	smcp_mmsghdr_t msgs[SMCP_CONF_RECV_BATCH_SIZE];
+	smcp_status_t flush_status;
+	int count;
+	int i;
+
+	// Read the clock once for this whole pass.
+	smcp_refresh_current_time(self);
+
+	for (i = 0; i < recv->batch_size; i++) {
+#if SMCP_USE_BUFFER_POOL
+		if (!recv->buffers[i]) {
+			recv->buffers[i] = smcp_buffer_alloc(&self->buffer_pool);
+		}
+		if (!recv->buffers[i]) {
+			// Make do with the buffers we already have.
+			require_action(i != 0, bail, ret = SMCP_STATUS_MALLOC_FAILURE);
+			break;
+		}
+		iov[i].iov_base = smcp_buffer_get_bytes(recv->buffers[i]);
+#else
+		iov[i].iov_base = recv->packet_bytes[i];
 #endif
-
-	int error = getaddrinfo(hostname, NULL, &hint, &results);
-
-#if SMCP_BSD_SOCKETS_NET_FAMILY==AF_INET6
-	if(error && (inet_addr(hostname) != INADDR_NONE)) {
-		char addr_v4mapped_str[8 + strlen(hostname)];
-		hint.ai_family = AF_INET6;
-		hint.ai_flags = AI_ALL | AI_V4MAPPED,
-		strcpy(addr_v4mapped_str,"::ffff:");
-		strcat(addr_v4mapped_str,hostname);
-		error = getaddrinfo(addr_v4mapped_str,
-			NULL,
-			&hint,
-			&results
-		);
+		iov[i].iov_len = SMCP_MAX_PACKET_LENGTH;
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_name = &recv->saddr[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(recv->saddr[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = recv->cmbuf[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(recv->cmbuf[i]);
 	}
-#endif
 
-	if (EAI_AGAIN == error) {
-		ret = SMCP_STATUS_WAIT_FOR_DNS;
-		goto bail;
-	}
+	errno = 0;
 
-#ifdef TM_EWOULDBLOCK
-	if (TM_EWOULDBLOCK == error) {
-		ret = SMCP_STATUS_WAIT_FOR_DNS;
-		goto bail;
-	}
-#endif
+	count = smcp_plat_recv_batch(self, msgs, (unsigned int)i);
 
+	// Nothing pending is not an error.
 	require_action_string(
-		!error,
+		count >= 0 || errno == EAGAIN || errno == EWOULDBLOCK,
 		bail,
-		ret = SMCP_STATUS_HOST_LOOKUP_FAILURE,
-		gai_strerror(error)
+		ret = SMCP_STATUS_ERRNO,
+		strerror(errno)
 	);
 
-	// Move to the first recognized result
-	for(iter = results;iter && (iter->ai_family!=AF_INET6 && iter->ai_family!=AF_INET);iter=iter->ai_next);
+	for (i = 0; i < count; i++) {
+		smcp_status_t status;
 
-	require_action(
-		iter,
-		bail,
-		ret = SMCP_STATUS_HOST_LOOKUP_FAILURE
-	);
+		if (msgs[i].msg_len == 0) {
+			continue;
+		}
 
-#if SMCP_BSD_SOCKETS_NET_FAMILY==AF_INET6
-	if(iter->ai_family == AF_INET) {
-		struct sockaddr_in *v4addr = (void*)iter->ai_addr;
-		saddr->sin6_addr.s6_addr[10] = 0xFF;
-		saddr->sin6_addr.s6_addr[11] = 0xFF;
-		memcpy(&saddr->sin6_addr.s6_addr[12], &v4addr->sin_addr.s_addr, 4);
-	} else
+		self->plat_stats.recv_packets++;
+
+		status = smcp_plat_handle_datagram(
+			self,
+#if SMCP_USE_BUFFER_POOL
+			recv->buffers[i],
+#else
+			NULL,
 #endif
-	if(iter->ai_family == SMCP_BSD_SOCKETS_NET_FAMILY) {
-		memcpy(saddr, iter->ai_addr, iter->ai_addrlen);
-	}
+			&msgs[i].msg_hdr,
+			(coap_size_t)msgs[i].msg_len
+		);
 
-	if(SMCP_IS_ADDR_MULTICAST(&saddr->smcp_addr)) {
-		smcp_t const self = smcp_get_current_instance();
-		check(self->outbound.packet->tt != COAP_TRANS_TYPE_CONFIRMABLE);
-		if(self->outbound.packet->tt == COAP_TRANS_TYPE_CONFIRMABLE) {
-			self->outbound.packet->tt = COAP_TRANS_TYPE_NONCONFIRMABLE;
+#if SMCP_USE_BUFFER_POOL
+		// If something held on to the packet, the buffer is theirs
+		// now. We'll pick up a fresh one for the next receive.
+		if (smcp_buffer_is_shared(recv->buffers[i])) {
+			smcp_buffer_release(recv->buffers[i]);
+			recv->buffers[i] = NULL;
+		}
+#endif
+
+		// A bad packet shouldn't keep us from handling the rest of the batch.
+		if (status != SMCP_STATUS_OK && ret == SMCP_STATUS_OK) {
+			ret = status;
 		}
 	}
 
-	ret = SMCP_STATUS_OK;
+	smcp_set_current_instance(self);
+	smcp_plat_bsd_dns_process(self);
+	smcp_handle_timers(self);
+#if SMCP_OBSERVABLE_USE_REGISTRY
+	// After the timers, so that events which just expired start over.
+	smcp_process_observers(self);
+#endif
 
 bail:
-	if(results)
-		freeaddrinfo(results);
+	smcp_set_current_instance(NULL);
+	self->is_responding = false;
+	self->has_current_time = false;
+
+	// Send everything that was queued during this pass.
+	flush_status = smcp_flush(self);
+	if (ret == SMCP_STATUS_OK) {
+		ret = flush_status;
+	}
+
 	return ret;
 }
 
+const struct smcp_plat_stats_s*
+smcp_get_plat_stats(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	return &self->plat_stats;
+}
+
+void
+smcp_set_recv_batch_size(smcp_t self, int batch_size) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	if (batch_size < 1) {
+		batch_size = 1;
+	} else if (batch_size > SMCP_CONF_RECV_BATCH_SIZE) {
+		batch_size = SMCP_CONF_RECV_BATCH_SIZE;
+	}
+	self->recv.batch_size = (uint16_t)batch_size;
+}
+
+int
+smcp_get_recv_batch_size(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	return self->recv.batch_size;
+}
 
 #endif // #if SMCP_USE_BSD_SOCKETS
@@ -64,4 +64,40 @@ typedef struct sockaddr_in smcp_sockaddr_t;
 **	poll(), or other async mechanisms. */
 SMCP_API_EXTERN int smcp_get_fd(smcp_t self);
 
+//!	Gets the file descriptor which becomes readable when a hostname lookup finishes.
+/*!	This is -1 until the first asynchronous lookup starts, so callers
+**	with their own event loop should fetch it again after each call to
+**	smcp_process(). smcp_wait() already watches it. */
+SMCP_API_EXTERN int smcp_get_dns_fd(smcp_t self);
+
+//!	Creates an instance whose socket shares `port` using SO_REUSEPORT.
+/*!	Several of these instances may be bound to the same port at once,
+**	with the kernel spreading inbound flows between them. Unlike
+**	smcp_create(), this fails rather than trying the next port
+**	if `port` is already in use by a socket without SO_REUSEPORT.
+**
+**	@sa smcp_worker_pool_create() */
+SMCP_API_EXTERN smcp_t smcp_create_reuseport(uint16_t port);
+
+//!	Socket-level counters for an smcp instance.
+/*!	Dividing `recv_packets` by `recv_calls` gives the average number
+**	of datagrams received per system call, and likewise for
+**	`send_packets` and `send_calls`. */
+struct smcp_plat_stats_s {
+	uint64_t recv_packets;	//!< Datagrams fed into the inbound pipeline.
+	uint64_t recv_calls;	//!< Receive system calls made by smcp_process().
+	uint64_t send_packets;	//!< Datagrams handed to the socket.
+	uint64_t send_calls;	//!< Send system calls made.
+};
+
+//!	Returns the socket-level counters for this instance.
+SMCP_API_EXTERN const struct smcp_plat_stats_s* smcp_get_plat_stats(smcp_t self);
+
+//!	Sets the maximum number of datagrams handled per smcp_process() call.
+/*!	The value is clamped to the range 1...SMCP_CONF_RECV_BATCH_SIZE. */
+SMCP_API_EXTERN void smcp_set_recv_batch_size(smcp_t self, int batch_size);
+
+//!	Gets the maximum number of datagrams handled per smcp_process() call.
+SMCP_API_EXTERN int smcp_get_recv_batch_size(smcp_t self);
+
 #endif
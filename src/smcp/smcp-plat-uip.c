@@ -240,10 +240,18 @@ bail:
 	return ret;
 }
 
+smcp_status_t
+smcp_flush(smcp_t self) {
+	// Packets are never queued with UIP.
+	return SMCP_STATUS_OK;
+}
+
 smcp_status_t
 smcp_process(smcp_t self) {
 	SMCP_EMBEDDED_SELF_HOOK;
 
+	smcp_refresh_current_time(self);
+
 	if (!uip_udpconnection()) {
 		goto bail;
 	}
@@ -282,6 +290,7 @@ smcp_process(smcp_t self) {
 bail:
 	smcp_set_current_instance(NULL);
 	self->is_responding = false;
+	self->has_current_time = false;
 
 	return 0;
 }
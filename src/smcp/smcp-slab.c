@@ -0,0 +1,182 @@
+/*!	@file smcp-slab.c
+**	@author Robert Quattlebaum <darco@deepdarc.com>
+**	@brief Fixed-size object allocator
+**
+**
+**	Copyright (C) 2014 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "assert-macros.h"
+#include "smcp-internal.h"
+#include "smcp-slab.h"
+
+#if SMCP_USE_SLAB_ALLOCATOR
+
+#define SMCP_SLAB_MIN_CHUNK_ITEMS		(16)
+#define SMCP_SLAB_MAX_CHUNK_ITEMS		(1024)
+
+// Precedes every object. Padded so that the object is 8-byte aligned.
+union smcp_slab_header_u {
+	smcp_slab_t slab;
+	uint64_t align;
+};
+
+struct smcp_slab_chunk_s {
+	struct smcp_slab_chunk_s* next;
+	uint64_t align;
+};
+
+struct smcp_slab_s {
+	size_t stride;
+	uint32_t chunk_items;
+	uint32_t live_count;
+	bool released;
+	struct smcp_slab_chunk_s* chunks;
+
+	// Free objects are linked through their first bytes.
+	union smcp_slab_header_u* free_list;
+};
+
+#define smcp_slab_next_free(header)		(*(union smcp_slab_header_u**)((header) + 1))
+
+static void
+smcp_slab_destroy(smcp_slab_t slab) {
+	while(slab->chunks) {
+		struct smcp_slab_chunk_s* const chunk = slab->chunks;
+		slab->chunks = chunk->next;
+		free(chunk);
+	}
+	free(slab);
+}
+
+static bool
+smcp_slab_grow(smcp_slab_t slab) {
+	struct smcp_slab_chunk_s* chunk;
+	uint8_t* item;
+	uint32_t i;
+
+	chunk = malloc(sizeof(*chunk) + slab->stride * slab->chunk_items);
+
+	if(!chunk)
+		return false;
+
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+
+	item = (uint8_t*)(chunk + 1);
+
+	for(i = 0; i < slab->chunk_items; i++, item += slab->stride) {
+		union smcp_slab_header_u* const header = (union smcp_slab_header_u*)item;
+		smcp_slab_next_free(header) = slab->free_list;
+		slab->free_list = header;
+	}
+
+	// Each chunk is twice as big as the last, up to a point.
+	if(slab->chunk_items < SMCP_SLAB_MAX_CHUNK_ITEMS)
+		slab->chunk_items *= 2;
+
+	return true;
+}
+
+void*
+smcp_slab_alloc(smcp_slab_t* slab_ptr, size_t size) {
+	union smcp_slab_header_u* header = NULL;
+	smcp_slab_t slab = slab_ptr ? *slab_ptr : NULL;
+
+	if(slab_ptr && !slab) {
+		slab = calloc(1, sizeof(*slab));
+		if(slab) {
+			slab->stride = sizeof(*header) + ((size + 7) & ~(size_t)7);
+			slab->chunk_items = SMCP_SLAB_MIN_CHUNK_ITEMS;
+			*slab_ptr = slab;
+		}
+	}
+
+	if(slab) {
+		check(slab->stride == sizeof(*header) + ((size + 7) & ~(size_t)7));
+
+		if(slab->free_list || smcp_slab_grow(slab)) {
+			header = slab->free_list;
+			slab->free_list = smcp_slab_next_free(header);
+			memset(header, 0, slab->stride);
+			slab->live_count++;
+		}
+	}
+
+	if(!header) {
+		// No slab, or it couldn't grow. Fall back to calloc().
+		header = calloc(1, sizeof(*header) + size);
+		require(header, bail);
+		slab = NULL;
+	}
+
+	header->slab = slab;
+
+	return (void*)(header + 1);
+
+bail:
+	return NULL;
+}
+
+void
+smcp_slab_free(void* item) {
+	union smcp_slab_header_u* header;
+	smcp_slab_t slab;
+
+	if(!item)
+		return;
+
+	header = (union smcp_slab_header_u*)item - 1;
+	slab = header->slab;
+
+	if(!slab) {
+		free(header);
+		return;
+	}
+
+	smcp_slab_next_free(header) = slab->free_list;
+	slab->free_list = header;
+	slab->live_count--;
+
+	if(slab->released && !slab->live_count)
+		smcp_slab_destroy(slab);
+}
+
+void
+smcp_slab_release(smcp_slab_t slab) {
+	if(!slab)
+		return;
+
+	slab->released = true;
+
+	if(!slab->live_count)
+		smcp_slab_destroy(slab);
+}
+
+#endif // SMCP_USE_SLAB_ALLOCATOR
@@ -0,0 +1,64 @@
+/*!	@file smcp-slab.h
+**	@author Robert Quattlebaum <darco@deepdarc.com>
+**	@brief Fixed-size object allocator
+**
+**
+**	Copyright (C) 2014 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef SMCP_smcp_slab_h
+#define SMCP_smcp_slab_h
+
+#include <stddef.h>
+
+/*	A slab hands out zeroed objects of a single size from large chunks,
+**	keeping freed objects on a free list so that both allocating and
+**	freeing are O(1). Chunks are never returned to the system until the
+**	slab itself is released.
+**
+**	Every object remembers which slab it came from, so objects can be
+**	freed without knowing where they were allocated. A slab is not
+**	thread-safe: its objects must be allocated and freed by the thread
+**	that owns it, which is normally the thread driving its smcp instance.
+*/
+
+struct smcp_slab_s;
+typedef struct smcp_slab_s* smcp_slab_t;
+
+//!	Allocates a zeroed object of `size` bytes from `*slab`.
+/*!	The slab is created on first use. If `slab` is NULL, the object
+**	is allocated with calloc() instead. Every object allocated from a
+**	given slab must have the same size. */
+void* smcp_slab_alloc(smcp_slab_t* slab, size_t size);
+
+//!	Returns an object allocated by smcp_slab_alloc().
+void smcp_slab_free(void* item);
+
+//!	Releases the slab.
+/*!	The memory behind the slab is freed once all of its
+**	outstanding objects have been freed. */
+void smcp_slab_release(smcp_slab_t slab);
+
+#endif
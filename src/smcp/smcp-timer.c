@@ -51,6 +51,8 @@
 #include "url-helpers.h"
 #include "smcp-node-router.h"
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
 #include "smcp-internal.h"
 
 #ifndef SMCP_MAX_TIMEOUT
@@ -114,23 +116,76 @@ convert_timeval_to_cms(const struct timeval* tv) {
 	return ret;
 }
 
-static ll_compare_result_t
-smcp_timer_compare_func(
-	const void* lhs_, const void* rhs_, void* context
-) {
-	const smcp_timer_t lhs = (smcp_timer_t)lhs_;
-	const smcp_timer_t rhs = (smcp_timer_t)rhs_;
+// MARK: -
+// MARK: Clock
 
-	if(lhs->fire_date.tv_sec > rhs->fire_date.tv_sec)
-		return 1;
+smcp_timestamp_t
+smcp_default_clock_func(void) {
+#if defined(CONTIKI)
+	return (smcp_timestamp_t)clock_time() * MSEC_PER_SEC / CLOCK_SECOND;
+#elif HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (smcp_timestamp_t)ts.tv_sec * MSEC_PER_SEC + ts.tv_nsec / NSEC_PER_MSEC;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (smcp_timestamp_t)tv.tv_sec * MSEC_PER_SEC + tv.tv_usec / USEC_PER_MSEC;
+#endif
+}
 
-	if(lhs->fire_date.tv_sec < rhs->fire_date.tv_sec)
-		return -1;
+static smcp_clock_func_t smcp_clock_func = &smcp_default_clock_func;
 
-	if(lhs->fire_date.tv_usec > rhs->fire_date.tv_usec)
+void
+smcp_set_clock_func(smcp_clock_func_t func) {
+	smcp_clock_func = func ? func : &smcp_default_clock_func;
+}
+
+void
+smcp_refresh_current_time(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	self->current_time = (*smcp_clock_func)();
+	self->has_current_time = true;
+}
+
+smcp_timestamp_t
+smcp_get_current_time(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	if(self->has_current_time)
+		return self->current_time;
+	return (*smcp_clock_func)();
+}
+
+smcp_timestamp_t
+smcp_convert_cms_to_timestamp(smcp_t self, cms_t cms) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	return smcp_get_current_time(self) + cms;
+}
+
+cms_t
+smcp_convert_timestamp_to_cms(smcp_t self, smcp_timestamp_t timestamp) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	smcp_timestamp_t ret = timestamp - smcp_get_current_time(self);
+
+	if(ret < 0)
+		ret = 0;
+
+	if(ret > CMS_DISTANT_FUTURE)
+		ret = CMS_DISTANT_FUTURE;
+
+	return (cms_t)ret;
+}
+
+// MARK: -
+
+static int
+smcp_timer_compare_fire_dates(
+	const smcp_timer_t lhs, const smcp_timer_t rhs
+) {
+	if(lhs->fire_date > rhs->fire_date)
 		return 1;
 
-	if(lhs->fire_date.tv_usec < rhs->fire_date.tv_usec)
+	if(lhs->fire_date < rhs->fire_date)
 		return -1;
 
 	return 0;
@@ -152,6 +207,178 @@ smcp_timer_init(
 	return self;
 }
 
+// MARK: -
+// MARK: Timer Queue
+
+#if SMCP_TIMERS_USE_HEAP
+
+/*	Pending timers live in a 4-ary min-heap ordered by fire date.
+**	Each timer remembers its slot in the heap (index plus one), so
+**	invalidating an arbitrary timer doesn't require a search. A
+**	4-ary heap is shallower than a binary one and keeps siblings
+**	together in memory, which makes sifting cheaper in practice.
+*/
+
+#define SMCP_TIMER_HEAP_ARITY				(4)
+#define SMCP_TIMER_HEAP_INITIAL_CAPACITY	(16)
+
+static void
+smcp_timer_heap_place(smcp_t self, smcp_timer_t timer, uint32_t index) {
+	self->timer_heap[index] = timer;
+	timer->heap_slot = index + 1;
+}
+
+static void
+smcp_timer_heap_sift_up(smcp_t self, uint32_t index) {
+	smcp_timer_t const timer = self->timer_heap[index];
+
+	while(index > 0) {
+		uint32_t parent = (index - 1) / SMCP_TIMER_HEAP_ARITY;
+
+		if(smcp_timer_compare_fire_dates(self->timer_heap[parent], timer) <= 0)
+			break;
+
+		smcp_timer_heap_place(self, self->timer_heap[parent], index);
+		index = parent;
+	}
+
+	smcp_timer_heap_place(self, timer, index);
+}
+
+static void
+smcp_timer_heap_sift_down(smcp_t self, uint32_t index) {
+	smcp_timer_t const timer = self->timer_heap[index];
+
+	for(;;) {
+		uint32_t child = index * SMCP_TIMER_HEAP_ARITY + 1;
+		uint32_t end = child + SMCP_TIMER_HEAP_ARITY;
+		uint32_t smallest = index;
+		smcp_timer_t smallest_timer = timer;
+
+		if(end > self->timer_count)
+			end = self->timer_count;
+
+		for(; child < end; child++) {
+			if(smcp_timer_compare_fire_dates(self->timer_heap[child], smallest_timer) < 0) {
+				smallest = child;
+				smallest_timer = self->timer_heap[child];
+			}
+		}
+
+		if(smallest == index)
+			break;
+
+		smcp_timer_heap_place(self, smallest_timer, index);
+		index = smallest;
+	}
+
+	smcp_timer_heap_place(self, timer, index);
+}
+
+static smcp_status_t
+smcp_timer_queue_insert(smcp_t self, smcp_timer_t timer) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+
+	if(self->timer_count == self->timer_capacity) {
+		uint32_t capacity = self->timer_capacity?self->timer_capacity*2:SMCP_TIMER_HEAP_INITIAL_CAPACITY;
+		smcp_timer_t* heap = realloc(self->timer_heap, capacity*sizeof(smcp_timer_t));
+
+		require_action(heap != NULL, bail, ret = SMCP_STATUS_MALLOC_FAILURE);
+
+		self->timer_heap = heap;
+		self->timer_capacity = capacity;
+	}
+
+	self->timer_heap[self->timer_count] = timer;
+	smcp_timer_heap_sift_up(self, self->timer_count++);
+
+bail:
+	return ret;
+}
+
+static void
+smcp_timer_queue_remove(smcp_t self, smcp_timer_t timer) {
+	uint32_t index;
+	smcp_timer_t last;
+
+	if(!smcp_timer_is_scheduled(self, timer))
+		return;
+
+	index = timer->heap_slot - 1;
+	timer->heap_slot = 0;
+	last = self->timer_heap[--self->timer_count];
+
+	if(last == timer)
+		return;
+
+	// Move the last timer into the hole and restore the heap property.
+	self->timer_heap[index] = last;
+	if(index > 0
+		&& smcp_timer_compare_fire_dates(last, self->timer_heap[(index - 1) / SMCP_TIMER_HEAP_ARITY]) < 0
+	) {
+		smcp_timer_heap_sift_up(self, index);
+	} else {
+		smcp_timer_heap_sift_down(self, index);
+	}
+}
+
+static smcp_timer_t
+smcp_timer_queue_first(smcp_t self) {
+	return self->timer_count?self->timer_heap[0]:NULL;
+}
+
+static size_t
+smcp_timer_queue_count(smcp_t self) {
+	return self->timer_count;
+}
+
+bool
+smcp_timer_is_scheduled(
+	smcp_t self, smcp_timer_t timer
+) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	return timer->heap_slot
+		&& (timer->heap_slot <= self->timer_count)
+		&& (self->timer_heap[timer->heap_slot - 1] == timer);
+}
+
+#else // SMCP_TIMERS_USE_HEAP
+
+static ll_compare_result_t
+smcp_timer_compare_func(
+	const void* lhs_, const void* rhs_, void* context
+) {
+	return smcp_timer_compare_fire_dates((smcp_timer_t)lhs_, (smcp_timer_t)rhs_);
+}
+
+static smcp_status_t
+smcp_timer_queue_insert(smcp_t self, smcp_timer_t timer) {
+	ll_sorted_insert(
+		(void**)&self->timers,
+		timer,
+		&smcp_timer_compare_func,
+		NULL
+	);
+	return SMCP_STATUS_OK;
+}
+
+static void
+smcp_timer_queue_remove(smcp_t self, smcp_timer_t timer) {
+	ll_remove((void**)&self->timers, (void*)timer);
+	timer->ll.next = NULL;
+	timer->ll.prev = NULL;
+}
+
+static smcp_timer_t
+smcp_timer_queue_first(smcp_t self) {
+	return self->timers;
+}
+
+static size_t
+smcp_timer_queue_count(smcp_t self) {
+	return ll_count(self->timers);
+}
+
 bool
 smcp_timer_is_scheduled(
 	smcp_t self, smcp_timer_t timer
@@ -160,6 +387,10 @@ smcp_timer_is_scheduled(
 	return timer->ll.next || timer->ll.prev || (self->timers == timer);
 }
 
+#endif // SMCP_TIMERS_USE_HEAP
+
+// MARK: -
+
 smcp_status_t
 smcp_schedule_timer(
 	smcp_t	self,
@@ -172,35 +403,27 @@ smcp_schedule_timer(
 	assert(self!=NULL);
 	assert(timer!=NULL);
 
-	// Make sure we aren't already part of the list.
-	require(!timer->ll.next, bail);
-	require(!timer->ll.prev, bail);
-	require(self->timers != timer, bail);
+	// Make sure we aren't already scheduled.
+	require(!smcp_timer_is_scheduled(self, timer), bail);
 
 	DEBUG_PRINTF("Timer:%p: Scheduling to fire in %dms ...",timer,cms);
 #if SMCP_DEBUG_TIMERS
-	size_t previousTimerCount = ll_count(self->timers);
+	size_t previousTimerCount = smcp_timer_queue_count(self);
 #endif
 
 	if(cms<0)
 		cms = 0;
 
-	convert_cms_to_timeval(&timer->fire_date, cms);
+	timer->fire_date = smcp_convert_cms_to_timestamp(self, cms);
 
-	ll_sorted_insert(
-		    (void**)&self->timers,
-		timer,
-		&smcp_timer_compare_func,
-		NULL
-	);
-
-	ret = SMCP_STATUS_OK;
+	ret = smcp_timer_queue_insert(self, timer);
+	require_noerr(ret, bail);
 
 	DEBUG_PRINTF("Timer:%p(CTX=%p): Scheduled.",timer,timer->context);
-	DEBUG_PRINTF("%p: Timers in play = %d",self,(int)ll_count(self->timers));
+	DEBUG_PRINTF("%p: Timers in play = %d",self,(int)smcp_timer_queue_count(self));
 
 #if SMCP_DEBUG_TIMERS
-	assert((ll_count(self->timers)) == previousTimerCount+1);
+	assert(smcp_timer_queue_count(self) == previousTimerCount+1);
 #endif
 
 bail:
@@ -214,7 +437,7 @@ smcp_invalidate_timer(
 ) {
 	SMCP_EMBEDDED_SELF_HOOK;
 #if SMCP_DEBUG_TIMERS
-	size_t previousTimerCount = ll_count(self->timers);
+	size_t previousTimerCount = smcp_timer_queue_count(self);
 	// Sanity check. If we don't have at least one timer
 	// then we know something is off.
 	check(previousTimerCount>=1);
@@ -223,17 +446,31 @@ smcp_invalidate_timer(
 	DEBUG_PRINTF("Timer:%p: Invalidating...",timer);
 	DEBUG_PRINTF("Timer:%p: (CTX=%p)",timer,timer->context);
 
-	ll_remove((void**)&self->timers, (void*)timer);
+	smcp_timer_queue_remove(self, timer);
 
 #if SMCP_DEBUG_TIMERS
-	check((ll_count(self->timers)) == previousTimerCount-1);
+	check(smcp_timer_queue_count(self) == previousTimerCount-1);
 #endif
-	timer->ll.next = NULL;
-	timer->ll.prev = NULL;
 	if(timer->cancel)
 		(*timer->cancel)(self,timer->context);
 	DEBUG_PRINTF("Timer:%p: Invalidated.",timer);
-	DEBUG_PRINTF("%p: Timers in play = %d",self,(int)ll_count(self->timers));
+	DEBUG_PRINTF("%p: Timers in play = %d",self,(int)smcp_timer_queue_count(self));
+}
+
+void
+smcp_release_timers(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	smcp_timer_t timer;
+
+	while((timer = smcp_timer_queue_first(self))) {
+		smcp_invalidate_timer(self, timer);
+	}
+
+#if SMCP_TIMERS_USE_HEAP
+	free(self->timer_heap);
+	self->timer_heap = NULL;
+	self->timer_capacity = 0;
+#endif
 }
 
 #if SMCP_DEBUG_TIMERS || VERBOSE_DEBUG
@@ -241,11 +478,17 @@ void
 smcp_dump_all_timers(smcp_t self) {
 	smcp_timer_t iter;
 
-	if(self->timers) {
+	if(smcp_timer_queue_first(self)) {
 		DEBUG_PRINTF("smcp(%p): Current Timers:",self);
 
+#if SMCP_TIMERS_USE_HEAP
+		uint32_t i;
+		for(i = 0;i < self->timer_count;i++) {
+			iter = self->timer_heap[i];
+#else
 		for(iter = self->timers;iter;iter = (void*)iter->ll.next) {
-			DEBUG_PRINTF("\t* [%p] expires-in:%dms context:%p",iter,convert_timeval_to_cms(&iter->fire_date),iter->context);
+#endif
+			DEBUG_PRINTF("\t* [%p] expires-in:%dms context:%p",iter,smcp_convert_timestamp_to_cms(self, iter->fire_date),iter->context);
 		}
 	} else {
 		DEBUG_PRINTF("smcp(%p): No timers active.",self);
@@ -257,9 +500,10 @@ cms_t
 smcp_get_timeout(smcp_t self) {
 	cms_t ret = SMCP_MAX_TIMEOUT;
 	SMCP_EMBEDDED_SELF_HOOK;
+	smcp_timer_t const next = smcp_timer_queue_first(self);
 
-	if(self->timers)
-		ret = MIN(ret, convert_timeval_to_cms(&self->timers->fire_date));
+	if(next)
+		ret = MIN(ret, smcp_convert_timestamp_to_cms(self, next->fire_date));
 
 	ret = MAX(ret, 0);
 
@@ -275,14 +519,23 @@ smcp_get_timeout(smcp_t self) {
 void
 smcp_handle_timers(smcp_t self) {
 	SMCP_EMBEDDED_SELF_HOOK;
-	if(	self->timers
-		&& (convert_timeval_to_cms(&self->timers->fire_date) <= 0)
-	) {
-		SMCP_NON_RECURSIVE smcp_timer_t timer;
-		SMCP_NON_RECURSIVE smcp_timer_callback_t callback;
-		SMCP_NON_RECURSIVE void* context;
+	SMCP_NON_RECURSIVE smcp_timer_t timer;
+	SMCP_NON_RECURSIVE smcp_timer_callback_t callback;
+	SMCP_NON_RECURSIVE void* context;
+	SMCP_NON_RECURSIVE smcp_timestamp_t now;
+	SMCP_NON_RECURSIVE size_t remaining;
+
+	// Fire every timer that has expired as of now. Timers that are
+	// (re)scheduled by the callbacks are bounded by the number of
+	// timers we started with, so a timer that keeps rescheduling
+	// itself for "now" can't keep us here forever.
+	now = smcp_get_current_time(self);
+	remaining = smcp_timer_queue_count(self);
+
+	while(remaining-- && (timer = smcp_timer_queue_first(self))) {
+		if(timer->fire_date > now)
+			break;
 
-		timer = self->timers;
 		callback = timer->callback;
 		context = timer->context;
 
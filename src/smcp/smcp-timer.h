@@ -44,6 +44,11 @@
 #define smcp_invalidate_timer(self,...)		smcp_invalidate_timer(__VA_ARGS__)
 #define smcp_handle_timers(self,...)		smcp_handle_timers(__VA_ARGS__)
 #define smcp_timer_is_scheduled(self,...)		smcp_timer_is_scheduled(__VA_ARGS__)
+#define smcp_release_timers(self)		smcp_release_timers()
+#define smcp_get_current_time(self)		smcp_get_current_time()
+#define smcp_refresh_current_time(self)		smcp_refresh_current_time()
+#define smcp_convert_cms_to_timestamp(self,...)		smcp_convert_cms_to_timestamp(__VA_ARGS__)
+#define smcp_convert_timestamp_to_cms(self,...)		smcp_convert_timestamp_to_cms(__VA_ARGS__)
 #endif
 
 #ifndef MSEC_PER_SEC
@@ -58,6 +63,10 @@
 #define USEC_PER_SEC    (1000000)
 #endif
 
+#ifndef NSEC_PER_MSEC
+#define NSEC_PER_MSEC   (1000000)
+#endif
+
 __BEGIN_DECLS
 /*!	@addtogroup smcp
 **	@{
@@ -71,16 +80,49 @@ __BEGIN_DECLS
 **
 **	 * Relative time (`cms_t`), measured in milliseconds from "now". The future
 **	   is positive and the past is negative.
-**	 * Absolute time (`struct timeval`), measured from some platform-specific
-**     reference epoc.
+**	 * Absolute time (`smcp_timestamp_t`), measured in milliseconds on a
+**	   monotonic clock from some platform-specific reference point.
 **
 **	The relative notation is convenient for specifying timeouts and such,
 **	but the individual timers store their firing time in absolute time.
-**	You can convert between relative time and absolute time using
-**	`convert_cms_to_timeval()` and back again using `convert_timeval_to_cms()`.
+**	You can convert between the two using `smcp_convert_cms_to_timestamp()`
+**	and `smcp_convert_timestamp_to_cms()`.
+**
+**	Absolute time comes from the clock function set with
+**	`smcp_set_clock_func()`, which defaults to `CLOCK_MONOTONIC` where
+**	available so that timers are unaffected by changes to the wall clock.
+**	While smcp_process() is running, "now" is read once and cached, so
+**	handling a batch of packets and timers costs a single clock read.
 **
+**	The older `struct timeval` functions are still available for
+**	measuring wall-clock time, but are no longer used by the timers.
 */
 
+//!	Absolute time on the monotonic clock, in milliseconds.
+typedef int64_t smcp_timestamp_t;
+
+//!	Returns the current absolute time, in milliseconds.
+typedef smcp_timestamp_t (*smcp_clock_func_t)(void);
+
+//!	Replaces the clock used for all timers. Pass NULL to restore the default.
+/*!	This should be called before any instances are created. */
+SMCP_API_EXTERN void smcp_set_clock_func(smcp_clock_func_t func);
+
+//!	Reads the default platform monotonic clock.
+SMCP_API_EXTERN smcp_timestamp_t smcp_default_clock_func(void);
+
+//!	Returns "now", which is cached for the duration of smcp_process().
+SMCP_API_EXTERN smcp_timestamp_t smcp_get_current_time(smcp_t self);
+
+//!	Reads the clock and caches the result until smcp_process() returns.
+SMCP_API_EXTERN void smcp_refresh_current_time(smcp_t self);
+
+//!	Converts relative time from 'now' into an absolute time.
+SMCP_API_EXTERN smcp_timestamp_t smcp_convert_cms_to_timestamp(smcp_t self, cms_t cms);
+
+//!	Converts an absolute time into milliseconds from 'now', clamped to be non-negative.
+SMCP_API_EXTERN cms_t smcp_convert_timestamp_to_cms(smcp_t self, smcp_timestamp_t timestamp);
+
 //!< Converts relative time from 'now' into an absolute time.
 SMCP_API_EXTERN void convert_cms_to_timeval(
 	struct timeval* tv, //!< [OUT] Pointer to timeval struct.
@@ -93,8 +135,12 @@ SMCP_API_EXTERN cms_t convert_timeval_to_cms(const struct timeval* tv);
 typedef void (*smcp_timer_callback_t)(smcp_t, void*);
 
 typedef struct smcp_timer_s {
+#if SMCP_TIMERS_USE_HEAP
+	uint32_t				heap_slot;	//!< Heap index plus one, zero if not scheduled.
+#else
 	struct ll_item_s		ll;
-	struct timeval			fire_date;
+#endif
+	smcp_timestamp_t		fire_date;
 	void*					context;
 	smcp_timer_callback_t	callback;
 	smcp_timer_callback_t	cancel;
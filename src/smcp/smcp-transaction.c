@@ -68,10 +68,262 @@ smcp_transaction_compare_msg_id(
 }
 #endif
 
+#if SMCP_TRANSACTIONS_USE_HASH
+// MARK: -
+// MARK: Transaction Index
+
+/*	Transactions are indexed by two open-addressing hash tables using
+**	linear probing: one keyed by message id, and one keyed by token and
+**	remote address. Multicast transactions are keyed by token alone,
+**	since the response can come from anyone. Each slot keeps the full
+**	hash so that growing the table doesn't need to look at the keys.
+**	Removed entries leave tombstones, which are purged when the table
+**	is rebuilt. If the table ever fails to grow, lookups fall back to
+**	a linear search.
+*/
+
+#define SMCP_TRANSACTION_INDEX_TOMBSTONE		((smcp_transaction_t)(uintptr_t)1)
+#define SMCP_TRANSACTION_INDEX_MIN_CAPACITY		(16)
+
+struct smcp_transaction_index_key_s {
+	coap_msg_id_t			id;
+	const smcp_sockaddr_t*	saddr;
+};
+
+typedef bool (*smcp_transaction_index_match_func)(
+	smcp_transaction_t transaction,
+	const struct smcp_transaction_index_key_s* key
+);
+
+static uint32_t
+smcp_transaction_hash_msg_id(coap_msg_id_t msg_id) {
+	return (uint32_t)msg_id * 2654435761u;
+}
+
+static uint32_t
+smcp_transaction_hash_token(coap_msg_id_t token, const smcp_sockaddr_t* saddr) {
+	struct fasthash_state_s state;
+
+	fasthash_start(&state, token);
+
+	if(saddr) {
+		fasthash_feed(&state, (const uint8_t*)&saddr->smcp_addr, sizeof(saddr->smcp_addr));
+		fasthash_feed(&state, (const uint8_t*)&saddr->smcp_port, sizeof(saddr->smcp_port));
+	}
+
+	return fasthash_finish_uint32(&state);
+}
+
+static uint32_t
+smcp_transaction_token_hash_for(smcp_transaction_t transaction) {
+	return smcp_transaction_hash_token(
+		transaction->token,
+		transaction->multicast?NULL:&transaction->saddr
+	);
+}
+
+static bool
+smcp_transaction_match_msg_id(
+	smcp_transaction_t transaction,
+	const struct smcp_transaction_index_key_s* key
+) {
+	return transaction->msg_id == key->id;
+}
+
+static bool
+smcp_transaction_match_token(
+	smcp_transaction_t transaction,
+	const struct smcp_transaction_index_key_s* key
+) {
+	if(transaction->token != key->id)
+		return false;
+
+	if(key->saddr == NULL)
+		return transaction->multicast;
+
+	return !transaction->multicast
+		&& (0 == memcmp(&transaction->saddr.smcp_addr, &key->saddr->smcp_addr, sizeof(key->saddr->smcp_addr)))
+		&& (transaction->saddr.smcp_port == key->saddr->smcp_port);
+}
+
+static bool
+smcp_transaction_index_resize(struct smcp_transaction_index_s* index, uint32_t capacity) {
+	struct smcp_transaction_index_slot_s* const old_slots = index->slots;
+	const uint32_t old_capacity = index->capacity;
+	uint32_t i;
+
+	index->slots = calloc(capacity, sizeof(*index->slots));
+
+	if(!index->slots) {
+		index->slots = old_slots;
+		return false;
+	}
+
+	index->capacity = capacity;
+	index->used = index->count;
+
+	for(i = 0; i < old_capacity; i++) {
+		smcp_transaction_t const transaction = old_slots[i].transaction;
+		uint32_t slot;
+
+		if(!transaction || transaction == SMCP_TRANSACTION_INDEX_TOMBSTONE)
+			continue;
+
+		slot = old_slots[i].hash & (capacity - 1);
+		while(index->slots[slot].transaction)
+			slot = (slot + 1) & (capacity - 1);
+
+		index->slots[slot] = old_slots[i];
+	}
+
+	free(old_slots);
+	return true;
+}
+
+static void
+smcp_transaction_index_insert(
+	struct smcp_transaction_index_s* index,
+	uint32_t hash,
+	smcp_transaction_t transaction
+) {
+	uint32_t slot;
+
+	// Keep the load factor (including tombstones) at or below one half.
+	if((index->used + 1) * 2 > index->capacity) {
+		uint32_t capacity = SMCP_TRANSACTION_INDEX_MIN_CAPACITY;
+
+		while(capacity < (index->count + 1) * 4)
+			capacity *= 2;
+
+		if(!smcp_transaction_index_resize(index, capacity)) {
+			index->overflowed = true;
+			return;
+		}
+	}
+
+	slot = hash & (index->capacity - 1);
+
+	while(index->slots[slot].transaction
+		&& index->slots[slot].transaction != SMCP_TRANSACTION_INDEX_TOMBSTONE
+	) {
+		slot = (slot + 1) & (index->capacity - 1);
+	}
+
+	if(!index->slots[slot].transaction)
+		index->used++;
+
+	index->slots[slot].hash = hash;
+	index->slots[slot].transaction = transaction;
+	index->count++;
+}
+
+static void
+smcp_transaction_index_remove(
+	struct smcp_transaction_index_s* index,
+	uint32_t hash,
+	smcp_transaction_t transaction
+) {
+	uint32_t slot;
+
+	if(!index->capacity)
+		return;
+
+	slot = hash & (index->capacity - 1);
+
+	while(index->slots[slot].transaction) {
+		if(index->slots[slot].transaction == transaction) {
+			index->slots[slot].transaction = SMCP_TRANSACTION_INDEX_TOMBSTONE;
+			index->count--;
+			break;
+		}
+		slot = (slot + 1) & (index->capacity - 1);
+	}
+}
+
+static smcp_transaction_t
+smcp_transaction_index_find(
+	const struct smcp_transaction_index_s* index,
+	uint32_t hash,
+	smcp_transaction_index_match_func match,
+	const struct smcp_transaction_index_key_s* key
+) {
+	uint32_t slot;
+
+	if(!index->capacity)
+		return NULL;
+
+	slot = hash & (index->capacity - 1);
+
+	while(index->slots[slot].transaction) {
+		smcp_transaction_t const transaction = index->slots[slot].transaction;
+
+		if(transaction != SMCP_TRANSACTION_INDEX_TOMBSTONE
+			&& index->slots[slot].hash == hash
+			&& (*match)(transaction, key)
+		) {
+			return transaction;
+		}
+		slot = (slot + 1) & (index->capacity - 1);
+	}
+
+	return NULL;
+}
+
+static void
+smcp_transaction_index_add(smcp_t self, smcp_transaction_t handler) {
+	if(handler->indexed)
+		return;
+
+	smcp_transaction_index_insert(
+		&self->transactions_by_msg_id,
+		smcp_transaction_hash_msg_id(handler->msg_id),
+		handler
+	);
+	smcp_transaction_index_insert(
+		&self->transactions_by_token,
+		smcp_transaction_token_hash_for(handler),
+		handler
+	);
+	handler->indexed = true;
+}
+
+static void
+smcp_transaction_index_drop(smcp_t self, smcp_transaction_t handler) {
+	if(!handler->indexed)
+		return;
+
+	smcp_transaction_index_remove(
+		&self->transactions_by_msg_id,
+		smcp_transaction_hash_msg_id(handler->msg_id),
+		handler
+	);
+	smcp_transaction_index_remove(
+		&self->transactions_by_token,
+		smcp_transaction_token_hash_for(handler),
+		handler
+	);
+	handler->indexed = false;
+}
+#endif // SMCP_TRANSACTIONS_USE_HASH
+
+// MARK: -
+
 smcp_transaction_t
 smcp_transaction_find_via_msg_id(smcp_t self, coap_msg_id_t msg_id) {
 	SMCP_EMBEDDED_SELF_HOOK;
 
+#if SMCP_TRANSACTIONS_USE_HASH
+	if(!self->transactions_by_msg_id.overflowed) {
+		struct smcp_transaction_index_key_s key = { msg_id, NULL };
+		return smcp_transaction_index_find(
+			&self->transactions_by_msg_id,
+			smcp_transaction_hash_msg_id(msg_id),
+			&smcp_transaction_match_msg_id,
+			&key
+		);
+	}
+#endif
+
 #if SMCP_TRANSACTIONS_USE_BTREE
 	return (smcp_transaction_t)bt_find(
 		(void*)&self->transactions,
@@ -104,6 +356,90 @@ smcp_transaction_find_via_token(smcp_t self, coap_msg_id_t token) {
 	return ret;
 }
 
+smcp_transaction_t
+smcp_transaction_find_via_token_and_saddr(
+	smcp_t self,
+	coap_msg_id_t token,
+	const smcp_sockaddr_t* saddr
+) {
+	SMCP_EMBEDDED_SELF_HOOK;
+	smcp_transaction_t ret;
+
+#if SMCP_TRANSACTIONS_USE_HASH
+	if(!self->transactions_by_token.overflowed) {
+		struct smcp_transaction_index_key_s key = { token, saddr };
+
+		// Try for a unicast match first, then a multicast one.
+		ret = smcp_transaction_index_find(
+			&self->transactions_by_token,
+			smcp_transaction_hash_token(token, saddr),
+			&smcp_transaction_match_token,
+			&key
+		);
+
+		if(!ret) {
+			key.saddr = NULL;
+			ret = smcp_transaction_index_find(
+				&self->transactions_by_token,
+				smcp_transaction_hash_token(token, NULL),
+				&smcp_transaction_match_token,
+				&key
+			);
+		}
+
+		return ret;
+	}
+#endif
+
+	// Ouch. Linear search.
+#if SMCP_TRANSACTIONS_USE_BTREE
+	ret = bt_first(self->transactions);
+#else
+	ret = self->transactions;
+#endif
+
+	while(ret) {
+		if(ret->token == token
+			&& (ret->multicast
+				|| ((0 == memcmp(&ret->saddr.smcp_addr, &saddr->smcp_addr, sizeof(saddr->smcp_addr)))
+					&& ret->saddr.smcp_port == saddr->smcp_port)
+			)
+		) {
+			break;
+		}
+#if SMCP_TRANSACTIONS_USE_BTREE
+		ret = bt_next(ret);
+#else
+		ret = ll_next((void*)ret);
+#endif
+	}
+
+	return ret;
+}
+
+void
+smcp_transaction_set_saddr(
+	smcp_t self,
+	smcp_transaction_t handler,
+	const smcp_sockaddr_t* saddr
+) {
+	SMCP_EMBEDDED_SELF_HOOK;
+#if SMCP_TRANSACTIONS_USE_HASH
+	const bool was_indexed = handler->indexed;
+
+	if(was_indexed)
+		smcp_transaction_index_drop(self, handler);
+#endif
+
+	memcpy(&handler->saddr, saddr, sizeof(handler->saddr));
+	handler->multicast = SMCP_IS_ADDR_MULTICAST(&saddr->smcp_addr);
+
+#if SMCP_TRANSACTIONS_USE_HASH
+	if(was_indexed)
+		smcp_transaction_index_add(self, handler);
+#endif
+}
+
 static void
 smcp_internal_delete_transaction_(
 	smcp_transaction_t handler,
@@ -120,6 +456,10 @@ smcp_internal_delete_transaction_(
 	ll_remove((void**)&self->transactions,(void*)handler);
 #endif
 
+#if SMCP_TRANSACTIONS_USE_HASH
+	smcp_transaction_index_drop(self, handler);
+#endif
+
 	// Remove the timer associated with this handler.
 	smcp_invalidate_timer(self, &handler->timer);
 
@@ -136,6 +476,9 @@ smcp_internal_delete_transaction_(
 #if SMCP_AVOID_MALLOC
 	if(handler->should_dealloc)
 		handler->callback = NULL;
+#elif SMCP_USE_SLAB_ALLOCATOR
+	if(handler->should_dealloc)
+		smcp_slab_free(handler);
 #else
 	if(handler->should_dealloc)
 		free(handler);
@@ -178,10 +521,18 @@ smcp_transaction_new_msg_id(
 	);
 #endif
 
+#if SMCP_TRANSACTIONS_USE_HASH
+	smcp_transaction_index_drop(self, handler);
+#endif
+
 	assert(!smcp_transaction_find_via_msg_id(self, msg_id));
 
 	handler->msg_id = msg_id;
 
+#if SMCP_TRANSACTIONS_USE_HASH
+	smcp_transaction_index_add(self, handler);
+#endif
+
 #if SMCP_TRANSACTIONS_USE_BTREE
 	bt_insert(
 		(void**)&self->transactions,
@@ -203,10 +554,12 @@ smcp_internal_transaction_timeout_(
 ) {
 	smcp_status_t status = SMCP_STATUS_TIMEOUT;
 	void* context = handler->context;
-	cms_t cms = convert_timeval_to_cms(&handler->expiration);
+	cms_t cms = smcp_convert_timestamp_to_cms(self, handler->expiration);
 
 	self->current_transaction = handler;
-	if((cms > 0) || (0==handler->attemptCount)) {
+
+	// Waiting on DNS doesn't count as an attempt, but it can still expire.
+	if((cms > 0) || ((0==handler->attemptCount) && !handler->waiting_for_dns)) {
 		if(	(handler->flags&SMCP_TRANSACTION_KEEPALIVE)
 			&& (cms > SMCP_OBSERVATION_KEEPALIVE_INTERVAL)
 		) {
@@ -229,6 +582,8 @@ smcp_internal_transaction_timeout_(
 
 			status = handler->resendCallback(context);
 
+			handler->waiting_for_dns = (status == SMCP_STATUS_WAIT_FOR_DNS);
+
 			if(status == SMCP_STATUS_OK) {
 				cms = MIN(cms,calc_retransmit_timeout(handler->attemptCount));
 
@@ -260,10 +615,11 @@ smcp_internal_transaction_timeout_(
 		handler->attemptCount = 0;
 		handler->last_observe = 0;
 #if SMCP_CONF_TRANS_ENABLE_BLOCK2
+		handler->next_block1 = 0;
 		handler->next_block2 = 0;
 #endif
 		smcp_transaction_new_msg_id(self,handler,smcp_get_next_msg_id(self));
-		convert_cms_to_timeval(&handler->expiration, SMCP_OBSERVATION_DEFAULT_MAX_AGE);
+		handler->expiration = smcp_convert_cms_to_timestamp(self, SMCP_OBSERVATION_DEFAULT_MAX_AGE);
 
 		if(handler->resendCallback) {
 			// In this case we will be reattempting for a given duration.
@@ -335,6 +691,12 @@ smcp_transaction_init(
 				break;
 			handler = NULL;
 		}
+#elif SMCP_USE_SLAB_ALLOCATOR
+		smcp_t const self = smcp_get_current_instance();
+		handler = (smcp_transaction_t)smcp_slab_alloc(
+			self ? &self->transaction_slab : NULL,
+			sizeof(*handler)
+		);
 #else
 		handler = (smcp_transaction_t)calloc(sizeof(*handler), 1);
 #endif
@@ -393,6 +755,10 @@ smcp_transaction_begin(
 	ll_remove((void**)&self->transactions,(void*)handler);
 #endif
 
+#if SMCP_TRANSACTIONS_USE_HASH
+	smcp_transaction_index_drop(self, handler);
+#endif
+
 	if (expiration<0) {
 		expiration = (cms_t)(COAP_EXCHANGE_LIFETIME*MSEC_PER_SEC);
 	}
@@ -405,10 +771,11 @@ smcp_transaction_begin(
 	handler->last_observe = 0;
 #endif
 #if SMCP_CONF_TRANS_ENABLE_BLOCK2
+	handler->next_block1 = 0;
 	handler->next_block2 = 0;
 #endif
 	handler->active = 1;
-	convert_cms_to_timeval(&handler->expiration, expiration);
+	handler->expiration = smcp_convert_cms_to_timestamp(self, expiration);
 
 	if(handler->resendCallback) {
 		// In this case we will be reattempting for a given duration.
@@ -454,6 +821,9 @@ smcp_transaction_begin(
 		(int)ll_count((void**)&self->transactions));
 #endif
 
+#if SMCP_TRANSACTIONS_USE_HASH
+	smcp_transaction_index_add(self, handler);
+#endif
 
 bail:
 	return 0;
@@ -496,6 +866,46 @@ smcp_transaction_end(
 	return 0;
 }
 
+void
+smcp_transaction_wake_dns_waiters(smcp_t self) {
+	smcp_transaction_t iter;
+
+#if SMCP_TRANSACTIONS_USE_BTREE
+	iter = bt_first(self->transactions);
+#else
+	iter = self->transactions;
+#endif
+
+	while(iter) {
+		if(iter->waiting_for_dns && smcp_timer_is_scheduled(self, &iter->timer)) {
+			iter->waiting_for_dns = false;
+			smcp_invalidate_timer(self, &iter->timer);
+			smcp_schedule_timer(self, &iter->timer, 0);
+		}
+#if SMCP_TRANSACTIONS_USE_BTREE
+		iter = bt_next(iter);
+#else
+		iter = ll_next((void*)iter);
+#endif
+	}
+}
+
+void
+smcp_release_transactions(smcp_t self) {
+	SMCP_EMBEDDED_SELF_HOOK;
+
+	while(self->transactions) {
+		smcp_transaction_end(self, self->transactions);
+	}
+
+#if SMCP_TRANSACTIONS_USE_HASH
+	free(self->transactions_by_msg_id.slots);
+	free(self->transactions_by_token.slots);
+	memset(&self->transactions_by_msg_id, 0, sizeof(self->transactions_by_msg_id));
+	memset(&self->transactions_by_token, 0, sizeof(self->transactions_by_token));
+#endif
+}
+
 smcp_status_t
 smcp_handle_response() {
 	smcp_status_t ret = 0;
@@ -528,7 +938,7 @@ smcp_handle_response() {
 
 		if (NULL == handler) {
 			if (self->inbound.packet->tt < COAP_TRANS_TYPE_ACK) {
-				handler = smcp_transaction_find_via_token(self,token);
+				handler = smcp_transaction_find_via_token_and_saddr(self,token,&self->inbound.saddr);
 			}
 		} else if (smcp_inbound_get_packet()->code != COAP_CODE_EMPTY
 			&& token != handler->token
@@ -632,7 +1042,7 @@ smcp_handle_response() {
 					cms = SMCP_OBSERVATION_DEFAULT_MAX_AGE;
 			}
 
-			convert_cms_to_timeval(&handler->expiration, cms);
+			handler->expiration = smcp_convert_cms_to_timestamp(self, cms);
 
 			if(	(handler->flags&SMCP_TRANSACTION_KEEPALIVE)
 				&& cms>SMCP_OBSERVATION_KEEPALIVE_INTERVAL
@@ -695,7 +1105,7 @@ smcp_handle_response() {
 							cms = SMCP_OBSERVATION_DEFAULT_MAX_AGE;
 					}
 
-					convert_cms_to_timeval(&handler->expiration, cms);
+					handler->expiration = smcp_convert_cms_to_timestamp(self, cms);
 
 					if(	(handler->flags&SMCP_TRANSACTION_KEEPALIVE)
 						&& cms>SMCP_OBSERVATION_KEEPALIVE_INTERVAL
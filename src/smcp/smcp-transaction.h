@@ -50,6 +50,9 @@
 #define smcp_transaction_end(self,...)		smcp_transaction_end(__VA_ARGS__)
 #define smcp_transaction_new_msg_id(self,...)		smcp_transaction_new_msg_id(__VA_ARGS__)
 #define smcp_transaction_tickle(self,...)		smcp_transaction_tickle(__VA_ARGS__)
+#define smcp_transaction_find_via_token_and_saddr(self,...)		smcp_transaction_find_via_token_and_saddr(__VA_ARGS__)
+#define smcp_transaction_set_saddr(self,...)		smcp_transaction_set_saddr(__VA_ARGS__)
+#define smcp_release_transactions(self)		smcp_release_transactions()
 #endif
 
 #define SMCP_TRANSACTION_MAX_ATTEMPTS	15
@@ -86,7 +89,7 @@ struct smcp_transaction_s {
 	// not observable, the expiration is when the transaction should
 	// be "timed out". If it is observable, it is when the
 	// max-age expires and we need to restart observing.
-	struct timeval				expiration;
+	smcp_timestamp_t			expiration;
 	struct smcp_timer_s			timer;
 
 	coap_msg_id_t				token;
@@ -102,6 +105,7 @@ struct smcp_transaction_s {
 #endif
 
 #if SMCP_CONF_TRANS_ENABLE_BLOCK2
+	uint32_t					next_block1;
 	uint32_t					next_block2;
 #endif
 
@@ -113,7 +117,9 @@ struct smcp_transaction_s {
 								should_dealloc:1,
 								active:1,
 								needs_to_close_observe:1,
-								multicast:1;
+								multicast:1,
+								indexed:1,
+								waiting_for_dns:1;
 };
 
 typedef struct smcp_transaction_s* smcp_transaction_t;
@@ -52,6 +52,68 @@
 
 #define BAD_KEY_INDEX		(255)
 
+#define ETAG_LEN			(4)
+
+//	Fills `etag` with the ETag for the value at `key_index`.
+/*	The callback can supply something cheaper to hash than the value
+**	itself with SMCP_VAR_GET_ETAG. Otherwise the value is hashed, in
+**	which case it is left in `buffer` and `has_value` is set. */
+static smcp_status_t
+smcp_variable_node_get_etag(
+	smcp_variable_node_t node,
+	uint8_t key_index,
+	char* buffer,
+	uint8_t etag[ETAG_LEN],
+	bool* has_value
+) {
+	smcp_status_t ret;
+	struct fasthash_state_s fasthash;
+	uint32_t hash;
+
+	*has_value = false;
+
+	// Callbacks that don't fill the buffer still leave us a string.
+	buffer[0] = 0;
+	ret = node->func(node,SMCP_VAR_GET_ETAG,key_index,buffer);
+
+	if(ret) {
+		buffer[0] = 0;
+		ret = node->func(node,SMCP_VAR_GET_VALUE,key_index,buffer);
+		require_noerr(ret,bail);
+		*has_value = true;
+	}
+
+	fasthash_start(&fasthash, 0);
+	fasthash_feed(&fasthash, (const uint8_t*)buffer,strlen(buffer));
+	hash = fasthash_finish_uint32(&fasthash);
+
+	etag[0] = (uint8_t)(hash >> 24);
+	etag[1] = (uint8_t)(hash >> 16);
+	etag[2] = (uint8_t)(hash >> 8);
+	etag[3] = (uint8_t)(hash);
+
+bail:
+	return ret;
+}
+
+//	Returns true if any inbound option with the given key holds `etag`.
+/*	An empty If-Match matches any current value. */
+static bool
+smcp_variable_node_etag_matches(coap_option_key_t key, const uint8_t etag[ETAG_LEN]) {
+	const uint8_t* value;
+	coap_size_t value_len;
+	int i;
+
+	for(i=0;smcp_inbound_get_nth_option(key,i,&value,&value_len);i++) {
+		if(key==COAP_OPTION_IF_MATCH && !value_len)
+			return true;
+		if(value_len==ETAG_LEN && 0==memcmp(value,etag,ETAG_LEN))
+			return true;
+	}
+
+	return false;
+}
+
 smcp_status_t
 smcp_variable_node_request_handler(
 	smcp_variable_node_t		node
@@ -69,6 +131,8 @@ smcp_variable_node_request_handler(
 	coap_size_t value_len;
 	bool needs_prefix = true;
 	char* prefix_name = "";
+	uint8_t etag[ETAG_LEN];
+	bool has_value;
 
 	content_type = smcp_inbound_get_content_type();
 	content_ptr = (char*)smcp_inbound_get_content_ptr();
@@ -108,9 +172,6 @@ smcp_variable_node_request_handler(
 					content_ptr = (char*)value+2;
 					content_len = value_len-2;
 				}
-//			} else if(key==COAP_OPTION_ETAG) {
-//			} else if(key==COAP_OPTION_IF_MATCH) {
-//			} else if(key==COAP_OPTION_IF_NONE_MATCH) {
 			} else if(key==COAP_OPTION_ACCEPT) {
 				reply_content_type = 0;
 				if(value_len==1)
@@ -162,6 +223,23 @@ smcp_variable_node_request_handler(
 			}
 		}
 
+		// The variable always exists, so If-None-Match can never be met.
+		// If-Match is met if the value is still the one the client saw.
+		if(smcp_inbound_get_option_count(COAP_OPTION_IF_NONE_MATCH)) {
+			ret = smcp_outbound_quick_response(COAP_RESULT_412_PRECONDITION_FAILED,NULL);
+			goto bail;
+		}
+
+		if(smcp_inbound_get_option_count(COAP_OPTION_IF_MATCH)) {
+			ret = smcp_variable_node_get_etag(node,key_index,buffer,etag,&has_value);
+			require_noerr(ret,bail);
+
+			if(!smcp_variable_node_etag_matches(COAP_OPTION_IF_MATCH,etag)) {
+				ret = smcp_outbound_quick_response(COAP_RESULT_412_PRECONDITION_FAILED,NULL);
+				goto bail;
+			}
+		}
+
 		// Make sure our content is zero terminated.
 		((char*)content_ptr)[content_len] = 0;
 
@@ -171,6 +249,10 @@ smcp_variable_node_request_handler(
 		ret = smcp_outbound_begin_response(COAP_RESULT_204_CHANGED);
 		require_noerr(ret,bail);
 
+		// Lets the client make its next change conditional on this one.
+		if(0==smcp_variable_node_get_etag(node,key_index,buffer,etag,&has_value))
+			smcp_outbound_add_option(COAP_OPTION_ETAG,(const char*)etag,ETAG_LEN);
+
 		ret = smcp_outbound_send();
 		require_noerr(ret,bail);
 	} else if(method == COAP_METHOD_GET) {
@@ -233,7 +315,8 @@ smcp_variable_node_request_handler(
 				}
 
 				// Observation flag
-				if(0==node->func(node,SMCP_VAR_GET_OBSERVABLE,key_index,NULL)) {
+				buffer[0] = 0;
+				if(0==node->func(node,SMCP_VAR_GET_OBSERVABLE,key_index,buffer)) {
 					content_ptr = stpncpy(content_ptr,";obs",MIN(4,(content_end_ptr-content_ptr)-1));
 				}
 
@@ -246,39 +329,54 @@ smcp_variable_node_request_handler(
 		} else {
 			coap_size_t replyContentLength = 0;
 			char *replyContent;
+			int32_t max_age = -1;
+			bool is_valid;
+			bool is_observable;
 
-			ret = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+			// Asked before the buffer ends up holding the value.
+			buffer[0] = 0;
+			is_observable = (0==node->func(node,SMCP_VAR_GET_OBSERVABLE,key_index,buffer));
+
+			buffer[0] = 0;
+			if(0==node->func(node,SMCP_VAR_GET_MAX_AGE,key_index,buffer)) {
+#if HAVE_STRTOL
+				max_age = strtol(buffer,NULL,0)&0xFFFFFF;
+#else
+				max_age = atoi(buffer)&0xFFFFFF;
+#endif
+			}
+
+			ret = smcp_variable_node_get_etag(node,key_index,buffer,etag,&has_value);
+			require_noerr(ret,bail);
+
+			// If the client already has this value, it only needs to hear
+			// that it is still good.
+			is_valid = smcp_variable_node_etag_matches(COAP_OPTION_ETAG,etag);
+
+			ret = smcp_outbound_begin_response(is_valid?COAP_RESULT_203_VALID:COAP_RESULT_205_CONTENT);
 			require_noerr(ret,bail);
 
-			if(0==node->func(node,SMCP_VAR_GET_OBSERVABLE,key_index,buffer)) {
+			if(is_observable) {
 				ret = smcp_observable_update(&node->observable, key_index);
 				check_string(ret==0,smcp_status_to_cstr(ret));
 			}
 
-			if(reply_content_type == SMCP_CONTENT_TYPE_APPLICATION_FORM_URLENCODED) {
-				uint32_t etag;
+			smcp_outbound_add_option(COAP_OPTION_ETAG,(const char*)etag,ETAG_LEN);
 
-				if(0==node->func(node,SMCP_VAR_GET_MAX_AGE,key_index,buffer)) {
-#if HAVE_STRTOL
-					uint32_t max_age = strtol(buffer,NULL,0)&0xFFFFFF;
-#else
-					uint32_t max_age = atoi(buffer)&0xFFFFFF;
-#endif
-					smcp_outbound_add_option_uint(COAP_OPTION_MAX_AGE, max_age);
-				}
+			if(max_age>=0)
+				smcp_outbound_add_option_uint(COAP_OPTION_MAX_AGE, max_age);
 
+			if(!is_valid && !has_value) {
+				buffer[0] = 0;
 				ret = node->func(node,SMCP_VAR_GET_VALUE,key_index,buffer);
 				require_noerr(ret,bail);
+			}
 
-				struct fasthash_state_s fasthash;
-				fasthash_start(&fasthash, 0);
-				fasthash_feed(&fasthash, (const uint8_t*)buffer,strlen(buffer));
-				etag = fasthash_finish_uint32(&fasthash);
-
+			if(is_valid) {
+				// A 2.03 has no content.
+			} else if(reply_content_type == SMCP_CONTENT_TYPE_APPLICATION_FORM_URLENCODED) {
 				smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE, SMCP_CONTENT_TYPE_APPLICATION_FORM_URLENCODED);
 
-				smcp_outbound_add_option_uint(COAP_OPTION_ETAG, etag);
-
 				replyContent = smcp_outbound_get_content_ptr(&replyContentLength);
 
 				*replyContent++ = 'v';
@@ -291,9 +389,6 @@ smcp_variable_node_request_handler(
 				);
 				ret = smcp_outbound_set_content_len(replyContentLength+2);
 			} else {
-				ret = node->func(node,SMCP_VAR_GET_VALUE,key_index,buffer);
-				require_noerr(ret,bail);
-
 				ret = smcp_outbound_append_content(buffer, SMCP_CSTR_LEN);
 			}
 
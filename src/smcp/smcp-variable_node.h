@@ -51,8 +51,8 @@ enum {
 	SMCP_VAR_SET_VALUE,
 	SMCP_VAR_GET_VALUE,
 	SMCP_VAR_GET_LF_TITLE,
-	SMCP_VAR_GET_MAX_AGE,
-	SMCP_VAR_GET_ETAG,
+	SMCP_VAR_GET_MAX_AGE,		//!< Optional. Max-Age of the value, in seconds.
+	SMCP_VAR_GET_ETAG,			//!< Optional. Any string that changes whenever the value does.
 	SMCP_VAR_GET_OBSERVABLE,
 };
 
@@ -0,0 +1,213 @@
+/*!	@file smcp-worker-pool.c
+**	@author Robert Quattlebaum <darco@deepdarc.com>
+**
+**	Copyright (C) 2014 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef VERBOSE_DEBUG
+#define VERBOSE_DEBUG 0
+#endif
+
+#ifndef DEBUG
+#define DEBUG VERBOSE_DEBUG
+#endif
+
+#include "assert-macros.h"
+
+#include "smcp.h"
+#include "smcp-worker-pool.h"
+
+#if SMCP_CONF_ENABLE_WORKER_POOL
+
+#include "smcp-internal.h"
+#include "smcp-logging.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+//!	How long a worker blocks in smcp_wait() before checking if it should stop.
+#ifndef SMCP_WORKER_POOL_WAIT_INTERVAL
+#define SMCP_WORKER_POOL_WAIT_INTERVAL		(250)
+#endif
+
+struct smcp_worker_s {
+	smcp_worker_pool_t	pool;
+	smcp_t				smcp;
+	pthread_t			thread;
+	bool				has_thread;
+};
+
+struct smcp_worker_pool_s {
+	volatile bool			should_stop;
+	bool					is_running;
+	int						count;
+	struct smcp_worker_s	workers[];
+};
+
+static void*
+smcp_worker_pool_thread_main(void* context) {
+	struct smcp_worker_s* const worker = context;
+
+	while(!worker->pool->should_stop) {
+		smcp_wait(worker->smcp, SMCP_WORKER_POOL_WAIT_INTERVAL);
+		smcp_process(worker->smcp);
+	}
+
+	return NULL;
+}
+
+smcp_worker_pool_t
+smcp_worker_pool_create(uint16_t port, int count) {
+	smcp_worker_pool_t ret = NULL;
+	int i;
+
+	require(count > 0, bail);
+
+	if(port == 0)
+		port = COAP_DEFAULT_PORT;
+
+	ret = calloc(1, sizeof(*ret) + sizeof(struct smcp_worker_s)*count);
+	require(ret != NULL, bail);
+
+	for(i = 0; i < count; i++) {
+		ret->workers[i].pool = ret;
+		ret->workers[i].smcp = smcp_create_reuseport(port);
+		require_action(
+			ret->workers[i].smcp != NULL,
+			bail,
+			(smcp_worker_pool_release(ret), ret = NULL)
+		);
+		ret->count++;
+	}
+
+bail:
+	return ret;
+}
+
+void
+smcp_worker_pool_release(smcp_worker_pool_t pool) {
+	int i;
+
+	require(pool != NULL, bail);
+
+	smcp_worker_pool_stop(pool);
+
+	for(i = 0; i < pool->count; i++) {
+		smcp_release(pool->workers[i].smcp);
+	}
+
+	free(pool);
+
+bail:
+	return;
+}
+
+int
+smcp_worker_pool_get_count(smcp_worker_pool_t pool) {
+	return pool->count;
+}
+
+smcp_t
+smcp_worker_pool_get_instance(smcp_worker_pool_t pool, int index) {
+	if(index < 0 || index >= pool->count)
+		return NULL;
+	return pool->workers[index].smcp;
+}
+
+void
+smcp_worker_pool_set_default_request_handler(
+	smcp_worker_pool_t pool,
+	smcp_request_handler_func request_handler,
+	void* context
+) {
+	int i;
+
+	check(!pool->is_running);
+
+	for(i = 0; i < pool->count; i++) {
+		smcp_set_default_request_handler(pool->workers[i].smcp, request_handler, context);
+	}
+}
+
+smcp_status_t
+smcp_worker_pool_start(smcp_worker_pool_t pool, int flags) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	int i = 0;
+
+	require_action(!pool->is_running, bail, ret = SMCP_STATUS_FAILURE);
+
+	pool->should_stop = false;
+	pool->is_running = true;
+
+	if(flags & SMCP_WORKER_POOL_FLAG_SKIP_FIRST)
+		i++;
+
+	for(; i < pool->count; i++) {
+		struct smcp_worker_s* const worker = &pool->workers[i];
+
+		errno = pthread_create(&worker->thread, NULL, &smcp_worker_pool_thread_main, worker);
+
+		require_action_string(
+			errno == 0,
+			bail,
+			(smcp_worker_pool_stop(pool), ret = SMCP_STATUS_ERRNO),
+			strerror(errno)
+		);
+
+		worker->has_thread = true;
+	}
+
+bail:
+	return ret;
+}
+
+void
+smcp_worker_pool_stop(smcp_worker_pool_t pool) {
+	int i;
+
+	pool->should_stop = true;
+
+	for(i = 0; i < pool->count; i++) {
+		struct smcp_worker_s* const worker = &pool->workers[i];
+
+		if(worker->has_thread) {
+			pthread_join(worker->thread, NULL);
+			worker->has_thread = false;
+		}
+	}
+
+	pool->is_running = false;
+}
+
+bool
+smcp_worker_pool_is_running(smcp_worker_pool_t pool) {
+	return pool->is_running;
+}
+
+#endif // SMCP_CONF_ENABLE_WORKER_POOL
@@ -0,0 +1,114 @@
+/*!	@file smcp-worker-pool.h
+**	@author Robert Quattlebaum <darco@deepdarc.com>
+**
+**	Copyright (C) 2014 Robert Quattlebaum
+**
+**	Permission is hereby granted, free of charge, to any person
+**	obtaining a copy of this software and associated
+**	documentation files (the "Software"), to deal in the
+**	Software without restriction, including without limitation
+**	the rights to use, copy, modify, merge, publish, distribute,
+**	sublicense, and/or sell copies of the Software, and to
+**	permit persons to whom the Software is furnished to do so,
+**	subject to the following conditions:
+**
+**	The above copyright notice and this permission notice shall
+**	be included in all copies or substantial portions of the
+**	Software.
+**
+**	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+**	KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+**	WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+**	PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+**	OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+**	OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+**	OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+**	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __SMCP_WORKER_POOL_H__
+#define __SMCP_WORKER_POOL_H__ 1
+
+#include "smcp.h"
+
+#if SMCP_CONF_ENABLE_WORKER_POOL
+
+__BEGIN_DECLS
+
+/*!	@addtogroup smcp
+**	@{
+*/
+
+/*!	@defgroup smcp-worker-pool Worker Pool
+**	@{
+**	@brief Spreading request handling across several threads.
+**
+**	A worker pool is a set of SMCP instances which are all bound to the
+**	same port using SO_REUSEPORT, each driven by its own thread. The
+**	kernel distributes inbound flows between the sockets, so requests
+**	from different peers can be handled on different cores.
+**
+**	The instances share nothing except what you give them. Typically
+**	every instance gets the same request handler and context (for
+**	example, a node tree via smcp_node_router_handler()), which must
+**	then be safe to use from several threads at once. Leaving the node
+**	tree alone while the pool is running is not enough by itself: any
+**	handler that keeps per-request state (asynchronous responses, or
+**	block-wise transfers in progress) or observer bookkeeping of its
+**	own must protect it, and a variable node is only as safe as its
+**	callback.
+**
+**	Observables may be shared between the instances. Each observer is
+**	registered with the instance that received its request, and
+**	smcp_observable_trigger() notifies the observers of every instance,
+**	whichever thread it is called from.
+*/
+
+struct smcp_worker_pool_s;
+typedef struct smcp_worker_pool_s *smcp_worker_pool_t;
+
+enum {
+	//!	Don't start a thread for instance zero; the caller will drive it.
+	SMCP_WORKER_POOL_FLAG_SKIP_FIRST = (1<<0),
+};
+
+//!	Creates `count` instances that all listen on `port`.
+SMCP_API_EXTERN smcp_worker_pool_t smcp_worker_pool_create(uint16_t port, int count);
+
+//!	Stops the worker threads and releases all of the instances.
+SMCP_API_EXTERN void smcp_worker_pool_release(smcp_worker_pool_t pool);
+
+//!	Returns the number of instances in the pool.
+SMCP_API_EXTERN int smcp_worker_pool_get_count(smcp_worker_pool_t pool);
+
+//!	Returns the instance at `index`, or NULL if it is out of range.
+SMCP_API_EXTERN smcp_t smcp_worker_pool_get_instance(smcp_worker_pool_t pool, int index);
+
+//!	Sets the default request handler for every instance in the pool.
+/*!	Must not be called while the pool is running. */
+SMCP_API_EXTERN void smcp_worker_pool_set_default_request_handler(
+	smcp_worker_pool_t pool,
+	smcp_request_handler_func request_handler,
+	void* context
+);
+
+//!	Starts a thread for each instance, which repeatedly waits and processes.
+SMCP_API_EXTERN smcp_status_t smcp_worker_pool_start(smcp_worker_pool_t pool, int flags);
+
+//!	Signals the worker threads to finish and waits for them to exit.
+/*!	After this returns, the node tree (or whatever else the handlers
+**	share) may be safely modified before calling smcp_worker_pool_start()
+**	again. */
+SMCP_API_EXTERN void smcp_worker_pool_stop(smcp_worker_pool_t pool);
+
+//!	Returns true if the worker threads are running.
+SMCP_API_EXTERN bool smcp_worker_pool_is_running(smcp_worker_pool_t pool);
+
+/*!	@} */
+/*!	@} */
+
+__END_DECLS
+
+#endif // SMCP_CONF_ENABLE_WORKER_POOL
+
+#endif // __SMCP_WORKER_POOL_H__
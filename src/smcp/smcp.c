@@ -130,18 +130,30 @@ smcp_release(smcp_t self) {
 	SMCP_EMBEDDED_SELF_HOOK;
 	require(self, bail);
 
+#if SMCP_OBSERVABLE_USE_REGISTRY
+	// Drop all observers
+	smcp_release_observers(self);
+#endif
+
 	// Delete all pending transactions
-	while(self->transactions) {
-		smcp_transaction_end(self, self->transactions);
-	}
+	smcp_release_transactions(self);
 
 	// Delete all timers
-	while(self->timers) {
-		smcp_timer_t timer = self->timers;
-		if(timer->cancel)
-			timer->cancel(self, timer->context);
-		smcp_invalidate_timer(self, timer);
-	}
+	smcp_release_timers(self);
+
+	// Forget all recently received messages
+	smcp_release_dupe_info(self);
+
+#if SMCP_USE_SLAB_ALLOCATOR
+	// Slabs stick around until their last object is freed.
+	smcp_slab_release(self->transaction_slab);
+	smcp_slab_release(self->node_slab);
+#endif
+
+#if SMCP_USE_BUFFER_POOL
+	// As does the buffer pool, for any packets still being held.
+	smcp_buffer_pool_release(self->buffer_pool);
+#endif
 
 	smcp_release_plat(self);
 
@@ -206,24 +218,17 @@ bail:
 smcp_status_t
 smcp_vhost_route(smcp_request_handler_func* func, void** context) {
 	smcp_t const self = smcp_get_current_instance();
-	coap_option_key_t key;
 
 	if(self->vhost_count) {
 		const uint8_t* value;
 		coap_size_t value_len = 0;
 
-		smcp_inbound_reset_next_option();
-
-		while((key = smcp_inbound_next_option(&value,&value_len))!=COAP_OPTION_INVALID) {
-			if(key >= COAP_OPTION_URI_HOST)
-				break;
-		}
+		if(smcp_inbound_get_nth_option(COAP_OPTION_URI_HOST, 0, &value, &value_len)) {
+			int i;
 
-		if(value_len>(sizeof(self->vhost[0].name)-1))
-			return SMCP_STATUS_INVALID_ARGUMENT;
+			if(value_len>(sizeof(self->vhost[0].name)-1))
+				return SMCP_STATUS_INVALID_ARGUMENT;
 
-		if(key == COAP_OPTION_URI_HOST) {
-			int i;
 			for(i=0;i<self->vhost_count;i++) {
 				if(strncmp(self->vhost[i].name,(const char*)value,value_len) && self->vhost[i].name[value_len]==0) {
 					*func = self->vhost[i].func;
@@ -246,12 +251,23 @@ smcp_status_t
 smcp_outbound_begin_async_response(coap_code_t code, struct smcp_async_response_s* x) {
 	smcp_status_t ret = 0;
 	smcp_t const self = smcp_get_current_instance();
-	self->inbound.packet = &x->request.header;
+	const struct coap_header_s* const request = smcp_async_response_get_request(x);
+
+	require_action_string(request!=NULL,bail,ret=SMCP_STATUS_INVALID_ARGUMENT,"Async response not started");
+
+	self->inbound.packet = request;
 	self->inbound.packet_len = x->request_len;
-	self->inbound.content_ptr = (char*)x->request.header.token + x->request.header.token_len;
+	self->inbound.content_ptr = (char*)request->token + request->token_len;
 	self->inbound.last_option_key = 0;
-	self->inbound.this_option = x->request.header.token;
+	self->inbound.this_option = request->token;
+	// The option index describes some other packet, so the
+	// random-access option getters must scan this one instead.
+	self->inbound.option_count = 0;
+	self->inbound.options_overflowed = true;
 	self->inbound.is_fake = true;
+#if SMCP_USE_BUFFER_POOL
+	self->inbound.buffer = x->request_buffer;
+#endif
 	self->inbound.saddr = x->remote_saddr;
 #if SMCP_USE_BSD_SOCKETS
 	self->inbound.pktinfo = x->pktinfo;
@@ -263,16 +279,16 @@ smcp_outbound_begin_async_response(coap_code_t code, struct smcp_async_response_
 
 	self->outbound.packet->msg_id = self->current_transaction->msg_id;
 
-	self->outbound.packet->tt = x->request.header.tt;
+	self->outbound.packet->tt = request->tt;
 
-	ret = smcp_outbound_set_token(x->request.header.token, x->request.header.token_len);
+	ret = smcp_outbound_set_token(request->token, request->token_len);
 	require_noerr(ret, bail);
 
 	ret = smcp_outbound_set_destaddr(&x->remote_saddr);
 
 	require_noerr(ret, bail);
 
-	assert(coap_verify_packet((const char*)x->request.bytes, x->request_len));
+	assert(coap_verify_packet((const char*)request, x->request_len));
 bail:
 	return ret;
 }
@@ -284,6 +300,24 @@ smcp_start_async_response(struct smcp_async_response_s* x, int flags) {
 
 	require_action_string(x!=NULL,bail,ret=SMCP_STATUS_INVALID_ARGUMENT,"NULL async_response arg");
 
+#if SMCP_USE_BUFFER_POOL
+	{
+		// Hang on to the request itself rather than copying it. This
+		// may be the very buffer that `x` already holds, so retain the
+		// new one before letting go of the old one.
+		smcp_buffer_t const buffer = smcp_inbound_retain_packet();
+
+		require_action_string(
+			buffer != NULL,
+			bail,
+			(smcp_outbound_quick_response(COAP_RESULT_503_SERVICE_UNAVAILABLE,NULL),ret=SMCP_STATUS_MALLOC_FAILURE),
+			"Unable to retain request for async response"
+		);
+
+		smcp_buffer_release(x->request_buffer);
+		x->request_buffer = buffer;
+	}
+#else
 	require_action_string(
 		smcp_inbound_get_packet_length()-smcp_inbound_get_content_len()<=sizeof(x->request),
 		bail,
@@ -291,10 +325,12 @@ smcp_start_async_response(struct smcp_async_response_s* x, int flags) {
 		"Request too big for async response"
 	);
 
+	memcpy(x->request.bytes,smcp_inbound_get_packet(),smcp_inbound_get_packet_length()-smcp_inbound_get_content_len());
+#endif
+
 	x->request_len = smcp_inbound_get_packet_length()-smcp_inbound_get_content_len();
-	memcpy(x->request.bytes,smcp_inbound_get_packet(),x->request_len);
 
-	assert(coap_verify_packet((const char*)x->request.bytes, x->request_len));
+	assert(coap_verify_packet((const char*)smcp_async_response_get_request(x), x->request_len));
 
 	memcpy(&x->remote_saddr,&self->inbound.saddr,sizeof(x->remote_saddr));
 #if SMCP_USE_BSD_SOCKETS
@@ -329,9 +365,11 @@ bail:
 
 smcp_status_t
 smcp_finish_async_response(struct smcp_async_response_s* x) {
-	// This method is largely a hook for future functionality.
-	// It doesn't really do much at the moment, but it may later.
 	x->request_len = 0;
+#if SMCP_USE_BUFFER_POOL
+	smcp_buffer_release(x->request_buffer);
+	x->request_buffer = NULL;
+#endif
 	return SMCP_STATUS_OK;
 }
 
@@ -393,6 +431,8 @@ const char* smcp_status_to_cstr(int x) {
 
 	case SMCP_STATUS_RESET: return "Transaction Reset"; break;
 	case SMCP_STATUS_URI_PARSE_FAILURE: return "URI Parse Failure"; break;
+	case SMCP_STATUS_CONTINUE: return "Continue"; break;
+	case SMCP_STATUS_INCOMPLETE: return "Incomplete"; break;
 
 	case SMCP_STATUS_ERRNO:
 #if SMCP_USE_BSD_SOCKETS
@@ -434,6 +474,9 @@ coap_code_t smcp_convert_status_to_result_code(smcp_status_t status) {
 	case SMCP_STATUS_BAD_OPTION:
 		ret = COAP_RESULT_402_BAD_OPTION;
 		break;
+	case SMCP_STATUS_INCOMPLETE:
+		ret = COAP_RESULT_408_REQUEST_INCOMPLETE;
+		break;
 	}
 
 	return ret;
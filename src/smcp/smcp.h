@@ -70,6 +70,7 @@
 
 #include "smcp-opts.h"
 #include "smcp-helpers.h"
+#include "smcp-buffer.h"
 
 #ifdef CONTIKI
 #include "contiki.h"
@@ -112,6 +113,8 @@ enum {
 	SMCP_STATUS_ASYNC_RESPONSE		= -24,
 	SMCP_STATUS_UNAUTHORIZED		= -25,
 	SMCP_STATUS_BAD_PACKET			= -26,
+	SMCP_STATUS_CONTINUE			= -27,	//!< More blocks of the request body are expected.
+	SMCP_STATUS_INCOMPLETE			= -28,	//!< Part of a block transfer is missing.
 };
 
 typedef int smcp_status_t;
@@ -150,12 +153,17 @@ typedef smcp_callback_func smcp_inbound_resend_func;
 #define smcp_get_port(self)		smcp_get_port()
 #define smcp_wait(self,...)		smcp_wait(__VA_ARGS__)
 #define smcp_process(self)		smcp_process()
+#define smcp_flush(self)		smcp_flush()
 #define smcp_release_plat(self)		smcp_release_plat()
 #define smcp_handle_request(self,...)		smcp_handle_request(__VA_ARGS__)
 #define smcp_handle_response(self,...)		smcp_handle_response(__VA_ARGS__)
 #define smcp_get_timeout(self)		smcp_get_timeout()
 #define smcp_set_proxy_url(self,...)		smcp_set_proxy_url(__VA_ARGS__)
 #define smcp_get_fd(self)		smcp_get_fd()
+#define smcp_get_dns_fd(self)		smcp_get_dns_fd()
+#define smcp_get_plat_stats(self)		smcp_get_plat_stats()
+#define smcp_set_recv_batch_size(self,...)		smcp_set_recv_batch_size(__VA_ARGS__)
+#define smcp_get_recv_batch_size(self)		smcp_get_recv_batch_size()
 #define smcp_get_udp_conn(self)		smcp_get_udp_conn()
 #define smcp_handle_inbound_packet(self,...)		smcp_handle_inbound_packet(__VA_ARGS__)
 #define smcp_outbound_begin(self,...)		smcp_outbound_begin(__VA_ARGS__)
@@ -273,6 +281,14 @@ SMCP_API_EXTERN smcp_status_t smcp_process(smcp_t self);
 **  Some platforms do not implement this function. */
 SMCP_API_EXTERN smcp_status_t smcp_wait(smcp_t self, cms_t cms);
 
+//!	Sends any outbound packets that are still queued.
+/*!	Outbound packets may be queued so that they can be sent to the
+**	network in batches. The queue is flushed automatically by
+**	smcp_process() and smcp_wait(), but callers that drive their
+**	own event loop should call this before blocking.
+*/
+SMCP_API_EXTERN smcp_status_t smcp_flush(smcp_t self);
+
 //!	Maximum amount of time that can pass before smcp_process() must be called again.
 SMCP_API_EXTERN cms_t smcp_get_timeout(smcp_t self);
 
@@ -344,6 +360,16 @@ SMCP_API_EXTERN const struct coap_header_s* smcp_inbound_get_packet(void);
 //!	Returns the length of the inbound packet.
 SMCP_API_EXTERN coap_size_t smcp_inbound_get_packet_length(void);
 
+#if SMCP_USE_BUFFER_POOL
+//!	Returns a reference to the buffer holding the inbound packet.
+/*!	The packet stays put until the returned buffer is passed to
+**	smcp_buffer_release(), so it can be looked at after the callback
+**	has returned. Packets which didn't arrive in a pool buffer are
+**	copied into one. Returns NULL if there is no inbound packet or
+**	if a buffer couldn't be allocated. */
+SMCP_API_EXTERN smcp_buffer_t smcp_inbound_retain_packet(void);
+#endif
+
 //! Convenience macro for getting the code of the inbound packet.
 #define smcp_inbound_get_code()		(smcp_inbound_get_packet()->code)
 
@@ -387,6 +413,35 @@ SMCP_API_EXTERN bool smcp_inbound_option_strequal(coap_option_key_t key, const c
 #define smcp_inbound_option_strequal_const(key,const_str)	\
 	smcp_inbound_option_strequal(key,const_str)
 
+// The options of every inbound packet are indexed when the packet is
+// first parsed, so the following functions don't need to scan the
+// packet. Only smcp_inbound_seek_option() moves the option pointer.
+
+//!	Returns the key of the option at position `index`, or COAP_OPTION_INVALID.
+SMCP_API_EXTERN coap_option_key_t smcp_inbound_get_option_at(int index, const uint8_t** value, coap_size_t* len);
+
+//!	Returns the number of options with the given key.
+SMCP_API_EXTERN int smcp_inbound_get_option_count(coap_option_key_t key);
+
+//!	Fetches the `n`th (zero-based) option with the given key.
+/*!	@returns true if there was such an option, false otherwise. */
+SMCP_API_EXTERN bool smcp_inbound_get_nth_option(coap_option_key_t key, int n, const uint8_t** value, coap_size_t* len);
+
+//!	Moves the option pointer so that smcp_inbound_next_option() returns the `n`th option with the given key.
+/*!	If there is no such option, the option pointer is left where
+**	that option would have been.
+**
+**	@returns true if there was such an option, false otherwise. */
+SMCP_API_EXTERN bool smcp_inbound_seek_option(coap_option_key_t key, int n);
+
+//!	Returns the number of Uri-Path options.
+#define smcp_inbound_get_path_segment_count()	\
+	smcp_inbound_get_option_count(COAP_OPTION_URI_PATH)
+
+//!	Fetches the `n`th (zero-based) Uri-Path option.
+#define smcp_inbound_get_path_segment(n,value,len)	\
+	smcp_inbound_get_nth_option(COAP_OPTION_URI_PATH,n,value,len)
+
 #define SMCP_GET_PATH_REMAINING			(1<<0)
 #define SMCP_GET_PATH_LEADING_SLASH		(1<<1)
 #define SMCP_GET_PATH_INCLUDE_QUERY		(1<<2)
@@ -524,6 +579,10 @@ SMCP_API_EXTERN smcp_status_t smcp_outbound_quick_response(coap_code_t code, con
 
 #define SMCP_ASYNC_RESPONSE_FLAG_DONT_ACK		(1<<0)
 
+//!	State for responding to a request after its handler has returned.
+/*!	Must be zero-initialized before it is first passed to
+**	smcp_start_async_response(), which lets go of whatever request the
+**	structure was already holding on to. */
 struct smcp_async_response_s {
 	smcp_sockaddr_t			remote_saddr;
 #if SMCP_USE_BSD_SOCKETS
@@ -534,19 +593,44 @@ struct smcp_async_response_s {
 #endif
 #endif
 
+	//!	Length of the request's header and options. Zero if not started.
 	coap_size_t request_len;
+#if SMCP_USE_BUFFER_POOL
+	smcp_buffer_t request_buffer;
+#else
 	union {
 		struct coap_header_s header;
 		uint8_t bytes[80];
 	} request;
+#endif
 };
 
 typedef struct smcp_async_response_s* smcp_async_response_t;
 
+//!	Returns the request that an async response was started for.
+/*!	Only valid between smcp_start_async_response() and
+**	smcp_finish_async_response(), and NULL outside of that when
+**	SMCP_USE_BUFFER_POOL is set. Only the header and options
+**	(`request_len` bytes) are meaningful. */
+#if SMCP_USE_BUFFER_POOL
+#define smcp_async_response_get_request(x) \
+	((x)->request_buffer \
+		? (const struct coap_header_s*)smcp_buffer_get_bytes((x)->request_buffer) \
+		: NULL)
+#else
+#define smcp_async_response_get_request(x)	(&(x)->request.header)
+#endif
+
 SMCP_API_EXTERN bool smcp_inbound_is_related_to_async_response(struct smcp_async_response_s* x);
 
+//!	Holds on to the current request so that it can be responded to later.
+/*!	`x` must have been zero-initialized, or already used with this
+**	function: any request it still holds is released first. Call it
+**	again for a later request of the same exchange, and call
+**	smcp_finish_async_response() once done. */
 SMCP_API_EXTERN smcp_status_t smcp_start_async_response(struct smcp_async_response_s* x,int flags);
 
+//!	Lets go of the request held by an async response.
 SMCP_API_EXTERN smcp_status_t smcp_finish_async_response(struct smcp_async_response_s* x);
 
 SMCP_API_EXTERN smcp_status_t smcp_outbound_begin_async_response(coap_code_t code, struct smcp_async_response_s* x);
@@ -26,6 +26,7 @@
 #include <signal.h>
 #include "smcpctl.h"
 #include <smcp/smcp-missing.h>
+#include <smcp/smcp-block.h>
 
 static arg_list_item_t option_list[] = {
 	{ 'h', "help",	  NULL, "Print Help"				},
@@ -38,6 +39,7 @@ static arg_list_item_t option_list[] = {
 	{ 0, "ignore-first", NULL, "(writeme)" },
 	{ 0, "observe-once", NULL, "(writeme)" },
 	{ 0  , "timeout",  "seconds", "Change timeout period (Default: 30 Seconds)" },
+	{ 'w', "window", "blocks", "Keep this many block requests in flight" },
 	{ 'a', "accept", "mime-type/coap-number", "hint to the server the content-type you want" },
 	{ 0 }
 };
@@ -52,6 +54,7 @@ static cms_t get_timeout;
 static bool observe_ignore_first;
 static bool observe_once;
 static coap_transaction_type_t get_tt;
+static int get_window;
 static void
 signal_interrupt(int sig) {
 	gRet = ERRORCODE_INTERRUPT;
@@ -69,6 +72,8 @@ static int last_observe_value = -1;
 static coap_content_type_t request_accept_type = -1;
 
 static struct smcp_transaction_s transaction;
+static struct smcp_block2_fetch_s block2_fetch;
+static char block2_last_char;
 
 static smcp_status_t
 get_response_handler(int statuscode, void* context) {
@@ -194,6 +199,59 @@ bail:
 	return status;
 }
 
+static smcp_status_t
+get_block2_data(void* context, const uint8_t* data, coap_size_t len, uint32_t offset) {
+	fwrite(data, len, 1, stdout);
+	fflush(stdout);
+	if(len)
+		block2_last_char = data[len - 1];
+	return SMCP_STATUS_OK;
+}
+
+static void
+get_block2_finished(void* context, int statuscode, uint32_t total_len) {
+	if((statuscode >= COAP_RESULT_200) && (statuscode < COAP_RESULT_300)) {
+		gRet = 0;
+		// Only print a newline if the content doesn't already print one.
+		if(total_len && (block2_last_char != '\n'))
+			printf("\n");
+	} else {
+		gRet = (statuscode == SMCP_STATUS_TIMEOUT)?ERRORCODE_TIMEOUT:ERRORCODE_COAP_ERROR;
+		fprintf(stderr, "get: Result code = %d (%s)\n", statuscode,
+				(statuscode < 0) ? smcp_status_to_cstr(
+				statuscode) : coap_code_to_cstr(statuscode));
+	}
+}
+
+static bool
+send_windowed_get_request(smcp_t smcp, const char* url) {
+	smcp_status_t status;
+
+	gRet = ERRORCODE_INPROGRESS;
+	url_data = url;
+
+	smcp_block2_fetch_end(smcp, &block2_fetch);
+	smcp_block2_fetch_init(
+		&block2_fetch,
+		(void*)&resend_get_request,
+		&get_block2_data,
+		&get_block2_finished,
+		(void*)url_data
+	);
+	smcp_block2_fetch_set_window(&block2_fetch, (uint8_t)get_window);
+
+	status = smcp_block2_fetch_begin(smcp, &block2_fetch, get_timeout);
+
+	if(status) {
+		fprintf(stderr,
+			"smcp_block2_fetch_begin() returned %d(%s).\n",
+			status,
+			smcp_status_to_cstr(status));
+	}
+
+	return status == SMCP_STATUS_OK;
+}
+
 bool
 send_get_request(
 	smcp_t smcp, const char* url, const char* next, coap_size_t nextlen
@@ -259,6 +317,7 @@ tool_cmd_get(
 	observe_once = false;
 	observe_ignore_first = false;
 	get_tt = COAP_TRANS_TYPE_CONFIRMABLE;
+	get_window = 0;
 
 	if(strcmp(argv[0],"observe")==0 || strcmp(argv[0],"obs")==0) {
 		get_observe = true;
@@ -275,6 +334,7 @@ tool_cmd_get(
 	HANDLE_LONG_ARGUMENT("no-observe") get_observe = false;
 	HANDLE_LONG_ARGUMENT("non") get_tt = COAP_TRANS_TYPE_NONCONFIRMABLE;
 	HANDLE_LONG_ARGUMENT("keep-alive") get_keep_alive = true;
+	HANDLE_LONG_ARGUMENT("window") get_window = (int)strtol(argv[++i], NULL, 0);
 	HANDLE_LONG_ARGUMENT("no-keep-alive") get_keep_alive = false;
 	HANDLE_LONG_ARGUMENT("once") observe_once = true;
 	HANDLE_LONG_ARGUMENT("ignore-first") observe_ignore_first = true;
@@ -297,6 +357,7 @@ tool_cmd_get(
 	HANDLE_SHORT_ARGUMENT('i') get_show_headers = true;
 	HANDLE_SHORT_ARGUMENT('f') redirect_count = 10;
 	HANDLE_SHORT_ARGUMENT('O') get_observe = true;
+	HANDLE_SHORT_ARGUMENT('w') get_window = (int)strtol(argv[++i], NULL, 0);
 	HANDLE_SHORT_ARGUMENT('a') {
 		i++;
 		if(!argv[i]) {
@@ -337,7 +398,9 @@ tool_cmd_get(
 		goto bail;
 	}
 
-	if(size_request) {
+	if(get_window > 0 && !get_observe) {
+		require(send_windowed_get_request(smcp, url), bail);
+	} else if(size_request) {
 		char block[] = {1};
 		require(send_get_request(smcp, url, block, 1), bail);
 	} else {
@@ -351,6 +414,7 @@ tool_cmd_get(
 
 bail:
 	smcp_transaction_end(smcp,&transaction);
+	smcp_block2_fetch_end(smcp,&block2_fetch);
 	signal(SIGINT, previous_sigint_handler);
 	url_data = NULL;
 	return gRet;
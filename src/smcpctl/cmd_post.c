@@ -28,11 +28,17 @@
 #include <smcp/url-helpers.h>
 #include <signal.h>
 #include "smcpctl.h"
+#include <smcp/smcp-block.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 static arg_list_item_t option_list[] = {
 	{ 'h', "help",				  NULL, "Print Help" },
 	{ 'i', "include",	 NULL,	 "Include headers in output" },
 	{ 0, "non",  NULL, "Send as non-confirmable" },
+	{ 'f', "file", "path", "Send the contents of a file ('-' for stdin) in blocks" },
+	{ 'w', "window", "blocks", "Keep this many blocks in flight (with --file)" },
 //	{ 'c', "content-file",NULL,"Use content from the specified input source" },
 //	{ 0,   "outbound-slice-size", NULL, "writeme"	 },
 	{ 0,   "content-type",		  "content-format", "Set content-format option"	 },
@@ -44,6 +50,8 @@ static sig_t previous_sigint_handler;
 static int outbound_slice_size;
 static bool post_show_headers;
 static coap_transaction_type_t post_tt;
+static int post_window;
+static struct smcp_block1_upload_s block1_upload;
 
 static void
 signal_interrupt(int sig) {
@@ -184,6 +192,70 @@ bail:
 	return ret;
 }
 
+static void
+post_block1_finished(struct post_request_s *request, int statuscode) {
+	if(statuscode >= 0) {
+		post_response_handler(statuscode, request);
+	} else {
+		gRet = (statuscode == SMCP_STATUS_TIMEOUT)?ERRORCODE_TIMEOUT:ERRORCODE_UNKNOWN;
+		fprintf(stderr, "post: Result code = %d (%s)\n", statuscode,
+			smcp_status_to_cstr(statuscode));
+	}
+}
+
+static smcp_status_t
+resend_block1_request(struct post_request_s *request) {
+	smcp_status_t status = 0;
+
+	status = smcp_outbound_begin(smcp_get_current_instance(),request->method, post_tt);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE, request->content_type);
+	require_noerr(status, bail);
+
+	status = smcp_outbound_set_uri(request->url, 0);
+	require_noerr(status, bail);
+
+bail:
+	return status;
+}
+
+static bool
+send_block1_request(
+	smcp_t	smcp,
+	struct post_request_s *request,
+	int fd
+) {
+	smcp_status_t status;
+	struct stat st;
+
+	gRet = ERRORCODE_INPROGRESS;
+
+	smcp_block1_upload_init(
+		&block1_upload,
+		(void*)&resend_block1_request,
+		NULL,
+		(void*)&post_block1_finished,
+		(void*)request
+	);
+	smcp_block1_upload_set_fd(&block1_upload, fd);
+	smcp_block1_upload_set_window(&block1_upload, (uint8_t)post_window);
+
+	if((0 == fstat(fd, &st)) && S_ISREG(st.st_mode))
+		smcp_block1_upload_set_size(&block1_upload, (uint32_t)st.st_size);
+
+	status = smcp_block1_upload_begin(smcp, &block1_upload, 30*MSEC_PER_SEC);
+
+	if(status) {
+		fprintf(stderr,
+			"smcp_block1_upload_begin() returned %d(%s).\n",
+			status,
+			smcp_status_to_cstr(status));
+	}
+
+	return status == SMCP_STATUS_OK;
+}
+
 int
 tool_cmd_post(
 	smcp_t smcp, int argc, char* argv[]
@@ -191,7 +263,10 @@ tool_cmd_post(
 	previous_sigint_handler = signal(SIGINT, &signal_interrupt);
 	coap_content_type_t content_type = 0;
 	coap_code_t method = COAP_METHOD_POST;
-	smcp_transaction_t transaction;
+	smcp_transaction_t transaction = NULL;
+	struct post_request_s block1_request = { 0 };
+	const char* filename = NULL;
+	int fd = -1;
 	int i;
 	char url[1000];
 	url[0] = 0;
@@ -204,6 +279,7 @@ tool_cmd_post(
 	outbound_slice_size = 100;
 	post_show_headers = false;
 	post_tt = COAP_TRANS_TYPE_CONFIRMABLE;
+	post_window = 1;
 
 	BEGIN_LONG_ARGUMENTS(gRet)
 	HANDLE_LONG_ARGUMENT("include") post_show_headers = true;
@@ -211,6 +287,8 @@ tool_cmd_post(
 	HANDLE_LONG_ARGUMENT("content-type") content_type = coap_content_type_from_cstr(argv[++i]);
 	HANDLE_LONG_ARGUMENT("content-format") content_type = coap_content_type_from_cstr(argv[++i]);
 	HANDLE_LONG_ARGUMENT("non") post_tt = COAP_TRANS_TYPE_NONCONFIRMABLE;
+	HANDLE_LONG_ARGUMENT("file") filename = argv[++i];
+	HANDLE_LONG_ARGUMENT("window") post_window = (int)strtol(argv[++i], NULL, 0);
 	HANDLE_LONG_ARGUMENT("help") {
 		print_arg_list_help(option_list,
 			argv[0],
@@ -220,6 +298,8 @@ tool_cmd_post(
 	}
 	BEGIN_SHORT_ARGUMENTS(gRet)
 	HANDLE_SHORT_ARGUMENT('i') post_show_headers = true;
+	HANDLE_SHORT_ARGUMENT('f') filename = argv[++i];
+	HANDLE_SHORT_ARGUMENT('w') post_window = (int)strtol(argv[++i], NULL, 0);
 	HANDLE_SHORT_ARGUMENT2('h', '?') {
 		print_arg_list_help(option_list,
 			argv[0],
@@ -258,16 +338,41 @@ tool_cmd_post(
 
 	gRet = ERRORCODE_INPROGRESS;
 
-	transaction = send_post_request(smcp, url, method,content, (coap_size_t)strlen(content),content_type);
+	if(filename) {
+		if(strequal_const(filename, "-")) {
+			fd = STDIN_FILENO;
+		} else {
+			fd = open(filename, O_RDONLY);
+		}
+
+		if(fd < 0) {
+			fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+			gRet = ERRORCODE_BADARG;
+			goto bail;
+		}
+
+		block1_request.url = url;
+		block1_request.content_type = content_type;
+		block1_request.method = method;
+
+		require(send_block1_request(smcp, &block1_request, fd), bail);
+	} else {
+		transaction = send_post_request(smcp, url, method,content, (coap_size_t)strlen(content),content_type);
+	}
 
 	while(ERRORCODE_INPROGRESS == gRet) {
 		smcp_wait(smcp,1000);
 		smcp_process(smcp);
 	}
 
-	smcp_transaction_end(smcp, transaction);
+	if(transaction)
+		smcp_transaction_end(smcp, transaction);
 
 bail:
+	if(filename)
+		smcp_block1_upload_end(smcp, &block1_upload);
+	if((fd >= 0) && (fd != STDIN_FILENO))
+		close(fd);
 	signal(SIGINT, previous_sigint_handler);
 	return gRet;
 }
@@ -39,17 +39,64 @@
 #include <smcp/smcp.h>
 #include <smcp/smcp-transaction.h>
 #include <smcp/smcp-node-router.h>
+#include <smcp/smcp-event-loop.h>
 #include <smcp/coap.h>
 #include <time.h>
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
 
 #ifndef CGI_NODE_MAX_REQUESTS
 #define CGI_NODE_MAX_REQUESTS		(20)
 #endif
 
+#ifndef CGI_NODE_REQUEST_TIMEOUT
+#define CGI_NODE_REQUEST_TIMEOUT	(30*MSEC_PER_SEC)
+#endif
+
+#ifndef CGI_NODE_MAX_WORKERS
+#define CGI_NODE_MAX_WORKERS		(8)
+#endif
+
+// How long a worker beyond the minimum can sit idle before it is stopped.
+#ifndef CGI_NODE_WORKER_IDLE_TIMEOUT
+#define CGI_NODE_WORKER_IDLE_TIMEOUT	(60*MSEC_PER_SEC)
+#endif
+
+// How long to wait before replacing a worker that has died.
+#ifndef CGI_NODE_WORKER_RESTART_DELAY
+#define CGI_NODE_WORKER_RESTART_DELAY	(1*MSEC_PER_SEC)
+#endif
+
+#define CGI_NODE_WORKER_MAX_HEADER_LEN	(64)
+
+// How much of the request body is held for the command. Once this
+// fills up, the next block isn't asked for until the command has
+// read some of it. Workers get the whole body at once, so this is
+// also the largest body that can be sent to one.
+#ifndef CGI_NODE_STDIN_BUFFER_SIZE
+#define CGI_NODE_STDIN_BUFFER_SIZE	(8*1024)
+#endif
+
+// How far the command's output is read ahead of the client. This
+// must be at least twice the largest block size. A command that
+// writes much more than this before reading all of the request body
+// stalls until the request times out, since nothing is sent back
+// until the body is in.
+#ifndef CGI_NODE_STDOUT_BUFFER_SIZE
+#define CGI_NODE_STDOUT_BUFFER_SIZE	(4*1024)
+#endif
+
+// A worker's response is read in whole as soon as it arrives, so the
+// worker can take the next request however slowly the client fetches
+// the blocks. Workers that answer with more than this are restarted.
+#ifndef CGI_NODE_WORKER_MAX_RESPONSE_SIZE
+#define CGI_NODE_WORKER_MAX_RESPONSE_SIZE	(256*1024)
+#endif
+
 /*
 
 Events:
@@ -75,7 +122,27 @@ States:
 	ACTIVE_BLOCK2_WAIT_FD - Input Finished, Async Response, Waiting For Data from fd_cmd_stdout
 	ACTIVE_BLOCK2_WAIT_ACK - Input Finished, Async Response Sent, Waiting For Ack
 
+Worker Mode:
+	If the node has MaxWorkers set, the command is started ahead of time
+	as a pool of long-lived workers instead of once for every request.
+	A worker handles one request at a time. Once the whole body of the
+	request is in, it is written to an idle worker's stdin as a line
+	holding the method, the request URI and the length of the body,
+	followed by the body itself:
 
+		POST /cgi/thing?x=1 5\n
+		hello
+
+	The worker answers on its stdout with a line holding the CoAP
+	response code and the length of the content, followed by the content:
+
+		2.05 12\n
+		Hello world!
+
+	Requests wait for a worker if none are idle and the pool is at
+	MaxWorkers. Workers that die or break the framing are replaced.
+	The content is read in as soon as the worker writes it, so the
+	worker is free again before the client has fetched every block.
 
 */
 
@@ -93,11 +160,25 @@ typedef enum {
 #define BLOCK_OPTION_UNSPECIFIED		(0xFFFFFFFF)
 #define BLOCK_OPTION_DEFAULT			(0x03)
 
+// Ring buffer, so that bytes are never moved once they are in. Only
+// cgi_node_buffer_reserve() moves them, to make it bigger.
+struct cgi_node_buffer_s {
+	char* data;			// Kept for the next request that uses the slot.
+	size_t size;
+	size_t start;
+	size_t len;
+};
+typedef struct cgi_node_buffer_s* cgi_node_buffer_t;
+
+struct cgi_node_worker_s;
+
 struct cgi_node_request_s {
 
 struct smcp_async_response_s async_response;
+	struct cgi_node_s* node;
 	cgi_node_state_t state;
-	time_t expiration;
+	smcp_t interface;	// Where the expiration timer is scheduled.
+	struct smcp_timer_s expiration_timer;
 	bool is_active;
 
 	int fd_cmd_stdin;
@@ -106,14 +187,45 @@ struct smcp_async_response_s async_response;
 	uint32_t block1;
 	uint32_t block2;
 	size_t bytes_sent;
-	char* stdin_buffer;
-	size_t stdin_buffer_len;
-	char* stdout_buffer;
-	size_t stdout_buffer_len;
+	struct cgi_node_buffer_s stdin_buffer;
+	struct cgi_node_buffer_s stdout_buffer;
 	smcp_transaction_t transaction;
+	coap_code_t code;
+
+	// Enough of the request to recognize its follow-ups, which still
+	// needs to be around once the async response has been finished.
+	coap_code_t method;
+	uint8_t token_len;
+	uint8_t token[COAP_MAX_TOKEN_SIZE];
+
+	// Worker mode only. While a worker is handling the request, the
+	// fds above are the worker's, and closing them only lets go of them.
+	bool uses_worker;
+	char* request_line;				// Until handed to a worker.
+	char* worker_header;			// Written to the worker ahead of the body.
+	size_t worker_header_len;
+	size_t worker_header_sent;
+	uint32_t queued;				// Non-zero while waiting for a worker.
+	struct cgi_node_worker_s* worker;
 };
 typedef struct cgi_node_request_s* cgi_node_request_t;
 
+struct cgi_node_worker_s {
+	struct cgi_node_s* node;
+	int pid;						// Zero if this slot is unused.
+	int fd_stdin;
+	int fd_stdout;
+	cgi_node_request_t request;		// NULL while idle.
+	smcp_timestamp_t idle_since;
+
+	// The response header, until it is complete.
+	char header[CGI_NODE_WORKER_MAX_HEADER_LEN];
+	size_t header_len;
+	bool has_header;
+	size_t content_remaining;
+};
+typedef struct cgi_node_worker_s* cgi_node_worker_t;
+
 struct cgi_node_s {
 	struct smcp_node_s node;
 	smcp_t interface;
@@ -122,11 +234,257 @@ struct cgi_node_s {
 
 	struct cgi_node_request_s requests[CGI_NODE_MAX_REQUESTS];
 	int request_count;
+
+	// If set, the pipes are watched by this loop instead of by
+	// cgi_node_update_fdset() and cgi_node_process().
+	smcp_event_loop_t event_loop;
+
+	// Worker mode is on if max_workers isn't zero.
+	struct cgi_node_worker_s workers[CGI_NODE_MAX_WORKERS];
+	int min_workers;
+	int max_workers;
+	uint32_t queue_count;
+	smcp_t worker_interface;	// Where the worker timer is scheduled.
+	struct smcp_timer_s worker_timer;
 };
 
 typedef struct cgi_node_s* cgi_node_t;
 
 smcp_status_t cgi_node_request_change_state(cgi_node_t node, cgi_node_request_t request, cgi_node_state_t new_state);
+smcp_status_t cgi_node_request_handle_io(cgi_node_t node, cgi_node_request_t request, bool can_write, bool write_err, bool can_read, bool read_err);
+static void cgi_node_worker_update_events(cgi_node_t node, cgi_node_worker_t worker);
+
+// MARK: -
+// MARK: Buffers
+
+static bool
+cgi_node_buffer_init(cgi_node_buffer_t buffer, size_t size) {
+	if(buffer->data && buffer->size != size) {
+		// Don't let one big response keep the slot big.
+		free(buffer->data);
+		buffer->data = NULL;
+	}
+	if(!buffer->data) {
+		buffer->data = malloc(size);
+		if(!buffer->data)
+			return false;
+		buffer->size = size;
+	}
+	buffer->start = 0;
+	buffer->len = 0;
+	return true;
+}
+
+static size_t
+cgi_node_buffer_get_space(cgi_node_buffer_t buffer) {
+	return buffer->size - buffer->len;
+}
+
+// Points `iov` at the buffered bytes, returning how many entries it used.
+static int
+cgi_node_buffer_get_data_iov(cgi_node_buffer_t buffer, struct iovec iov[2]) {
+	const size_t first = MIN(buffer->len, buffer->size - buffer->start);
+	int ret = 0;
+
+	if(first) {
+		iov[ret].iov_base = buffer->data + buffer->start;
+		iov[ret++].iov_len = first;
+	}
+	if(buffer->len > first) {
+		iov[ret].iov_base = buffer->data;
+		iov[ret++].iov_len = buffer->len - first;
+	}
+	return ret;
+}
+
+// Points `iov` at up to `max` bytes of free space, returning how many entries it used.
+static int
+cgi_node_buffer_get_space_iov(cgi_node_buffer_t buffer, struct iovec iov[2], size_t max) {
+	const size_t space = MIN(cgi_node_buffer_get_space(buffer), max);
+	size_t end, first;
+	int ret = 0;
+
+	if(!space)
+		return 0;
+
+	end = (buffer->start + buffer->len) % buffer->size;
+	first = MIN(space, buffer->size - end);
+
+	iov[ret].iov_base = buffer->data + end;
+	iov[ret++].iov_len = first;
+
+	if(space > first) {
+		iov[ret].iov_base = buffer->data;
+		iov[ret++].iov_len = space - first;
+	}
+	return ret;
+}
+
+// Takes in `count` bytes that were put in the space from cgi_node_buffer_get_space_iov().
+static void
+cgi_node_buffer_commit(cgi_node_buffer_t buffer, size_t count) {
+	buffer->len += count;
+}
+
+static void
+cgi_node_buffer_consume(cgi_node_buffer_t buffer, size_t count) {
+	count = MIN(count, buffer->len);
+	buffer->len -= count;
+	buffer->start = buffer->len ? (buffer->start + count) % buffer->size : 0;
+}
+
+// Returns false, adding nothing, if there isn't room for all of it.
+static bool
+cgi_node_buffer_append(cgi_node_buffer_t buffer, const char* data, size_t len) {
+	struct iovec iov[2];
+	int i, iovcnt;
+
+	if(len > cgi_node_buffer_get_space(buffer))
+		return false;
+
+	iovcnt = cgi_node_buffer_get_space_iov(buffer, iov, len);
+
+	for(i=0;i<iovcnt;i++) {
+		memcpy(iov[i].iov_base, data, iov[i].iov_len);
+		data += iov[i].iov_len;
+	}
+
+	cgi_node_buffer_commit(buffer, len);
+	return true;
+}
+
+// Copies out up to `max` bytes from the front without consuming them.
+static size_t
+cgi_node_buffer_peek(cgi_node_buffer_t buffer, char* dest, size_t max) {
+	struct iovec iov[2];
+	int i, iovcnt = cgi_node_buffer_get_data_iov(buffer, iov);
+	size_t ret = 0;
+
+	for(i=0;i<iovcnt && ret<max;i++) {
+		const size_t len = MIN(iov[i].iov_len, max - ret);
+		memcpy(dest + ret, iov[i].iov_base, len);
+		ret += len;
+	}
+	return ret;
+}
+
+// Makes the buffer big enough to hold `size` bytes in all.
+static bool
+cgi_node_buffer_reserve(cgi_node_buffer_t buffer, size_t size) {
+	char* data;
+
+	if(size <= buffer->size)
+		return true;
+
+	data = malloc(size);
+	if(!data)
+		return false;
+
+	cgi_node_buffer_peek(buffer, data, buffer->len);
+	free(buffer->data);
+	buffer->data = data;
+	buffer->size = size;
+	buffer->start = 0;
+	return true;
+}
+
+// MARK: -
+// MARK: Requests
+
+// Bytes waiting to be written to the command's stdin.
+static size_t
+cgi_node_request_get_stdin_pending(cgi_node_request_t request) {
+	return request->stdin_buffer.len
+		+ (request->worker_header_len - request->worker_header_sent);
+}
+
+static void
+cgi_node_request_close_fd(cgi_node_t node, cgi_node_request_t request, int* fd) {
+	if(*fd < 0)
+		return;
+
+	// The worker keeps its pipes.
+	if(request->worker) {
+		*fd = -1;
+		return;
+	}
+
+	// Forked commands may still hold the other end, so the
+	// event loop won't notice this on its own.
+	if(node->event_loop)
+		smcp_event_loop_remove_fd(node->event_loop, *fd);
+
+	close(*fd);
+	*fd = -1;
+}
+
+// Keeps the event loop watching for exactly what cgi_node_update_fdset() would.
+static void
+cgi_node_request_update_events(cgi_node_t node, cgi_node_request_t request) {
+	const bool is_active = (request->state > CGI_NODE_STATE_FINISHED);
+
+	if(request->worker) {
+		cgi_node_worker_update_events(node, request->worker);
+		return;
+	}
+
+	if(!node->event_loop)
+		return;
+
+	if(request->fd_cmd_stdin >= 0) {
+		smcp_event_loop_set_fd_events(
+			node->event_loop,
+			request->fd_cmd_stdin,
+			(is_active && cgi_node_request_get_stdin_pending(request)) ? SMCP_EVENT_WRITE : 0
+		);
+	}
+
+	if(request->fd_cmd_stdout >= 0) {
+		smcp_event_loop_set_fd_events(
+			node->event_loop,
+			request->fd_cmd_stdout,
+			(is_active && cgi_node_buffer_get_space(&request->stdout_buffer)) ? SMCP_EVENT_READ : 0
+		);
+	}
+}
+
+static void
+cgi_node_request_fd_ready(smcp_event_loop_t loop, int fd, int events, void* context) {
+	cgi_node_request_t request = context;
+
+	if(fd == request->fd_cmd_stdin) {
+		cgi_node_request_handle_io(
+			request->node,
+			request,
+			(events & SMCP_EVENT_WRITE) != 0,
+			(events & SMCP_EVENT_ERROR) != 0,
+			false,
+			false
+		);
+	} else {
+		cgi_node_request_handle_io(
+			request->node,
+			request,
+			false,
+			false,
+			(events & SMCP_EVENT_READ) != 0,
+			(events & SMCP_EVENT_ERROR) != 0
+		);
+	}
+}
+
+static void
+cgi_node_request_expired(smcp_t smcp, void* context) {
+	cgi_node_request_t request = context;
+
+	if(request->state > CGI_NODE_STATE_FINISHED) {
+		cgi_node_request_change_state(
+			request->node,
+			request,
+			CGI_NODE_STATE_FINISHED
+		);
+	}
+}
 
 cgi_node_request_t
 cgi_node_get_associated_request(cgi_node_t node) {
@@ -138,15 +496,15 @@ cgi_node_get_associated_request(cgi_node_t node) {
 		if(request->state<CGI_NODE_STATE_FINISHED) {
 			continue;
 		}
-		if(request->async_response.request.header.token_len != smcp_inbound_get_packet()->token_len) {
+		if(request->token_len != smcp_inbound_get_packet()->token_len) {
 //			printf("cgi_node_get_associated_request: %d: token_len mismatch\n",i);
 			continue;
 		}
-		if(request->async_response.request.header.code != smcp_inbound_get_packet()->code) {
+		if(request->method != smcp_inbound_get_packet()->code) {
 //			printf("cgi_node_get_associated_request: %d: code mismatch\n",i);
 			continue;
 		}
-		if(0!=memcmp(request->async_response.request.header.token,smcp_inbound_get_packet()->token,smcp_inbound_get_packet()->token_len)) {
+		if(0!=memcmp(request->token,smcp_inbound_get_packet()->token,smcp_inbound_get_packet()->token_len)) {
 //			printf("cgi_node_get_associated_request: %d: token mismatch\n",i);
 			continue;
 		}
@@ -162,58 +520,32 @@ cgi_node_get_associated_request(cgi_node_t node) {
 	return ret;
 }
 
-cgi_node_request_t
-cgi_node_create_request(cgi_node_t node) {
-	cgi_node_request_t ret = NULL;
-	int i;
+// Starts the command with its stdin and stdout on pipes, returning its pid or -1.
+// Workers outlive any one request, so they only get the node's environment.
+static int
+cgi_node_fork(cgi_node_t node, int* fd_stdin, int* fd_stdout, bool is_worker) {
+	int pid;
 	int pipe_cmd_stdin[2];
 	int pipe_cmd_stdout[2];
-//	int set = 1;
-
-	for(i=0;i<CGI_NODE_MAX_REQUESTS;i++) {
-		if(node->requests[i].state<=CGI_NODE_STATE_FINISHED) {
-			ret = &node->requests[i];
-			if(node->requests[i].state==CGI_NODE_STATE_INACTIVE)
-				break;
-		}
-	}
-
-	require(ret,bail);
 
-	ret->is_active = 1;
-	ret->state = CGI_NODE_STATE_ACTIVE_BLOCK1_WAIT_REQ;
+	if(pipe(pipe_cmd_stdin) < 0)
+		return -1;
 
-	if(ret->pid != 0 && ret->pid != -1) {
-		int status;
-		kill(ret->pid,SIGKILL);
-		waitpid(ret->pid, &status, 0);
+	if(pipe(pipe_cmd_stdout) < 0) {
+		close(pipe_cmd_stdin[0]);
+		close(pipe_cmd_stdin[1]);
+		return -1;
 	}
-	if(ret->fd_cmd_stdin>=0)
-		close(ret->fd_cmd_stdin);
-	if(ret->fd_cmd_stdout>=0)
-		close(ret->fd_cmd_stdout);
-
-	ret->pid = 0;
-	ret->fd_cmd_stdin = -1;
-	ret->fd_cmd_stdout = -1;
-	ret->block1 = BLOCK_OPTION_UNSPECIFIED;
-	ret->block2 = BLOCK_OPTION_DEFAULT; // Default value, overwrite with actual block
-	ret->stdin_buffer_len = 0;
-	ret->stdout_buffer_len = 0;
-	ret->expiration = time(NULL)+30;
-
-	free(ret->stdin_buffer);
-	ret->stdin_buffer = NULL;
 
-	free(ret->stdout_buffer);
-	ret->stdout_buffer = NULL;
+	// Keeps other commands from holding on to these.
+	fcntl(pipe_cmd_stdin[1], F_SETFD, FD_CLOEXEC);
+	fcntl(pipe_cmd_stdout[0], F_SETFD, FD_CLOEXEC);
 
-	smcp_start_async_response(&ret->async_response, SMCP_ASYNC_RESPONSE_FLAG_DONT_ACK);
+	// A command that stops reading must not be able to stall us.
+	fcntl(pipe_cmd_stdin[1], F_SETFL, O_NONBLOCK);
+	fcntl(pipe_cmd_stdout[0], F_SETFL, O_NONBLOCK);
 
-	pipe(pipe_cmd_stdin);
-	pipe(pipe_cmd_stdout);
-
-	if(!(ret->pid=fork())) {
+	if(!(pid=fork())) {
 		// We are the child!
 		char path[2048]; // todo: this max should be a preprocessor macro
 
@@ -231,8 +563,6 @@ cgi_node_create_request(cgi_node_t node) {
 		setenv("SCRIPT_NAME",path,1);
 
 		setenv("SERVER_SOFTWARE","smcpd/"PACKAGE_VERSION,1);
-		setenv("REQUEST_METHOD",coap_code_to_cstr(smcp_inbound_get_packet()->code),1);
-		setenv("REQUEST_URI",smcp_inbound_get_path(path,2),1);
 		setenv("GATEWAY_INTERFACE","CGI/1.1",1);
 		setenv("SERVER_PROTOCOL","CoAP/1.0",1);
 
@@ -242,8 +572,13 @@ cgi_node_create_request(cgi_node_t node) {
 		setenv("SERVER_ADDR","",1);
 		setenv("SERVER_PORT","",1);
 
-		if(0==strncmp(path,getenv("SCRIPT_NAME"),strlen(getenv("SCRIPT_NAME")))) {
-			setenv("PATH_INFO",path+strlen(getenv("SCRIPT_NAME")),1);
+		if(!is_worker) {
+			setenv("REQUEST_METHOD",coap_code_to_cstr(smcp_inbound_get_packet()->code),1);
+			setenv("REQUEST_URI",smcp_inbound_get_path(path,2),1);
+
+			if(0==strncmp(path,getenv("SCRIPT_NAME"),strlen(getenv("SCRIPT_NAME")))) {
+				setenv("PATH_INFO",path+strlen(getenv("SCRIPT_NAME")),1);
+			}
 		}
 
 //		fprintf(stderr,"CHILD: About to execute \"%s\" using shell \"%s\"\n",node->cmd,node->shell);
@@ -257,7 +592,7 @@ cgi_node_create_request(cgi_node_t node) {
 		abort();
 	}
 
-	if(ret->pid<0) {
+	if(pid<0) {
 		// Oh hell.
 
 		syslog(LOG_ERR,"Unable to fork!");
@@ -267,19 +602,583 @@ cgi_node_create_request(cgi_node_t node) {
 		close(pipe_cmd_stdout[0]);
 		close(pipe_cmd_stdout[1]);
 
-		ret->is_active = 0;
-		ret->state = CGI_NODE_STATE_INACTIVE;
-
-		ret = NULL;
-		goto bail;
+		return -1;
 	}
 
-	ret->fd_cmd_stdin = pipe_cmd_stdin[1];
-	ret->fd_cmd_stdout = pipe_cmd_stdout[0];
+	*fd_stdin = pipe_cmd_stdin[1];
+	*fd_stdout = pipe_cmd_stdout[0];
 
 	close(pipe_cmd_stdin[0]);
 	close(pipe_cmd_stdout[1]);
 
+	return pid;
+}
+
+cgi_node_request_t
+cgi_node_create_request(cgi_node_t node) {
+	cgi_node_request_t ret = NULL;
+	int i;
+//	int set = 1;
+
+	for(i=0;i<CGI_NODE_MAX_REQUESTS;i++) {
+		if(node->requests[i].state<=CGI_NODE_STATE_FINISHED) {
+			ret = &node->requests[i];
+			if(node->requests[i].state==CGI_NODE_STATE_INACTIVE)
+				break;
+		}
+	}
+
+	require(ret,bail);
+
+	ret->is_active = 1;
+	ret->state = CGI_NODE_STATE_ACTIVE_BLOCK1_WAIT_REQ;
+
+	if(ret->pid != 0 && ret->pid != -1) {
+		int status;
+		kill(ret->pid,SIGKILL);
+		waitpid(ret->pid, &status, 0);
+	}
+	cgi_node_request_close_fd(node, ret, &ret->fd_cmd_stdin);
+	cgi_node_request_close_fd(node, ret, &ret->fd_cmd_stdout);
+
+	ret->pid = 0;
+	ret->node = node;
+	ret->block1 = BLOCK_OPTION_UNSPECIFIED;
+	ret->block2 = BLOCK_OPTION_DEFAULT; // Default value, overwrite with actual block
+	ret->code = COAP_RESULT_205_CONTENT;
+	ret->uses_worker = (node->max_workers != 0);
+	ret->queued = 0;
+
+	if(ret->interface)
+		smcp_invalidate_timer(ret->interface, &ret->expiration_timer);
+	ret->interface = node->interface;
+	smcp_timer_init(&ret->expiration_timer, &cgi_node_request_expired, NULL, (void*)ret);
+	smcp_schedule_timer(ret->interface, &ret->expiration_timer, CGI_NODE_REQUEST_TIMEOUT);
+
+	free(ret->request_line);
+	ret->request_line = NULL;
+
+	free(ret->worker_header);
+	ret->worker_header = NULL;
+	ret->worker_header_len = 0;
+	ret->worker_header_sent = 0;
+
+	if(!cgi_node_buffer_init(&ret->stdin_buffer, CGI_NODE_STDIN_BUFFER_SIZE)
+		|| !cgi_node_buffer_init(&ret->stdout_buffer, CGI_NODE_STDOUT_BUFFER_SIZE)
+	) {
+		goto fail;
+	}
+
+	if(smcp_start_async_response(&ret->async_response, SMCP_ASYNC_RESPONSE_FLAG_DONT_ACK) != SMCP_STATUS_OK)
+		goto fail;
+
+	ret->method = smcp_inbound_get_packet()->code;
+	ret->token_len = smcp_inbound_get_packet()->token_len;
+	memcpy(ret->token, smcp_inbound_get_packet()->token, ret->token_len);
+
+	if(ret->uses_worker) {
+		// Handed to a worker once the whole body is in.
+		char path[2048];
+		const char* method = coap_code_to_cstr(smcp_inbound_get_packet()->code);
+
+		smcp_inbound_get_path(path,2);
+
+		ret->request_line = malloc(strlen(method)+strlen(path)+2);
+
+		if(!ret->request_line)
+			goto fail;
+
+		sprintf(ret->request_line,"%s %s",method,path);
+		goto bail;
+	}
+
+	ret->pid = cgi_node_fork(node, &ret->fd_cmd_stdin, &ret->fd_cmd_stdout, false);
+
+	if(ret->pid<0) {
+		ret->pid = 0;
+		goto fail;
+	}
+
+	if(node->event_loop) {
+		smcp_event_loop_add_fd(node->event_loop, ret->fd_cmd_stdin, 0, &cgi_node_request_fd_ready, (void*)ret);
+		smcp_event_loop_add_fd(node->event_loop, ret->fd_cmd_stdout, 0, &cgi_node_request_fd_ready, (void*)ret);
+		cgi_node_request_update_events(node, ret);
+	}
+
+bail:
+	return ret;
+
+fail:
+	smcp_invalidate_timer(ret->interface, &ret->expiration_timer);
+	smcp_finish_async_response(&ret->async_response);
+
+	ret->is_active = 0;
+	ret->state = CGI_NODE_STATE_INACTIVE;
+
+	return NULL;
+}
+
+// MARK: -
+// MARK: Workers
+
+static smcp_t
+cgi_node_get_worker_interface(cgi_node_t node) {
+	if(!node->worker_interface)
+		node->worker_interface = node->interface;
+	if(!node->worker_interface)
+		node->worker_interface = smcp_get_current_instance();
+	if(!node->worker_interface && node->event_loop)
+		node->worker_interface = smcp_event_loop_get_instance(node->event_loop);
+	return node->worker_interface;
+}
+
+static int
+cgi_node_get_worker_count(cgi_node_t node) {
+	int i, ret = 0;
+
+	for(i=0;i<CGI_NODE_MAX_WORKERS;i++) {
+		if(node->workers[i].pid > 0)
+			ret++;
+	}
+
+	return ret;
+}
+
+static void
+cgi_node_schedule_worker_timer(cgi_node_t node, cms_t cms) {
+	smcp_t interface = cgi_node_get_worker_interface(node);
+
+	require(interface!=NULL, bail);
+
+	if(smcp_timer_is_scheduled(interface, &node->worker_timer)
+		&& smcp_convert_timestamp_to_cms(interface, node->worker_timer.fire_date) <= cms
+	) {
+		goto bail;
+	}
+
+	smcp_invalidate_timer(interface, &node->worker_timer);
+	smcp_schedule_timer(interface, &node->worker_timer, cms);
+
+bail:
+	return;
+}
+
+static void
+cgi_node_worker_update_events(cgi_node_t node, cgi_node_worker_t worker) {
+	cgi_node_request_t request = worker->request;
+
+	if(!node->event_loop || worker->pid <= 0)
+		return;
+
+	smcp_event_loop_set_fd_events(
+		node->event_loop,
+		worker->fd_stdin,
+		(request && request->fd_cmd_stdin >= 0 && cgi_node_request_get_stdin_pending(request)) ? SMCP_EVENT_WRITE : 0
+	);
+
+	// Idle workers are watched too, so we notice if they die.
+	smcp_event_loop_set_fd_events(
+		node->event_loop,
+		worker->fd_stdout,
+		(!request || cgi_node_buffer_get_space(&request->stdout_buffer)) ? SMCP_EVENT_READ : 0
+	);
+}
+
+static void
+cgi_node_worker_stop(cgi_node_t node, cgi_node_worker_t worker) {
+	cgi_node_request_t request = worker->request;
+	int status;
+	int i;
+
+	if(request) {
+		// Whatever the request got so far is all it is getting.
+		request->worker = NULL;
+		request->fd_cmd_stdin = -1;
+		request->fd_cmd_stdout = -1;
+		if(!worker->has_header || worker->content_remaining) {
+			// The response was cut short, and a truncated body
+			// mustn't pass for the whole thing.
+			request->code = COAP_RESULT_500_INTERNAL_SERVER_ERROR;
+			cgi_node_buffer_consume(&request->stdout_buffer, request->stdout_buffer.len);
+		}
+		worker->request = NULL;
+	}
+
+	if(node->event_loop) {
+		smcp_event_loop_remove_fd(node->event_loop, worker->fd_stdin);
+		smcp_event_loop_remove_fd(node->event_loop, worker->fd_stdout);
+	}
+
+	close(worker->fd_stdin);
+	close(worker->fd_stdout);
+	worker->fd_stdin = -1;
+	worker->fd_stdout = -1;
+
+	kill(worker->pid,SIGKILL);
+	waitpid(worker->pid, &status, 0);
+	worker->pid = 0;
+
+	for(i=0;i<CGI_NODE_MAX_REQUESTS;i++) {
+		if(node->requests[i].queued)
+			break;
+	}
+
+	if(i<CGI_NODE_MAX_REQUESTS) {
+		// There is room for another worker now.
+		cgi_node_schedule_worker_timer(node, 0);
+	} else if(cgi_node_get_worker_count(node) < node->min_workers) {
+		cgi_node_schedule_worker_timer(node, CGI_NODE_WORKER_RESTART_DELAY);
+	}
+}
+
+static void
+cgi_node_worker_fd_ready(smcp_event_loop_t loop, int fd, int events, void* context) {
+	cgi_node_worker_t worker = context;
+	cgi_node_request_t request = worker->request;
+
+	if(!request) {
+		// Idle workers have nothing to say, so it must have exited.
+		if(fd == worker->fd_stdout)
+			cgi_node_worker_stop(worker->node, worker);
+	} else if(fd == worker->fd_stdin) {
+		cgi_node_request_handle_io(
+			request->node,
+			request,
+			(events & SMCP_EVENT_WRITE) != 0,
+			(events & SMCP_EVENT_ERROR) != 0,
+			false,
+			false
+		);
+	} else {
+		cgi_node_request_handle_io(
+			request->node,
+			request,
+			false,
+			false,
+			(events & SMCP_EVENT_READ) != 0,
+			(events & SMCP_EVENT_ERROR) != 0
+		);
+	}
+}
+
+static bool
+cgi_node_worker_start(cgi_node_t node, cgi_node_worker_t worker) {
+	smcp_t interface = cgi_node_get_worker_interface(node);
+
+	worker->pid = cgi_node_fork(node, &worker->fd_stdin, &worker->fd_stdout, true);
+
+	if(worker->pid < 0) {
+		worker->pid = 0;
+		return false;
+	}
+
+	worker->node = node;
+	worker->request = NULL;
+	worker->header_len = 0;
+	worker->has_header = false;
+	worker->content_remaining = 0;
+	worker->idle_since = interface ? smcp_get_current_time(interface) : 0;
+
+	if(node->event_loop) {
+		smcp_event_loop_add_fd(node->event_loop, worker->fd_stdin, 0, &cgi_node_worker_fd_ready, (void*)worker);
+		smcp_event_loop_add_fd(node->event_loop, worker->fd_stdout, 0, &cgi_node_worker_fd_ready, (void*)worker);
+		cgi_node_worker_update_events(node, worker);
+	}
+
+	return true;
+}
+
+// Hands `request` to an idle worker, starting one if there is room.
+// Returns false if it has to wait for a worker to free up.
+static bool
+cgi_node_request_dispatch(cgi_node_t node, cgi_node_request_t request) {
+	cgi_node_worker_t worker = NULL;
+	char header[32];
+	char* worker_header;
+	int i;
+
+	for(i=0;i<CGI_NODE_MAX_WORKERS && !worker;i++) {
+		if(node->workers[i].pid > 0 && !node->workers[i].request)
+			worker = &node->workers[i];
+	}
+
+	if(!worker && cgi_node_get_worker_count(node) < node->max_workers) {
+		for(i=0;i<CGI_NODE_MAX_WORKERS && !worker;i++) {
+			if(node->workers[i].pid <= 0 && cgi_node_worker_start(node, &node->workers[i]))
+				worker = &node->workers[i];
+		}
+	}
+
+	if(!worker) {
+		if(!request->queued)
+			request->queued = ++node->queue_count;
+		return false;
+	}
+
+	// The request line and the length go out ahead of the body.
+	snprintf(header,sizeof(header)," %lu\n",(unsigned long)request->stdin_buffer.len);
+
+	worker_header = realloc(request->request_line,strlen(request->request_line)+strlen(header)+1);
+
+	if(!worker_header) {
+		// Give up on it.
+		free(request->request_line);
+		request->request_line = NULL;
+		request->queued = 0;
+		request->fd_cmd_stdout = -1;
+		request->code = COAP_RESULT_500_INTERNAL_SERVER_ERROR;
+		return true;
+	}
+
+	strcat(worker_header,header);
+
+	request->request_line = NULL;
+	request->worker_header = worker_header;
+	request->worker_header_len = strlen(worker_header);
+	request->worker_header_sent = 0;
+	request->queued = 0;
+
+	worker->request = request;
+	worker->header_len = 0;
+	worker->has_header = false;
+	worker->content_remaining = 0;
+
+	request->worker = worker;
+	request->fd_cmd_stdin = worker->fd_stdin;
+	request->fd_cmd_stdout = worker->fd_stdout;
+
+	cgi_node_worker_update_events(node, worker);
+
+	return true;
+}
+
+// Hands the longest waiting requests to whatever workers are free.
+static void
+cgi_node_dispatch_queued(cgi_node_t node) {
+	while(true) {
+		cgi_node_request_t request = NULL;
+		int i;
+
+		for(i=0;i<CGI_NODE_MAX_REQUESTS;i++) {
+			if(!node->requests[i].queued)
+				continue;
+			if(!request || node->requests[i].queued < request->queued)
+				request = &node->requests[i];
+		}
+
+		if(!request || !cgi_node_request_dispatch(node, request))
+			break;
+
+		// It might have been given up on, so move it along.
+		cgi_node_request_handle_io(node, request, false, false, false, false);
+	}
+}
+
+// The worker has sent its whole response, so it can take another request.
+static void
+cgi_node_worker_release(cgi_node_t node, cgi_node_worker_t worker) {
+	cgi_node_request_t request = worker->request;
+	smcp_t interface = cgi_node_get_worker_interface(node);
+
+	request->worker = NULL;
+	request->fd_cmd_stdin = -1;
+	request->fd_cmd_stdout = -1;
+	worker->request = NULL;
+
+	if(cgi_node_request_get_stdin_pending(request)) {
+		// It didn't read all of the request, so the rest of it would
+		// be taken for the next one.
+		syslog(LOG_WARNING,"CGI worker %d answered before reading the whole request",worker->pid);
+		cgi_node_worker_stop(node, worker);
+		return;
+	}
+
+	worker->idle_since = interface ? smcp_get_current_time(interface) : 0;
+
+	cgi_node_worker_update_events(node, worker);
+
+	if(cgi_node_get_worker_count(node) > node->min_workers)
+		cgi_node_schedule_worker_timer(node, CGI_NODE_WORKER_IDLE_TIMEOUT);
+
+	cgi_node_dispatch_queued(node);
+}
+
+// Reads the worker's response into the request's stdout buffer.
+static smcp_status_t
+cgi_node_worker_read(cgi_node_t node, cgi_node_worker_t worker) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	cgi_node_request_t request = worker->request;
+	ssize_t bytes_read;
+
+	errno = 0;
+
+	if(!worker->has_header) {
+		char* content;
+		unsigned int code_class, code_detail;
+		unsigned long content_len;
+
+		bytes_read = read(
+			worker->fd_stdout,
+			worker->header+worker->header_len,
+			sizeof(worker->header)-worker->header_len-1
+		);
+
+		require_quiet(bytes_read>=0 || errno!=EAGAIN, bail);
+		require_quiet(bytes_read>0, died);
+
+		worker->header_len += bytes_read;
+		worker->header[worker->header_len] = 0;
+
+		content = strchr(worker->header,'\n');
+
+		if(!content) {
+			require_string(worker->header_len<sizeof(worker->header)-1, bad_response, "Response header too long");
+			goto bail;
+		}
+
+		*content++ = 0;
+
+		require_string(
+			3==sscanf(worker->header,"%u.%u %lu",&code_class,&code_detail,&content_len)
+				&& code_class>=2 && code_class<=5 && code_detail<32,
+			bad_response,
+			"Bad response header"
+		);
+
+		require_string(content_len<=CGI_NODE_WORKER_MAX_RESPONSE_SIZE, bad_response, "Response too long");
+
+		// Make room for all of it, so the worker never has to wait on the client.
+		require_string(
+			cgi_node_buffer_reserve(&request->stdout_buffer, content_len),
+			bad_response,
+			"Unable to buffer response"
+		);
+
+		request->code = (coap_code_t)(code_class*32+code_detail);
+		worker->has_header = true;
+		worker->content_remaining = content_len;
+
+		// Whatever came in after the header is content.
+		bytes_read = worker->header+worker->header_len-content;
+
+		require_string((size_t)bytes_read<=worker->content_remaining, bad_response, "Response too long");
+
+		// The buffer is empty at this point, and has room for all of it.
+		cgi_node_buffer_append(&request->stdout_buffer, content, bytes_read);
+
+		worker->content_remaining -= bytes_read;
+	} else if(worker->content_remaining) {
+		struct iovec iov[2];
+		int iovcnt = cgi_node_buffer_get_space_iov(&request->stdout_buffer, iov, worker->content_remaining);
+
+		// There is room for the rest, since the client only ever takes bytes out.
+		require(iovcnt, bail);
+
+		bytes_read = readv(worker->fd_stdout, iov, iovcnt);
+
+		require_quiet(bytes_read>=0 || errno!=EAGAIN, bail);
+		require_quiet(bytes_read>0, died);
+
+		cgi_node_buffer_commit(&request->stdout_buffer, bytes_read);
+		worker->content_remaining -= bytes_read;
+	}
+
+	if(worker->has_header && !worker->content_remaining)
+		cgi_node_worker_release(node, worker);
+
+bail:
+	return ret;
+
+died:
+	if(bytes_read<0 && errno!=EPIPE)
+		syslog(LOG_ERR,"Error on read, %s (%d)",strerror(errno),errno);
+	else
+		syslog(LOG_WARNING,"CGI worker %d exited in the middle of a request",worker->pid);
+	cgi_node_worker_stop(node, worker);
+	return ret;
+
+bad_response:
+	syslog(LOG_ERR,"CGI worker %d sent a bad response, restarting it",worker->pid);
+	cgi_node_worker_stop(node, worker);
+	return ret;
+}
+
+// Replaces workers that have died, and stops ones that have been idle too long.
+static void
+cgi_node_worker_timer_fired(smcp_t smcp, void* context) {
+	cgi_node_t node = context;
+	smcp_timestamp_t now = smcp ? smcp_get_current_time(smcp) : 0;
+	smcp_timestamp_t next_idle_check = 0;
+	int count = cgi_node_get_worker_count(node);
+	int i;
+
+	for(i=0;i<CGI_NODE_MAX_WORKERS && count>node->min_workers;i++) {
+		cgi_node_worker_t worker = &node->workers[i];
+
+		if(worker->pid<=0 || worker->request)
+			continue;
+
+		if(now - worker->idle_since >= CGI_NODE_WORKER_IDLE_TIMEOUT) {
+			cgi_node_worker_stop(node, worker);
+			count--;
+		} else if(!next_idle_check || worker->idle_since < next_idle_check) {
+			next_idle_check = worker->idle_since;
+		}
+	}
+
+	for(i=0;i<CGI_NODE_MAX_WORKERS && count<node->min_workers;i++) {
+		if(node->workers[i].pid<=0 && cgi_node_worker_start(node, &node->workers[i]))
+			count++;
+	}
+
+	if(count < node->min_workers) {
+		cgi_node_schedule_worker_timer(node, CGI_NODE_WORKER_RESTART_DELAY);
+	} else if(next_idle_check && count > node->min_workers) {
+		cgi_node_schedule_worker_timer(
+			node,
+			(cms_t)(next_idle_check + CGI_NODE_WORKER_IDLE_TIMEOUT - now)
+		);
+	}
+
+	cgi_node_dispatch_queued(node);
+}
+
+// Turns on worker mode if `max` isn't zero, starting `min` workers right away.
+smcp_status_t
+cgi_node_set_workers(cgi_node_t self, int min, int max) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+
+	require_action(min>=0 && max>=min && max<=CGI_NODE_MAX_WORKERS, bail, ret = SMCP_STATUS_INVALID_ARGUMENT);
+
+	self->min_workers = min;
+	self->max_workers = max;
+
+	cgi_node_worker_timer_fired(cgi_node_get_worker_interface(self), (void*)self);
+
+bail:
+	return ret;
+}
+
+smcp_status_t
+cgi_node_set_option(cgi_node_t self, const char* key, const char* value) {
+	smcp_status_t ret = SMCP_STATUS_NOT_IMPLEMENTED;
+	int min = self->min_workers;
+	int max = self->max_workers;
+
+	if(0==strcasecmp(key,"MinWorkers")) {
+		require_action(value!=NULL, bail, ret = SMCP_STATUS_INVALID_ARGUMENT);
+		min = atoi(value);
+		max = MAX(min,max);
+	} else if(0==strcasecmp(key,"MaxWorkers")) {
+		require_action(value!=NULL, bail, ret = SMCP_STATUS_INVALID_ARGUMENT);
+		max = atoi(value);
+		min = MIN(min,max);
+	} else {
+		goto bail;
+	}
+
+	ret = cgi_node_set_workers(self, min, max);
+
 bail:
 	return ret;
 }
@@ -293,7 +1192,12 @@ cgi_node_async_resend_response(void* context) {
 
 //	printf("Resending async response. . .\n");
 
-	ret = smcp_outbound_begin_async_response(COAP_RESULT_205_CONTENT,&request->async_response);
+	ret = smcp_outbound_begin_async_response(
+		(request->state == CGI_NODE_STATE_ACTIVE_BLOCK1_WAIT_ACK)
+			? COAP_RESULT_231_CONTINUE
+			: request->code,
+		&request->async_response
+	);
 	require_noerr(ret,bail);
 
 //	ret = smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE, COAP_CONTENT_TYPE_TEXT_PLAIN);
@@ -305,8 +1209,8 @@ cgi_node_async_resend_response(void* context) {
 	}
 
 	if(request->state == CGI_NODE_STATE_ACTIVE_BLOCK2_WAIT_ACK) {
-		if(request->stdout_buffer_len>block_len || request->fd_cmd_stdout>=0 || ((request->block2>>4)!=0)) {
-			if(request->stdout_buffer_len>block_len || request->fd_cmd_stdout>=0)
+		if(request->stdout_buffer.len>block_len || request->fd_cmd_stdout>=0 || ((request->block2>>4)!=0)) {
+			if(request->stdout_buffer.len>block_len || request->fd_cmd_stdout>=0)
 				request->block2 |= (1<<3);
 			else
 				request->block2 &= ~(1<<3);
@@ -317,9 +1221,9 @@ cgi_node_async_resend_response(void* context) {
 		char *content = smcp_outbound_get_content_ptr(&max_len);
 		require_noerr(ret,bail);
 
-		memcpy(content,request->stdout_buffer,MIN(request->stdout_buffer_len,block_len));
-
-		ret = smcp_outbound_set_content_len(MIN(request->stdout_buffer_len,block_len));
+		ret = smcp_outbound_set_content_len(
+			cgi_node_buffer_peek(&request->stdout_buffer,content,MIN(max_len,block_len))
+		);
 		require_noerr(ret,bail);
 	}
 
@@ -332,20 +1236,14 @@ bail:
 
 smcp_status_t
 cgi_node_request_pop_bytes_from_stdin(cgi_node_request_t request, int count) {
-	request->stdin_buffer_len-=count;
-	memmove(request->stdin_buffer,request->stdin_buffer+count,request->stdin_buffer_len);
+	cgi_node_buffer_consume(&request->stdin_buffer,count);
 	return SMCP_STATUS_OK;
 }
 
 smcp_status_t
 cgi_node_request_pop_bytes_from_stdout(cgi_node_request_t request, int count) {
 	//fprintf(stderr,"pushing %d bytes from stdout buffer\n",count);
-	if((signed)request->stdout_buffer_len>count) {
-		request->stdout_buffer_len-=count;
-		memmove(request->stdout_buffer,request->stdout_buffer+count,request->stdout_buffer_len);
-	} else {
-		request->stdout_buffer_len = 0;
-	}
+	cgi_node_buffer_consume(&request->stdout_buffer,count);
 	return SMCP_STATUS_OK;
 }
 
@@ -353,13 +1251,13 @@ smcp_status_t
 cgi_node_async_ack_handler(int statuscode, void* context) {
 	smcp_status_t ret = SMCP_STATUS_OK;
 	cgi_node_request_t request = context;
-	cgi_node_t node = (cgi_node_t)smcp_get_current_instance(); // TODO: WTF!!?!!!
+	cgi_node_t node = request->node;
 
 //	printf("Finished sending async response.\n");
 
 
 	if(request->state==CGI_NODE_STATE_ACTIVE_BLOCK1_WAIT_ACK) {
-		if(request->block1!=BLOCK_OPTION_UNSPECIFIED && 0==(request->block1&(1<<3))) {
+		if(request->block1!=BLOCK_OPTION_UNSPECIFIED && (request->block1&(1<<3))) {
 			ret = cgi_node_request_change_state(
 				node,
 				request,
@@ -373,7 +1271,7 @@ cgi_node_async_ack_handler(int statuscode, void* context) {
 			);
 		}
 	} else if(request->state==CGI_NODE_STATE_ACTIVE_BLOCK2_WAIT_ACK) {
-		if(request->fd_cmd_stdout<0 && request->stdout_buffer_len<=2*(1<<((request->block2&0x7)+4))) {
+		if(request->fd_cmd_stdout<0 && request->stdout_buffer.len<=2*(1<<((request->block2&0x7)+4))) {
 			ret = cgi_node_request_change_state(
 				node,
 				request,
@@ -465,25 +1363,26 @@ cgi_node_request_change_state(cgi_node_t node, cgi_node_request_t request, cgi_n
 	if( (request->state == CGI_NODE_STATE_ACTIVE_BLOCK2_WAIT_REQ || request->state == CGI_NODE_STATE_ACTIVE_BLOCK1_WAIT_REQ)
 		&& new_state == CGI_NODE_STATE_ACTIVE_BLOCK2_WAIT_FD
 	) {
-		if(!request->stdin_buffer_len &&  request->fd_cmd_stdin>=0) {
-			close(request->fd_cmd_stdin);
-			request->fd_cmd_stdin = -1;
+		if(!cgi_node_request_get_stdin_pending(request)) {
+			cgi_node_request_close_fd(node, request, &request->fd_cmd_stdin);
 		}
 		smcp_start_async_response(&request->async_response, 0);
+		if(request->request_line && !request->queued) {
+			// The whole body is in, so it can go to a worker.
+			cgi_node_request_dispatch(node, request);
+		}
 	} else if(request->state == CGI_NODE_STATE_ACTIVE_BLOCK2_WAIT_FD
 		&& new_state == CGI_NODE_STATE_ACTIVE_BLOCK2_WAIT_ACK
 	) {
-		if(!request->stdin_buffer_len &&  request->fd_cmd_stdin>=0) {
-			close(request->fd_cmd_stdin);
-			request->fd_cmd_stdin = -1;
+		if(!cgi_node_request_get_stdin_pending(request)) {
+			cgi_node_request_close_fd(node, request, &request->fd_cmd_stdin);
 		}
 		cgi_node_send_next_block(node,request);
 	} else if(request->state == CGI_NODE_STATE_ACTIVE_BLOCK2_WAIT_ACK
 		&& new_state == CGI_NODE_STATE_ACTIVE_BLOCK2_WAIT_REQ
 	) {
-		if(!request->stdin_buffer_len &&  request->fd_cmd_stdin>=0) {
-			close(request->fd_cmd_stdin);
-			request->fd_cmd_stdin = -1;
+		if(!cgi_node_request_get_stdin_pending(request)) {
+			cgi_node_request_close_fd(node, request, &request->fd_cmd_stdin);
 		}
 		//cgi_node_request_pop_bytes_from_stdout(request,(1<<((request->block2&0x7)+4)));
 		if(request->transaction) {
@@ -495,10 +1394,19 @@ cgi_node_request_change_state(cgi_node_t node, cgi_node_request_t request, cgi_n
 			smcp_transaction_end(smcp_get_current_instance(),request->transaction);
 			request->transaction = NULL;
 		}
-		close(request->fd_cmd_stdin);
-		request->fd_cmd_stdin = -1;
-		close(request->fd_cmd_stdout);
-		request->fd_cmd_stdout = -1;
+		if(request->interface)
+			smcp_invalidate_timer(request->interface, &request->expiration_timer);
+		// Follow-ups are matched by the token we kept, so there's no
+		// need to hold on to the request's buffer while the slot idles.
+		smcp_finish_async_response(&request->async_response);
+		if(request->worker) {
+			// The worker is still in the middle of it, so it can't
+			// be trusted with another request.
+			cgi_node_worker_stop(node, request->worker);
+		}
+		request->queued = 0;
+		cgi_node_request_close_fd(node, request, &request->fd_cmd_stdin);
+		cgi_node_request_close_fd(node, request, &request->fd_cmd_stdout);
 		if(request->pid != 0 && request->pid != -1) {
 			int status;
 			kill(request->pid,SIGTERM);
@@ -514,6 +1422,8 @@ cgi_node_request_change_state(cgi_node_t node, cgi_node_request_t request, cgi_n
 
 	request->state = new_state;
 
+	cgi_node_request_update_events(node, request);
+
 	return SMCP_STATUS_OK;
 }
 
@@ -601,25 +1511,31 @@ cgi_node_request_handler(
 			);
 		}
 
-		if(smcp_inbound_get_content_len()) {
-			request->stdin_buffer_len += smcp_inbound_get_content_len();
-			request->stdin_buffer = realloc(request->stdin_buffer,request->stdin_buffer_len);
-			// TODO: We should look at the block1 header to make sure it makes sense!
-			// This could be a duplicate or it could be *ahead* of where we are. We
-			// must catch these cases in the future!
-			if(request->stdin_buffer) {
-				memcpy(
-					request->stdin_buffer+request->stdin_buffer_len - smcp_inbound_get_content_len(),
-					smcp_inbound_get_content_ptr(),
-					smcp_inbound_get_content_len()
-				);
-			} else {
-				ret = SMCP_STATUS_MALLOC_FAILURE;
-				goto bail;
-			}
+		request->block1 = block1_option;
+
+		// TODO: We should look at the block1 header to make sure it makes sense!
+		// This could be a duplicate or it could be *ahead* of where we are. We
+		// must catch these cases in the future!
+		if(	smcp_inbound_get_content_len()
+			&& (request->fd_cmd_stdin>=0 || request->request_line)
+			&& !cgi_node_buffer_append(
+				&request->stdin_buffer,
+				smcp_inbound_get_content_ptr(),
+				smcp_inbound_get_content_len()
+			)
+		) {
+			// Either the body is too big for a worker, or the
+			// client didn't wait for us to ask for more.
+			smcp_outbound_quick_response(COAP_RESULT_413_REQUEST_ENTITY_TOO_LARGE,NULL);
+			ret = cgi_node_request_change_state(
+				node,
+				request,
+				CGI_NODE_STATE_FINISHED
+			);
+			goto bail;
 		}
 
-		if(block1_option==0xFFFFFFFF || (0==(block1_option&0x4))) {
+		if(block1_option==BLOCK_OPTION_UNSPECIFIED || (0==(block1_option&(1<<3)))) {
 			ret = cgi_node_request_change_state(
 				node,
 				request,
@@ -632,6 +1548,11 @@ cgi_node_request_handler(
 				CGI_NODE_STATE_ACTIVE_BLOCK1_WAIT_FD
 			);
 		}
+
+		// Nothing is written to a worker until the whole body is in,
+		// so there won't be an event to move the request along.
+		if(request->uses_worker)
+			cgi_node_request_handle_io(node, request, false, false, false, false);
 	} else if(request->state==CGI_NODE_STATE_ACTIVE_BLOCK1_WAIT_FD) {
 		// We should not get a request at this point in the state machine.
 		if(smcp_inbound_is_dupe()) {
@@ -672,7 +1593,7 @@ cgi_node_request_handler(
 				request,
 				CGI_NODE_STATE_ACTIVE_BLOCK2_WAIT_REQ
 			);
-		} else if(block2_option != request->block2) {
+		} else if((block2_option|(1<<3)) != (request->block2|(1<<3))) {
 			// TODO: check to make sure this is valid!
 			ret = cgi_node_request_pop_bytes_from_stdout(request,(1<<((request->block2&0x7)+4)));
 			require_noerr(ret,bail);
@@ -682,17 +1603,21 @@ cgi_node_request_handler(
 
 		coap_size_t block_len = (1<<((request->block2&0x7)+4));
 
-		if(request->stdout_buffer_len>=block_len || request->fd_cmd_stdout<=-1) {
+		if(request->stdout_buffer.len>=block_len || request->fd_cmd_stdout<=-1) {
 			// We have data!
 			coap_size_t max_len;
 
-			ret = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+			ret = smcp_outbound_begin_response(request->code);
 			require_noerr(ret,bail);
 
 //			ret = smcp_outbound_add_option_uint(COAP_OPTION_CONTENT_TYPE, COAP_CONTENT_TYPE_TEXT_PLAIN);
 //			require_noerr(ret,bail);
 
-			if(request->stdout_buffer_len>block_len || request->fd_cmd_stdout>=0) {
+			if(request->stdout_buffer.len>block_len || request->fd_cmd_stdout>=0 || ((request->block2>>4)!=0)) {
+				if(request->stdout_buffer.len>block_len || request->fd_cmd_stdout>=0)
+					request->block2 |= (1<<3);
+				else
+					request->block2 &= ~(1<<3);
 				ret = smcp_outbound_add_option_uint(COAP_OPTION_BLOCK2,request->block2);
 				require_noerr(ret,bail);
 			}
@@ -700,15 +1625,15 @@ cgi_node_request_handler(
 			char *content = smcp_outbound_get_content_ptr(&max_len);
 			require_noerr(ret,bail);
 
-			memcpy(content,request->stdout_buffer,MIN(request->stdout_buffer_len,block_len));
-
-			ret = smcp_outbound_set_content_len(MIN(request->stdout_buffer_len,block_len));
+			ret = smcp_outbound_set_content_len(
+				cgi_node_buffer_peek(&request->stdout_buffer,content,MIN(max_len,block_len))
+			);
 			require_noerr(ret,bail);
 
 			ret = smcp_outbound_send();
 			require_noerr(ret,bail);
 
-			if(request->fd_cmd_stdout<0 && request->stdout_buffer_len<=block_len) {
+			if(request->fd_cmd_stdout<0 && request->stdout_buffer.len<=block_len) {
 				ret = cgi_node_request_change_state(
 					node,
 					request,
@@ -737,12 +1662,32 @@ cgi_node_request_handler(
 	}
 
 bail:
+	if(request)
+		cgi_node_request_update_events(node, request);
 	return ret;
 }
 
 void
 cgi_node_dealloc(cgi_node_t x) {
-	// TODO: Clean up requests!
+	int i;
+
+	x->min_workers = 0;
+	for(i=0;i<CGI_NODE_MAX_WORKERS;i++) {
+		if(x->workers[i].pid>0)
+			cgi_node_worker_stop(x, &x->workers[i]);
+	}
+	if(x->worker_interface)
+		smcp_invalidate_timer(x->worker_interface, &x->worker_timer);
+
+	for(i=0;i<CGI_NODE_MAX_REQUESTS;i++) {
+		smcp_finish_async_response(&x->requests[i].async_response);
+		free(x->requests[i].stdin_buffer.data);
+		free(x->requests[i].stdout_buffer.data);
+		free(x->requests[i].request_line);
+		free(x->requests[i].worker_header);
+	}
+
+	// TODO: Clean up the rest of the requests!
 	free((void*)x->cmd);
 	free((void*)x->shell);
 	free(x);
@@ -785,6 +1730,8 @@ cgi_node_init(
 		self->requests[i].fd_cmd_stdout = -1;
 	}
 
+	smcp_timer_init(&self->worker_timer, &cgi_node_worker_timer_fired, NULL, (void*)self);
+
 bail:
 	return self;
 }
@@ -799,13 +1746,17 @@ cgi_node_update_fdset(
 	cms_t *timeout
 ) {
 	int i;
+
+	if(self->event_loop)
+		return SMCP_STATUS_OK;
+
 	for(i=0;i<CGI_NODE_MAX_REQUESTS;i++) {
 		cgi_node_request_t request = &self->requests[i];
 
 		if(request->state<=CGI_NODE_STATE_FINISHED)
 			continue;
 
-		if(	request->stdin_buffer_len
+		if(	cgi_node_request_get_stdin_pending(request)
 			&& request->fd_cmd_stdin >= 0
 			&& write_fd_set
 		) {
@@ -818,7 +1769,7 @@ cgi_node_update_fdset(
 		}
 
 		if(	request->fd_cmd_stdout >= 0
-			&& request->stdout_buffer_len<(1<<((request->block2&0x7)+4))
+			&& cgi_node_buffer_get_space(&request->stdout_buffer)
 			&& read_fd_set
 		) {
 			//printf("Adding FD %d to read set\n",request->fd_cmd_stdout);
@@ -828,21 +1779,136 @@ cgi_node_update_fdset(
 			if(max_fd)
 				*max_fd = MAX(*max_fd,request->fd_cmd_stdout);
 		}
+	}
+
+	// Idle workers are watched too, so we notice if they die.
+	for(i=0;i<CGI_NODE_MAX_WORKERS;i++) {
+		cgi_node_worker_t worker = &self->workers[i];
+
+		if(worker->pid<=0 || worker->request || !read_fd_set)
+			continue;
+
+		FD_SET(worker->fd_stdout,read_fd_set);
+		if(max_fd)
+			*max_fd = MAX(*max_fd,worker->fd_stdout);
+	}
+	return SMCP_STATUS_OK;
+}
+
+smcp_status_t
+cgi_node_request_handle_io(
+	cgi_node_t self,
+	cgi_node_request_t request,
+	bool can_write,
+	bool write_err,
+	bool can_read,
+	bool read_err
+) {
+	//printf("Request %p, stdin_fd=%d, stdout_fd=%d\n",request,request->fd_cmd_stdin,request->fd_cmd_stdout);
+
+	// Still waiting for a worker.
+	if(request->queued)
+		return SMCP_STATUS_OK;
 
-		if(timeout && request->expiration) {
-			*timeout = MIN(*timeout,MAX(0,request->expiration-time(NULL) ));
+	errno = 0;
+
+	if(cgi_node_request_get_stdin_pending(request) && request->fd_cmd_stdin>=0 && (can_write||write_err)) {
+		// Ready to send data to command
+		struct iovec iov[3];
+		int iovcnt = 0;
+		ssize_t bytes_written;
+
+		if(request->worker_header_sent < request->worker_header_len) {
+			iov[iovcnt].iov_base = request->worker_header + request->worker_header_sent;
+			iov[iovcnt++].iov_len = request->worker_header_len - request->worker_header_sent;
+		}
+		iovcnt += cgi_node_buffer_get_data_iov(&request->stdin_buffer, iov+iovcnt);
+
+		bytes_written = writev(request->fd_cmd_stdin, iov, iovcnt);
+		//printf("WROTE %d BYTES TO FD_CMD_STDIN\n",bytes_written);
+		if(bytes_written<0 && errno==EAGAIN && !write_err) {
+			// The pipe is full after all.
+		} else if(bytes_written<0 || errno || write_err) {
+			if(errno!=EPIPE)
+				syslog(LOG_ERR,"Error on write, %s (%d)",strerror(errno),errno);
+			cgi_node_request_close_fd(self, request, &request->fd_cmd_stdin);
+		} else {
+			const size_t header_written = MIN(
+				(size_t)bytes_written,
+				request->worker_header_len - request->worker_header_sent
+			);
+			request->worker_header_sent += header_written;
+			cgi_node_buffer_consume(&request->stdin_buffer, bytes_written - header_written);
+		}
+	}
+	if(request->state == CGI_NODE_STATE_ACTIVE_BLOCK1_WAIT_FD) {
+		// Ask for the next block as soon as there is room for it.
+		if(	cgi_node_buffer_get_space(&request->stdin_buffer)>=(1<<((request->block1&0x7)+4))
+			|| request->fd_cmd_stdin<0
+		) {
+			cgi_node_request_change_state(
+				self,
+				request,
+				CGI_NODE_STATE_ACTIVE_BLOCK1_WAIT_ACK
+			);
 		}
+	}
 
+	errno = 0;
+	if(request->worker && (can_read||read_err)) {
+		smcp_status_t status = cgi_node_worker_read(self, request->worker);
+		if(status)
+			return status;
+	} else if(	request->fd_cmd_stdout>=0
+		&& (can_read||read_err)
+		&& cgi_node_buffer_get_space(&request->stdout_buffer)
+	) {
+		// Data is pending from command. If there is no room for it, it
+		// waits in the pipe until the client has taken the next block.
+		struct iovec iov[2];
+		int iovcnt = cgi_node_buffer_get_space_iov(&request->stdout_buffer, iov, SIZE_MAX);
+		ssize_t bytes_read = readv(request->fd_cmd_stdout, iov, iovcnt);
+
+		if(bytes_read<0 && errno==EAGAIN && !read_err) {
+			// Nothing there after all.
+		} else if(bytes_read<=0 || errno || (read_err && !can_read)) {
+			if(errno && errno!=EPIPE)
+				syslog(LOG_ERR,"Error on read, %s (%d)",strerror(errno),errno);
+			cgi_node_request_close_fd(self, request, &request->fd_cmd_stdout);
+		} else {
+			//printf("READ %d BYTES FROM FD_CMD_STDOUT\n",bytes_read);
+			cgi_node_buffer_commit(&request->stdout_buffer, bytes_read);
+		}
 	}
+	if(request->state == CGI_NODE_STATE_ACTIVE_BLOCK2_WAIT_FD) {
+		if(!cgi_node_request_get_stdin_pending(request)) {
+			cgi_node_request_close_fd(self, request, &request->fd_cmd_stdin);
+		}
+		if(request->stdout_buffer.len>=(1<<((request->block2&0x7)+4)) || request->fd_cmd_stdout<0) {
+			cgi_node_request_change_state(
+				self,
+				request,
+				CGI_NODE_STATE_ACTIVE_BLOCK2_WAIT_ACK
+			);
+		}
+	}
+
+	cgi_node_request_update_events(self, request);
+
 	return SMCP_STATUS_OK;
 }
 
 smcp_status_t
 cgi_node_process(cgi_node_t self) {
+	smcp_status_t ret = SMCP_STATUS_OK;
 	int i;
 	fd_set rd_set, wr_set, er_set;
 	int max_fd = -1;
 	struct timeval t = {};
+
+	if(self->event_loop)
+		return SMCP_STATUS_OK;
+
 	FD_ZERO(&rd_set);
 	FD_ZERO(&wr_set);
 	FD_ZERO(&er_set);
@@ -850,86 +1916,73 @@ cgi_node_process(cgi_node_t self) {
 	cgi_node_update_fdset(self,&rd_set,&wr_set,&er_set,&max_fd,NULL);
 
 	if(select(max_fd+1,&rd_set,&wr_set,&er_set,&t)>0) {
-		for(i=0;i<CGI_NODE_MAX_REQUESTS;i++) {
+		for(i=0;i<CGI_NODE_MAX_REQUESTS && !ret;i++) {
 			cgi_node_request_t request = &self->requests[i];
 			if(request->state<=CGI_NODE_STATE_FINISHED)
 				continue;
 
-			if(request->expiration<time(NULL)) {
-				request->expiration = 0;
-				cgi_node_request_change_state(
-					self,
-					request,
-					CGI_NODE_STATE_FINISHED
-				);
-			}
+			ret = cgi_node_request_handle_io(
+				self,
+				request,
+				request->fd_cmd_stdin>=0 && FD_ISSET(request->fd_cmd_stdin,&wr_set),
+				request->fd_cmd_stdin>=0 && FD_ISSET(request->fd_cmd_stdin,&er_set),
+				request->fd_cmd_stdout>=0 && FD_ISSET(request->fd_cmd_stdout,&rd_set),
+				request->fd_cmd_stdout>=0 && FD_ISSET(request->fd_cmd_stdout,&er_set)
+			);
+		}
 
-			//printf("Request %p, stdin_fd=%d, stdout_fd=%d\n",request,request->fd_cmd_stdin,request->fd_cmd_stdout);
-			errno = 0;
-
-			if(request->stdin_buffer_len && request->fd_cmd_stdin>=0 && (FD_ISSET(request->fd_cmd_stdin,&wr_set)||FD_ISSET(request->fd_cmd_stdin,&er_set))) {
-				// Ready to send data to command
-				int bytes_written = write(request->fd_cmd_stdin, request->stdin_buffer, request->stdin_buffer_len);
-				//printf("WROTE %d BYTES TO FD_CMD_STDIN\n",bytes_written);
-				if(bytes_written<0 || errno || FD_ISSET(request->fd_cmd_stdin,&er_set)) {
-					if(errno!=EPIPE)
-						syslog(LOG_ERR,"Error on write, %s (%d)",strerror(errno),errno);
-					close(request->fd_cmd_stdin);
-					request->fd_cmd_stdin = -1;
-				} else if((size_t)bytes_written==request->stdin_buffer_len) {
-					request->stdin_buffer_len = 0;
-				} else {
-					request->stdin_buffer_len-=bytes_written;
-					memmove(request->stdin_buffer,request->stdin_buffer+bytes_written,request->stdin_buffer_len);
-				}
-			}
-			if(request->state == CGI_NODE_STATE_ACTIVE_BLOCK1_WAIT_FD) {
-				if(request->stdin_buffer_len==0 || request->fd_cmd_stdin<0) {
-					cgi_node_request_change_state(
-						self,
-						request,
-						CGI_NODE_STATE_ACTIVE_BLOCK1_WAIT_ACK
-					);
-				}
-			}
+		for(i=0;i<CGI_NODE_MAX_WORKERS;i++) {
+			cgi_node_worker_t worker = &self->workers[i];
 
-			errno = 0;
-			if(request->fd_cmd_stdout>=0 && (FD_ISSET(request->fd_cmd_stdout,&rd_set)||FD_ISSET(request->fd_cmd_stdout,&er_set))) {
-				// Data is pending from command
-				int bytes_read = (1<<((request->block2&0x7)+4))*2;
-				request->stdout_buffer = realloc(request->stdout_buffer,request->stdout_buffer_len+bytes_read);
-				if(!request->stdout_buffer)
-					return SMCP_STATUS_MALLOC_FAILURE;
-				bytes_read = read(request->fd_cmd_stdout, request->stdout_buffer+request->stdout_buffer_len, bytes_read);
-
-				if(bytes_read<=0 || errno || FD_ISSET(request->fd_cmd_stdout,&er_set)) {
-					if(errno && errno!=EPIPE)
-						syslog(LOG_ERR,"Error on read, %s (%d)",strerror(errno),errno);
-					close(request->fd_cmd_stdout);
-					request->fd_cmd_stdout = -1;
-				} else {
-					//printf("READ %d BYTES FROM FD_CMD_STDOUT\n",bytes_read);
-					request->stdout_buffer_len += bytes_read;
-				}
-			}
-			if(request->state == CGI_NODE_STATE_ACTIVE_BLOCK2_WAIT_FD) {
-				if(!request->stdin_buffer_len &&  request->fd_cmd_stdin>=0) {
-					close(request->fd_cmd_stdin);
-					request->fd_cmd_stdin = -1;
-				}
-				if(request->stdout_buffer_len>=(1<<((request->block2&0x7)+4)) || request->fd_cmd_stdout<0) {
-					cgi_node_request_change_state(
-						self,
-						request,
-						CGI_NODE_STATE_ACTIVE_BLOCK2_WAIT_ACK
-					);
-				}
-			}
+			if(worker->pid<=0 || worker->request)
+				continue;
+
+			// Idle workers have nothing to say, so it must have exited.
+			if(FD_ISSET(worker->fd_stdout,&rd_set))
+				cgi_node_worker_stop(self, worker);
 		}
 	} else {
 //		if(max_fd>-1)printf("...\n");
 	}
-	return SMCP_STATUS_OK;
+	return ret;
+}
+
+//!	Has `loop` watch the command pipes from now on.
+smcp_status_t
+cgi_node_set_event_loop(cgi_node_t self, smcp_event_loop_t loop) {
+	smcp_status_t ret = SMCP_STATUS_OK;
+	int i;
+
+	require_action(loop != NULL, bail, ret = SMCP_STATUS_INVALID_ARGUMENT);
+	require_action(self->event_loop == NULL, bail, ret = SMCP_STATUS_INVALID_ARGUMENT);
+
+	self->event_loop = loop;
+
+	// Pick up any requests that were started before now.
+	for(i=0;i<CGI_NODE_MAX_REQUESTS;i++) {
+		cgi_node_request_t request = &self->requests[i];
+
+		if(request->fd_cmd_stdin>=0)
+			smcp_event_loop_add_fd(loop, request->fd_cmd_stdin, 0, &cgi_node_request_fd_ready, (void*)request);
+		if(request->fd_cmd_stdout>=0)
+			smcp_event_loop_add_fd(loop, request->fd_cmd_stdout, 0, &cgi_node_request_fd_ready, (void*)request);
+
+		cgi_node_request_update_events(self, request);
+	}
+
+	for(i=0;i<CGI_NODE_MAX_WORKERS;i++) {
+		cgi_node_worker_t worker = &self->workers[i];
+
+		if(worker->pid<=0)
+			continue;
+
+		smcp_event_loop_add_fd(loop, worker->fd_stdin, 0, &cgi_node_worker_fd_ready, (void*)worker);
+		smcp_event_loop_add_fd(loop, worker->fd_stdout, 0, &cgi_node_worker_fd_ready, (void*)worker);
+		cgi_node_worker_update_events(self, worker);
+	}
+
+bail:
+	return ret;
 }
 
 
@@ -947,6 +2000,12 @@ SMCPD_module__cgi_node_update_fdset(
 	cms_t *timeout
 );
 
+extern smcp_status_t
+SMCPD_module__cgi_node_set_event_loop(cgi_node_t self, smcp_event_loop_t loop);
+
+extern smcp_status_t
+SMCPD_module__cgi_node_set_option(cgi_node_t self, const char* key, const char* value);
+
 extern cgi_node_t
 SMCPD_module__cgi_node_init(
 	cgi_node_t	self,
@@ -972,6 +2031,16 @@ SMCPD_module__cgi_node_update_fdset(
 	return cgi_node_update_fdset(self, read_fd_set, write_fd_set, error_fd_set, max_fd, timeout);
 }
 
+smcp_status_t
+SMCPD_module__cgi_node_set_event_loop(cgi_node_t self, smcp_event_loop_t loop) {
+	return cgi_node_set_event_loop(self, loop);
+}
+
+smcp_status_t
+SMCPD_module__cgi_node_set_option(cgi_node_t self, const char* key, const char* value) {
+	return cgi_node_set_option(self, key, value);
+}
+
 cgi_node_t
 SMCPD_module__cgi_node_init(
 	cgi_node_t	self,
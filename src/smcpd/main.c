@@ -54,6 +54,7 @@
 
 #include <smcp/smcp.h>
 #include <smcp/smcp-node-router.h>
+#include <smcp/smcp-event-loop.h>
 //#include <smcp/smcp-pairing.h>
 #include <missing/fgetln.h>
 //#include <smcp/smcp-timer_node.h>
@@ -105,6 +106,7 @@ static arg_list_item_t option_list[] = {
 };
 
 static smcp_t smcp;
+static smcp_event_loop_t gEventLoop;
 static struct smcp_node_s root_node;
 static int gRet;
 
@@ -135,6 +137,8 @@ signal_SIGHUP(int sig) {
 }
 
 #define SMCPD_MAX_ASYNC_IO_MODULES	30
+
+// Modules that take the event loop have neither update_fdset nor process.
 struct {
 	smcp_node_t node;
 	smcp_status_t (*update_fdset)(
@@ -149,6 +153,27 @@ struct {
 } async_io_module[SMCPD_MAX_ASYNC_IO_MODULES];
 int async_io_module_count;
 
+#define SMCPD_MAX_CONFIGURABLE_NODES	30
+
+// Nodes that take options of their own inside their <node> block.
+struct {
+	smcp_node_t node;
+	smcp_status_t (*set_option)(smcp_node_t node, const char* key, const char* value);
+} configurable_node[SMCPD_MAX_CONFIGURABLE_NODES];
+int configurable_node_count;
+
+static smcp_status_t
+smcpd_node_set_option(smcp_node_t node, const char* key, const char* value) {
+	int i;
+
+	for(i=0;i<configurable_node_count;i++) {
+		if(configurable_node[i].node == node)
+			return configurable_node[i].set_option(node,key,value);
+	}
+
+	return SMCP_STATUS_NOT_IMPLEMENTED;
+}
+
 smcp_status_t
 smcpd_modules_update_fdset(
     fd_set *read_fd_set,
@@ -172,6 +197,53 @@ smcpd_modules_update_fdset(
 	return SMCP_STATUS_OK;
 }
 
+static void
+smcpd_module_fd_ready(smcp_event_loop_t loop, int fd, int events, void* context) {
+	// Nothing to do, smcpd_modules_process() will take care of it.
+}
+
+// The descriptors from update_fdset that are currently on the event loop.
+static fd_set gWatchedReadFdSet, gWatchedWriteFdSet;
+static int gWatchedMaxFd = -1;
+
+// Brings the event loop up to date with the descriptors from update_fdset,
+// for modules that don't know about the event loop. Only the descriptors
+// that changed since the last pass are added, changed or removed. This is
+// a compatibility path, and like select() it is limited to descriptors
+// below FD_SETSIZE. A module that closes a descriptor and opens another
+// with the same number between two passes must give it different events
+// in one of them, or take the event loop instead.
+static void
+smcpd_modules_watch_fdset(
+	fd_set *read_fd_set,
+	fd_set *write_fd_set,
+	int max_fd
+) {
+	const int scan_fd = (max_fd > gWatchedMaxFd) ? max_fd : gWatchedMaxFd;
+	int fd;
+
+	for(fd=0;fd<=scan_fd;fd++) {
+		int events = (FD_ISSET(fd,read_fd_set)?SMCP_EVENT_READ:0)
+			| (FD_ISSET(fd,write_fd_set)?SMCP_EVENT_WRITE:0);
+		int watched = (FD_ISSET(fd,&gWatchedReadFdSet)?SMCP_EVENT_READ:0)
+			| (FD_ISSET(fd,&gWatchedWriteFdSet)?SMCP_EVENT_WRITE:0);
+
+		if(events == watched)
+			continue;
+
+		if(!events)
+			smcp_event_loop_remove_fd(gEventLoop,fd);
+		else if(!watched)
+			smcp_event_loop_add_fd(gEventLoop,fd,events,&smcpd_module_fd_ready,NULL);
+		else
+			smcp_event_loop_set_fd_events(gEventLoop,fd,events);
+	}
+
+	gWatchedReadFdSet = *read_fd_set;
+	gWatchedWriteFdSet = *write_fd_set;
+	gWatchedMaxFd = max_fd;
+}
+
 smcp_status_t
 smcpd_modules_process() {
 	smcp_status_t status = 0;
@@ -188,6 +260,8 @@ smcp_node_t smcpd_make_node(const char* type, smcp_node_t parent, const char* na
 
 	typedef smcp_node_t (*init_func_t)(smcp_node_t self, smcp_node_t parent, const char* name, const char* argument);
 	typedef smcp_status_t (*process_func_t)(smcp_node_t self);
+	typedef smcp_status_t (*set_event_loop_func_t)(smcp_node_t self, smcp_event_loop_t loop);
+	typedef smcp_status_t (*set_option_func_t)(smcp_node_t self, const char* key, const char* value);
 	typedef smcp_status_t (*update_fdset_func_t)(
 		smcp_node_t node,
 		fd_set *read_fd_set,
@@ -197,10 +271,11 @@ smcp_node_t smcpd_make_node(const char* type, smcp_node_t parent, const char* na
 		cms_t *timeout
 	);
 
-	init_func_t init_func;
-	process_func_t process_func;
-	update_fdset_func_t update_fdset_func;
-
+	init_func_t init_func = NULL;
+	process_func_t process_func = NULL;
+	update_fdset_func_t update_fdset_func = NULL;
+	set_event_loop_func_t set_event_loop_func = NULL;
+	set_option_func_t set_option_func = NULL;
 
 	syslog(LOG_NOTICE,"MAKE t=\"%s\" n=\"%s\" a=\"%s\"",type, name, argument);
 
@@ -213,6 +288,7 @@ smcp_node_t smcpd_make_node(const char* type, smcp_node_t parent, const char* na
 		init_func = (init_func_t)&smcp_curl_proxy_node_init;
 		update_fdset_func = (update_fdset_func_t)&smcp_curl_proxy_node_update_fdset;
 		process_func = (process_func_t)&smcp_curl_proxy_node_process;
+		set_event_loop_func = (set_event_loop_func_t)&smcp_curl_proxy_node_set_event_loop;
 #endif
 #if HAVE_DLFCN_H
 	} else if(type) {
@@ -238,6 +314,20 @@ smcp_node_t smcpd_make_node(const char* type, smcp_node_t parent, const char* na
 			snprintf(symbol_name,sizeof(symbol_name),"smcp_%s_node_process",type);
 			process_func = dlsym(RTLD_DEFAULT,symbol_name);
 		}
+
+		snprintf(symbol_name,sizeof(symbol_name),"SMCPD_module__%s_node_set_event_loop",type);
+		set_event_loop_func = dlsym(RTLD_DEFAULT,symbol_name);
+		if(!set_event_loop_func) {
+			snprintf(symbol_name,sizeof(symbol_name),"smcp_%s_node_set_event_loop",type);
+			set_event_loop_func = dlsym(RTLD_DEFAULT,symbol_name);
+		}
+
+		snprintf(symbol_name,sizeof(symbol_name),"SMCPD_module__%s_node_set_option",type);
+		set_option_func = dlsym(RTLD_DEFAULT,symbol_name);
+		if(!set_option_func) {
+			snprintf(symbol_name,sizeof(symbol_name),"smcp_%s_node_set_option",type);
+			set_option_func = dlsym(RTLD_DEFAULT,symbol_name);
+		}
 #endif
 	}
 
@@ -255,13 +345,29 @@ smcp_node_t smcpd_make_node(const char* type, smcp_node_t parent, const char* na
 		syslog(LOG_NOTICE,"Can't find init method for node type \"%s\"",type);
 	}
 
-	if(ret && (process_func || update_fdset_func)) {
+	if(ret && set_event_loop_func) {
+		if((*set_event_loop_func)(ret,gEventLoop)==SMCP_STATUS_OK) {
+			update_fdset_func = NULL;
+			process_func = NULL;
+		} else {
+			syslog(LOG_WARNING,"Unable to set event loop for node type \"%s\"",type);
+			set_event_loop_func = NULL;
+		}
+	}
+
+	if(ret && (process_func || update_fdset_func || set_event_loop_func)) {
 		async_io_module[async_io_module_count].node = ret;
 		async_io_module[async_io_module_count].update_fdset = update_fdset_func;
 		async_io_module[async_io_module_count].process = process_func;
 		async_io_module_count++;
 	}
 
+	if(ret && set_option_func && configurable_node_count<SMCPD_MAX_CONFIGURABLE_NODES) {
+		configurable_node[configurable_node_count].node = ret;
+		configurable_node[configurable_node_count].set_option = set_option_func;
+		configurable_node_count++;
+	}
+
 	check_noerr(init_func);
 
 	return ret;
@@ -452,6 +558,15 @@ read_configuration(smcp_t smcp,const char* filename) {
 				goto bail;
 			}
 			node = node->parent;
+		} else if(node->parent) {
+			// Options for the node we are in.
+			char* arg = get_next_arg(line,&line);
+			status = smcpd_node_set_option(node,cmd,arg);
+			if(status==SMCP_STATUS_NOT_IMPLEMENTED) {
+				syslog(LOG_ERR,"%s:%d: Unrecognised config option \"%s\".",filename,line_number,cmd);
+			} else if(status) {
+				syslog(LOG_ERR,"%s:%d: Bad value for config option \"%s\", error %d \"%s\"",filename,line_number,cmd,status,smcp_status_to_cstr(status));
+			}
 		} else {
 			syslog(LOG_ERR,"Unrecognised config option \"%s\".",cmd);
 		}
@@ -482,6 +597,9 @@ main(
 	gPreviousHandlerForSIGTERM = signal(SIGINT, &signal_SIGTERM);
 	signal(SIGHUP, &signal_SIGHUP);
 
+	// Commands that exit early show up as EPIPE instead.
+	signal(SIGPIPE, SIG_IGN);
+
 	srandom(time(NULL));
 
 	if(argc && argv[0][0])
@@ -541,6 +659,18 @@ main(
 		goto bail;
 	}
 
+	gEventLoop = smcp_event_loop_create(0);
+
+	if(!gEventLoop) {
+		syslog(LOG_CRIT,"Unable to create event loop.");
+		gRet = ERRORCODE_UNKNOWN;
+		goto bail;
+	}
+
+	syslog(LOG_INFO,"Using %s for the event loop.",smcp_event_loop_get_backend(gEventLoop));
+
+	smcp_event_loop_add_instance(gEventLoop,smcp);
+
 	// Set up the root node.
 	smcp_node_init(&root_node,NULL,NULL);
 
@@ -557,10 +687,10 @@ main(
 	}
 
 	while(!gRet) {
-		int fds_ready = 0, max_fd = -1;
+		int max_fd = -1;
 		fd_set read_fd_set,write_fd_set,error_fd_set;
 		cms_t cms_timeout = 600000;
-		struct timeval timeout = {};
+		smcp_status_t status;
 
 		FD_ZERO(&read_fd_set);
 		FD_ZERO(&write_fd_set);
@@ -573,27 +703,23 @@ main(
 			&cms_timeout
 		);
 
-		cms_timeout = MIN(smcp_get_timeout(smcp),cms_timeout);
-		max_fd = MAX(smcp_get_fd(smcp),max_fd);
-		FD_SET(smcp_get_fd(smcp),&read_fd_set);
-		FD_SET(smcp_get_fd(smcp),&error_fd_set);
+		smcpd_modules_watch_fdset(&read_fd_set,&write_fd_set,max_fd);
 
-		timeout.tv_sec = cms_timeout/1000;
-		timeout.tv_usec = (cms_timeout%1000)*1000;
+		status = smcp_event_loop_run_once(gEventLoop,cms_timeout);
 
-		fds_ready = select(max_fd+1,&read_fd_set,&write_fd_set,&error_fd_set,&timeout);
-		if(fds_ready < 0 && errno!=EINTR) {
-			syslog(LOG_ERR,"select() errno=\"%s\" (%d)",strerror(errno),errno);
+		if(status == SMCP_STATUS_ERRNO) {
+			syslog(LOG_ERR,"Event loop errno=\"%s\" (%d)",strerror(errno),errno);
 			break;
 		}
 
-		smcp_process(smcp);
-
 		if(smcpd_modules_process()!=SMCP_STATUS_OK) {
 			syslog(LOG_ERR,"Module process error.");
 			gRet = ERRORCODE_UNKNOWN;
 		}
 
+		// Modules may have sent async responses.
+		smcp_flush(smcp);
+
 		if(gRet == ERRORCODE_SIGHUP) {
 			gRet = 0;
 			read_configuration(smcp,config_file);
@@ -611,6 +737,8 @@ bail:
 		if(gPIDFilename)
 			unlink(gPIDFilename);
 
+		smcp_event_loop_release(gEventLoop);
+
 		smcp_release(smcp);
 
 		syslog(LOG_NOTICE,"Stopped.");
@@ -0,0 +1,192 @@
+/*!	@page test-observe-trigger test-observe-trigger.c: Cross-thread trigger test.
+**
+**	This test runs an SMCP instance on its own thread, blocked in
+**	smcp_wait() with a long timeout, and triggers an observable it
+**	serves from the main thread. Every trigger must wake the instance
+**	and get a notification out to the observer right away, rather
+**	than whenever the instance next happens to wake up.
+**
+**	@include test-observe-trigger.c
+**
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <smcp/assert-macros.h>
+#include <smcp/smcp.h>
+#include <smcp/smcp-node-router.h>
+#include <smcp/smcp-observable.h>
+
+#define NUMBER_OF_TRIGGERS			(5)
+
+//!	How long a notification may take to arrive after a trigger.
+#define NOTIFICATION_TIMEOUT_MS		(2000)
+
+#define OBS_KEY						(1)
+
+#define expect(c)	do { \
+		if(!(c)) { \
+			fprintf(stderr, "%s:%d: Expected %s\n", __FILE__, __LINE__, #c); \
+			exit(EXIT_FAILURE); \
+		} \
+	} while(0)
+
+static struct smcp_observable_s gObservable;
+
+static pthread_mutex_t gPortLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gPortCond = PTHREAD_COND_INITIALIZER;
+static uint16_t gPort;
+
+static int gSocket = -1;
+
+static smcp_status_t
+obs_request_handler(void* context) {
+	smcp_status_t ret;
+
+	if(smcp_inbound_get_code() != COAP_METHOD_GET)
+		return SMCP_STATUS_NOT_IMPLEMENTED;
+
+	ret = smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	require_noerr(ret, bail);
+
+	ret = smcp_observable_update(&gObservable, OBS_KEY);
+	require_noerr(ret, bail);
+
+	ret = smcp_outbound_append_content("tick", SMCP_CSTR_LEN);
+	require_noerr(ret, bail);
+
+	ret = smcp_outbound_send();
+
+bail:
+	return ret;
+}
+
+void*
+server_main(void* context) {
+	struct smcp_node_s root_node = {};
+	struct smcp_node_s obs_node = {};
+	smcp_t instance = smcp_create(0);
+
+	expect(instance != NULL);
+
+	smcp_node_init(&root_node, NULL, NULL);
+	smcp_set_default_request_handler(instance, &smcp_node_router_handler, &root_node);
+
+	smcp_node_init(&obs_node, &root_node, "obs");
+	obs_node.request_handler = (smcp_callback_func)&obs_request_handler;
+	obs_node.is_observable = true;
+
+	pthread_mutex_lock(&gPortLock);
+	gPort = smcp_get_port(instance);
+	pthread_cond_signal(&gPortCond);
+	pthread_mutex_unlock(&gPortLock);
+
+	// Nothing but the trigger wakes this thread up in time.
+	for(;;) {
+		smcp_wait(instance, 60*MSEC_PER_SEC);
+		smcp_process(instance);
+	}
+
+	return NULL;
+}
+
+//!	Waits for a response or notification, acknowledging it if need be.
+static void
+receive_notification(coap_msg_id_t token) {
+	struct pollfd pfd = { .fd = gSocket, .events = POLLIN };
+	uint8_t packet[SMCP_MAX_PACKET_LENGTH];
+	const uint8_t* ptr;
+	coap_option_key_t key = 0;
+	bool has_observe = false;
+	ssize_t len;
+
+	expect(poll(&pfd, 1, NOTIFICATION_TIMEOUT_MS) == 1);
+
+	len = recv(gSocket, packet, sizeof(packet), 0);
+	expect(len >= 4 + 2);
+	expect(packet[1] == COAP_RESULT_205_CONTENT);
+	expect((packet[0] & 0xF) == 2);
+	expect(packet[4] == (uint8_t)(token >> 8));
+	expect(packet[5] == (uint8_t)token);
+
+	for(ptr = packet + 6; ptr < packet + len && *ptr != 0xFF; ) {
+		const uint8_t* value;
+		coap_size_t value_len;
+
+		ptr = coap_decode_option(ptr, &key, &value, &value_len);
+		if(key == COAP_OPTION_OBSERVE)
+			has_observe = true;
+	}
+	expect(has_observe);
+
+	if(((packet[0] >> 4) & 0x3) == COAP_TRANS_TYPE_CONFIRMABLE) {
+		const uint8_t ack[4] = { 0x60, 0, packet[2], packet[3] };
+
+		expect(send(gSocket, ack, sizeof(ack), 0) == sizeof(ack));
+	}
+}
+
+int
+main(void) {
+	pthread_t server_thread;
+	smcp_sockaddr_t saddr = {};
+	const coap_msg_id_t msg_id = 0x5150;
+	uint8_t request[32];
+	uint8_t* ptr = request;
+	int i;
+
+	SMCP_LIBRARY_VERSION_CHECK();
+
+	pthread_create(&server_thread, NULL, &server_main, NULL);
+
+	pthread_mutex_lock(&gPortLock);
+	while(!gPort)
+		pthread_cond_wait(&gPortCond, &gPortLock);
+	pthread_mutex_unlock(&gPortLock);
+
+	gSocket = socket(SMCP_BSD_SOCKETS_NET_FAMILY, SOCK_DGRAM, IPPROTO_UDP);
+	expect(gSocket >= 0);
+
+#if SMCP_BSD_SOCKETS_NET_FAMILY == AF_INET6
+	saddr.sin6_family = AF_INET6;
+	saddr.sin6_addr = in6addr_loopback;
+#else
+	saddr.sin_family = AF_INET;
+	saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#endif
+	saddr.smcp_port = htons(gPort);
+
+	expect(connect(gSocket, (struct sockaddr*)&saddr, sizeof(saddr)) == 0);
+
+	// Confirmable GET /obs with Observe, and the message id as the token.
+	*ptr++ = 0x42;
+	*ptr++ = COAP_METHOD_GET;
+	*ptr++ = (uint8_t)(msg_id >> 8);
+	*ptr++ = (uint8_t)msg_id;
+	*ptr++ = (uint8_t)(msg_id >> 8);
+	*ptr++ = (uint8_t)msg_id;
+	ptr = coap_encode_option(ptr, 0, COAP_OPTION_OBSERVE, NULL, 0);
+	ptr = coap_encode_option(ptr, COAP_OPTION_OBSERVE, COAP_OPTION_URI_PATH, (const uint8_t*)"obs", 3);
+
+	expect(send(gSocket, request, ptr - request, 0) == ptr - request);
+
+	receive_notification(msg_id);
+
+	for(i = 0; i < NUMBER_OF_TRIGGERS; i++) {
+		// Give the server time to go back to sleep.
+		usleep(100*USEC_PER_MSEC);
+
+		expect(smcp_observable_observer_count(&gObservable, OBS_KEY) == 1);
+
+		smcp_observable_trigger(&gObservable, OBS_KEY, 0);
+
+		receive_notification(msg_id);
+	}
+
+	close(gSocket);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,240 @@
+/*!	@page test-responses test-responses.c: Response replay and validation test.
+**
+**	This test sends hand-built requests to an SMCP instance and checks
+**	the responses byte by byte: duplicate confirmable requests must get
+**	the original response replayed without calling the handler again.
+**
+**	@include test-responses.c
+**
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <smcp/assert-macros.h>
+#include <smcp/smcp.h>
+#include <smcp/smcp-node-router.h>
+
+#define expect(c)	do { \
+		if(!(c)) { \
+			fprintf(stderr, "%s:%d: Expected %s\n", __FILE__, __LINE__, #c); \
+			exit(EXIT_FAILURE); \
+		} \
+	} while(0)
+
+static smcp_t gInstance;
+static int gSocket = -1;
+static coap_msg_id_t gNextMsgId = 0x4200;
+
+static int gCountCalls;
+
+struct test_response_s {
+	uint8_t packet[SMCP_MAX_PACKET_LENGTH];
+	coap_size_t len;
+	coap_code_t code;
+	const uint8_t* content;
+	coap_size_t content_len;
+};
+
+// MARK: -
+// MARK: Server
+
+static smcp_status_t
+count_request_handler(void* context) {
+	char content[16];
+
+	if(smcp_inbound_get_code() != COAP_METHOD_GET)
+		return SMCP_STATUS_NOT_IMPLEMENTED;
+
+	gCountCalls++;
+
+	// Every call gets a different answer, so a replay is easy to spot.
+	snprintf(content, sizeof(content), "%d", gCountCalls);
+
+	smcp_outbound_begin_response(COAP_RESULT_205_CONTENT);
+	smcp_outbound_append_content(content, SMCP_CSTR_LEN);
+	return smcp_outbound_send();
+}
+
+// MARK: -
+// MARK: Client
+
+//!	Sends a confirmable request and waits for the response.
+/*!	`options` is a list of key/value/length triples in ascending key
+**	order, ending with COAP_OPTION_INVALID. A `msg_id` of zero picks a
+**	new message id. */
+static void
+exchange(
+	struct test_response_s* response,
+	coap_msg_id_t msg_id,
+	coap_code_t code,
+	const char* path,
+	const char* content,
+	...
+) {
+	uint8_t packet[SMCP_MAX_PACKET_LENGTH];
+	uint8_t* ptr = packet;
+	coap_option_key_t prev_key = 0;
+	coap_option_key_t key;
+	va_list args;
+	int tries;
+
+	if(!msg_id)
+		msg_id = gNextMsgId++;
+
+	*ptr++ = 0x42;	// Version 1, CON, two byte token.
+	*ptr++ = code;
+	*ptr++ = (uint8_t)(msg_id >> 8);
+	*ptr++ = (uint8_t)msg_id;
+	*ptr++ = (uint8_t)(msg_id >> 8);
+	*ptr++ = (uint8_t)msg_id;
+
+	va_start(args, content);
+	while((key = va_arg(args, int)) != COAP_OPTION_INVALID) {
+		const uint8_t* value = va_arg(args, const uint8_t*);
+		coap_size_t len = (coap_size_t)va_arg(args, int);
+
+		// Everything used here comes before Uri-Path.
+		ptr = coap_encode_option(ptr, prev_key, key, value, len);
+		prev_key = key;
+	}
+
+	if(path) {
+		const char* segment = path;
+
+		while(*segment) {
+			const char* end = strchr(segment, '/');
+			if(!end)
+				end = segment + strlen(segment);
+			ptr = coap_encode_option(ptr, prev_key, COAP_OPTION_URI_PATH, (const uint8_t*)segment, (coap_size_t)(end - segment));
+			prev_key = COAP_OPTION_URI_PATH;
+			segment = *end ? end + 1 : end;
+		}
+	}
+	va_end(args);
+
+	if(content) {
+		*ptr++ = 0xFF;
+		memcpy(ptr, content, strlen(content));
+		ptr += strlen(content);
+	}
+
+	expect(send(gSocket, packet, ptr - packet, 0) == ptr - packet);
+
+	memset(response, 0, sizeof(*response));
+
+	for(tries = 0; tries < 50; tries++) {
+		struct pollfd pfd = { .fd = gSocket, .events = POLLIN };
+		ssize_t len;
+
+		smcp_process(gInstance);
+
+		if(poll(&pfd, 1, 0) == 1) {
+			len = recv(gSocket, response->packet, sizeof(response->packet), 0);
+			expect(len >= 4 + 2);
+			response->len = (coap_size_t)len;
+			break;
+		}
+
+		smcp_wait(gInstance, 50);
+	}
+
+	expect(response->len != 0);
+	expect((response->packet[0] >> 4) == 0x6);	// Version 1, ACK.
+	expect(response->packet[2] == (uint8_t)(msg_id >> 8));
+	expect(response->packet[3] == (uint8_t)msg_id);
+
+	response->code = response->packet[1];
+
+	ptr = response->packet + 4 + (response->packet[0] & 0xF);
+	key = 0;
+	while(ptr < response->packet + response->len && *ptr != 0xFF) {
+		const uint8_t* value;
+		coap_size_t len;
+
+		ptr = coap_decode_option(ptr, &key, &value, &len);
+	}
+
+	if(ptr < response->packet + response->len) {
+		response->content = ptr + 1;
+		response->content_len = (coap_size_t)(response->len - (ptr + 1 - response->packet));
+	}
+}
+
+#define NO_OPTIONS		COAP_OPTION_INVALID
+
+static bool
+content_equals(const struct test_response_s* response, const char* content) {
+	return response->content_len == strlen(content)
+		&& 0 == memcmp(response->content, content, response->content_len);
+}
+
+// MARK: -
+// MARK: Tests
+
+static void
+test_duplicate_request(void) {
+	struct test_response_s first, again;
+	const coap_msg_id_t msg_id = gNextMsgId++;
+
+	exchange(&first, msg_id, COAP_METHOD_GET, "count", NULL, NO_OPTIONS);
+	expect(first.code == COAP_RESULT_205_CONTENT);
+	expect(content_equals(&first, "1"));
+
+	// The same message again is a retransmission. The handler must not
+	// see it, and the original response must come back unchanged.
+	exchange(&again, msg_id, COAP_METHOD_GET, "count", NULL, NO_OPTIONS);
+	expect(gCountCalls == 1);
+	expect(again.len == first.len);
+	expect(0 == memcmp(again.packet, first.packet, first.len));
+
+	// A new message is a new request.
+	exchange(&again, 0, COAP_METHOD_GET, "count", NULL, NO_OPTIONS);
+	expect(gCountCalls == 2);
+	expect(content_equals(&again, "2"));
+}
+
+int
+main(void) {
+	struct smcp_node_s root_node = {};
+	struct smcp_node_s count_node = {};
+	smcp_sockaddr_t saddr = {};
+
+	SMCP_LIBRARY_VERSION_CHECK();
+
+	gInstance = smcp_create(0);
+
+	if(!gInstance) {
+		perror("Unable to create SMCP instance");
+		exit(EXIT_FAILURE);
+	}
+
+	smcp_node_init(&root_node, NULL, NULL);
+	smcp_set_default_request_handler(gInstance, &smcp_node_router_handler, &root_node);
+
+	smcp_node_init(&count_node, &root_node, "count");
+	count_node.request_handler = (smcp_callback_func)&count_request_handler;
+
+	gSocket = socket(SMCP_BSD_SOCKETS_NET_FAMILY, SOCK_DGRAM, IPPROTO_UDP);
+	expect(gSocket >= 0);
+
+#if SMCP_BSD_SOCKETS_NET_FAMILY == AF_INET6
+	saddr.sin6_family = AF_INET6;
+	saddr.sin6_addr = in6addr_loopback;
+#else
+	saddr.sin_family = AF_INET;
+	saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#endif
+	saddr.smcp_port = htons(smcp_get_port(gInstance));
+
+	expect(connect(gSocket, (struct sockaddr*)&saddr, sizeof(saddr)) == 0);
+
+	test_duplicate_request();
+
+	close(gSocket);
+	smcp_release(gInstance);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,334 @@
+/*!	@page test-variable-node test-variable-node.c: Variable node test.
+**
+**	This test sends hand-built requests to a variable node and checks
+**	the responses: the listing must mark the observable variables, and
+**	each variable must honor ETag, If-Match and If-None-Match.
+**
+**	@include test-variable-node.c
+**
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <smcp/assert-macros.h>
+#include <smcp/smcp.h>
+#include <smcp/smcp-node-router.h>
+#include <smcp/smcp-variable_node.h>
+
+#define expect(c)	do { \
+		if(!(c)) { \
+			fprintf(stderr, "%s:%d: Expected %s\n", __FILE__, __LINE__, #c); \
+			exit(EXIT_FAILURE); \
+		} \
+	} while(0)
+
+static smcp_t gInstance;
+static int gSocket = -1;
+static coap_msg_id_t gNextMsgId = 0x4300;
+
+static char gValueA[64] = "hello";
+static char gValueB[64] = "7";
+static int gVersionB = 1;
+
+struct test_response_s {
+	uint8_t packet[SMCP_MAX_PACKET_LENGTH];
+	coap_size_t len;
+	coap_code_t code;
+	const uint8_t* etag;
+	coap_size_t etag_len;
+	const uint8_t* content;
+	coap_size_t content_len;
+};
+
+// MARK: -
+// MARK: Server
+
+static smcp_status_t
+variable_func(
+	smcp_variable_node_t node,
+	uint8_t action,
+	uint8_t i,
+	char* value
+) {
+	smcp_status_t ret = SMCP_STATUS_NOT_IMPLEMENTED;
+
+	if(i > 1) {
+		ret = SMCP_STATUS_NOT_FOUND;
+	} else if(action == SMCP_VAR_GET_KEY) {
+		strcpy(value, i ? "b" : "a");
+		ret = SMCP_STATUS_OK;
+	} else if(action == SMCP_VAR_GET_VALUE) {
+		strcpy(value, i ? gValueB : gValueA);
+		ret = SMCP_STATUS_OK;
+	} else if(action == SMCP_VAR_SET_VALUE) {
+		if(i) {
+			snprintf(gValueB, sizeof(gValueB), "%s", value);
+			gVersionB++;
+		} else {
+			snprintf(gValueA, sizeof(gValueA), "%s", value);
+		}
+		ret = SMCP_STATUS_OK;
+	} else if(action == SMCP_VAR_GET_OBSERVABLE && i == 1) {
+		// Scribble on the buffer, so a missing one can't go unnoticed.
+		value[0] = 0;
+		ret = SMCP_STATUS_OK;
+	} else if(action == SMCP_VAR_GET_ETAG && i == 1) {
+		// "b" is versioned, "a" gets an ETag hashed from its value.
+		sprintf(value, "%d", gVersionB);
+		ret = SMCP_STATUS_OK;
+	}
+
+	return ret;
+}
+
+// MARK: -
+// MARK: Client
+
+//!	Sends a confirmable request and waits for the response.
+/*!	`options` is a list of key/value/length triples in ascending key
+**	order, ending with COAP_OPTION_INVALID. A `msg_id` of zero picks a
+**	new message id. */
+static void
+exchange(
+	struct test_response_s* response,
+	coap_msg_id_t msg_id,
+	coap_code_t code,
+	const char* path,
+	const char* content,
+	...
+) {
+	uint8_t packet[SMCP_MAX_PACKET_LENGTH];
+	uint8_t* ptr = packet;
+	coap_option_key_t prev_key = 0;
+	coap_option_key_t key;
+	va_list args;
+	int tries;
+
+	if(!msg_id)
+		msg_id = gNextMsgId++;
+
+	*ptr++ = 0x42;	// Version 1, CON, two byte token.
+	*ptr++ = code;
+	*ptr++ = (uint8_t)(msg_id >> 8);
+	*ptr++ = (uint8_t)msg_id;
+	*ptr++ = (uint8_t)(msg_id >> 8);
+	*ptr++ = (uint8_t)msg_id;
+
+	va_start(args, content);
+	while((key = va_arg(args, int)) != COAP_OPTION_INVALID) {
+		const uint8_t* value = va_arg(args, const uint8_t*);
+		coap_size_t len = (coap_size_t)va_arg(args, int);
+
+		// Everything used here comes before Uri-Path.
+		ptr = coap_encode_option(ptr, prev_key, key, value, len);
+		prev_key = key;
+	}
+
+	if(path) {
+		const char* segment = path;
+
+		while(*segment) {
+			const char* end = strchr(segment, '/');
+			if(!end)
+				end = segment + strlen(segment);
+			ptr = coap_encode_option(ptr, prev_key, COAP_OPTION_URI_PATH, (const uint8_t*)segment, (coap_size_t)(end - segment));
+			prev_key = COAP_OPTION_URI_PATH;
+			segment = *end ? end + 1 : end;
+		}
+	}
+	va_end(args);
+
+	if(content) {
+		*ptr++ = 0xFF;
+		memcpy(ptr, content, strlen(content));
+		ptr += strlen(content);
+	}
+
+	expect(send(gSocket, packet, ptr - packet, 0) == ptr - packet);
+
+	memset(response, 0, sizeof(*response));
+
+	for(tries = 0; tries < 50; tries++) {
+		struct pollfd pfd = { .fd = gSocket, .events = POLLIN };
+		ssize_t len;
+
+		smcp_process(gInstance);
+
+		if(poll(&pfd, 1, 0) == 1) {
+			len = recv(gSocket, response->packet, sizeof(response->packet), 0);
+			expect(len >= 4 + 2);
+			response->len = (coap_size_t)len;
+			break;
+		}
+
+		smcp_wait(gInstance, 50);
+	}
+
+	expect(response->len != 0);
+	expect((response->packet[0] >> 4) == 0x6);	// Version 1, ACK.
+	expect(response->packet[2] == (uint8_t)(msg_id >> 8));
+	expect(response->packet[3] == (uint8_t)msg_id);
+
+	response->code = response->packet[1];
+
+	ptr = response->packet + 4 + (response->packet[0] & 0xF);
+	key = 0;
+	while(ptr < response->packet + response->len && *ptr != 0xFF) {
+		const uint8_t* value;
+		coap_size_t len;
+
+		ptr = coap_decode_option(ptr, &key, &value, &len);
+		if(key == COAP_OPTION_ETAG) {
+			response->etag = value;
+			response->etag_len = len;
+		}
+	}
+
+	if(ptr < response->packet + response->len) {
+		response->content = ptr + 1;
+		response->content_len = (coap_size_t)(response->len - (ptr + 1 - response->packet));
+	}
+}
+
+#define NO_OPTIONS		COAP_OPTION_INVALID
+
+static bool
+content_equals(const struct test_response_s* response, const char* content) {
+	return response->content_len == strlen(content)
+		&& 0 == memcmp(response->content, content, response->content_len);
+}
+
+// MARK: -
+// MARK: Tests
+
+static void
+test_variable_listing(void) {
+	struct test_response_s response;
+	char content[SMCP_MAX_PACKET_LENGTH + 1];
+
+	exchange(&response, 0, COAP_METHOD_GET, "var", NULL, NO_OPTIONS);
+	expect(response.code == COAP_RESULT_205_CONTENT);
+
+	memcpy(content, response.content, response.content_len);
+	content[response.content_len] = 0;
+
+	// Only "b" is observable.
+	expect(strstr(content, "\"hello\";obs") == NULL);
+	expect(strstr(content, "\"7\";obs") != NULL);
+}
+
+static void
+test_variable_conditions(const char* path, const char* content) {
+	struct test_response_s response;
+	uint8_t etag[8];
+	coap_size_t etag_len;
+	static const uint8_t other_etag[] = { 0xDE, 0xAD };
+
+	exchange(&response, 0, COAP_METHOD_GET, path, NULL, NO_OPTIONS);
+	expect(response.code == COAP_RESULT_205_CONTENT);
+	expect(response.etag_len != 0 && response.etag_len <= sizeof(etag));
+	etag_len = response.etag_len;
+	memcpy(etag, response.etag, etag_len);
+
+	// A client which already has the value is told that it is still good.
+	exchange(&response, 0, COAP_METHOD_GET, path, NULL,
+		COAP_OPTION_ETAG, etag, (int)etag_len,
+		NO_OPTIONS);
+	expect(response.code == COAP_RESULT_203_VALID);
+	expect(response.content_len == 0);
+	expect(response.etag_len == etag_len && 0 == memcmp(response.etag, etag, etag_len));
+
+	// Any one of several ETags will do.
+	exchange(&response, 0, COAP_METHOD_GET, path, NULL,
+		COAP_OPTION_ETAG, other_etag, (int)sizeof(other_etag),
+		COAP_OPTION_ETAG, etag, (int)etag_len,
+		NO_OPTIONS);
+	expect(response.code == COAP_RESULT_203_VALID);
+
+	exchange(&response, 0, COAP_METHOD_GET, path, NULL,
+		COAP_OPTION_ETAG, other_etag, (int)sizeof(other_etag),
+		NO_OPTIONS);
+	expect(response.code == COAP_RESULT_205_CONTENT);
+	expect(content_equals(&response, content));
+
+	// The variable always exists, so If-None-Match always fails.
+	exchange(&response, 0, COAP_METHOD_PUT, path, "changed",
+		COAP_OPTION_IF_NONE_MATCH, NULL, 0,
+		NO_OPTIONS);
+	expect(response.code == COAP_RESULT_412_PRECONDITION_FAILED);
+
+	// If-Match with somebody else's ETag fails too.
+	exchange(&response, 0, COAP_METHOD_PUT, path, "changed",
+		COAP_OPTION_IF_MATCH, other_etag, (int)sizeof(other_etag),
+		NO_OPTIONS);
+	expect(response.code == COAP_RESULT_412_PRECONDITION_FAILED);
+
+	exchange(&response, 0, COAP_METHOD_GET, path, NULL, NO_OPTIONS);
+	expect(content_equals(&response, content));
+
+	// With the current ETag the change goes through, and the new
+	// ETag comes back with it.
+	exchange(&response, 0, COAP_METHOD_PUT, path, "changed",
+		COAP_OPTION_IF_MATCH, etag, (int)etag_len,
+		NO_OPTIONS);
+	expect(response.code == COAP_RESULT_204_CHANGED);
+	expect(response.etag_len != 0);
+	expect(response.etag_len != etag_len || 0 != memcmp(response.etag, etag, etag_len));
+
+	exchange(&response, 0, COAP_METHOD_GET, path, NULL,
+		COAP_OPTION_ETAG, etag, (int)etag_len,
+		NO_OPTIONS);
+	expect(response.code == COAP_RESULT_205_CONTENT);
+	expect(content_equals(&response, "v=changed"));
+}
+
+int
+main(void) {
+	struct smcp_node_s root_node = {};
+	struct smcp_node_s var_node = {};
+	struct smcp_variable_node_s variable = {};
+	smcp_sockaddr_t saddr = {};
+
+	SMCP_LIBRARY_VERSION_CHECK();
+
+	gInstance = smcp_create(0);
+
+	if(!gInstance) {
+		perror("Unable to create SMCP instance");
+		exit(EXIT_FAILURE);
+	}
+
+	smcp_node_init(&root_node, NULL, NULL);
+	smcp_set_default_request_handler(gInstance, &smcp_node_router_handler, &root_node);
+
+	variable.func = &variable_func;
+	smcp_node_init(&var_node, &root_node, "var");
+	var_node.request_handler = (smcp_callback_func)&smcp_variable_node_request_handler;
+	var_node.context = (void*)&variable;
+
+	gSocket = socket(SMCP_BSD_SOCKETS_NET_FAMILY, SOCK_DGRAM, IPPROTO_UDP);
+	expect(gSocket >= 0);
+
+#if SMCP_BSD_SOCKETS_NET_FAMILY == AF_INET6
+	saddr.sin6_family = AF_INET6;
+	saddr.sin6_addr = in6addr_loopback;
+#else
+	saddr.sin_family = AF_INET;
+	saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#endif
+	saddr.smcp_port = htons(smcp_get_port(gInstance));
+
+	expect(connect(gSocket, (struct sockaddr*)&saddr, sizeof(saddr)) == 0);
+
+	test_variable_listing();
+	test_variable_conditions("var/a", "v=hello");
+	test_variable_conditions("var/b", "v=7");
+
+	close(gSocket);
+	smcp_release(gInstance);
+
+	return EXIT_SUCCESS;
+}